@@ -0,0 +1,308 @@
+/*
+    Title:  Bitmap microbenchmark.
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/*
+   Compares the word-based Bitmap with the previous byte-based code on the
+   operations the GC uses.  This is not built as part of the RTS.  To build it
+   from a configured build directory:
+
+     g++ -O3 -DHAVE_CONFIG_H -I. -I<src>/libpolyml <src>/libpolyml/benchmarks/bitmapbench.cpp \
+         <src>/libpolyml/bitmap.cpp <src>/libpolyml/osmem.cpp -o bitmapbench
+
+   Usage: bitmapbench [megabytes]
+   The size is the size of each bitmap, default 1024Mbytes.  Two bitmaps of this
+   size are allocated, one for each implementation, and the results of each
+   operation are checked against one another.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "globals.h"
+#include "bitmap.h"
+
+// The byte-based bitmap operations as they were before the change to words.
+// In the RTS they were in bitmap.cpp and called out of line in the same way as
+// the new code so they must not be inlined into the timing loops here.
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE
+#endif
+
+class ByteBitmap
+{
+public:
+    ByteBitmap(POLYUNSIGNED bits) { m_bits = (unsigned char*)calloc((bits+7) >> 3, 1); }
+    ~ByteBitmap() { free(m_bits); }
+    bool Created() const { return m_bits != 0; }
+
+    void SetBits(POLYUNSIGNED bitno, POLYUNSIGNED length);
+    bool TestBit(POLYUNSIGNED n) const { return (m_bits[n >> 3] & (1 << (n & 7))) != 0; }
+    POLYUNSIGNED CountZeroBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const;
+    POLYUNSIGNED FindFree(POLYUNSIGNED limit, POLYUNSIGNED start, POLYUNSIGNED n) const;
+    POLYUNSIGNED CountSetBits(POLYUNSIGNED size) const;
+    POLYUNSIGNED FindLastSet(POLYUNSIGNED bitno) const;
+    POLYUNSIGNED FindNextSet(POLYUNSIGNED bitno, POLYUNSIGNED limit) const;
+
+private:
+    unsigned char *m_bits;
+};
+
+void ByteBitmap::SetBits(POLYUNSIGNED bitno, POLYUNSIGNED length)
+{
+    POLYUNSIGNED byte_index = bitno >> 3;
+    POLYUNSIGNED start_bit_index = bitno & 7;
+    POLYUNSIGNED stop_bit_index  = start_bit_index + length;
+    if (stop_bit_index < 8)
+    {
+        m_bits[byte_index] |= (0xff << start_bit_index) & ~(0xff << stop_bit_index);
+        return;
+    }
+    m_bits[byte_index] |= 0xff << start_bit_index;
+    length = stop_bit_index - 8;
+    if (8 <= length)
+    {
+        memset(m_bits + byte_index + 1, 0xff, length >> 3);
+        byte_index += length >> 3;
+        length &= 7;
+    }
+    if (length == 0) return;
+    byte_index ++;
+    m_bits[byte_index] |= 0xff & ~(0xff << length);
+}
+
+NOINLINE POLYUNSIGNED ByteBitmap::CountZeroBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const
+{
+    POLYUNSIGNED byte_index = bitno >> 3;
+    unsigned bit_index  = bitno & 7;
+    unsigned mask  = 1 << bit_index;
+    POLYUNSIGNED zero_bits  = 0;
+    while (mask != 0)
+    {
+        if ((m_bits[byte_index] & mask) != 0) return zero_bits;
+        zero_bits ++;
+        if (zero_bits == n) return zero_bits;
+        mask = (mask << 1) & 0xff;
+    }
+    byte_index ++;
+    while (zero_bits < n && m_bits[byte_index] == 0)
+    {
+        zero_bits += 8;
+        byte_index ++;
+    }
+    mask = 1;
+    while (zero_bits < n && (m_bits[byte_index] & mask) == 0)
+    {
+        zero_bits ++;
+        mask = (mask << 1) & 0xff;
+    }
+    return zero_bits;
+}
+
+NOINLINE POLYUNSIGNED ByteBitmap::FindFree(POLYUNSIGNED limit, POLYUNSIGNED start, POLYUNSIGNED n) const
+{
+    if (limit + n >= start)
+        return start;
+    POLYUNSIGNED candidate = start - n;
+    while (1)
+    {
+        POLYUNSIGNED bits_free = CountZeroBits(candidate, n);
+        if (n <= bits_free)
+            return candidate;
+        if (candidate < n - bits_free + limit)
+            return start;
+        candidate -= (n - bits_free);
+    }
+}
+
+NOINLINE POLYUNSIGNED ByteBitmap::CountSetBits(POLYUNSIGNED size) const
+{
+    size_t bytes = (size+7) >> 3;
+    POLYUNSIGNED count = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        unsigned char byte = m_bits[i];
+        if (byte == 0xff)
+            count += 8;
+        else
+        {
+            while (byte != 0)
+            {
+                unsigned char b = byte & (-byte);
+                count++;
+                byte -= b;
+            }
+        }
+    }
+    return count;
+}
+
+NOINLINE POLYUNSIGNED ByteBitmap::FindLastSet(POLYUNSIGNED bitno) const
+{
+    size_t byteno = bitno >> 3;
+    if (m_bits[byteno] == 0)
+    {
+       do {
+            if (byteno == 0) return 0;
+            byteno--;
+        } while (m_bits[byteno] == 0);
+        bitno = (byteno << 3) + 7;
+    }
+    while (bitno > 0 && ! TestBit(bitno)) bitno--;
+    return bitno;
+}
+
+NOINLINE POLYUNSIGNED ByteBitmap::FindNextSet(POLYUNSIGNED bitno, POLYUNSIGNED limit) const
+{
+    while (bitno < limit)
+    {
+        if ((bitno & 7) == 0 && m_bits[bitno >> 3] == 0)
+            bitno += 8;
+        else if (TestBit(bitno))
+            return bitno;
+        else bitno++;
+    }
+    return limit;
+}
+
+// A cheap pseudo-random sequence so that both bitmaps get the same pattern.
+static POLYUNSIGNED randomState = 1;
+static unsigned NextRandom()
+{
+    randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(randomState >> 33);
+}
+
+// Fill both bitmaps with runs of set bits separated by gaps.  This is similar
+// to the bitmap of a space after marking where each run is an object.
+static void FillRuns(Bitmap &b, ByteBitmap &o, POLYUNSIGNED bits, unsigned maxRun, unsigned maxGap)
+{
+    randomState = 1;
+    POLYUNSIGNED bitno = 0;
+    while (true)
+    {
+        bitno += NextRandom() % maxGap;
+        POLYUNSIGNED run = 1 + NextRandom() % maxRun;
+        if (bitno + run > bits) break;
+        b.SetBits(bitno, run);
+        o.SetBits(bitno, run);
+        bitno += run;
+    }
+}
+
+static double Now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Report(const char *test, double oldTime, double newTime, POLYUNSIGNED oldResult, POLYUNSIGNED newResult)
+{
+    printf("%-34s old %8.3fs new %8.3fs speed-up %6.1fx %s\n", test, oldTime, newTime,
+           newTime == 0.0 ? 0.0 : oldTime / newTime, oldResult == newResult ? "" : "RESULTS DIFFER");
+    if (oldResult != newResult)
+        exit(1);
+}
+
+// Time an operation on each of the bitmaps.
+#define COMPARE(test, expr) \
+    { \
+        double t0 = Now(); \
+        POLYUNSIGNED oldResult = 0; \
+        { ByteBitmap &bm = oldMap; expr; oldResult = result; } \
+        double t1 = Now(); \
+        POLYUNSIGNED newResult = 0; \
+        { Bitmap &bm = newMap; expr; newResult = result; } \
+        double t2 = Now(); \
+        Report(test, t1-t0, t2-t1, oldResult, newResult); \
+    }
+
+// Walk through the bitmap in the same way as the copy phase, skipping the
+// gaps with CountZeroBits and the runs with CountZeroBits on the next gap.
+#define WALK_RUNS \
+    POLYUNSIGNED result = 0; \
+    for (POLYUNSIGNED bitno = 0; bitno < bits; ) \
+    { \
+        bitno += bm.CountZeroBits(bitno, bits - bitno); \
+        if (bitno >= bits) break; \
+        result++; \
+        while (bitno < bits && bm.TestBit(bitno)) bitno++; \
+    }
+
+int main(int argc, char **argv)
+{
+    POLYUNSIGNED megabytes = argc > 1 ? strtoul(argv[1], 0, 10) : 1024;
+    POLYUNSIGNED bits = megabytes * 1024 * 1024 * 8;
+
+    printf("Bitmaps of %lu Mbytes (%lu bits), implementation %s\n",
+           (unsigned long)megabytes, (unsigned long)bits, Bitmap::Implementation());
+
+    {
+        // Dense: a heap after a major GC with most of the space live.
+        Bitmap newMap;
+        ByteBitmap oldMap(bits);
+        if (! newMap.Create(bits) || ! oldMap.Created())
+        {
+            fprintf(stderr, "Unable to allocate the bitmaps\n");
+            return 1;
+        }
+        FillRuns(newMap, oldMap, bits, 12, 8);
+        printf("Dense bitmap: objects of 1-12 words, gaps of 0-7 words\n");
+        COMPARE("CountSetBits", POLYUNSIGNED result = bm.CountSetBits(bits));
+        COMPARE("CountZeroBits (copy phase walk)", WALK_RUNS);
+        COMPARE("FindFree 3 words x 10000000", POLYUNSIGNED result = 0;
+            for (unsigned i = 0; i < 10000000 && (POLYUNSIGNED)i * 64 < bits - 64; i++)
+                result += bm.FindFree(0, bits - (POLYUNSIGNED)i * 64, 3));
+        COMPARE("FindFree 64 words", POLYUNSIGNED result = bm.FindFree(0, bits, 64));
+    }
+
+    {
+        // Sparse: a code space header map or a mostly empty space.
+        Bitmap newMap;
+        ByteBitmap oldMap(bits);
+        if (! newMap.Create(bits) || ! oldMap.Created())
+        {
+            fprintf(stderr, "Unable to allocate the bitmaps\n");
+            return 1;
+        }
+        FillRuns(newMap, oldMap, bits, 1, 4000);
+        printf("Sparse bitmap: single bits 0-4000 apart\n");
+        COMPARE("CountSetBits", POLYUNSIGNED result = bm.CountSetBits(bits));
+        COMPARE("CountZeroBits (copy phase walk)", WALK_RUNS);
+        COMPARE("FindNextSet walk", POLYUNSIGNED result = 0;
+            for (POLYUNSIGNED bitno = bm.FindNextSet(0, bits); bitno < bits; bitno = bm.FindNextSet(bitno+1, bits))
+                result++);
+        COMPARE("FindLastSet x 10000000", POLYUNSIGNED result = 0; randomState = 1;
+            for (unsigned i = 0; i < 10000000; i++) result += bm.FindLastSet(((POLYUNSIGNED)NextRandom() << 2) % bits));
+        COMPARE("FindFree 4096 words", POLYUNSIGNED result = bm.FindFree(0, bits, 4096));
+    }
+    return 0;
+}
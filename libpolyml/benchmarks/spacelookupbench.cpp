@@ -0,0 +1,295 @@
+/*
+    Title:  Space lookup microbenchmark.
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/*
+   Compares MemMgr::SpaceForAddress using the space tree with the lookup in
+   the heap range (--heaprange) on the address patterns seen by the update
+   phase of the major GC (GCUpdatePhase) and by QuickGCScanner::ScanAddressAt
+   in the minor GC.  The tree and the table are copies of the code in memmgr.
+   This is not built as part of the RTS.  To build it from a configured build
+   directory:
+
+     g++ -O3 -DHAVE_CONFIG_H -I. -I<src>/libpolyml <src>/libpolyml/benchmarks/spacelookupbench.cpp \
+         <src>/libpolyml/osmem.cpp -o spacelookupbench
+
+   Usage: spacelookupbench [spaces [megawords]]
+   "spaces" is the number of 1Mbyte local spaces, default 1024.  "megawords" is
+   the number of words scanned in each test, default 8.  The spaces are only
+   reserved so the memory used is just the words being scanned.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "globals.h"
+#include "osmem.h"
+
+#define SPACE_BYTES     ((size_t)1024*1024)
+#define SPACE_SHIFT     20
+#define PERMANENT_SPACES 8
+#define ALLOCATION_SPACES 8
+
+// The space tree as in memmgr.h.
+class SpaceTree
+{
+public:
+    SpaceTree(bool is): isSpace(is) { }
+    virtual ~SpaceTree() {}
+    bool isSpace;
+};
+
+class SpaceTreeTree: public SpaceTree
+{
+public:
+    SpaceTreeTree(): SpaceTree(false) { for (unsigned i = 0; i < 256; i++) tree[i] = 0; }
+    SpaceTree *tree[256];
+};
+
+// The fields of a LocalMemSpace that the scanners look at.
+class BenchSpace: public SpaceTree
+{
+public:
+    BenchSpace(): SpaceTree(true), bottom(0), top(0), isLocal(false), allocationSpace(false), slideSummary(0) {}
+    char *bottom, *top;
+    bool isLocal, allocationSpace;
+    POLYUNSIGNED slideSummary;
+};
+
+static void AddTreeRange(SpaceTree **tt, BenchSpace *space, uintptr_t startS, uintptr_t endS)
+{
+    if (*tt == 0)
+        *tt = new SpaceTreeTree;
+    SpaceTreeTree *t = (SpaceTreeTree*)*tt;
+
+    const unsigned shift = (sizeof(void*)-1) * 8; // Takes the high-order byte
+    uintptr_t r = startS >> shift;
+    const uintptr_t s = endS == 0 ? 256 : endS >> shift;
+
+    if (r == s) // Wholly within this entry
+        AddTreeRange(&(t->tree[r]), space, startS << 8, endS << 8);
+    else
+    {
+        if ((r << shift) != startS)
+        {
+            AddTreeRange(&(t->tree[r]), space, startS << 8, 0 /*End of range*/);
+            r++;
+        }
+        while (r < s)
+        {
+            t->tree[r] = space;
+            r++;
+        }
+        if ((s << shift) != endS)
+            AddTreeRange(&(t->tree[r]), space, 0, endS << 8);
+    }
+}
+
+static SpaceTree *spaceTree;
+static uintptr_t heapRangeBase, heapRangeSize;
+static const unsigned heapRangeShift = SPACE_SHIFT;
+static BenchSpace **heapRangeTable;
+
+// SpaceForAddress before the heap range.
+static inline BenchSpace *TreeSpaceForAddress(const void *pt)
+{
+    uintptr_t t = (uintptr_t)pt;
+    SpaceTree *tr = spaceTree;
+    unsigned j = sizeof(void *)*8;
+    for (;;)
+    {
+        if (tr == 0 || tr->isSpace)
+            return (BenchSpace*)tr;
+        j -= 8;
+        tr = ((SpaceTreeTree*)tr)->tree[(t >> j) & 0xff];
+    }
+}
+
+// SpaceForAddress with the heap range.
+static inline BenchSpace *RangeSpaceForAddress(const void *pt)
+{
+    uintptr_t t = (uintptr_t)pt;
+    if (t - heapRangeBase < heapRangeSize)
+        return heapRangeTable[(t - heapRangeBase) >> heapRangeShift];
+    return TreeSpaceForAddress(pt);
+}
+
+// A cheap pseudo-random sequence so that both heaps get the same pattern.
+static POLYUNSIGNED randomState = 1;
+static unsigned NextRandom()
+{
+    randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)(randomState >> 33);
+}
+
+// Fill the words to be scanned.  Each word is a tagged integer or the address
+// of a length word in one of the spaces.  The same sequence is generated for
+// both sets of spaces.  The percentages are of the whole.
+static void FillWords(uintptr_t *words, size_t n, BenchSpace *spaces, unsigned nSpaces,
+                      unsigned taggedPC, unsigned permPC, unsigned allocPC)
+{
+    randomState = 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned kind = NextRandom() % 100;
+        unsigned offset = (NextRandom() % (SPACE_BYTES / sizeof(PolyWord))) * sizeof(PolyWord);
+        unsigned sp;
+        if (kind < taggedPC)
+        {
+            words[i] = ((uintptr_t)NextRandom() << 1) | 1;
+            continue;
+        }
+        else if (kind < taggedPC + permPC)
+            sp = NextRandom() % PERMANENT_SPACES;
+        else if (kind < taggedPC + permPC + allocPC)
+            sp = PERMANENT_SPACES + NextRandom() % ALLOCATION_SPACES;
+        else sp = PERMANENT_SPACES + ALLOCATION_SPACES + NextRandom() % (nSpaces - ALLOCATION_SPACES);
+        words[i] = (uintptr_t)(spaces[sp].bottom + offset);
+    }
+}
+
+// The first PERMANENT_SPACES are permanent spaces which are always in the tree.
+// The local spaces follow with the allocation spaces first.
+static bool SetUpSpaces(BenchSpace *spaces, unsigned nSpaces, bool inRange)
+{
+    for (unsigned i = 0; i < PERMANENT_SPACES + nSpaces; i++)
+    {
+        BenchSpace *space = &spaces[i];
+        space->isLocal = i >= PERMANENT_SPACES;
+        space->allocationSpace = space->isLocal && i < PERMANENT_SPACES + ALLOCATION_SPACES;
+        space->slideSummary = i & 1; // Half the spaces are being compacted.
+        if (space->isLocal && inRange)
+            space->bottom = (char*)heapRangeBase + (size_t)(i - PERMANENT_SPACES) * SPACE_BYTES;
+        else
+        {
+            size_t bytes = SPACE_BYTES;
+            space->bottom = (char*)osMemoryManager->Reserve(bytes, false);
+            if (space->bottom == 0)
+                return false;
+        }
+        space->top = space->bottom + SPACE_BYTES;
+        if (space->isLocal && inRange)
+            heapRangeTable[i - PERMANENT_SPACES] = space;
+        else AddTreeRange(&spaceTree, space, (uintptr_t)space->bottom, (uintptr_t)space->top);
+    }
+    return true;
+}
+
+static double Now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Report(const char *test, double oldTime, double newTime, POLYUNSIGNED oldResult, POLYUNSIGNED newResult)
+{
+    printf("%-34s tree %8.3fs range %8.3fs speed-up %6.1fx %s\n", test, oldTime, newTime,
+           newTime == 0.0 ? 0.0 : oldTime / newTime, oldResult == newResult ? "" : "RESULTS DIFFER");
+    if (oldResult != newResult)
+        exit(1);
+}
+
+// The update phase: NewAddress looks up every address to see if the object
+// is in a local space that has been compacted.
+#define UPDATE_SCAN(lookup, words) \
+    POLYUNSIGNED result = 0; \
+    for (size_t i = 0; i < nWords; i++) \
+    { \
+        uintptr_t val = words[i]; \
+        if (val & 1) continue; \
+        BenchSpace *space = lookup((void*)val); \
+        if (space != 0 && space->isLocal && space->slideSummary != 0) result++; \
+    }
+
+// The minor GC: ScanAddressAt looks up every address to see if it is in an
+// allocation space and so has to be copied.
+#define QUICK_SCAN(lookup, words) \
+    POLYUNSIGNED result = 0; \
+    for (size_t i = 0; i < nWords; i++) \
+    { \
+        uintptr_t val = words[i]; \
+        if (val & 1) continue; \
+        BenchSpace *space = lookup((void*)val); \
+        if (space != 0 && space->isLocal && space->allocationSpace) result++; \
+    }
+
+#define COMPARE(test, scan, treeWords, rangeWords) \
+    { \
+        POLYUNSIGNED oldResult = 0, newResult = 0; \
+        double t0 = Now(); \
+        for (unsigned rep = 0; rep < 10; rep++) { scan(TreeSpaceForAddress, treeWords); oldResult += result; } \
+        double t1 = Now(); \
+        for (unsigned rep = 0; rep < 10; rep++) { scan(RangeSpaceForAddress, rangeWords); newResult += result; } \
+        double t2 = Now(); \
+        Report(test, t1-t0, t2-t1, oldResult, newResult); \
+    }
+
+int main(int argc, char **argv)
+{
+    unsigned nSpaces = argc > 1 ? (unsigned)strtoul(argv[1], 0, 10) : 1024;
+    size_t nWords = (argc > 2 ? strtoul(argv[2], 0, 10) : 8) * 1024 * 1024;
+    if (nSpaces <= ALLOCATION_SPACES)
+        nSpaces = ALLOCATION_SPACES+1;
+
+    // Reserve the range and the separate spaces.  The tree contains the separate
+    // local spaces and the permanent spaces in both cases.
+    size_t rangeBytes = (size_t)nSpaces * SPACE_BYTES;
+    void *range = osMemoryManager->Reserve(rangeBytes, false);
+    heapRangeTable = (BenchSpace**)calloc(rangeBytes >> SPACE_SHIFT, sizeof(BenchSpace*));
+    BenchSpace *treeSpaces = new BenchSpace[PERMANENT_SPACES+nSpaces];
+    BenchSpace *rangeSpaces = new BenchSpace[PERMANENT_SPACES+nSpaces];
+    uintptr_t *treeWords = (uintptr_t*)malloc(nWords * sizeof(uintptr_t));
+    uintptr_t *rangeWords = (uintptr_t*)malloc(nWords * sizeof(uintptr_t));
+    if (range == 0 || heapRangeTable == 0 || treeWords == 0 || rangeWords == 0)
+    {
+        fprintf(stderr, "Unable to allocate the heap\n");
+        return 1;
+    }
+    heapRangeBase = (uintptr_t)range;
+    heapRangeSize = rangeBytes;
+    // Both sets of permanent spaces go in the same tree.
+    if (! SetUpSpaces(treeSpaces, nSpaces, false) || ! SetUpSpaces(rangeSpaces, nSpaces, true))
+    {
+        fprintf(stderr, "Unable to reserve the spaces\n");
+        return 1;
+    }
+
+    printf("%u local spaces of 1Mbyte, %lu words scanned 10 times in each test\n",
+           nSpaces, (unsigned long)nWords);
+
+    // Major GC: a quarter of the words are tagged, a tenth point into the permanent
+    // spaces and the rest are spread over the local spaces.
+    FillWords(treeWords, nWords, treeSpaces, nSpaces, 25, 10, 0);
+    FillWords(rangeWords, nWords, rangeSpaces, nSpaces, 25, 10, 0);
+    COMPARE("GCUpdatePhase NewAddress", UPDATE_SCAN, treeWords, rangeWords);
+
+    // Minor GC: most addresses in new objects are to other new objects.
+    FillWords(treeWords, nWords, treeSpaces, nSpaces, 25, 10, 45);
+    FillWords(rangeWords, nWords, rangeSpaces, nSpaces, 25, 10, 45);
+    COMPARE("QuickGCScanner::ScanAddressAt", QUICK_SCAN, treeWords, rangeWords);
+    return 0;
+}
@@ -53,21 +53,208 @@
 #include <string.h>
 #endif
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "bitmap.h"
 #include "globals.h"
+#include "osmem.h"
+
+// On x86-64 with GCC or Clang we compile versions of the whole-word scans for
+// popcnt and for AVX2 and choose between them when the RTS starts.
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define BITMAP_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+typedef Bitmap::BitWord BitWord;
 
-bool Bitmap::Create(POLYUNSIGNED bits)
+#define ALL_ONES    (~(BitWord)0)
+
+static inline unsigned PopCount(BitWord w)
 {
-    free(m_bits); // Any previous data
-    size_t bytes = (bits+7) >> 3;
-    m_bits = (unsigned char*)calloc(bytes, sizeof(unsigned char));
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (unsigned)((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// The number of zero bits below the lowest set bit.  w must not be zero.
+static inline unsigned CountTrailingZeros(BitWord w)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(w);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, w);
+    return index;
+#else
+    unsigned n = 0;
+    while ((w & 1) == 0) { w >>= 1; n++; }
+    return n;
+#endif
+}
+
+// The number of zero bits above the highest set bit.  w must not be zero.
+static inline unsigned CountLeadingZeros(BitWord w)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(w);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, w);
+    return Bitmap::BITS_PER_WORD - 1 - index;
+#else
+    unsigned n = 0;
+    while ((w & ((BitWord)1 << (Bitmap::BITS_PER_WORD-1))) == 0) { w <<= 1; n++; }
+    return n;
+#endif
+}
+
+// Count the bits set in the words from "from" up to but not including "to".
+static POLYUNSIGNED CountSetWordsGeneric(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to)
+{
+    POLYUNSIGNED count = 0;
+    for (POLYUNSIGNED i = from; i < to; i++)
+        count += PopCount(bits[i]);
+    return count;
+}
+
+// Return the index of the first non-zero word from "from" up to but not
+// including "to" or "to" if they are all zero.
+static POLYUNSIGNED FindNonZeroWordGeneric(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to)
+{
+    while (from < to && bits[from] == 0)
+        from++;
+    return from;
+}
+
+#ifdef BITMAP_X86_DISPATCH
+// The same as the generic version but using the popcnt instruction.
+__attribute__((target("popcnt")))
+static POLYUNSIGNED CountSetWordsPopcnt(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to)
+{
+    POLYUNSIGNED count = 0;
+    for (POLYUNSIGNED i = from; i < to; i++)
+        count += __builtin_popcountll(bits[i]);
+    return count;
+}
+
+// Count bits 256 at a time.  Each nibble is looked up in a table with vpshufb
+// and the byte counts are summed with vpsadbw.  The byte counts are added into
+// the total at most every 8 iterations so they can't overflow.
+__attribute__((target("avx2,popcnt")))
+static POLYUNSIGNED CountSetWordsAVX2(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    POLYUNSIGNED i = from;
+    while (to - i >= 4)
+    {
+        __m256i bytes = _mm256_setzero_si256();
+        for (unsigned j = 0; j < 8 && to - i >= 4; j++, i += 4)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(bits + i));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, lowMask));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask));
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    POLYUNSIGNED count = (POLYUNSIGNED)(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                                        _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+    for (; i < to; i++)
+        count += __builtin_popcountll(bits[i]);
+    return count;
+}
+
+// Skip zero words four at a time.
+__attribute__((target("avx2")))
+static POLYUNSIGNED FindNonZeroWordAVX2(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to)
+{
+    while (to - from >= 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bits + from));
+        if (! _mm256_testz_si256(v, v))
+            break;
+        from += 4;
+    }
+    while (from < to && bits[from] == 0)
+        from++;
+    return from;
+}
+#endif
+
+static struct BitmapScan
+{
+    const char *name;
+    POLYUNSIGNED (*countSetWords)(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to);
+    POLYUNSIGNED (*findNonZeroWord)(const BitWord *bits, POLYUNSIGNED from, POLYUNSIGNED to);
+} bitmapScan = { "generic", CountSetWordsGeneric, FindNonZeroWordGeneric };
+
+// Choose the scanning functions for this processor.  This is run when the RTS
+// is initialised, before the first GC.
+static class BitmapScanChooser
+{
+public:
+    BitmapScanChooser()
+    {
+#ifdef BITMAP_X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        {
+            bitmapScan.name = "avx2";
+            bitmapScan.countSetWords = CountSetWordsAVX2;
+            bitmapScan.findNonZeroWord = FindNonZeroWordAVX2;
+        }
+        else if (__builtin_cpu_supports("popcnt"))
+        {
+            bitmapScan.name = "popcnt";
+            bitmapScan.countSetWords = CountSetWordsPopcnt;
+        }
+#endif
+    }
+} bitmapScanChooser;
+
+const char *Bitmap::Implementation()
+{
+    return bitmapScan.name;
+}
+
+bool Bitmap::Create(POLYUNSIGNED bits, bool hugePages)
+{
+    Destroy(); // Any previous data
+    size_t words = (bits + BITS_PER_WORD - 1) >> WORD_SHIFT;
+    size_t bytes = words * sizeof(BitWord);
+    // The memory from OSMem is zeroed in the same way as calloc.
+    if (hugePages && bytes >= HUGE_PAGE_SIZE)
+    {
+        m_bits = (BitWord*)osMemoryManager->AllocateHuge(bytes, PERMISSION_READ|PERMISSION_WRITE, m_hugePages);
+        if (m_bits != 0)
+        {
+            m_osBytes = bytes;
+            return true;
+        }
+    }
+    m_bits = (BitWord*)calloc(words, sizeof(BitWord));
     return m_bits != 0;
 }
 
 void Bitmap::Destroy()
 {
-    free(m_bits);
+    if (m_osBytes != 0)
+        osMemoryManager->Free(m_bits, m_osBytes);
+    else free(m_bits);
     m_bits = 0;
+    m_osBytes = 0;
+    m_hugePages = HUGE_PAGES_NONE;
 }
 
 Bitmap::~Bitmap()
@@ -75,57 +262,44 @@ Bitmap::~Bitmap()
     Destroy();
 }
 
-// Set a range of bits in a bitmap.  This checks that the bits are not already set.
+void Bitmap::SetBitAtomic(POLYUNSIGNED n)
+{
+#if defined(_MSC_VER)
+    // _InterlockedOr64 is not available on 32-bit Windows.
+    volatile __int64 *p = (volatile __int64*)&m_bits[n >> WORD_SHIFT];
+    __int64 old;
+    do old = *p;
+    while (_InterlockedCompareExchange64(p, old | (__int64)BitN(n), old) != old);
+#else
+    __sync_fetch_and_or(&m_bits[n >> WORD_SHIFT], BitN(n));
+#endif
+}
+
+// Set a range of bits in a bitmap.
 void Bitmap::SetBits(POLYUNSIGNED bitno, POLYUNSIGNED length)
 {
-    POLYUNSIGNED byte_index = bitno >> 3;
-    
     ASSERT (0 < length); // Strictly positive
-    
-    /* Set the first part byte */
-    POLYUNSIGNED start_bit_index = bitno & 7;
+
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    POLYUNSIGNED start_bit_index = bitno & (BITS_PER_WORD-1);
     POLYUNSIGNED stop_bit_index  = start_bit_index + length;
-    /* Do we need to change more than one byte? */
-    if (stop_bit_index < 8)
+    // Do we need to change more than one word?
+    if (stop_bit_index < BITS_PER_WORD)
     {
-        const unsigned mask1 = 0xff << start_bit_index;
-        const unsigned mask2 = 0xff << stop_bit_index;
-        const unsigned mask  = mask1 & ~mask2;
-        
-//        ASSERT((m_bits[byte_index] & mask) == 0);
-        m_bits[byte_index] |= mask;
+        m_bits[word_index] |= (ALL_ONES << start_bit_index) & ~(ALL_ONES << stop_bit_index);
         return;
     }
-    else /* Set all the bits we can in the first byte */
-    {
-        const unsigned mask  = 0xff << start_bit_index;
-        
-//        ASSERT((m_bits[byte_index] & mask) == 0);
-        m_bits[byte_index] |= mask;
-        
-        /* length = length - (8 - start_bit_index); */
-        length = stop_bit_index - 8;
-    }
-    
-    /* Set as many full bytes as possible */
-    if (8 <= length)
-    {
-        memset(m_bits + byte_index + 1, 0xff, length >> 3);
-        byte_index += length >> 3;
-        length &= 7;
-    }
-    
-    /* Invariant: 0 <= length < 8 */
-    ASSERT(length < 8);
-    if (length == 0) return;
-    
-    /* Invariant: 0 < length < 8 */
-    
-    /* Set the final part byte */
-    byte_index ++;
-    const unsigned mask  = 0xff & ~(0xff << length);
-//    ASSERT((m_bits[byte_index] & mask) == 0);
-    m_bits[byte_index] |= mask;
+    // Set all the bits we can in the first word
+    m_bits[word_index++] |= ALL_ONES << start_bit_index;
+    length = stop_bit_index - BITS_PER_WORD;
+
+    // Set as many full words as possible
+    for (; length >= BITS_PER_WORD; length -= BITS_PER_WORD)
+        m_bits[word_index++] = ALL_ONES;
+
+    // Set the final part word
+    if (length != 0)
+        m_bits[word_index] |= ~(ALL_ONES << length);
 }
 
 // Clear a range of bits.  This is only used to clear the bitmap so
@@ -133,52 +307,36 @@ void Bitmap::SetBits(POLYUNSIGNED bitno, POLYUNSIGNED length)
 // is zero.
 void Bitmap::ClearBits(POLYUNSIGNED bitno, POLYUNSIGNED length)
 {
-    POLYUNSIGNED byte_index = bitno >> 3;
-    length += bitno & 7;
-    size_t bytes = length >> 3;
-    if (length & 7) bytes++;
-    memset(m_bits+byte_index, 0, bytes);
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    POLYUNSIGNED end_index = (bitno + length + BITS_PER_WORD - 1) >> WORD_SHIFT;
+    memset(m_bits+word_index, 0, (end_index - word_index) * sizeof(BitWord));
 }
 
 // How many zero bits (maximum n) are there in the bitmap, starting at location start? */
 POLYUNSIGNED Bitmap::CountZeroBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const
 {
-    POLYUNSIGNED byte_index = bitno >> 3;
-    unsigned bit_index  = bitno & 7;
-    unsigned mask  = 1 << bit_index;
-    POLYUNSIGNED zero_bits  = 0;
     ASSERT (0 < n); // Strictly positive
-    
-    /* Check the first part byte */
-    while (mask != 0)
-    {
-        /* zero_bits < n */
-        if ((m_bits[byte_index] & mask) != 0) return zero_bits;
-        zero_bits ++;
-        if (zero_bits == n) return zero_bits;
-        mask = (mask << 1) & 0xff;
-        /* zero_bits < n */
-    }
-    
-    /* zero_bits < n */
-    
-    /* Check as many bytes as possible */
-    byte_index ++;
-    while (zero_bits < n && m_bits[byte_index] == 0)
-    {
-        zero_bits += 8;
-        byte_index ++;
-    }
-    
-    /* Check the final part byte */
-    mask = 1;
-    while (zero_bits < n && (m_bits[byte_index] & mask) == 0)
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    unsigned bit_index = bitno & (BITS_PER_WORD-1);
+
+    // Check the first part word
+    BitWord w = m_bits[word_index] >> bit_index;
+    if (w != 0)
     {
-        zero_bits ++;
-        mask = (mask << 1) & 0xff;
+        POLYUNSIGNED zero_bits = CountTrailingZeros(w);
+        return zero_bits < n ? zero_bits : n;
     }
-    
-    return zero_bits;
+    POLYUNSIGNED zero_bits = BITS_PER_WORD - bit_index;
+    if (zero_bits >= n)
+        return n;
+
+    // Skip the zero words.  We mustn't look beyond the last word containing bitno+n-1.
+    POLYUNSIGNED end_index = ((bitno + n - 1) >> WORD_SHIFT) + 1;
+    POLYUNSIGNED nonZero = bitmapScan.findNonZeroWord(m_bits, word_index+1, end_index);
+    zero_bits += (nonZero - word_index - 1) * BITS_PER_WORD;
+    if (nonZero < end_index)
+        zero_bits += CountTrailingZeros(m_bits[nonZero]);
+    return zero_bits < n ? zero_bits : n;
 }
 
 
@@ -197,6 +355,28 @@ POLYUNSIGNED Bitmap::FindFree
     POLYUNSIGNED candidate = start - n;
     ASSERT (start > limit);
     
+    if (n < BITS_PER_WORD)
+    {
+        // A short run lies within at most two words.  Test the whole run at once
+        // and if any bit is set the next candidate ends at the lowest of them.
+        BitWord runMask = ((BitWord)1 << n) - 1;
+        while (1)
+        {
+            POLYUNSIGNED word_index = candidate >> WORD_SHIFT;
+            unsigned bit_index = candidate & (BITS_PER_WORD-1);
+            BitWord w = m_bits[word_index] >> bit_index;
+            if (bit_index + n > BITS_PER_WORD)
+                w |= m_bits[word_index+1] << (BITS_PER_WORD - bit_index);
+            w &= runMask;
+            if (w == 0)
+                return candidate;
+            POLYUNSIGNED lowest = candidate + CountTrailingZeros(w);
+            if (lowest < n + limit)
+                return start; // Failure
+            candidate = lowest - n;
+        }
+    }
+
     while (1)
     {
         POLYUNSIGNED bits_free = CountZeroBits(candidate, n);
@@ -214,40 +394,147 @@ POLYUNSIGNED Bitmap::FindFree
 // Count the number of set bits in the bitmap.
 POLYUNSIGNED Bitmap::CountSetBits(POLYUNSIGNED size) const
 {
-    size_t bytes = (size+7) >> 3;
-    POLYUNSIGNED count = 0;
-    for (size_t i = 0; i < bytes; i++)
-    {
-        unsigned char byte = m_bits[i];
-        if (byte == 0xff) // Common case
-            count += 8;
-        else
-        {
-            while (byte != 0)
-            {
-                unsigned char b = byte & (-byte);
-                count++;
-                byte -= b;
-            }
-        }
-    }
+    POLYUNSIGNED words = size >> WORD_SHIFT;
+    POLYUNSIGNED count = bitmapScan.countSetWords(m_bits, 0, words);
+    unsigned rest = size & (BITS_PER_WORD-1);
+    if (rest != 0)
+        count += PopCount(m_bits[words] & ~(ALL_ONES << rest));
     return count;
 }
 
+// Count the set bits in a range.  Used in the copy and update phases to find
+// the new address of an object that has been slid.
+POLYUNSIGNED Bitmap::CountSetBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const
+{
+    if (n == 0) return 0;
+    POLYUNSIGNED first = bitno >> WORD_SHIFT;
+    POLYUNSIGNED last = (bitno + n - 1) >> WORD_SHIFT;
+    BitWord lowMask = ALL_ONES << (bitno & (BITS_PER_WORD-1));
+    unsigned rest = (bitno + n) & (BITS_PER_WORD-1);
+    BitWord highMask = rest == 0 ? ALL_ONES : ~(ALL_ONES << rest);
+    if (first == last)
+        return PopCount(m_bits[first] & lowMask & highMask);
+    return PopCount(m_bits[first] & lowMask) +
+        bitmapScan.countSetWords(m_bits, first+1, last) + PopCount(m_bits[last] & highMask);
+}
+
 // Find the last set bit before here.  Used to find the start of a code cell.
 // Returns zero if no bit is set.
 POLYUNSIGNED Bitmap::FindLastSet(POLYUNSIGNED bitno) const
 {
-    size_t byteno = bitno >> 3;
-    // Code cells are quite long so most of the bitmap will be zero.
-    if (m_bits[byteno] == 0)
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    unsigned bit_index = bitno & (BITS_PER_WORD-1);
+    // Mask out the bits above bitno.  Code cells are quite long so most of the
+    // words will be zero.
+    BitWord w = m_bits[word_index] & (ALL_ONES >> (BITS_PER_WORD - 1 - bit_index));
+    while (w == 0)
+    {
+        if (word_index == 0) return 0;
+        w = m_bits[--word_index];
+    }
+    return (word_index << WORD_SHIFT) + BITS_PER_WORD - 1 - CountLeadingZeros(w);
+}
+
+// Find the next set bit.  Used to find the objects marked by the concurrent marker.
+POLYUNSIGNED Bitmap::FindNextSet(POLYUNSIGNED bitno, POLYUNSIGNED limit) const
+{
+    if (bitno >= limit)
+        return limit;
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    BitWord w = m_bits[word_index] & (ALL_ONES << (bitno & (BITS_PER_WORD-1)));
+    if (w == 0)
+    {
+        POLYUNSIGNED end_index = ((limit - 1) >> WORD_SHIFT) + 1;
+        word_index = bitmapScan.findNonZeroWord(m_bits, word_index+1, end_index);
+        if (word_index >= end_index)
+            return limit;
+        w = m_bits[word_index];
+    }
+    POLYUNSIGNED result = (word_index << WORD_SHIFT) + CountTrailingZeros(w);
+    return result < limit ? result : limit;
+}
+
+// Find the first clear bit at or after bitno.  The update phase uses this to
+// find the end of a run of objects when it splits a space into chunks.
+POLYUNSIGNED Bitmap::FindNextClear(POLYUNSIGNED bitno, POLYUNSIGNED limit) const
+{
+    if (bitno >= limit)
+        return limit;
+    POLYUNSIGNED word_index = bitno >> WORD_SHIFT;
+    POLYUNSIGNED last_index = (limit - 1) >> WORD_SHIFT;
+    BitWord w = ~m_bits[word_index] & (ALL_ONES << (bitno & (BITS_PER_WORD-1)));
+    while (w == 0)
+    {
+        if (word_index >= last_index)
+            return limit;
+        w = ~m_bits[++word_index];
+    }
+    POLYUNSIGNED result = (word_index << WORD_SHIFT) + CountTrailingZeros(w);
+    return result < limit ? result : limit;
+}
+
+bool CardTable::Create(PolyWord *bottom, PolyWord *top)
+{
+    Destroy(); // Any previous data
+    m_bottom = bottom;
+    m_cards = (top - bottom + CARD_WORDS - 1) >> CARD_SHIFT;
+    m_dirty = (unsigned char*)calloc(m_cards, sizeof(unsigned char));
+    m_objects = (PolyWord**)calloc(m_cards, sizeof(PolyWord*));
+    if (m_dirty == 0 || m_objects == 0)
+    {
+        Destroy();
+        return false;
+    }
+    return true;
+}
+
+void CardTable::Destroy()
+{
+    free(m_dirty);
+    free(m_objects);
+    m_dirty = 0;
+    m_objects = 0;
+    m_cards = 0;
+    valid = false;
+}
+
+CardTable::~CardTable()
+{
+    Destroy();
+}
+
+void CardTable::ClearAllDirty()
+{
+    if (m_dirty != 0)
+        memset(m_dirty, 0, m_cards);
+}
+
+POLYUNSIGNED CardTable::FindDirty(POLYUNSIGNED card, POLYUNSIGNED end) const
+{
+    if (card >= end)
+        return end;
+    unsigned char *dirty = (unsigned char*)memchr(m_dirty+card, 1, end-card);
+    if (dirty == 0)
+        return end;
+    return dirty - m_dirty;
+}
+
+void CardTable::SetObjects(PolyWord *start, PolyWord *end)
+{
+    POLYUNSIGNED card = (start - m_bottom + CARD_WORDS - 1) >> CARD_SHIFT;
+    PolyWord *pt = start;
+    while (pt < end)
     {
-       do {
-            if (byteno == 0) return 0;
-            byteno--;
-        } while (m_bits[byteno] == 0);
-        bitno = (byteno << 3) + 7; // Set it to the last bit
+        PolyObject *obj = (PolyObject*)(pt+1);
+        POLYUNSIGNED length;
+        // There may be forwarding pointers if this has been converted
+        // from a saved state.
+        if (obj->ContainsForwardingPtr())
+            length = obj->FollowForwardingChain()->Length();
+        else length = obj->Length();
+        PolyWord *next = pt + length + 1;
+        while (card < m_cards && CardAddr(card) < next)
+            m_objects[card++] = pt;
+        pt = next;
     }
-    while (bitno > 0 && ! TestBit(bitno)) bitno--;
-    return bitno;
-}
\ No newline at end of file
+}
@@ -27,42 +27,114 @@
 class Bitmap
 {
 public:
-    Bitmap(): m_bits(0) {}
+    Bitmap(): m_bits(0), m_osBytes(0), m_hugePages(0) {}
     ~Bitmap();
 
-    // Allocate the bitmap bits
-    bool Create(POLYUNSIGNED bits);
+    // Allocate the bitmap bits.  If hugePages is true and the bitmap is at least
+    // the size of a huge page it is allocated in huge pages if possible.
+    bool Create(POLYUNSIGNED bits, bool hugePages = false);
 
     // Free the bitmap bits.
     void Destroy();
 
+    // The bits are held in 64-bit words.  Bit n is bit (n & 63) of word (n >> 6).
+    // On a little-endian machine this is the same layout as a byte array.
+    typedef uint64_t BitWord;
+    enum { BITS_PER_WORD = 64, WORD_SHIFT = 6 };
+
 private:
-    static unsigned char BitN(POLYUNSIGNED n) { return 1 << (n & 7); }
+    static BitWord BitN(POLYUNSIGNED n) { return (BitWord)1 << (n & (BITS_PER_WORD-1)); }
 public:
     // Test to see if it has been created
     bool Created() const { return m_bits != 0; }
+    // What kind of huge pages, if any, the bitmap was given.
+    unsigned HugePages() const { return m_hugePages; }
     // Set a single bit
-    void SetBit(POLYUNSIGNED n) { m_bits[n >> 3] |=  BitN(n); }
+    void SetBit(POLYUNSIGNED n) { m_bits[n >> WORD_SHIFT] |=  BitN(n); }
+    // Set a single bit when other threads may be setting bits in the same word.
+    void SetBitAtomic(POLYUNSIGNED n);
     // Clear a single bit
-    void ClearBit(POLYUNSIGNED n) { m_bits[n >> 3] &= (0xff ^ BitN(n)); }
+    void ClearBit(POLYUNSIGNED n) { m_bits[n >> WORD_SHIFT] &= ~BitN(n); }
     // Set a range of bits
     void SetBits(POLYUNSIGNED bitno, POLYUNSIGNED length);
     // Clear a range of bits.  May already be partly clear
     // N.B.  This may clear more than just the bits specified
     void ClearBits(POLYUNSIGNED bitno, POLYUNSIGNED length);
     // Test a bit
-    bool TestBit(POLYUNSIGNED n) const { return (m_bits[n >> 3] & BitN(n)) != 0; }
+    bool TestBit(POLYUNSIGNED n) const { return (m_bits[n >> WORD_SHIFT] & BitN(n)) != 0; }
     // How many zero bits (maximum n) are there in the bitmap, starting at location start?
     POLYUNSIGNED CountZeroBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const;
     //* search the bitmap from the high end down looking for n contiguous zeros
     POLYUNSIGNED FindFree(POLYUNSIGNED limit, POLYUNSIGNED bitno, POLYUNSIGNED n) const;
     // How many set bits are there in the bitmap?
     POLYUNSIGNED CountSetBits(POLYUNSIGNED size) const;
+    // How many set bits are there in the n bits starting at bitno?
+    POLYUNSIGNED CountSetBits(POLYUNSIGNED bitno, POLYUNSIGNED n) const;
     // Find the last set bit before here.
     POLYUNSIGNED FindLastSet(POLYUNSIGNED bitno) const;
+    // Find the first set bit at or after bitno.  Returns limit if there is none.
+    POLYUNSIGNED FindNextSet(POLYUNSIGNED bitno, POLYUNSIGNED limit) const;
+    // Find the first clear bit at or after bitno.  Returns limit if there is none.
+    POLYUNSIGNED FindNextClear(POLYUNSIGNED bitno, POLYUNSIGNED limit) const;
+
+    // The name of the implementation used for the whole-word scans: "generic",
+    // "popcnt" or "avx2".  This is chosen at run time from the processor features.
+    static const char *Implementation();
 private:
 
-    unsigned char *m_bits;
+    BitWord       *m_bits;
+    size_t         m_osBytes;   // Non-zero if the bits were allocated by OSMem rather than calloc.
+    unsigned       m_hugePages;
+};
+
+// Card table.  A mutable space is divided into cards of CARD_WORDS words.
+// When an address is stored into an existing mutable object the write barrier
+// marks the card containing the updated word.  The minor GC then only has to scan
+// the dirty cards rather than all the old mutable data.  For each card we also
+// record the start of the object that covers the first word of the card.
+#define CARD_SHIFT  6
+#define CARD_WORDS  ((POLYUNSIGNED)1 << CARD_SHIFT)
+
+class CardTable
+{
+public:
+    CardTable(): valid(false), m_dirty(0), m_objects(0), m_bottom(0), m_cards(0) {}
+    ~CardTable();
+
+    // Allocate the table for the space between bottom and top.
+    bool Create(PolyWord *bottom, PolyWord *top);
+
+    // Free the table.
+    void Destroy();
+
+    // Test to see if it has been created
+    bool Created() const { return m_dirty != 0; }
+
+    POLYUNSIGNED CardCount() const { return m_cards; }
+    POLYUNSIGNED CardNo(PolyWord *pt) const { return (POLYUNSIGNED)(pt - m_bottom) >> CARD_SHIFT; }
+    PolyWord *CardAddr(POLYUNSIGNED card) const { return m_bottom + (card << CARD_SHIFT); }
+
+    // Mark the card containing this word.
+    void SetDirty(PolyWord *pt) { m_dirty[CardNo(pt)] = 1; }
+    void ClearDirty(POLYUNSIGNED card) { m_dirty[card] = 0; }
+    // Clear all the cards.
+    void ClearAllDirty();
+    // Find the first dirty card in the range.  Returns "end" if there are none.
+    POLYUNSIGNED FindDirty(POLYUNSIGNED card, POLYUNSIGNED end) const;
+
+    // The length word of the object covering the first word of a card.
+    PolyWord *CardObject(POLYUNSIGNED card) const { return m_objects[card]; }
+    // Record the objects covering the cards that begin within a region.
+    // The region must consist of complete objects.
+    void SetObjects(PolyWord *start, PolyWord *end);
+
+    bool valid; // True if the object table is up to date with the layout of the space.
+
+private:
+    unsigned char *m_dirty;     // One byte for each card.  Non-zero if the card is dirty.
+    PolyWord     **m_objects;
+    PolyWord      *m_bottom;
+    POLYUNSIGNED   m_cards;
 };
 
 // A wrapper class that adds the address range.  It is used when scanning
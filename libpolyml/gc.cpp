@@ -78,13 +78,12 @@ bool convertedWeak = false;
     Marking involves setting bits in the bitmap for reachable words.
 
     2. Compact phase.
-    Marked objects are copied to try to compact, upwards, the heap segments.  When
-    an object is moved the length word of the object in the old location is set as
-    a tombstone that points to its new location.  In particular this means that we
-    cannot reuse the space where an object previously was during the compaction phase.
-    Immutable objects are moved into immutable segments.  When an object is moved
-    to a new location the bits are set in the bitmap as though the object had been
-    marked at that location.
+    Marked objects in most segments are slid up to the top of the segment, keeping
+    their order.  The new location is computed from the bitmap and a summary table.
+    Objects in the allocation areas and in segments that are almost empty are copied
+    into the free space below the data in other segments.  When an object is copied
+    the length word of the object in the old location is set as a tombstone that
+    points to its new location.  Immutable objects are copied into immutable segments.
 
     3. Update phase.
     The roots and objects marked during the first two phases are scanned and any
@@ -100,25 +99,40 @@ bool convertedWeak = false;
 */
 static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
 {
+    // If the marking has been started concurrently stop the marker.  The
+    // marking is completed in the mark phase.
+    GCConcurrentMarkStop();
+
     gHeapSizeParameters.RecordAtStartOfMajorGC();
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeStart);
     globalStats.incCount(PSC_GC_FULLGC);
 
+    // The survivors of minor GCs are treated as old data from now on.
+    TenureSurvivorSpaces();
+
     // Remove any empty spaces.  There will not normally be any except
     // if we have triggered a full GC as a result of detecting paging in the
     // minor GC but in that case we want to try to stop the system writing
     // out areas that are now empty.
     gMem.RemoveEmptyLocals();
 
+    if (userOptions.decommitDecay != 0)
+        gMem.RecordRecentlyUsed(userOptions.decommitDecay);
+
     if (debugOptions & DEBUG_GC)
         Log("GC: Full GC, %lu words required %zu spaces\n", wordsRequiredToAllocate, gMem.lSpaces.size());
 
     if (debugOptions & DEBUG_HEAPSIZE)
         gMem.ReportHeapSizes("Full GC (before)");
 
-    // Data sharing pass.
+    // Data sharing pass.  This uses the bitmaps so any concurrent marks are lost.
     if (gHeapSizeParameters.PerformSharingPass())
+    {
+        AbandonConcurrentGC();
+        TIMEDATA shareStart = HeapSizeParameters::StartGCPhase();
         GCSharingPhase();
+        HeapSizeParameters::EndGCPause(PSH_GC_SHARING, shareStart);
+    }
 /*
  * There is a really weird bug somewhere.  An extra bit may be set in the bitmap during
  * the mark phase.  It seems to be related to heavy swapping activity.  Duplicating the
@@ -137,9 +151,6 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
             ASSERT (lSpace->top >= lSpace->upperAllocPtr);
             ASSERT (lSpace->upperAllocPtr >= lSpace->lowerAllocPtr);
             ASSERT (lSpace->lowerAllocPtr >= lSpace->bottom);
-            // Set upper and lower limits of weak refs.
-            lSpace->highestWeak = lSpace->bottom;
-            lSpace->lowestWeak = lSpace->top;
             lSpace->fullGCLowerLimit = lSpace->top;
             // Put dummy objects in the unused space.  This allows
             // us to scan over the whole of the space.
@@ -156,7 +167,9 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
         }
 
         /* Mark phase */
+        TIMEDATA markStart = HeapSizeParameters::StartGCPhase();
         GCMarkPhase();
+        HeapSizeParameters::EndGCPhase(PST_GC_MARK_PAUSE, markStart, PSH_GC_MARK);
         
         POLYUNSIGNED bitCount = 0, markCount = 0;
         
@@ -201,6 +214,9 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
         for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
         {
             LocalMemSpace *lSpace = *i;
+            // Large objects are never moved so they don't need space to be copied into.
+            if (lSpace->largeObjectSpace)
+                continue;
             iMarked += lSpace->i_marked;
             mMarked += lSpace->m_marked;
             if (! lSpace->allocationSpace)
@@ -219,13 +235,19 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
     }
 
     /* Compact phase */
+    TIMEDATA copyStart = HeapSizeParameters::StartGCPhase();
     GCCopyPhase();
+    HeapSizeParameters::EndGCPhase(PST_GC_COPY_PAUSE, copyStart, PSH_GC_COPY);
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Copy");
 
     // Update Phase.
     if (debugOptions & DEBUG_GC) Log("GC: Update\n");
+    TIMEDATA updateStart = HeapSizeParameters::StartGCPhase();
     GCUpdatePhase();
+    HeapSizeParameters::EndGCPhase(PST_GC_UPDATE_PAUSE, updateStart, PSH_GC_UPDATE);
+    // Release any code spaces that have been emptied.
+    GCCodeCompactionComplete();
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Update");
 
@@ -283,12 +305,25 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
 #ifdef FILL_UNUSED_MEMORY
         memset(space->bottom, 0xaa, (char*)space->upperAllocPtr - (char*)space->bottom);
 #endif
+        // Objects have been moved so rebuild the card table.
+        if (! space->allocationSpace)
+            space->ResetCards();
         if (debugOptions & DEBUG_GC_ENHANCED)
             Log("GC: %s space %p %zu free in %zu words %2.1f%% full\n", space->spaceTypeString(),
                 space, space->freeSpace(), space->spaceSize(),
                 ((float)space->allocatedSpace()) * 100 / (float)space->spaceSize());
     }
 
+    // Return free pages that have not been needed recently to the OS.
+    if (userOptions.decommitDecay != 0)
+        globalStats.setSize(PSS_DECOMMITTED, gMem.DecommitFreeSpace());
+    globalStats.setSize(PSS_RESIDENT, osMemoryManager->ResidentSize());
+
+    // The allocation area is now empty so the permanent mutable areas
+    // cannot contain any references into it.
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+        (*i)->cards.ClearAllDirty();
+
     // End of garbage collection
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeEnd);
 
@@ -296,6 +331,7 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
     gHeapSizeParameters.AdjustSizeAfterMajorGC(wordsRequiredToAllocate);
     gHeapSizeParameters.resetMajorTimingData();
 
+    gMem.ResetLargeObjectAllocation();
     bool haveSpace = gMem.CheckForAllocation(wordsRequiredToAllocate);
 
     // Invariant: the bitmaps are completely clean.
@@ -324,26 +360,66 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
 // physical memory.
 void CreateHeap()
 {
+    // In NUMA mode spaces are allocated on particular nodes.
+    if (userOptions.numa)
+        gMem.SetNumaNodes(osMemoryManager->NumaNodeCount());
+    gMem.SetHugePages(userOptions.hugePages);
+    // If the range can't be reserved the spaces are allocated individually.
+    if (userOptions.heapRange != 0)
+        (void)gMem.ReserveHeapRange((uintptr_t)userOptions.heapRange * 1024);
+
     // Create an initial allocation space.
-    if (gMem.CreateAllocationSpace(gMem.DefaultSpaceSize()) == 0)
+    if (gMem.CreateAllocationSpace(gMem.DefaultSpaceSize(), gMem.CurrentNumaNode()) == 0)
         Exit("Insufficient memory to allocate the heap");
 
     // Create the task farm if required
     if (userOptions.gcthreads != 1)
     {
-        if (! gTaskFarm.Initialise(userOptions.gcthreads, 100))
+        if (! gTaskFarm.Initialise(userOptions.gcthreads, 100, gMem.NumaNodes()))
             Crash("Unable to initialise the GC task farm");
     }
     // Set up the stacks for the mark phase.
     initialiseMarkerTables();
 }
 
+// Start the mark phase of the next major GC in parallel with the ML threads.
+// This is called at the end of a successful minor GC.
+void StartConcurrentGC(void)
+{
+    if (! userOptions.concurrentGC || concurrentMarking || gpTaskFarm->ThreadCount() == 0)
+        return;
+    // Concurrent marking depends on the write barrier.
+    if (! machineDependent->HasWriteBarrier())
+        return;
+    // The markers ignore the allocation spaces so they must not contain any data
+    // that the last full GC was unable to move out of them.
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        if (lSpace->allocationSpace && lSpace->upperAllocPtr != lSpace->top)
+            return;
+    }
+    // Only start it if the next GC is going to be a major GC.  The sharing
+    // pass and profiling the live data both require the normal mark phase.
+    if (! gHeapSizeParameters.MajorGCPending() || gHeapSizeParameters.PerformSharingPass() ||
+            profileMode == kProfileLiveData || profileMode == kProfileLiveMutables)
+        return;
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
+    GCConcurrentMarkStart();
+    HeapSizeParameters::EndGCPhase(PST_GC_MARK_PAUSE, startTime, PSH_GC_MARK);
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark started\n");
+}
+
 class FullGCRequest: public MainThreadRequest
 {
 public:
     FullGCRequest(): MainThreadRequest(MTP_GCPHASEMARK) {}
     virtual void Perform()
     {
+        // An explicit full GC is expected to clear any unreferenced weak
+        // references so we don't complete a concurrent mark.
+        AbandonConcurrentGC();
         doGC (0);
     }
 };
@@ -398,3 +474,18 @@ void FullGCForShareCommonData(void)
 {
     doGC(0);
 }
+
+class GarbageCollector: public RtsModule
+{
+public:
+    virtual void Stop(void);
+};
+
+// Declare this.  It will be automatically added to the table.
+static GarbageCollector gcModule;
+
+// Make sure the concurrent marker is not running when the heap is deleted.
+void GarbageCollector::Stop()
+{
+    GCConcurrentMarkStop();
+}
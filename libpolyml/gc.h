@@ -25,9 +25,12 @@
 #ifndef GC_H_INCLUDED
 #define GC_H_INCLUDED
 
+#include <vector>
+
 #include "globals.h" // For POLYUNSIGNED
 
 class TaskData;
+class ScanAddress;
 
 // Make a request for a full garbage collection.
 extern void FullGC(TaskData *taskData);
@@ -42,6 +45,11 @@ extern bool convertedWeak;
 // Multi-thread GC.
 extern void initialiseMarkerTables();
 
+// Objects found by the mark phase wait in a queue of this depth, after being
+// prefetched, before they are scanned.  Set with --gcprefetch.
+#define MARK_PREFETCH_DEFAULT   0
+#define MARK_PREFETCH_MAX       64
+
 // The task farm for the GC.  The threads are left waiting for the GC,
 class GCTaskFarm;
 extern GCTaskFarm *gpTaskFarm;
@@ -50,11 +58,48 @@ extern void CopyObjectToNewAddress(PolyObject *srcAddress, PolyObject *destAddre
 
 extern bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate);
 
+// The number of minor GCs an object must survive before it is copied into the
+// old spaces.  Set with --gctenure.  With a threshold of one there are no survivor
+// spaces and each minor GC promotes everything it copies.
+#define TENURE_THRESHOLD_DEFAULT    1
+#define TENURE_THRESHOLD_MAX        15
+// Called at the start of a major GC to turn the survivor spaces into old spaces.
+extern void TenureSurvivorSpaces(void);
+
+// Concurrent marking.  If this is enabled the mark phase of a major GC is started
+// at the end of the preceding minor GC and runs in the GC threads while the ML
+// threads continue.  concurrentMarking is true while the markers are running and
+// ConcurrentMarkRecord must then be called with the old value of any word
+// overwritten in an existing object.  ConcurrentMarkAllocated must be called
+// with any code or large object allocated outside the allocation spaces.
+extern bool concurrentMarking;
+extern void ConcurrentMarkRecord(PolyWord oldValue);
+extern void ConcurrentMarkAllocated(PolyObject *obj);
+extern void StartConcurrentGC(void);
+// True once the markers have run out of work.  The next GC is then a major GC.
+extern bool ConcurrentMarkFinished(void);
+// Discard any concurrent marking.  Called before anything other than a GC
+// examines or modifies the heap.
+extern void AbandonConcurrentGC(void);
+
+// How the GC sharing pass finds objects with the same contents.  Set with
+// --gcshare.  The automatic choice hashes if there are many candidate objects.
+#define GC_SHARE_AUTO   0
+#define GC_SHARE_SORT   1
+#define GC_SHARE_HASH   2
+
 // GC Phases.
 extern void GCSharingPhase(void);
+extern void GCConcurrentMarkStart(void);
+extern void GCConcurrentMarkStop(void);
+// Used by a minor GC while the marking is in progress.  The objects the markers
+// have still to process are roots and the objects it copies are passed back.
+extern void GCConcurrentMarkScanRoots(ScanAddress *process);
+extern void GCConcurrentMarkResume(std::vector<PolyObject*> &copied);
 extern void GCMarkPhase(void);
 extern void GCheckWeakRefs(void);
 extern void GCCopyPhase(void);
 extern void GCUpdatePhase(void);
+extern void GCCodeCompactionComplete(void);
 
 #endif
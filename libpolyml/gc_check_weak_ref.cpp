@@ -23,7 +23,10 @@
 */
 /*
 This is an intermediate phase in the GC that checks for weak references
-that are no longer reachable.  It is performed after the first, mark, phase. 
+that are no longer reachable.  It is performed after the first, mark, phase.
+The mark phase records the weak objects that it has marked in each space
+and these are checked in parallel.  A space is scanned in full if there was
+not enough memory to record them.
 */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -45,10 +48,17 @@ that are no longer reachable.  It is performed after the first, mark, phase.
 #include "scanaddrs.h"
 #include "rts_module.h"
 #include "memmgr.h"
+#include "gctaskfarm.h"
+#include "diagnostics.h"
+
+// The weak objects in a space are checked in tasks of this many objects.
+#define WEAK_OBJECTS_PER_TASK   1024
 
 class MTGCCheckWeakRef: public ScanAddress {
 public:
     void ScanAreas(void);
+    void CheckWeakObjects(LocalMemSpace *space, size_t from, size_t to);
+    void CheckWeakSpace(LocalMemSpace *space);
 private:
     virtual void ScanRuntimeAddress(PolyObject **pt, RtsStrength weak);
     // This has to be defined since it's virtual.
@@ -128,19 +138,63 @@ void MTGCCheckWeakRef::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNED L)
     }
 }
 
-// We need to check any weak references both in the areas we are
-// currently collecting and any other areas.  This actually checks
-// weak refs in the area we're collecting even if they are not
-// actually reachable any more.  N.B.  This differs from OpMutables
-// because it also scans the area we're collecting.
-void MTGCCheckWeakRef::ScanAreas(void)
+// Check a range of the weak objects recorded for a local space.  If the same
+// SOME cell is referenced from two weak objects they may be checked at the
+// same time by different threads but both will make the same change.
+void MTGCCheckWeakRef::CheckWeakObjects(LocalMemSpace *space, size_t from, size_t to)
 {
-    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    for (size_t i = from; i < to; i++)
     {
-        LocalMemSpace *space = *i;
-        if (space->isMutable)
-            ScanAddressesInRegion(space->lowestWeak, space->highestWeak);
+        PolyObject *obj = space->weakObjects[i];
+        ScanAddressesInObject(obj, obj->LengthWord());
+    }
+}
+
+// Task to check some of the weak objects in a space.
+static void CheckWeakObjectsTask(GCTaskId *, void *arg1, void *arg2)
+{
+    LocalMemSpace *space = (LocalMemSpace *)arg1;
+    size_t from = (size_t)(uintptr_t)arg2;
+    size_t to = from + WEAK_OBJECTS_PER_TASK;
+    if (to > space->weakObjects.size()) to = space->weakObjects.size();
+    MTGCCheckWeakRef checkRef;
+    checkRef.CheckWeakObjects(space, from, to);
+}
+
+// Check every marked weak object in a space.  Used if the mark phase ran out
+// of memory while recording the weak objects in the space.
+void MTGCCheckWeakRef::CheckWeakSpace(LocalMemSpace *space)
+{
+    PolyWord *pt = space->bottom;
+    while (pt < space->top)
+    {
+        PolyObject *obj = (PolyObject*)++pt;
+        // Skip objects that have been copied by a minor collection.
+        if (obj->ContainsForwardingPtr())
+        {
+            obj = obj->FollowForwardingChain();
+            pt += obj->Length();
+        }
+        else
+        {
+            POLYUNSIGNED L = obj->LengthWord();
+            if (OBJ_IS_WEAKREF_OBJECT(L) && space->bitmap.TestBit(space->wordNo(pt)))
+                ScanAddressesInObject(obj, L);
+            pt += OBJ_OBJECT_LENGTH(L);
+        }
     }
+}
+
+static void CheckWeakSpaceTask(GCTaskId *, void *arg1, void *)
+{
+    MTGCCheckWeakRef checkRef;
+    checkRef.CheckWeakSpace((LocalMemSpace *)arg1);
+}
+
+// Weak objects in the local spaces have been recorded by the mark phase.
+// This only checks the permanent mutable areas.
+void MTGCCheckWeakRef::ScanAreas(void)
+{
     // Scan the permanent mutable areas.
     for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
     {
@@ -153,7 +207,26 @@ void MTGCCheckWeakRef::ScanAreas(void)
 
 void GCheckWeakRefs()
 {
+    size_t weakCount = 0;
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *space = *i;
+        if (space->weakObjectsOverflowed)
+        {
+            gpTaskFarm->AddWorkOrRunNow(&CheckWeakSpaceTask, space, 0);
+            continue;
+        }
+        weakCount += space->weakObjects.size();
+        for (size_t from = 0; from < space->weakObjects.size(); from += WEAK_OBJECTS_PER_TASK)
+            gpTaskFarm->AddWorkOrRunNow(&CheckWeakObjectsTask, space, (void*)(uintptr_t)from);
+    }
+
     MTGCCheckWeakRef checkRef;
     GCModules(&checkRef);
     checkRef.ScanAreas();
+
+    gpTaskFarm->WaitForCompletion();
+
+    if (debugOptions & DEBUG_GC_ENHANCED)
+        Log("GC: Checked %lu weak objects\n", (unsigned long)weakCount);
 }
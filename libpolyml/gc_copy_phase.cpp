@@ -25,33 +25,29 @@
 /*
 This is the second, copy, phase of the garbage collector.  The previous,
 mark, phase has identified all the live data and set the bits in the bit-maps.
-This phase compacts the memory by copying cells from lower in the segment or
-from other segments.  When a cell is copied the length-word is modified to be
-a tomb-stone that gives the new location for the cell.  Cells can be copied to
-areas of memory that are shown as free in the bit-maps and the destination area
-is then marked as allocated.  Because there are tomb-stones left behind the original
-location of a cell must remain as allocated and its space cannot be reused until the
-GC is complete.
-
-We copy cells in a defined order to avoid copying loops.
-The ordering on the addresses is:
-    Immutable areas (for immutable cells) (highest)
-    Mutable areas
-    Allocation areas (lowest)
-Within each group a lower position in the gMem.lSpaces is higher
-MemMgr::AddLocalSpace enters spaces gMem.lSpaces such that immutable
-areas come before mutable areas which come before allocation areas
-so this reduces to the order in that table.
-Within a space higher addresses are higher.
-So we try to copy data out of the allocation areas and to copy any
-cells that are now immutable out of the mutable areas.  We try to copy
-data out of higher numbered spaces in order to try to free them
-completely and to compact data towards the top of a space if we
-can't.
-
-Once a thread has started copying into or out of an area it takes
-ownership of the area and no other thread can use the area.  This
-avoids 
+This phase compacts the memory in two ways.
+
+Most spaces are compacted by sliding the live cells up to the top of the space,
+keeping them in the same order.  The new address of a cell is the top of the
+space less the number of live words at or above it.  A summary table records
+the number of live words above each block of SLIDE_BLOCK_WORDS and the rest is
+counted from the bit-map, which is left unchanged.  The update phase uses the
+same calculation so there is no need for tomb-stones in the slid spaces.  Each
+space is slid by a single thread and needs no locking.
+
+Allocation spaces, and spaces where very little of the data is still live, are
+emptied by copying their cells into the free space below the data in the other
+spaces.  When a cell is copied the length-word is modified to be a tomb-stone
+that gives the new location for the cell.  This is done after the sliding so
+the destinations are not themselves moved.  Space is allocated in a destination
+by atomically moving down its upperAllocPtr so several threads can copy into
+the same space.  The copied cells are immediately below the data in the space
+so the update phase can process them in a linear scan.
+Mutable cells are copied into mutable spaces and immutable cells into immutable
+spaces.  We try the spaces in the order of gMem.lSpaces.  MemMgr::AddLocalSpace
+enters spaces in gMem.lSpaces such that immutable areas come before mutable
+areas which come before allocation areas.  If there is no room for a cell it
+and the rest of the space are left where they are.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -73,6 +69,8 @@ avoids
 #include <string.h>
 #endif
 
+#include <new>
+
 #include "globals.h"
 #include "machine_dep.h"
 #include "processes.h"
@@ -83,62 +81,86 @@ avoids
 #include "gctaskfarm.h"
 #include "locking.h"
 #include "diagnostics.h"
+#include "heapsizing.h"
+#include "mpoly.h"
+#include "rts_module.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif ! defined(__GNUC__)
+// Fallback if we have no atomic operations.
+static PLock allocPtrLock("Alloc pointer");
+#endif
 
-static PLock copyLock("Copy");
-
-// Search the area downwards looking for n consecutive free words.
-// Return the address of the word if successful or 0 on failure.
-// "limit" is the bit position of the bottom of the area or, if we're compacting an area,
-// the bit position of the object we'd like to move to a higher address.
-static inline PolyWord *FindFreeAndAllocate(LocalMemSpace *dst, POLYUNSIGNED limit, POLYUNSIGNED n)
-{
-    if (dst == 0) return 0; // No current space
-
-    /* SPF's version of the start caching code. SPF 2/10/96 */
-    // The idea of it is to avoid having to search over an area that is
-    // already known not to have any spaces large enough for an object of
-    // a given size.  Knowing that there is no space for an object of
-    // size n implies that there is no space for anything of size larger
-    // than n.  SPF's idea is that after finding the space in the bitmap
-    // we update only the element for the size we are looking for rather
-    // than everything larger.
-    unsigned truncated_n = n < NSTARTS ? (unsigned)n : NSTARTS - 1;
-
-    // If we're looking for something larger than last time update
-    // all the entries last time's size and this size.
-    for (unsigned i = dst->start_index; i < truncated_n; i ++)
-    {
-        if (dst->start[i] < dst->start[i+1])
-            dst->start[i+1] = dst->start[i];
-    }
-
-    dst->start_index = truncated_n;
-    POLYUNSIGNED start = dst->start[truncated_n];
-    if (start <= limit)
-        return 0;
-
-    // Look in the bitmap.  Returns "start" if it can't find space.
-    POLYUNSIGNED free = dst->bitmap.FindFree(limit, start, n);
+// A space is emptied rather than slid if less than this fraction of it is live.
+#define EMPTY_SPACE_FRACTION    8
 
-    // If we failed to allocate the space (free == start) we set this to
-    // zero to indicate that there is no space for anything of this size
-    // or larger.
-    if (n < NSTARTS)
-        dst->start[n] = free == start ? 0 : free;
+// The spaces that cells can be copied into, in the order they are tried.
+// This is set up before any tasks are started and is then read-only.
+static std::vector<LocalMemSpace*> destinations;
 
-    if (free == start)
-        return 0;
+// Start of the copy phase and whether we have used the time allowed for it.
+static TIMEDATA compactStartTime;
+static volatile bool compactTimeExceeded;
 
-    // Allocate the space.
-    dst->bitmap.SetBits(free, n);
+// A space is only compacted if the free space between its lowest object and the
+// top is at least the threshold.  Otherwise we leave it, including the free space
+// within it, until a later GC.  Large object spaces are never compacted.
+static bool SpaceNeedsCompacting(LocalMemSpace *space)
+{
+    if (space->largeObjectSpace)
+        return false;
+    if (compactTimeExceeded)
+        return false;
+    if (userOptions.compactThreshold == 0)
+        return true;
+    POLYUNSIGNED holes = (space->top - space->fullGCLowerLimit) - space->i_marked - space->m_marked;
+    return (float)holes * 100 >= (float)space->spaceSize() * (float)userOptions.compactThreshold;
+}
 
-    PolyWord *newp = dst->wordAddr(free); /* New object address */
+// Check whether compaction has taken longer than the user allows.  Once this
+// is exceeded any remaining data is left for a later GC.
+static bool CompactTimeExceeded()
+{
+    if (userOptions.compactTime == 0)
+        return false;
+    if (! compactTimeExceeded &&
+            HeapSizeParameters::GCPhaseTime(compactStartTime) * 1000 >= (float)userOptions.compactTime)
+    {
+        compactTimeExceeded = true;
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Copy: Time limit of %u ms exceeded\n", userOptions.compactTime);
+    }
+    return compactTimeExceeded;
+}
 
-    // Update dst->upperAllocPtr, so the new object doesn't get trampled.
-    if (newp < dst->upperAllocPtr)
-        dst->upperAllocPtr = newp;
+// Atomically update the allocation pointer of a destination space.
+static inline bool CompareAndSwapAllocPtr(PolyWord **p, PolyWord *oldVal, PolyWord *newVal)
+{
+#if defined(_MSC_VER)
+    return InterlockedCompareExchangePointer((PVOID volatile*)p, newVal, oldVal) == oldVal;
+#elif defined(__GNUC__)
+    return __sync_bool_compare_and_swap(p, oldVal, newVal);
+#else
+    PLocker lock(&allocPtrLock);
+    if (*p != oldVal) return false;
+    *p = newVal;
+    return true;
+#endif
+}
 
-    return newp;
+// Allocate n words immediately below the data in a destination space.
+// Returns zero if there is no room.
+static inline PolyWord *AllocateInDestination(LocalMemSpace *dst, POLYUNSIGNED n)
+{
+    while (true)
+    {
+        PolyWord *upper = dst->upperAllocPtr;
+        if ((POLYUNSIGNED)(upper - dst->lowerAllocPtr) < n)
+            return 0;
+        if (CompareAndSwapAllocPtr(&dst->upperAllocPtr, upper, upper - n))
+            return upper - n;
+    }
 }
 
 // This does nothing to the addresses but by applying it in ScanConstantsWithinCode we
@@ -182,192 +204,437 @@ void CopyObjectToNewAddress(PolyObject *srcAddress, PolyObject *destAddress, POL
     }
 }
 
-// Find the next space in the sequence.  It may return with the space unchanged if it
-// is unable to find a suitable space.
-static bool FindNextSpace(LocalMemSpace *src, LocalMemSpace **dst, bool isMutable, GCTaskId *id)
+// Move a cell up within its space.  The old and new locations may overlap.
+static void SlideObject(PolyWord *old, PolyWord *dest, POLYUNSIGNED n, POLYUNSIGNED L)
 {
-    std::vector<LocalMemSpace*>::iterator m = gMem.lSpaces.begin();
-    // If we're compressing the space and it's full that's it.
-    if (*dst == src)
-        return false;
-    if (*dst != 0)
+    memmove(dest, old, n * sizeof(PolyWord));
+    if (OBJ_IS_CODE_OBJECT(L))
+    {
+        MTGCProcessIdentity identity;
+        machineDependent->FlushInstructionCache(dest+1, (n-1) * sizeof(PolyWord));
+        machineDependent->ScanConstantsWithinCode((PolyObject*)(dest+1), (PolyObject*)(old+1), n-1, &identity);
+    }
+}
+
+// Slide the live cells in a space up to the top.
+static void SlideSpace(GCTaskId *, void *arg1, void *)
+{
+    LocalMemSpace *space = (LocalMemSpace *)arg1;
+    POLYUNSIGNED highest = space->spaceSize();
+    POLYUNSIGNED blocks = (highest + SLIDE_BLOCK_WORDS - 1) >> SLIDE_BLOCK_SHIFT;
+    POLYUNSIGNED *summary = 0;
+    unsigned short *firstObject = 0;
+
+    if (! CompactTimeExceeded())
+    {
+        summary = new(std::nothrow) POLYUNSIGNED[blocks];
+        firstObject = new(std::nothrow) unsigned short[blocks];
+    }
+    if (summary == 0 || firstObject == 0)
     {
-        // Find the next space after this
-        while (*m != *dst) m++;
-        m++;
+        // Leave the data where it is.
+        delete[] summary;
+        delete[] firstObject;
+        space->upperAllocPtr = space->fullGCLowerLimit;
+        if (debugOptions & DEBUG_GC_ENHANCED)
+            Log("GC: Copy: leaving area %p uncompacted\n", space);
+        return;
     }
-    for (; m < gMem.lSpaces.end(); m++) {
-        LocalMemSpace *lSpace = *m;
-        if (lSpace == src)
+
+    // Find the first cell that starts in each block.  We can only find the
+    // start of a cell by working up from the bottom of the space.
+    // N.B.  It's essential that the first set bit at or above fullGCLowerLimit
+    // corresponds to the length word of a real object.
+    for (POLYUNSIGNED b = 0; b < blocks; b++)
+        firstObject[b] = SLIDE_BLOCK_WORDS;
+    POLYUNSIGNED lowest = space->wordNo(space->fullGCLowerLimit);
+    for (POLYUNSIGNED bitno = lowest; bitno < highest; )
+    {
+        bitno += space->bitmap.CountZeroBits(bitno, highest - bitno);
+        if (bitno >= highest) break;
+        POLYUNSIGNED block = bitno >> SLIDE_BLOCK_SHIFT;
+        if (firstObject[block] == SLIDE_BLOCK_WORDS)
+            firstObject[block] = (unsigned short)(bitno & (SLIDE_BLOCK_WORDS-1));
+        POLYUNSIGNED L = ((PolyObject*)(space->wordAddr(bitno)+1))->LengthWord();
+        ASSERT (OBJ_IS_LENGTH(L));
+        bitno += OBJ_OBJECT_LENGTH(L) + 1;
+    }
+
+    // Build the summary table.
+    POLYUNSIGNED live = 0;
+    for (POLYUNSIGNED b = blocks; b-- > 0; )
+    {
+        summary[b] = live;
+        POLYUNSIGNED blockStart = b << SLIDE_BLOCK_SHIFT;
+        POLYUNSIGNED blockEnd = blockStart + SLIDE_BLOCK_WORDS;
+        if (blockEnd > highest) blockEnd = highest;
+        live += space->bitmap.CountSetBits(blockStart, blockEnd - blockStart);
+    }
+    ASSERT(live == space->i_marked + space->m_marked);
+
+    // Move the cells, highest first.  A cell is only ever moved up and every cell
+    // above it has already been moved so this cannot overwrite a cell that is still
+    // to be moved.  Within a block we have to find the cells from the bottom up.
+    PolyWord *dest = space->top;
+    for (POLYUNSIGNED b = blocks; b-- > (lowest >> SLIDE_BLOCK_SHIFT); )
+    {
+        if (firstObject[b] == SLIDE_BLOCK_WORDS)
+            continue;
+        POLYUNSIGNED blockStart = b << SLIDE_BLOCK_SHIFT;
+        POLYUNSIGNED blockEnd = blockStart + SLIDE_BLOCK_WORDS;
+        if (blockEnd > highest) blockEnd = highest;
+        POLYUNSIGNED starts[SLIDE_BLOCK_WORDS];
+        unsigned count = 0;
+        for (POLYUNSIGNED bitno = blockStart + firstObject[b]; bitno < blockEnd; )
         {
-            // The only possibility is to compact this area.
-            ASSERT(!isMutable || src->isMutable);
-            *dst = src;
-            return true; // We already own it
+            starts[count++] = bitno;
+            bitno += OBJ_OBJECT_LENGTH(((PolyObject*)(space->wordAddr(bitno)+1))->LengthWord()) + 1;
+            if (bitno < blockEnd)
+                bitno += space->bitmap.CountZeroBits(bitno, blockEnd - bitno);
         }
-        if (lSpace->isMutable == isMutable && !lSpace->allocationSpace && lSpace->spaceOwner == 0)
+        while (count > 0)
         {
-            // Now acquire the lock.  We have to retest spaceOwner with the lock held.
-            PLocker lock(&copyLock);
-            if (lSpace->spaceOwner == 0)
+            PolyWord *old = space->wordAddr(starts[--count]);
+            POLYUNSIGNED L = ((PolyObject*)(old+1))->LengthWord();
+            POLYUNSIGNED n = OBJ_OBJECT_LENGTH(L) + 1;
+            dest -= n;
+            if (dest != old)
             {
-                // Change the space.
-                lSpace->spaceOwner = id;
-                *dst = lSpace; // Return the space
-                if (debugOptions & DEBUG_GC_ENHANCED)
-                    Log("GC: Copy: copying %s cells from %p to %p\n",
-                                isMutable ? "mutable" : "immutable", src, lSpace);
-                return true;
+                SlideObject(old, dest, n, L);
+                if (debugOptions & DEBUG_GC_DETAIL)
+                    Log("GC: Copy: %p %lu %u -> %p\n", old+1, OBJ_OBJECT_LENGTH(L),
+                                GetTypeBits(L), dest+1);
             }
         }
     }
-    return false;
+    ASSERT(dest == space->top - live);
+    delete[] firstObject;
+
+    space->slideSummary = summary;
+    space->upperAllocPtr = dest;
+    // The whole of the data is now contiguous.
+    space->fullGCLowerLimit = space->top;
+
+    if (debugOptions & DEBUG_GC_ENHANCED)
+        Log("GC: Copy: slid %lu words in area %p %s\n", live, space, space->spaceTypeString());
 }
 
-// Copy objects from the source space into an earlier space or up within the
-// current space.
-static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
+// Copy the cells out of a space into the destination spaces.
+static void EmptySpace(GCTaskId *, void *arg1, void *)
 {
-    LocalMemSpace *mutableDest = 0, *immutableDest = 0;
+    LocalMemSpace *src = (LocalMemSpace *)arg1;
+    // Indexes into "destinations" for mutable and immutable cells.
+    size_t mutableDest = 0, immutableDest = 0;
+    unsigned objectCount = 0;
+    POLYUNSIGNED copied = 0;
+
+    POLYUNSIGNED bitno = src->wordNo(src->fullGCLowerLimit);
+    POLYUNSIGNED highest = src->wordNo(src->top);
 
-    for (std::vector<LocalMemSpace*>::reverse_iterator i = gMem.lSpaces.rbegin(); i != gMem.lSpaces.rend(); i++)
+    for (;;)
     {
-        LocalMemSpace *src = *i;
+        if (bitno >= highest) break;
 
-        if (src->spaceOwner == 0)
+        bitno += src->bitmap.CountZeroBits(bitno, highest - bitno);
+
+        if (bitno >= highest) break;
+
+        /* first set bit corresponds to the length word */
+        PolyWord *old = src->wordAddr(bitno); /* Old object address */
+
+        // Check the time occasionally.  If we have run out we leave the
+        // rest of the space in place.
+        if (! src->allocationSpace && (++objectCount & 255) == 0 && CompactTimeExceeded())
         {
-            PLocker lock(&copyLock);
-            if (src->spaceOwner == 0)
-                src->spaceOwner = id;
-            else continue;
+            src->upperAllocPtr = old;
+            break;
         }
-        else if (src->spaceOwner != id)
-            continue;
 
-        if (debugOptions & DEBUG_GC_ENHANCED)
-            Log("GC: Copy: copying area %p (thread %p) %s \n", src, id, src->spaceTypeString());
-
-        // We start at fullGCLowerLimit which is the lowest marked object in the heap
-        // N.B.  It's essential that the first set bit at or above this corresponds
-        // to the length word of a real object.
-        POLYUNSIGNED  bitno   = src->wordNo(src->fullGCLowerLimit);
-        // Set the limit to the top so we won't rescan this.  That can
-        // only happen if copying takes a very short time and the same
-        // thread runs multiple tasks.
-        src->fullGCLowerLimit = src->top;
-
-        // src->highest is the bit position that corresponds to the top of
-        // generation we're copying.
-        POLYUNSIGNED  highest = src->wordNo(src->top);
-
-        for (;;)
+        PolyObject *obj = (PolyObject*)(old+1);
+
+        POLYUNSIGNED L = obj->LengthWord();
+        ASSERT (OBJ_IS_LENGTH(L));
+
+        POLYUNSIGNED n = OBJ_OBJECT_LENGTH(L) + 1 ;/* Length of allocation (including length word) */
+
+        bool isMutable = OBJ_IS_MUTABLE_OBJECT(L);
+        size_t &d = isMutable ? mutableDest : immutableDest;
+        PolyWord *newp = 0;
+        for (; d < destinations.size(); d++)
         {
-            if (bitno >= highest) break;
+            LocalMemSpace *dst = destinations[d];
+            if (dst->isMutable == isMutable && (newp = AllocateInDestination(dst, n)) != 0)
+                break;
+        }
 
-            /* SPF version; Invariant: 0 < highest - bitno */
-            bitno += src->bitmap.CountZeroBits(bitno, highest - bitno);
+        if (newp == 0)
+        {
+            // No room.  Leave this and the rest of the space where they are.
+            src->upperAllocPtr = old;
+            break;
+        }
 
-            if (bitno >= highest) break;
+        bitno += n;
+        copied += n;
+        PolyObject *destAddress = (PolyObject*)(newp+1);
+        obj->SetForwardingPtr(destAddress);
+        CopyObjectToNewAddress(obj, destAddress, L);
 
-            /* first set bit corresponds to the length word */
-            PolyWord *old = src->wordAddr(bitno); /* Old object address */
+        if (debugOptions & DEBUG_GC_DETAIL)
+            Log("GC: Copy: %p %lu %u -> %p\n", obj, OBJ_OBJECT_LENGTH(L),
+                        GetTypeBits(L), destAddress);
+    }
+
+    // Anything left is processed using the bitmap.
+    src->fullGCLowerLimit = src->upperAllocPtr;
 
-            PolyObject *obj = (PolyObject*)(old+1);
+    if (debugOptions & DEBUG_GC_ENHANCED)
+        Log("GC: Copy: copied %lu words out of area %p %s\n", copied, src, src->spaceTypeString());
+}
 
+// The thread stacks and registers are scanned conservatively so a word that looks
+// like an address in a code object may actually be an integer.  It must not be
+// changed so code that any of these words refers to can't be moved.  A space that
+// contains such code is not emptied.
+class CodePinScanner: public ScanAddress
+{
+public:
+    virtual PolyObject *ScanObjectAddress(PolyObject *base) { return base; }
+    virtual void ScanCodeAddressAt(PolyObject *base, PolyWord *)
+    {
+        MemSpace *space = gMem.SpaceForAddress((PolyWord*)base - 1);
+        if (space != 0 && space->spaceType == ST_CODE)
+            ((CodeSpace*)space)->evacuating = false;
+    }
+};
+
+// Code is normally left where it was allocated but if code compaction is enabled
+// the code in spaces that are nearly empty is moved into the free cells of the
+// other code spaces so that the emptied spaces can be released.  The old copies
+// are left with forwarding pointers until the update phase has run.
+static void CompactCodeSpaces()
+{
+    // Choose the spaces with the least live code first.  A space is only emptied
+    // if its code will fit in the free space of the spaces that are not emptied.
+    std::vector<CodeSpace*> candidates;
+    POLYUNSIGNED available = 0;
+    for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+    {
+        CodeSpace *space = *i;
+        available += space->freeWords;
+        POLYUNSIGNED live = space->spaceSize() - space->freeWords;
+        if ((float)live * 100 >= (float)space->spaceSize() * (float)userOptions.codeCompactThreshold)
+            continue;
+        std::vector<CodeSpace*>::iterator j = candidates.begin();
+        while (j < candidates.end() && (*j)->spaceSize() - (*j)->freeWords <= live) j++;
+        candidates.insert(j, space);
+    }
+    unsigned emptied = 0;
+    for (std::vector<CodeSpace *>::iterator i = candidates.begin(); i < candidates.end(); i++)
+    {
+        CodeSpace *space = *i;
+        POLYUNSIGNED live = space->spaceSize() - space->freeWords;
+        if (live + space->freeWords > available)
+            break;
+        available -= live + space->freeWords;
+        space->evacuating = true;
+        emptied++;
+    }
+    if (emptied == 0)
+        return;
+
+    // Keep any space that a thread may be executing in.
+    CodePinScanner pinScanner;
+    GCModules(&pinScanner);
+    emptied = 0;
+    for (std::vector<CodeSpace *>::iterator i = candidates.begin(); i < candidates.end(); i++)
+    {
+        if ((*i)->evacuating)
+            emptied++;
+    }
+    if (emptied == 0)
+        return;
+
+    // Stop moving code once the time is up or the free space is too fragmented.
+    // The remaining code stays where it is and any space it is in is kept.
+    POLYUNSIGNED moved = 0, objectCount = 0;
+    bool stopped = false;
+    for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); ! stopped && i < gMem.cSpaces.end(); i++)
+    {
+        CodeSpace *src = *i;
+        if (! src->evacuating)
+            continue;
+        if (CompactTimeExceeded())
+            break;
+        PolyWord *pt = src->bottom;
+        while (pt < src->top)
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
             POLYUNSIGNED L = obj->LengthWord();
-            ASSERT (OBJ_IS_LENGTH(L));
-
-            POLYUNSIGNED n = OBJ_OBJECT_LENGTH(L) + 1 ;/* Length of allocation (including length word) */
-            bitno += n;
-
-            // Find a mutable space for the mutable objects and an immutable space for
-            // the immutables.  We copy objects into earlier spaces or within its own
-            // space but we don't copy an object to a later space.  This avoids the
-            // risk of copying an object multiple times.  Previously this copied objects
-            // into later spaces but that doesn't work well if we have converted old
-            // saved state segments into local areas.  It's much better to delete them
-            // if possible.
-            bool isMutable = OBJ_IS_MUTABLE_OBJECT(L);
-            LocalMemSpace *destSpace = isMutable || immutableDest == 0 ? mutableDest : immutableDest;
-            PolyWord *newp = FindFreeAndAllocate(destSpace, (src == destSpace) ? bitno : 0, n);
-            if (newp == 0 && src != destSpace)
+            POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+            pt += length+1;
+            // Free cells are byte objects.  Code that is still being built is mutable
+            // and the compiler holds its address so it must stay where it is.
+            if (! OBJ_IS_CODE_OBJECT(L) || OBJ_IS_MUTABLE_OBJECT(L))
+                continue;
+            if ((++objectCount & 255) == 0 && CompactTimeExceeded())
+            {
+                stopped = true;
+                break;
+            }
+            CodeSpace *dest = 0;
+            PolyWord *newp = 0;
+            for (std::vector<CodeSpace *>::iterator j = gMem.cSpaces.begin(); newp == 0 && j < gMem.cSpaces.end(); j++)
             {
-                // See if we can find a different space.
-                // N.B.  FindNextSpace side-effects mutableDest/immutableDest to give the next space.
-                if (FindNextSpace(src, isMutable ? &mutableDest : &immutableDest, isMutable, id))
+                if (! (*j)->evacuating)
                 {
-                    bitno -= n; // Redo this object
-                    continue;
+                    dest = *j;
+                    newp = dest->TakeFreeCell(length);
                 }
-                // else just leave it
             }
-
-            if (newp == 0) /* no room */
+            if (newp == 0)
             {
-                // We're not going to move this object
-                // Update src->upperAllocPtr, so the old object doesn't get trampled.
-                if (old < src->upperAllocPtr)
-                    src->upperAllocPtr = old;
-
-                // Previously this continued compressing to try to make space available
-                // on the next GC.  Normally full GCs are infrequent so the chances are
-                // that at the next GC other data will have been freed.  Just stop at
-                // this point.
-                // However if we're compressing a mutable area and there is immutable
-                // data in it we should move those out because the mutable area is scanned
-                // on every partial GC.
-                if (! src->isMutable || src->i_marked == 0)
-                    break;
+                stopped = true; // The free space is too fragmented.  Leave the rest.
+                break;
             }
-            else
+            POLYUNSIGNED cellLength = ((PolyObject*)(newp+1))->Length();
+            if (cellLength > length)
             {
-                PolyObject *destAddress = (PolyObject*)(newp+1);
-                obj->SetForwardingPtr(destAddress);
-                CopyObjectToNewAddress(obj, destAddress, L);
-
-                if (debugOptions & DEBUG_GC_DETAIL)
-                    Log("GC: Copy: %p %lu %u -> %p\n", obj, OBJ_OBJECT_LENGTH(L),
-                                GetTypeBits(L), destAddress);
+                PolyWord *next = newp + length + 1;
+                gMem.FillUnusedSpace(next, cellLength - length);
+                dest->AddFreeCells(next, cellLength - length);
             }
+            PolyObject *destAddress = (PolyObject*)(newp+1);
+            dest->headerMap.SetBit(newp - dest->bottom);
+            CopyObjectToNewAddress(obj, destAddress, L);
+            obj->SetForwardingPtr(destAddress);
+            moved += length+1;
+
+            if (debugOptions & DEBUG_GC_DETAIL)
+                Log("GC: Copy: code %p %lu -> %p\n", obj, length, destAddress);
         }
+    }
 
-        if (mutableDest == src)
-            mutableDest = 0;
-        if (immutableDest == src)
-            immutableDest = 0;
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Copy: moved %lu words of code out of %u code spaces\n", moved, emptied);
+}
+
+// Called after the update phase.  Turns the cells that code has been moved out of
+// into free cells and releases any code spaces that are now empty.
+void GCCodeCompactionComplete()
+{
+    bool compacted = false;
+    for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+    {
+        CodeSpace *space = *i;
+        if (! space->evacuating)
+            continue;
+        compacted = true;
+        space->evacuating = false;
+        space->ClearFreeLists();
+        PolyWord *pt = space->bottom;
+        PolyWord *lastFree = 0;
+        POLYUNSIGNED lastFreeSpace = 0;
+        while (pt < space->top)
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            POLYUNSIGNED length;
+            if (obj->ContainsForwardingPtr())
+            {
+                length = obj->FollowForwardingChain()->Length();
+                space->headerMap.ClearBit(pt-space->bottom);
+            }
+            else length = obj->Length();
+            if (obj->ContainsForwardingPtr() || obj->IsByteObject())
+            {
+                // Merge adjacent free cells.
+                if (lastFree + lastFreeSpace == pt)
+                    lastFreeSpace += length + 1;
+                else
+                {
+                    if (lastFree != 0)
+                        space->AddFreeCell(lastFree);
+                    lastFree = pt;
+                    lastFreeSpace = length + 1;
+                }
+                ((PolyObject*)(lastFree+1))->SetLengthWord(lastFreeSpace-1, F_BYTE_OBJ);
+            }
+            else if (lastFree != 0)
+            {
+                space->AddFreeCell(lastFree);
+                lastFree = 0;
+                lastFreeSpace = 0;
+            }
+            pt += length+1;
+        }
+        if (lastFree != 0)
+            space->AddFreeCell(lastFree);
+    }
+    if (compacted)
+    {
+        gMem.RemoveEmptyCodeAreas();
+        gMem.RebuildCodeIndex();
     }
 }
 
 void GCCopyPhase()
 {
     mainThreadPhase = MTP_GCPHASECOMPACT;
+    compactStartTime = HeapSizeParameters::StartGCPhase();
+    compactTimeExceeded = false;
+
+    // Decide what to do with each space.  Spaces that are slid or left where they
+    // are can have cells copied into them once the sliding is complete.
+    std::vector<LocalMemSpace*> toEmpty;
+    unsigned slid = 0;
+    destinations.clear();
 
     for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *lSpace = *i;
-        POLYUNSIGNED highest = lSpace->wordNo(lSpace->top);
-        for (unsigned i = 0; i < NSTARTS; i++)
-            lSpace->start[i] = highest;
-        lSpace->start_index = NSTARTS - 1;
-        lSpace->spaceOwner = 0;
         // Reset the allocation pointers. This puts garbage (and real data) below them.
         // At the end of the compaction the allocation pointer will point below the
         // lowest real data.
         lSpace->upperAllocPtr = lSpace->top;
-    }
+        POLYUNSIGNED live = lSpace->i_marked + lSpace->m_marked;
 
-    // Copy the mutable data into a lower area if possible.
-    if (gpTaskFarm->ThreadCount() == 0)
-        copyAllData(globalTask, 0, 0);
-    else
-    {
-        // We start as many tasks as we have threads.  If the amount of work to
-        // be done is very small one thread could process more than one task.
-        // Have to be careful because we use the task ID to decide which space
-        // to scan.
-        for (unsigned j = 0; j < gpTaskFarm->ThreadCount(); j++)
-            gpTaskFarm->AddWorkOrRunNow(&copyAllData, 0, 0);
+        if (lSpace->allocationSpace)
+        {
+            if (live != 0)
+                toEmpty.push_back(lSpace);
+            continue;
+        }
+        if (! lSpace->largeObjectSpace)
+            destinations.push_back(lSpace);
+
+        if (live == 0 || ! SpaceNeedsCompacting(lSpace))
+        {
+            // Leave the data where it is.
+            lSpace->upperAllocPtr = lSpace->fullGCLowerLimit;
+            if (live != 0 && (debugOptions & DEBUG_GC_ENHANCED))
+                Log("GC: Copy: leaving area %p uncompacted\n", lSpace);
+        }
+        else if (live < lSpace->spaceSize() / EMPTY_SPACE_FRACTION)
+        {
+            destinations.pop_back();
+            toEmpty.push_back(lSpace);
+        }
+        else
+        {
+            slid++;
+            gpTaskFarm->AddWorkOrRunNow(&SlideSpace, lSpace, 0);
+        }
     }
+    gpTaskFarm->WaitForCompletion();
 
+    // Now copy the data out of the allocation spaces and any spaces that are almost empty.
+    for (std::vector<LocalMemSpace*>::iterator i = toEmpty.begin(); i < toEmpty.end(); i++)
+        gpTaskFarm->AddWorkOrRunNow(&EmptySpace, *i, 0);
     gpTaskFarm->WaitForCompletion();
+
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Copy: slid %u spaces, emptied %lu spaces\n", slid, (unsigned long)toEmpty.size());
+
+    if (userOptions.codeCompactThreshold != 0)
+        CompactCodeSpaces();
 }
@@ -50,8 +50,26 @@ then this is safe.  The only assumption made about the memory is
 that all the bits of a word are updated together so that a thread
 will always read a value that is a valid pointer.
 
+When a stack fills up the older half of it is moved into a chunk on a shared
+list and any thread that runs out of work takes chunks from the list.  Only if
+a chunk cannot be allocated is the object recorded for rescanning.
+
 Many of the ideas are drawn from Flood, Detlefs, Shavit and Zhang 2001
 "Parallel Garbage Collection for Shared Memory Multiprocessors".
+
+The marking can also be started at the end of a minor GC and run by the same
+markers in the GC threads while the ML threads continue.  This uses a
+snapshot-at-the-beginning scheme.  The roots are recorded before the ML threads
+are restarted and the write barrier records the old value of any word that is
+overwritten while the markers are running.  Since the ML threads can read and
+modify the objects the concurrent markers do not set the mark bit in the header
+of objects in the local spaces but instead set the bit for the length word in
+the bitmap.  Minor GCs continue while the marking is in progress.  The markers
+are stopped and the objects they have still to scan are roots for the minor GC.
+The objects it copies are then scanned when the markers are restarted.  At the
+next major GC the bits are transferred to the headers and the marking is
+completed in the normal way, with the ML threads stopped, from the roots, the
+recorded values and the mutable objects that have been modified.
 */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -68,6 +86,8 @@ Many of the ideas are drawn from Flood, Detlefs, Shavit and Zhang 2001
 #define ASSERT(x)
 #endif
 
+#include <new>
+
 #include "globals.h"
 #include "processes.h"
 #include "gc.h"
@@ -79,10 +99,71 @@ Many of the ideas are drawn from Flood, Detlefs, Shavit and Zhang 2001
 #include "gctaskfarm.h"
 #include "profiling.h"
 #include "heapsizing.h"
+#include "statistics.h"
+#include "mpoly.h"
 
 #define MARK_STACK_SIZE 3000
+#define MARK_CHUNK_SIZE (MARK_STACK_SIZE/2)
 #define LARGECACHE_SIZE 20
 
+// When a mark stack fills up the older half of it is moved into a chunk and the
+// chunk is added to a shared list.  A marker takes a chunk from the list when its
+// own stack is empty.  If a chunk cannot be allocated we fall back to recording
+// the range to be rescanned.
+struct MarkChunk
+{
+    MarkChunk *next;
+    unsigned count;
+    PolyObject *objects[MARK_CHUNK_SIZE];
+};
+
+// True if there are marks in the bitmaps from a concurrent mark that
+// must be completed by the next mark phase.
+static bool concurrentMarksPending = false;
+// Set while the markers are running in parallel with the ML threads.  Objects in
+// the local spaces are then marked in the bitmap rather than in the header.
+static bool markingConcurrently = false;
+// Set to stop the concurrent markers before they have finished.
+static volatile bool concurrentStop = false;
+// Set when the concurrent markers have run out of work.
+static volatile bool concurrentDone = false;
+// Set if one of the lists below could not be extended.  The marks are then abandoned.
+static bool concurrentFailed = false;
+// True once the concurrent markers have scanned the permanent mutable areas.
+static bool permanentsScanned = false;
+// Objects the concurrent markers have still to scan.  These are the roots, the
+// objects left when the markers were stopped and the objects copied by minor GCs.
+static std::vector<PolyObject*> pendingObjects;
+// Objects that have to be marked or scanned when the concurrent marking is completed.
+static std::vector<PolyObject*> remarkObjects;
+// Old values recorded by the write barrier while the concurrent marker is running.
+static std::vector<PolyObject*> satbBuffer;
+// Protects the lists while the concurrent markers are running.
+static PLock satbLock("GC SATB buffer");
+static TIMEDATA concurrentStartTime;
+
+// Add an object to one of the lists.  The caller must hold satbLock if the
+// markers are running.
+static void AddToList(std::vector<PolyObject*> &list, PolyObject *obj)
+{
+    try {
+        list.push_back(obj);
+    }
+    catch (std::bad_alloc &) {
+        concurrentFailed = true;
+    }
+}
+
+// Start loading the cache line containing an address.
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define PREFETCH(p)
+#endif
+
 class MTGCProcessMarkPointers: public ScanAddress
 {
 public:
@@ -100,21 +181,36 @@ public:
 
     static void MarkPointersTask(GCTaskId *, void *arg1, void *arg2);
 
-    static void InitStatics(unsigned threads)
+    static void InitStatics(unsigned threads, unsigned prefetch)
     {
         markStacks = new MTGCProcessMarkPointers[threads];
         nInUse = 0;
         nThreads = threads;
+        prefetchDepth = prefetch;
     }
 
     static void MarkRoots(void);
     static bool RescanForStackOverflow();
+    static void ResetRates(void);
+    static void LogRates(void);
+    static void ReleaseChunks(void);
+
+    static bool StartConcurrentMarker(void);
+    static void SaveChunks(void);
 
 private:
+    void RemarkConcurrent(void);
+
     bool TestForScan(PolyWord *pt);
+    bool TestForScanConcurrently(PolyObject *obj);
     void MarkAndTestForScan(PolyWord *pt);
+    void SetMark(PolyObject *obj);
     void Reset();
 
+    bool TakeConcurrentWork(void);
+    void ScanPending(PolyObject *obj);
+    void SaveConcurrentWork(PolyObject *obj);
+
     void PushToStack(PolyObject *obj, PolyWord *currentPtr = 0, POLYUNSIGNED originalLength = 0)
     {
         // If we don't have all the threads running we start a new one but
@@ -122,7 +218,7 @@ private:
         // can end up creating a task that terminates almost immediately.
         if (nInUse >= nThreads || msp < 2 || ! ForkNew(obj))
         {
-            if (msp < MARK_STACK_SIZE)
+            if (msp < MARK_STACK_SIZE || SpillToChunk())
             {
                 markStack[msp++] = obj;
                 if (currentPtr != 0)
@@ -140,11 +236,36 @@ private:
 
     static void StackOverflow(PolyObject *obj);
     static bool ForkNew(PolyObject *obj);    
+    bool SpillToChunk();
+    bool TakeChunk();
+
+    // Add an object that has been marked to the prefetch queue.
+    void AddToPrefetch(PolyObject *obj)
+    {
+        PREFETCH((PolyWord*)obj - 1);
+        unsigned tail = pfHead + pfCount++;
+        if (tail >= MARK_PREFETCH_MAX) tail -= MARK_PREFETCH_MAX;
+        prefetchQueue[tail] = obj;
+    }
 
     PolyObject *markStack[MARK_STACK_SIZE];
     unsigned msp;
     bool active;
 
+    // Marked objects that are waiting to be scanned.  Scanning an object involves
+    // reading the length words of the objects it refers to and with a large heap
+    // these are usually cache misses.  Objects are prefetched when they are added
+    // to this queue and by the time they reach the front they should be in the cache.
+    // Objects in the queue cannot be stolen so it must be emptied before the
+    // marker finishes.
+    PolyObject *prefetchQueue[MARK_PREFETCH_MAX];
+    unsigned pfHead, pfCount;
+    static unsigned prefetchDepth;
+
+    // Words scanned and time spent by this marker in the current GC.
+    POLYUNSIGNED wordsScanned;
+    float markTime;
+
     // For the typical small cell it's easier just to rescan from the start
     // but that can be expensive for large cells.  This caches the offset for
     // large cells.
@@ -153,6 +274,10 @@ private:
     unsigned locPtr;
 
     static MTGCProcessMarkPointers *markStacks;
+    // Chunks moved off the stacks and waiting to be scanned, and unused chunks.
+    static MarkChunk *fullChunks, *freeChunks;
+    static unsigned chunksAllocated;
+    static PLock chunkLock;
 protected:
     static unsigned nThreads, nInUse;
     static PLock stackLock;
@@ -164,7 +289,14 @@ protected:
 // worker thread.
 MTGCProcessMarkPointers *MTGCProcessMarkPointers::markStacks;
 unsigned MTGCProcessMarkPointers::nThreads, MTGCProcessMarkPointers::nInUse;
+unsigned MTGCProcessMarkPointers::prefetchDepth;
 PLock MTGCProcessMarkPointers::stackLock("GC mark stack");
+MarkChunk *MTGCProcessMarkPointers::fullChunks, *MTGCProcessMarkPointers::freeChunks;
+unsigned MTGCProcessMarkPointers::chunksAllocated;
+PLock MTGCProcessMarkPointers::chunkLock("GC mark chunks");
+
+// Words rescanned in the current GC because a mark stack overflowed.
+static POLYUNSIGNED rescannedWords;
 
 // It is possible to have two levels of forwarding because
 // we could have a cell in the allocation area that has been moved
@@ -176,7 +308,8 @@ inline PolyObject *FollowForwarding(PolyObject *obj)
     return obj;
 }
 
-MTGCProcessMarkPointers::MTGCProcessMarkPointers(): msp(0), active(false), locPtr(0)
+MTGCProcessMarkPointers::MTGCProcessMarkPointers(): msp(0), active(false), pfHead(0), pfCount(0),
+    wordsScanned(0), markTime(0), locPtr(0)
 {
     // Clear the mark stack
     for (unsigned i = 0; i < MARK_STACK_SIZE; i++)
@@ -203,10 +336,17 @@ void MTGCProcessMarkPointers::Reset()
 
 }
 
-// Called when the stack has overflowed.  We need to include this
-// in the range to be rescanned.
+// Called when the stack has overflowed and we could not allocate a chunk.
+// We need to include this in the range to be rescanned.
 void MTGCProcessMarkPointers::StackOverflow(PolyObject *obj)
 {
+    // A concurrent marker leaves it to be scanned later.
+    if (markingConcurrently)
+    {
+        PLocker lock(&satbLock);
+        AddToList(pendingObjects, obj);
+        return;
+    }
     MarkableSpace *space = (MarkableSpace*)gMem.SpaceForAddress(obj-1);
     ASSERT(space != 0 && (space->spaceType == ST_LOCAL || space->spaceType == ST_CODE));
     PLocker lock(&space->spaceLock);
@@ -221,6 +361,81 @@ void MTGCProcessMarkPointers::StackOverflow(PolyObject *obj)
         Log("GC: Mark: Stack overflow.  Rescan for %p\n", obj);
 }
 
+// Called when the stack is full.  Move the older half of it into a chunk where
+// any marker can take it.  Other threads may be reading the stack to steal from
+// it while we move the entries down but that is safe since they will only ever
+// see pointers to objects that have been marked.
+bool MTGCProcessMarkPointers::SpillToChunk()
+{
+    MarkChunk *chunk;
+    {
+        PLocker lock(&chunkLock);
+        chunk = freeChunks;
+        if (chunk != 0)
+            freeChunks = chunk->next;
+    }
+    if (chunk == 0)
+    {
+        chunk = new(std::nothrow) MarkChunk;
+        if (chunk == 0)
+            return false;
+        PLocker lock(&chunkLock);
+        chunksAllocated++;
+    }
+    for (unsigned i = 0; i < MARK_CHUNK_SIZE; i++)
+        chunk->objects[i] = markStack[i];
+    chunk->count = MARK_CHUNK_SIZE;
+    for (unsigned j = MARK_CHUNK_SIZE; j < msp; j++)
+        markStack[j-MARK_CHUNK_SIZE] = markStack[j];
+    msp -= MARK_CHUNK_SIZE;
+    for (unsigned k = msp; k < MARK_STACK_SIZE; k++)
+        markStack[k] = 0;
+    PLocker lock(&chunkLock);
+    chunk->next = fullChunks;
+    fullChunks = chunk;
+    return true;
+}
+
+// Called when the stack is empty.  Refill it from a chunk if there is one.
+bool MTGCProcessMarkPointers::TakeChunk()
+{
+    ASSERT(msp == 0);
+    // We can test this without the lock.  If another marker adds a chunk after
+    // we've looked that marker will find it itself before it finishes.
+    if (fullChunks == 0)
+        return false;
+    MarkChunk *chunk;
+    {
+        PLocker lock(&chunkLock);
+        chunk = fullChunks;
+        if (chunk == 0)
+            return false;
+        fullChunks = chunk->next;
+    }
+    for (unsigned i = 0; i < chunk->count; i++)
+        markStack[i] = chunk->objects[i];
+    msp = chunk->count;
+    PLocker lock(&chunkLock);
+    chunk->next = freeChunks;
+    freeChunks = chunk;
+    return true;
+}
+
+// Free the chunks at the end of the mark phase.
+void MTGCProcessMarkPointers::ReleaseChunks()
+{
+    ASSERT(fullChunks == 0);
+    if (chunksAllocated != 0 && (debugOptions & DEBUG_GC_ENHANCED))
+        Log("GC: Mark: Mark stacks used %u additional chunks\n", chunksAllocated);
+    while (freeChunks != 0)
+    {
+        MarkChunk *chunk = freeChunks;
+        freeChunks = chunk->next;
+        delete chunk;
+    }
+    chunksAllocated = 0;
+}
+
 // Fork a new task.  Because we've checked nInUse without taking the lock
 // we may find that we can no longer create a new task.
 bool MTGCProcessMarkPointers::ForkNew(PolyObject *obj)
@@ -253,12 +468,26 @@ bool MTGCProcessMarkPointers::ForkNew(PolyObject *obj)
 void MTGCProcessMarkPointers::MarkPointersTask(GCTaskId *, void *arg1, void *arg2)
 {
     MTGCProcessMarkPointers *marker = (MTGCProcessMarkPointers*)arg1;
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     marker->Reset();
 
-    marker->ScanAddressesInObject((PolyObject*)arg2);
+    // The first concurrent marker is started without an object.
+    if (arg2 != 0)
+        marker->ScanAddressesInObject((PolyObject*)arg2);
 
     while (true)
     {
+        // If the concurrent markers are being stopped any chunks are saved
+        // by GCConcurrentMarkStop.
+        if (markingConcurrently && concurrentStop)
+            break;
+        // Take a chunk if there is one.
+        if (marker->TakeChunk())
+        {
+            PolyObject *obj = marker->markStack[--marker->msp];
+            marker->ScanAddressesInObject(obj);
+            continue;
+        }
         // Look for a stack that has at least one item on it.
         MTGCProcessMarkPointers *steal = 0;
         for (unsigned i = 0; i < nThreads && steal == 0; i++)
@@ -266,9 +495,14 @@ void MTGCProcessMarkPointers::MarkPointersTask(GCTaskId *, void *arg1, void *arg
             if (markStacks[i].markStack[0] != 0)
                 steal = &markStacks[i];
         }
-        // We're finished if they're all done.
+        // We're finished if they're all done.  The concurrent markers may also
+        // have objects left for them and values recorded by the write barrier.
         if (steal == 0)
+        {
+            if (markingConcurrently && marker->TakeConcurrentWork())
+                continue;
             break;
+        }
         // Look for items on this stack
         for (unsigned j = 0; j < MARK_STACK_SIZE; j++)
         {
@@ -287,10 +521,21 @@ void MTGCProcessMarkPointers::MarkPointersTask(GCTaskId *, void *arg1, void *arg
         }
     }
 
+    marker->markTime += HeapSizeParameters::GCPhaseTime(startTime);
+
     PLocker lock(&stackLock);
     marker->active = false; // It's finished
     nInUse--;
     ASSERT(marker->markStack[0] == 0);
+    // When the last concurrent marker finishes only the remark is left.  Any values
+    // recorded by the write barrier after this are processed in the remark.
+    if (markingConcurrently && nInUse == 0 && ! concurrentStop)
+    {
+        concurrentDone = true;
+        HeapSizeParameters::EndGCPhase(PST_GC_CONCURRENT_MARK, concurrentStartTime);
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Concurrent mark finished\n");
+    }
 }
 
 // Tests if this needs to be scanned.  It marks it if it has not been marked
@@ -306,6 +551,10 @@ bool MTGCProcessMarkPointers::TestForScan(PolyWord *pt)
     // be following any forwarding pointers here.  However it's safe
     // because they will update it with the same value.
     PolyObject *obj = (*pt).AsObjPtr();
+    // The concurrent marker must not update the word because the ML threads
+    // may be using it.  There are no forwarding pointers while it is running.
+    if (markingConcurrently)
+        return TestForScanConcurrently(obj);
     if (obj->ContainsForwardingPtr())
     {
         obj = FollowForwarding(obj);
@@ -331,13 +580,76 @@ bool MTGCProcessMarkPointers::TestForScan(PolyWord *pt)
     return true;
 }
 
-void MTGCProcessMarkPointers::MarkAndTestForScan(PolyWord *pt)
+// TestForScan when the ML threads are running.  Objects in the local spaces are
+// marked in the bitmap because the ML threads may be using their headers.  Code
+// objects are marked in the header because once they are complete they are never
+// modified.  Code that is still being built is left for the remark.  Objects in
+// the allocation spaces have been allocated since the marking started and are
+// found when it is completed.
+bool MTGCProcessMarkPointers::TestForScanConcurrently(PolyObject *obj)
 {
-    if (TestForScan(pt))
+    MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
+    if (sp == 0)
+        return false;
+    if (sp->spaceType == ST_LOCAL)
     {
-        PolyObject *obj = (*pt).AsObjPtr();
-        obj->SetLengthWord(obj->LengthWord() | _OBJ_GC_MARK);
+        LocalMemSpace *lSpace = (LocalMemSpace*)sp;
+        if (lSpace->allocationSpace)
+            return false;
+        POLYUNSIGNED bitno = lSpace->wordNo((PolyWord*)obj-1);
+        if (lSpace->bitmap.TestBit(bitno))
+            return false; // Already marked
+        POLYUNSIGNED L = obj->LengthWord();
+        if (OBJ_IS_BYTE_OBJECT(L))
+        {
+            lSpace->bitmap.SetBitAtomic(bitno);
+            return false;
+        }
+        if (OBJ_IS_CODE_OBJECT(L))
+        {
+            lSpace->bitmap.SetBitAtomic(bitno);
+            PLocker lock(&satbLock);
+            AddToList(remarkObjects, obj);
+            return false;
+        }
+        return true;
+    }
+    else if (sp->spaceType == ST_CODE)
+    {
+        POLYUNSIGNED L = obj->LengthWord();
+        if (L & _OBJ_GC_MARK)
+            return false;
+        if (OBJ_IS_MUTABLE_OBJECT(L))
+        {
+            PLocker lock(&satbLock);
+            AddToList(remarkObjects, obj);
+            return false;
+        }
+        return true;
     }
+    return false; // Ignore anything in the permanent areas.
+}
+
+// Mark an object that TestForScan has returned true for.
+inline void MTGCProcessMarkPointers::SetMark(PolyObject *obj)
+{
+    if (markingConcurrently)
+    {
+        MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
+        if (sp->spaceType == ST_LOCAL)
+        {
+            LocalMemSpace *lSpace = (LocalMemSpace*)sp;
+            lSpace->bitmap.SetBitAtomic(lSpace->wordNo((PolyWord*)obj-1));
+            return;
+        }
+    }
+    obj->SetLengthWord(obj->LengthWord() | _OBJ_GC_MARK);
+}
+
+void MTGCProcessMarkPointers::MarkAndTestForScan(PolyWord *pt)
+{
+    if (TestForScan(pt))
+        SetMark((*pt).AsObjPtr());
 }
 
 // The initial entry to process the roots.  These may be RTS addresses or addresses in
@@ -346,6 +658,18 @@ void MTGCProcessMarkPointers::MarkAndTestForScan(PolyWord *pt)
 // updated address of an object.
 PolyObject *MTGCProcessMarkPointers::ScanObjectAddress(PolyObject *obj)
 {
+    if (markingConcurrently)
+    {
+        if (TestForScanConcurrently(obj))
+        {
+            SetMark(obj);
+            if (msp != 0 || pfCount != 0)
+                PushToStack(obj);
+            else MTGCProcessMarkPointers::ScanAddressesInObject(obj, obj->LengthWord());
+        }
+        return obj;
+    }
+
     PolyWord val = obj;
     MemSpace *sp = gMem.SpaceForAddress(val.AsStackAddr()-1);
     if (!(sp->spaceType == ST_LOCAL || sp->spaceType == ST_CODE))
@@ -376,10 +700,10 @@ PolyObject *MTGCProcessMarkPointers::ScanObjectAddress(PolyObject *obj)
     if (OBJ_IS_BYTE_OBJECT(L))
         return obj;
 
-    // If we already have something on the stack we must being called
-    // recursively to process a constant in a code segment.  Just push
-    // it on the stack and let the caller deal with it.
-    if (msp != 0)
+    // If we already have something on the stack or in the prefetch queue we
+    // must being called recursively to process a constant in a code segment.
+    // Just push it on the stack and let the caller deal with it.
+    if (msp != 0 || pfCount != 0)
         PushToStack(obj); // Can't check this because it may have forwarding ptrs.
     else
     {
@@ -414,6 +738,13 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
 
     while (true)
     {
+        // If the concurrent markers are being stopped save what is left.
+        if (markingConcurrently && concurrentStop)
+        {
+            SaveConcurrentWork(obj);
+            return;
+        }
+
         ASSERT (OBJ_IS_LENGTH(lengthWord));
 
         // Get the length and base address.  N.B.  If this is a code segment
@@ -432,6 +763,7 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
             for (POLYUNSIGNED i = 0; i < length; i++)
                 (void)MarkAndTestForScan(baseAddr+i);
             // We've finished with this.
+            wordsScanned += length;
             length = 0;
         }
 
@@ -439,6 +771,7 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
         {
             // It's better to process the whole code object in one go.
             ScanAddress::ScanAddressesInObject(obj, lengthWord);
+            wordsScanned += length;
             length = 0; // Finished
         }
 
@@ -456,13 +789,28 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
         PolyObject *secondWord = 0;
         PolyWord *restartAddr = 0;
 
-        if (obj == largeObjectCache[locPtr].base)
+        if (length >= largeObjectSize)
         {
-            baseAddr = largeObjectCache[locPtr].current;
-            ASSERT(baseAddr > (PolyWord*)obj && baseAddr < ((PolyWord*)obj)+length);
-            if (locPtr == 0) locPtr = LARGECACHE_SIZE-1; else locPtr--;
+            // Usually this will be the most recent entry but objects taken through
+            // the prefetch queue may be scanned in a different order.
+            for (unsigned j = 0, k = locPtr; j < LARGECACHE_SIZE; j++, k = k == 0 ? LARGECACHE_SIZE-1 : k-1)
+            {
+                if (obj == largeObjectCache[k].base)
+                {
+                    baseAddr = largeObjectCache[k].current;
+                    ASSERT(baseAddr > (PolyWord*)obj && baseAddr < ((PolyWord*)obj)+length);
+                    largeObjectCache[k].base = 0;
+                    if (k == locPtr)
+                    {
+                        if (locPtr == 0) locPtr = LARGECACHE_SIZE-1; else locPtr--;
+                    }
+                    break;
+                }
+            }
         }
 
+        PolyWord *scanStart = baseAddr;
+
         while (baseAddr != endWord)
         {
             PolyWord wordAt = *baseAddr;
@@ -489,6 +837,7 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
             }
             baseAddr++;
         }
+        wordsScanned += baseAddr - scanStart;
 
         if (baseAddr != endWord)
             // Put this back on the stack while we process the first word
@@ -496,19 +845,42 @@ void MTGCProcessMarkPointers::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNE
         else if (secondWord != 0)
         {
             // Mark it now because we will process it.
-            secondWord->SetLengthWord(secondWord->LengthWord() | _OBJ_GC_MARK);
+            SetMark(secondWord);
             // Put this on the stack.  If this is a list node we will be
             // pushing the tail.
             PushToStack(secondWord);
         }
 
-        if (firstWord != 0)
+        if (prefetchDepth != 0)
+        {
+            // Put the next object into the prefetch queue and fill the queue from
+            // the stack then take the object at the front.
+            if (firstWord != 0)
+            {
+                SetMark(firstWord);
+                AddToPrefetch(firstWord);
+            }
+            if (pfCount == 0 && msp == 0 && ! TakeChunk())
+            {
+                markStack[msp] = 0; // Really finished
+                return;
+            }
+            while (pfCount < prefetchDepth && msp != 0)
+            {
+                if (msp < MARK_STACK_SIZE) markStack[msp] = 0;
+                AddToPrefetch(markStack[--msp]);
+            }
+            obj = prefetchQueue[pfHead];
+            if (++pfHead == MARK_PREFETCH_MAX) pfHead = 0;
+            pfCount--;
+        }
+        else if (firstWord != 0)
         {
             // Mark it and process it immediately.
-            firstWord->SetLengthWord(firstWord->LengthWord() | _OBJ_GC_MARK);
+            SetMark(firstWord);
             obj = firstWord;
         }
-        else if (msp == 0)
+        else if (msp == 0 && ! TakeChunk())
         {
             markStack[msp] = 0; // Really finished
             return;
@@ -573,6 +945,7 @@ void MTGCProcessMarkPointers::MarkRoots(void)
     ASSERT(nThreads >= 1);
     ASSERT(nInUse == 0);
     MTGCProcessMarkPointers *marker = &markStacks[0];
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     marker->Reset();
     marker->active = true;
     nInUse = 1;
@@ -588,7 +961,11 @@ void MTGCProcessMarkPointers::MarkRoots(void)
     // Scan the RTS roots.
     GCModules(marker);
 
+    if (concurrentMarksPending)
+        marker->RemarkConcurrent();
+
     ASSERT(marker->markStack[0] == 0);
+    marker->markTime += HeapSizeParameters::GCPhaseTime(startTime);
 
     // When this has finished there may well be other tasks running.
     PLocker lock(&stackLock);
@@ -615,6 +992,7 @@ public:
     virtual PolyObject *ScanObjectAddress(PolyObject *base) { ASSERT(false); return 0; }
 
     bool ScanSpace(MarkableSpace *space);
+    void ScanDirtyCards(LocalMemSpace *space);
 private:
     MTGCProcessMarkPointers *m_marker;
 };
@@ -636,12 +1014,49 @@ bool Rescanner::ScanSpace(MarkableSpace *space)
     {
         if (debugOptions & DEBUG_GC_ENHANCED)
             Log("GC: Mark: Rescanning from %p to %p\n", start, end);
+        rescannedWords += end - start;
         ScanAddressesInRegion(start, end);
         return true; // Require rescan
     }
     else return false;
 }
 
+// Rescan the marked objects on the dirty cards of a mutable space.  The cards record
+// the stores made by the ML threads while the concurrent marker was running.  N.B.
+// The unused area of the space has been filled with dummy objects.
+void Rescanner::ScanDirtyCards(LocalMemSpace *space)
+{
+    CardTable *cards = &space->cards;
+    if (! cards->valid)
+    {
+        ScanAddressesInRegion(space->bottom, space->top);
+        return;
+    }
+    PolyWord *scanned = space->bottom; // Objects below this have been rescanned
+    POLYUNSIGNED nCards = cards->CardCount();
+    for (POLYUNSIGNED card = cards->FindDirty(0, nCards); card < nCards;
+         card = cards->FindDirty(card+1, nCards))
+    {
+        PolyWord *cardStart = cards->CardAddr(card);
+        PolyWord *cardEnd = cardStart + CARD_WORDS;
+        if (cardEnd > space->top) cardEnd = space->top;
+        PolyWord *pt;
+        if (cardStart >= space->lowerAllocPtr && cardStart < space->upperAllocPtr)
+            pt = space->upperAllocPtr; // The card begins in the unused area.
+        else pt = cards->CardObject(card);
+        if (pt < scanned) pt = scanned;
+        while (pt < cardEnd)
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            POLYUNSIGNED L = obj->LengthWord();
+            if (L & _OBJ_GC_MARK)
+                m_marker->ScanAddressesInObject(obj, L);
+            pt += OBJ_OBJECT_LENGTH(L) + 1;
+        }
+        scanned = pt;
+    }
+}
+
 // When the threads created by marking the roots have completed we need to check that
 // the mark stack has not overflowed.  If it has we need to rescan.  This rescanning
 // pass may result in a further overflow so if we find we have to rescan we repeat.
@@ -650,6 +1065,7 @@ bool MTGCProcessMarkPointers::RescanForStackOverflow()
     ASSERT(nThreads >= 1);
     ASSERT(nInUse == 0);
     MTGCProcessMarkPointers *marker = &markStacks[0];
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     marker->Reset();
     marker->active = true;
     nInUse = 1;
@@ -666,6 +1082,7 @@ bool MTGCProcessMarkPointers::RescanForStackOverflow()
         if (rescanner.ScanSpace(*i))
             rescan = true;
     }
+    marker->markTime += HeapSizeParameters::GCPhaseTime(startTime);
     {
         PLocker lock(&stackLock);
         nInUse--;
@@ -674,6 +1091,197 @@ bool MTGCProcessMarkPointers::RescanForStackOverflow()
     return rescan;
 }
 
+void MTGCProcessMarkPointers::ResetRates()
+{
+    for (unsigned i = 0; i < nThreads; i++)
+    {
+        markStacks[i].wordsScanned = 0;
+        markStacks[i].markTime = 0;
+    }
+}
+
+// Report the rate at which each marker has scanned the heap.  A marker is not tied
+// to a particular GC thread but there are never more markers running than threads.
+void MTGCProcessMarkPointers::LogRates()
+{
+    for (unsigned i = 0; i < nThreads; i++)
+    {
+        MTGCProcessMarkPointers *marker = &markStacks[i];
+        if (marker->wordsScanned == 0)
+            continue;
+        Log("GC: Mark: Marker %u scanned %" POLYUFMT " words in %0.3f secs: %0.1f Mwords/sec (prefetch %u)\n",
+            i, marker->wordsScanned, marker->markTime,
+            marker->markTime == 0 ? 0.0 : (double)marker->wordsScanned / marker->markTime / 1.0E6,
+            prefetchDepth);
+    }
+}
+
+// The objects left by the concurrent marker and the old values recorded by the write
+// barrier are marked and scanned.  We also have to rescan mutable objects that have
+// been updated because the new values may refer to objects allocated since the
+// start of the marking.  The permanent mutable areas and the roots have
+// already been rescanned.
+void MTGCProcessMarkPointers::RemarkConcurrent()
+{
+    std::vector<PolyObject*> recorded;
+    {
+        PLocker lock(&satbLock);
+        recorded.swap(satbBuffer);
+    }
+    recorded.insert(recorded.end(), remarkObjects.begin(), remarkObjects.end());
+    std::vector<PolyObject*>().swap(remarkObjects);
+    recorded.insert(recorded.end(), pendingObjects.begin(), pendingObjects.end());
+    std::vector<PolyObject*>().swap(pendingObjects);
+
+    for (std::vector<PolyObject*>::iterator i = recorded.begin(); i < recorded.end(); i++)
+    {
+        PolyObject *obj = *i;
+        // If it was marked by the concurrent marker it may not have been scanned.
+        if (obj->LengthWord() & _OBJ_GC_MARK)
+            ScanAddressesInObject(obj);
+        else (void)ScanObjectAddress(obj);
+    }
+
+    Rescanner rescanner(this);
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        if (lSpace->isMutable && ! lSpace->allocationSpace)
+            rescanner.ScanDirtyCards(lSpace);
+    }
+}
+
+// Start the first concurrent marker.  Other markers are forked as it finds work.
+bool MTGCProcessMarkPointers::StartConcurrentMarker()
+{
+    ASSERT(nThreads >= 1);
+    ASSERT(nInUse == 0);
+    MTGCProcessMarkPointers *marker = &markStacks[0];
+    marker->active = true;
+    nInUse = 1;
+    if (gpTaskFarm->AddWork(&MTGCProcessMarkPointers::MarkPointersTask, marker, 0))
+        return true;
+    marker->active = false;
+    nInUse = 0;
+    return false;
+}
+
+// Called when a concurrent marker has nothing else to do.  The first marker scans
+// the permanent mutable areas.  Then it takes the objects left for the markers and
+// the values recorded by the write barrier.  Returns false if there is nothing.
+bool MTGCProcessMarkPointers::TakeConcurrentWork()
+{
+    bool scanPermanent = false;
+    std::vector<PolyObject*> pending, recorded;
+    {
+        PLocker lock(&satbLock);
+        scanPermanent = ! permanentsScanned;
+        permanentsScanned = true;
+        pending.swap(pendingObjects);
+        recorded.swap(satbBuffer);
+    }
+    if (! scanPermanent && pending.empty() && recorded.empty())
+        return false;
+
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); scanPermanent && i < gMem.pSpaces.end(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        if (! space->isMutable || space->byteOnly)
+            continue;
+        for (PolyWord *pt = space->bottom; pt < space->top && ! concurrentStop; )
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            POLYUNSIGNED L = obj->LengthWord();
+            ScanAddressesInObject(obj, L);
+            pt += OBJ_OBJECT_LENGTH(L) + 1;
+        }
+    }
+
+    std::vector<PolyObject*>::iterator p = pending.begin(), r = recorded.begin();
+    while (p < pending.end() && ! concurrentStop)
+        ScanPending(*p++);
+    while (r < recorded.end() && ! concurrentStop)
+        (void)ScanObjectAddress(*r++);
+
+    if (concurrentStop)
+    {
+        // Keep anything we haven't done for when the markers are restarted.
+        PLocker lock(&satbLock);
+        if (scanPermanent)
+            permanentsScanned = false;
+        try {
+            pendingObjects.insert(pendingObjects.end(), p, pending.end());
+            satbBuffer.insert(satbBuffer.end(), r, recorded.end());
+        }
+        catch (std::bad_alloc &) {
+            concurrentFailed = true;
+        }
+    }
+    return true;
+}
+
+// Scan an object left for the concurrent markers.  It may have been marked and not
+// scanned or it may be a root or an object copied by a minor GC that has not been
+// marked.  Objects in the permanent areas are left when a marker is stopped
+// while it is scanning the permanent mutable areas.
+void MTGCProcessMarkPointers::ScanPending(PolyObject *obj)
+{
+    MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
+    POLYUNSIGNED L = obj->LengthWord();
+    bool marked;
+    if (sp->spaceType == ST_LOCAL)
+    {
+        LocalMemSpace *lSpace = (LocalMemSpace*)sp;
+        marked = lSpace->bitmap.TestBit(lSpace->wordNo((PolyWord*)obj-1));
+        // Code in the local spaces is left for the remark.
+        if (marked && OBJ_IS_CODE_OBJECT(L))
+            return;
+    }
+    else if (sp->spaceType == ST_CODE)
+        marked = (L & _OBJ_GC_MARK) != 0;
+    else marked = true;
+    if (marked)
+        ScanAddressesInObject(obj, L);
+    else (void)ScanObjectAddress(obj);
+}
+
+// Called when the concurrent markers are stopped.  The object that was about to
+// be scanned and those on the stack and in the prefetch queue have been marked
+// but not scanned.  They are scanned when the markers are restarted or in the remark.
+void MTGCProcessMarkPointers::SaveConcurrentWork(PolyObject *obj)
+{
+    PLocker lock(&satbLock);
+    AddToList(pendingObjects, obj);
+    while (pfCount != 0)
+    {
+        AddToList(pendingObjects, prefetchQueue[pfHead]);
+        if (++pfHead == MARK_PREFETCH_MAX) pfHead = 0;
+        pfCount--;
+    }
+    // The entry above the top may be the object we were about to scan.
+    if (msp < MARK_STACK_SIZE) markStack[msp] = 0;
+    while (msp != 0)
+    {
+        AddToList(pendingObjects, markStack[--msp]);
+        markStack[msp] = 0;
+    }
+}
+
+// Move the objects in any chunks left when the concurrent markers were stopped
+// into the list of pending objects.
+void MTGCProcessMarkPointers::SaveChunks()
+{
+    while (fullChunks != 0)
+    {
+        MarkChunk *chunk = fullChunks;
+        fullChunks = chunk->next;
+        for (unsigned i = 0; i < chunk->count; i++)
+            AddToList(pendingObjects, chunk->objects[i]);
+        chunk->next = freeChunks;
+        freeChunks = chunk;
+    }
+}
+
 static void SetBitmaps(LocalMemSpace *space, PolyWord *pt, PolyWord *top)
 {
     while (pt < top)
@@ -704,14 +1312,18 @@ static void SetBitmaps(LocalMemSpace *space, PolyWord *pt, PolyWord *top)
                 if ((PolyWord*)obj <= space->fullGCLowerLimit)
                     space->fullGCLowerLimit = (PolyWord*)obj-1;
 
-                if (OBJ_IS_WEAKREF_OBJECT(L))
+                // Record weak objects so that GCheckWeakRefs need only look at these.
+                // Only this task adds to the space's list.
+                if (OBJ_IS_WEAKREF_OBJECT(L) && ! space->weakObjectsOverflowed)
                 {
-                    // Add this to the limits for the containing area.
-                    PolyWord *baseAddr = (PolyWord*)obj;
-                    PolyWord *startAddr = baseAddr-1; // Must point AT length word.
-                    PolyWord *endObject = baseAddr + n;
-                    if (startAddr < space->lowestWeak) space->lowestWeak = startAddr;
-                    if (endObject > space->highestWeak) space->highestWeak = endObject;
+                    try {
+                        space->weakObjects.push_back(obj);
+                    }
+                    catch (std::bad_alloc &) {
+                        // GCheckWeakRefs will have to scan the space.
+                        std::vector<PolyObject*>().swap(space->weakObjects);
+                        space->weakObjectsOverflowed = true;
+                    }
                 }
             }
             pt += n;
@@ -723,19 +1335,21 @@ static void CreateBitmapsTask(GCTaskId *, void *arg1, void *arg2)
 {
     LocalMemSpace *lSpace = (LocalMemSpace *)arg1;
     lSpace->bitmap.ClearBits(0, lSpace->spaceSize());
+    lSpace->weakObjects.clear();
+    lSpace->weakObjectsOverflowed = false;
     SetBitmaps(lSpace, lSpace->bottom, lSpace->top);
 }
 
 // Parallel task to check the marks on cells in the code area and
-// turn them into byte areas if they are free.
+// turn them into byte areas if they are free.  Adjacent free cells are
+// merged and the free lists are rebuilt.
 static void CheckMarksOnCodeTask(GCTaskId *, void *arg1, void *arg2)
 {
     CodeSpace *space = (CodeSpace*)arg1;
     PolyWord *pt = space->bottom;
     PolyWord *lastFree = 0;
     POLYUNSIGNED lastFreeSpace = 0;
-    space->largestFree = 0;
-    space->firstFree = 0;
+    space->ClearFreeLists();
     while (pt < space->top)
     {
         PolyObject *obj = (PolyObject*)(pt+1);
@@ -748,11 +1362,12 @@ static void CheckMarksOnCodeTask(GCTaskId *, void *arg1, void *arg2)
             // It's marked - retain it.
             ASSERT(L & _OBJ_CODE_OBJ);
             obj->SetLengthWord(L & ~(_OBJ_GC_MARK)); // Clear the mark bit
+            if (lastFree != 0)
+                space->AddFreeCell(lastFree);
             lastFree = 0;
             lastFreeSpace = 0;
         }
         else { // Turn it into a byte area i.e. free.  It may already be free.
-            if (space->firstFree == 0) space->firstFree = pt;
             space->headerMap.ClearBit(pt-space->bottom); // Remove the "header" bit
             if (lastFree + lastFreeSpace == pt)
                 // Merge free spaces.  Speeds up subsequent scans.
@@ -764,16 +1379,47 @@ static void CheckMarksOnCodeTask(GCTaskId *, void *arg1, void *arg2)
             }
             PolyObject *freeSpace = (PolyObject*)(lastFree+1);
             freeSpace->SetLengthWord(lastFreeSpace-1, F_BYTE_OBJ);
-            if (lastFreeSpace > space->largestFree) space->largestFree = lastFreeSpace;
         }
         pt += length+1;
     }
+    if (lastFree != 0)
+        space->AddFreeCell(lastFree);
+}
+
+// Transfer the marks made by the concurrent marker from the bitmap to the headers.
+static void ConvertConcurrentMarksTask(GCTaskId *, void *arg1, void *arg2)
+{
+    LocalMemSpace *lSpace = (LocalMemSpace *)arg1;
+    POLYUNSIGNED words = lSpace->spaceSize();
+    for (POLYUNSIGNED bitno = lSpace->bitmap.FindNextSet(0, words); bitno < words;
+         bitno = lSpace->bitmap.FindNextSet(bitno+1, words))
+    {
+        PolyObject *obj = (PolyObject*)(lSpace->wordAddr(bitno)+1);
+        obj->SetLengthWord(obj->LengthWord() | _OBJ_GC_MARK);
+    }
 }
 
 void GCMarkPhase(void)
 {
     mainThreadPhase = MTP_GCPHASEMARK;
 
+    // If a list could not be extended the concurrent marks are incomplete.
+    if (concurrentMarksPending && concurrentFailed)
+        AbandonConcurrentGC();
+
+    if (concurrentMarksPending)
+    {
+        ASSERT(! concurrentMarking);
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Mark: Completing concurrent mark\n");
+        for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        {
+            if (! (*i)->allocationSpace)
+                gpTaskFarm->AddWorkOrRunNow(&ConvertConcurrentMarksTask, *i, 0);
+        }
+        gpTaskFarm->WaitForCompletion();
+    }
+
     // Clear the mark counters and set the rescan limits.
     for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
@@ -788,7 +1434,9 @@ void GCMarkPhase(void)
         space->fullGCRescanStart = space->top;
         space->fullGCRescanEnd = space->bottom;
     }
-    
+
+    MTGCProcessMarkPointers::ResetRates();
+    rescannedWords = 0;
     MTGCProcessMarkPointers::MarkRoots();
     gpTaskFarm->WaitForCompletion();
 
@@ -799,6 +1447,18 @@ void GCMarkPhase(void)
         gpTaskFarm->WaitForCompletion();
     } while(rescan);
 
+    concurrentMarksPending = false;
+
+    MTGCProcessMarkPointers::ReleaseChunks();
+    if (debugOptions & DEBUG_GC_ENHANCED)
+        MTGCProcessMarkPointers::LogRates();
+    if (rescannedWords != 0)
+    {
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Mark: Rescanned %" POLYUFMT " words after mark stack overflow\n", rescannedWords);
+        globalStats.incSize(PSC_GC_MARK_RESCAN, rescannedWords);
+    }
+
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Mark");
 
     // Turn the marks into bitmap entries.
@@ -812,6 +1472,7 @@ void GCMarkPhase(void)
     gpTaskFarm->WaitForCompletion(); // Wait for completion of the bitmaps
 
     gMem.RemoveEmptyCodeAreas();
+    gMem.RebuildCodeIndex();
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Bitmap");
 
@@ -830,10 +1491,180 @@ void GCMarkPhase(void)
         Log("GC: Mark: Total live data %" POLYUFMT " words\n", totalLive);
 }
 
+bool concurrentMarking = false;
+
+// Records the roots when the concurrent marking is started.  They are scanned
+// by the markers once the ML threads have been restarted.
+class ConcurrentRootRecorder: public ScanAddress
+{
+public:
+    virtual PolyObject *ScanObjectAddress(PolyObject *obj)
+    {
+        MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
+        if (sp != 0 && (sp->spaceType == ST_LOCAL || sp->spaceType == ST_CODE))
+            AddToList(pendingObjects, obj);
+        return obj;
+    }
+    virtual void ScanRuntimeAddress(PolyObject **pt, RtsStrength weak)
+        { if (weak == STRENGTH_STRONG) (void)ScanObjectAddress(*pt); }
+};
+
+// Called by the write barrier with the value that is being overwritten.
+void ConcurrentMarkRecord(PolyWord oldValue)
+{
+    if (! oldValue.IsDataPtr() || oldValue == PolyWord::FromUnsigned(0))
+        return;
+    PolyObject *obj = oldValue.AsObjPtr();
+    MemSpace *sp = gMem.SpaceForAddress((PolyWord*)obj-1);
+    if (sp == 0)
+        return;
+    if (sp->spaceType == ST_LOCAL)
+    {
+        LocalMemSpace *lSpace = (LocalMemSpace*)sp;
+        if (lSpace->allocationSpace || lSpace->bitmap.TestBit(lSpace->wordNo((PolyWord*)obj-1)))
+            return;
+    }
+    else if (sp->spaceType != ST_CODE || (obj->LengthWord() & _OBJ_GC_MARK))
+        return;
+    PLocker lock(&satbLock);
+    AddToList(satbBuffer, obj);
+}
+
+// Called when a code or large object is allocated.  These are not in the allocation
+// spaces so they are not found by a minor GC and a minor GC clears the card of any
+// old object a pointer to them is stored in.  They are scanned in the final remark.
+void ConcurrentMarkAllocated(PolyObject *obj)
+{
+    PLocker lock(&satbLock);
+    AddToList(remarkObjects, obj);
+}
+
+// Start or restart the markers.
+static void RunConcurrentMarkers(void)
+{
+    concurrentStop = false;
+    concurrentDone = false;
+    markingConcurrently = true;
+    concurrentMarking = true;
+    concurrentStartTime = HeapSizeParameters::StartGCPhase();
+    if (! MTGCProcessMarkPointers::StartConcurrentMarker())
+        AbandonConcurrentGC();
+}
+
+// Start the concurrent marker.  This is called with the ML threads stopped at
+// the end of a minor GC when the allocation spaces are empty.
+void GCConcurrentMarkStart(void)
+{
+    ASSERT(! concurrentMarking && ! concurrentMarksPending);
+    concurrentMarksPending = true;
+    concurrentFailed = false;
+    permanentsScanned = false;
+    // The bitmaps are left dirty by the previous GC so must be cleared first.
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        if (! lSpace->allocationSpace)
+            lSpace->bitmap.ClearBits(0, lSpace->spaceSize());
+    }
+    // Record the roots while the ML threads are stopped.
+    ConcurrentRootRecorder recorder;
+    GCModules(&recorder);
+    RunConcurrentMarkers();
+}
+
+// Stop the concurrent markers.  The marks are retained and the objects the
+// markers had still to scan are kept until they are restarted or the remark.
+void GCConcurrentMarkStop(void)
+{
+    if (! concurrentMarking)
+        return;
+    concurrentStop = true;
+    gpTaskFarm->WaitForCompletion();
+    MTGCProcessMarkPointers::SaveChunks();
+    if (! concurrentDone)
+    {
+        HeapSizeParameters::EndGCPhase(PST_GC_CONCURRENT_MARK, concurrentStartTime);
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Concurrent mark stopped\n");
+    }
+    markingConcurrently = false;
+    concurrentMarking = false;
+    concurrentStop = false;
+}
+
+bool ConcurrentMarkFinished(void)
+{
+    return concurrentDone;
+}
+
+// A minor GC may move objects in the lists from the survivor spaces so the
+// lists are roots for it.
+void GCConcurrentMarkScanRoots(ScanAddress *process)
+{
+    if (! concurrentMarksPending)
+        return;
+    std::vector<PolyObject*> *lists[] = { &pendingObjects, &remarkObjects, &satbBuffer };
+    for (unsigned l = 0; l < sizeof(lists)/sizeof(lists[0]); l++)
+    {
+        for (std::vector<PolyObject*>::iterator i = lists[l]->begin(); i < lists[l]->end(); i++)
+            *i = process->ScanObjectAddress(*i);
+    }
+}
+
+// Restart the markers after a minor GC.  The objects the minor GC copied may
+// have been reachable from the roots when the marking started but they have
+// not been marked so they are added to the objects to be scanned.
+void GCConcurrentMarkResume(std::vector<PolyObject*> &copied)
+{
+    if (! concurrentMarksPending)
+        return;
+    try {
+        pendingObjects.insert(pendingObjects.end(), copied.begin(), copied.end());
+    }
+    catch (std::bad_alloc &) {
+        concurrentFailed = true;
+    }
+    if (concurrentFailed)
+        AbandonConcurrentGC();
+    else RunConcurrentMarkers();
+}
+
+void AbandonConcurrentGC(void)
+{
+    GCConcurrentMarkStop();
+    if (! concurrentMarksPending)
+        return;
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        if (! lSpace->allocationSpace)
+            lSpace->bitmap.ClearBits(0, lSpace->spaceSize());
+    }
+    for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+    {
+        CodeSpace *space = *i;
+        for (PolyWord *pt = space->bottom; pt < space->top; )
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            POLYUNSIGNED L = obj->LengthWord();
+            if (L & _OBJ_GC_MARK)
+                obj->SetLengthWord(L & ~(_OBJ_GC_MARK));
+            pt += OBJ_OBJECT_LENGTH(L) + 1;
+        }
+    }
+    std::vector<PolyObject*>().swap(pendingObjects);
+    std::vector<PolyObject*>().swap(remarkObjects);
+    std::vector<PolyObject*>().swap(satbBuffer);
+    concurrentMarksPending = false;
+    concurrentFailed = false;
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark abandoned\n");
+}
+
 // Set up the stacks.
 void initialiseMarkerTables()
 {
     unsigned threads = gpTaskFarm->ThreadCount();
     if (threads == 0) threads = 1;
-    MTGCProcessMarkPointers::InitStatics(threads);
+    MTGCProcessMarkPointers::InitStatics(threads, userOptions.markPrefetch);
 }
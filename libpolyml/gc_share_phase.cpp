@@ -43,6 +43,13 @@
     forwarding pointers to the chosen cell.  Hashing allows for easy
     parallel processing.
 
+    As an alternative to sorting, selected with --gcshare, each hash
+    table entry can be merged by entering its cells in an open-addressed
+    table keyed on a hash of the whole contents.  The same hash selects the
+    entry so the entries are independent and can be processed in parallel
+    without locking.  This is linear in the number of cells rather than
+    n log n but needs a temporary table for each entry.
+
     The structure sharing code works by first sharing the byte
     data which cannot contain pointers.  Then the word data is processed
     to separate out "tail" cells that contain only tagged integers or
@@ -94,6 +101,11 @@
 #include "diagnostics.h"
 #include "gctaskfarm.h"
 #include "heapsizing.h"
+#include "mpoly.h"
+
+// With --gcshare auto, hash rather than sort if there are at least this
+// many objects to consider.
+#define SHARE_HASH_THRESHOLD    200000
 
 class ObjEntry
 {
@@ -109,7 +121,7 @@ public:
 class SortVector
 {
 public:
-    SortVector(): totalCount(0), carryOver(0) {}
+    SortVector(): totalCount(0), carryOver(0), useHash(false) {}
 
     void AddToVector(PolyObject *obj, POLYUNSIGNED length);
 
@@ -119,6 +131,7 @@ public:
     POLYUNSIGNED Shared() const;
     void SetLengthWord(POLYUNSIGNED l) { lengthWord = l; }
     POLYUNSIGNED CarryOver() const { return carryOver; }
+    void SetHashing(bool h) { useHash = h; }
 
     static void hashAndSortAllTask(GCTaskId*, void *a, void *b);
     static void sharingTask(GCTaskId*, void *a, void *b);
@@ -126,13 +139,48 @@ public:
 
 private:
     void sortList(PolyObject *head, POLYUNSIGNED nItems, POLYUNSIGNED &count);
+    bool hashList(PolyObject *head, POLYUNSIGNED nItems, POLYUNSIGNED &count);
+    unsigned char TableEntry(PolyObject *obj);
+    void AddToTable(PolyObject *obj);
 
     ObjEntry baseObject, processObjects[256];
     POLYUNSIGNED totalCount;
     POLYUNSIGNED lengthWord;
     POLYUNSIGNED carryOver;
+    bool useHash;
 };
 
+// Hash the contents of an object.  The top byte selects the entry in
+// processObjects and the rest is used in hashList.
+static POLYUNSIGNED ContentHash(PolyObject *obj, POLYUNSIGNED words)
+{
+    POLYUNSIGNED hash = 0;
+    for (POLYUNSIGNED i = 0; i < words; i++)
+        hash = (hash ^ obj->Get(i).AsUnsigned()) * (POLYUNSIGNED)0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> (sizeof(POLYUNSIGNED)*4));
+}
+
+// Choose the entry in processObjects.  When sorting this is a sum of the bytes,
+// which is cheap, but when hashing it must be consistent with ContentHash.
+unsigned char SortVector::TableEntry(PolyObject *obj)
+{
+    POLYUNSIGNED words = OBJ_OBJECT_LENGTH(lengthWord);
+    if (useHash)
+        return (unsigned char)(ContentHash(obj, words) >> (sizeof(POLYUNSIGNED)*8 - 8));
+    unsigned char hash = 0;
+    for (POLYUNSIGNED i = 0; i < words*sizeof(PolyWord); i++)
+        hash += obj->AsBytePtr()[i];
+    return hash;
+}
+
+void SortVector::AddToTable(PolyObject *obj)
+{
+    unsigned char hash = TableEntry(obj);
+    obj->SetShareChain(processObjects[hash].objList);
+    processObjects[hash].objList = obj;
+    processObjects[hash].objCount++;
+}
+
 POLYUNSIGNED SortVector::Shared() const
 {
     // Add all the sharing counts
@@ -329,11 +377,58 @@ void SortVector::sortList(PolyObject *head, POLYUNSIGNED nItems, POLYUNSIGNED &s
     }
 }
 
+class HashEntry
+{
+public:
+    POLYUNSIGNED hash;
+    PolyObject *obj;
+};
+
+// Enter the cells in an open-addressed hash table.  The first cell with
+// particular contents is retained and the others are forwarded to it.
+// Returns false, leaving the list unchanged, if there isn't memory for the table.
+bool SortVector::hashList(PolyObject *head, POLYUNSIGNED nItems, POLYUNSIGNED &shareCount)
+{
+    POLYUNSIGNED tableSize = 16;
+    while (tableSize < nItems * 2)
+        tableSize <<= 1;
+    HashEntry *table = (HashEntry*)calloc(tableSize, sizeof(HashEntry));
+    if (table == 0)
+        return false;
+    POLYUNSIGNED words = OBJ_OBJECT_LENGTH(lengthWord);
+    while (head != 0)
+    {
+        PolyObject *next = head->GetShareChain();
+        POLYUNSIGNED hash = ContentHash(head, words);
+        for (POLYUNSIGNED i = hash & (tableSize-1); ; i = (i+1) & (tableSize-1))
+        {
+            HashEntry *entry = &table[i];
+            if (entry->obj == 0)
+            {
+                entry->hash = hash;
+                entry->obj = head;
+                head->SetLengthWord(lengthWord);
+                break;
+            }
+            if (entry->hash == hash && memcmp(entry->obj, head, words*sizeof(PolyWord)) == 0)
+            {
+                head->SetForwardingPtr(entry->obj);
+                shareCount++;
+                break;
+            }
+        }
+        head = next;
+    }
+    free(table);
+    return true;
+}
+
 void SortVector::sharingTask(GCTaskId*, void *a, void *b)
 {
     SortVector *s = (SortVector *)a;
     ObjEntry *o = (ObjEntry*)b;
-    s->sortList(o->objList, o->objCount, o->shareCount);
+    if (! s->useHash || ! s->hashList(o->objList, o->objCount, o->shareCount))
+        s->sortList(o->objList, o->objCount, o->shareCount);
 }
 
 // Process one level of the word data.
@@ -398,16 +493,7 @@ void SortVector::wordDataTask(GCTaskId*, void *a, void *)
             s->baseObject.objList = h;
             s->baseObject.objCount++;
         }
-        else
-        {
-            // Add it to the hash table.
-            unsigned char hash = 0;
-            for (POLYUNSIGNED i = 0; i < words*sizeof(PolyWord); i++)
-                hash += h->AsBytePtr()[i];
-            h->SetShareChain(s->processObjects[hash].objList);
-            s->processObjects[hash].objList = h;
-            s->processObjects[hash].objCount++;
-        }
+        else s->AddToTable(h); // Add it to the hash table.
         h = next;
     }
     s->SortData();
@@ -460,16 +546,10 @@ void SortVector::hashAndSortAllTask(GCTaskId*, void *a, void *b)
         s->processObjects[i].objCount = 0;
     }
     PolyObject *h = s->baseObject.objList;
-    POLYUNSIGNED bytes = OBJ_OBJECT_LENGTH(s->lengthWord)*sizeof(PolyWord);
     while (h != 0)
     {
         PolyObject *next = h->GetShareChain();
-        unsigned char hash = 0;
-        for (POLYUNSIGNED j = 0; j < bytes; j++)
-            hash += h->AsBytePtr()[j];
-        h->SetShareChain(s->processObjects[hash].objList);
-        s->processObjects[hash].objList = h;
-        s->processObjects[hash].objCount++;
+        s->AddToTable(h);
         h = next;
     }
     s->SortData();
@@ -511,6 +591,22 @@ void GetSharing::shareRemainingWordData(GCTaskId *, void *a, void *)
 
 void GetSharing::SortData()
 {
+    POLYUNSIGNED candidates = 0;
+    for (unsigned i = 0; i < NUM_BYTE_VECTORS; i++)
+        candidates += byteVectors[i].TotalCount();
+    for (unsigned j = 0; j < NUM_WORD_VECTORS; j++)
+        candidates += wordVectors[j].TotalCount();
+    unsigned method = userOptions.shareMethod;
+    if (method == GC_SHARE_AUTO)
+        method = candidates >= SHARE_HASH_THRESHOLD ? GC_SHARE_HASH : GC_SHARE_SORT;
+    for (unsigned k = 0; k < NUM_BYTE_VECTORS; k++)
+        byteVectors[k].SetHashing(method == GC_SHARE_HASH);
+    for (unsigned l = 0; l < NUM_WORD_VECTORS; l++)
+        wordVectors[l].SetHashing(method == GC_SHARE_HASH);
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Share: %s %" POLYUFMT " objects\n", method == GC_SHARE_HASH ? "Hashing" : "Sorting", candidates);
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
+
     // First process the byte objects.  They cannot contain pointers.
     // We create a task to do this so that we never have more threads
     // running than given with --gcthreads.
@@ -615,7 +711,7 @@ void GetSharing::SortData()
             largeWordCount, largeByteCount, excludedCount);
     }
 
-    gHeapSizeParameters.RecordSharingData(totalRecovered);
+    gHeapSizeParameters.RecordSharingData(method, totalRecovered, HeapSizeParameters::GCPhaseTime(startTime));
 }
 
 void GCSharingPhase(void)
@@ -25,8 +25,10 @@
 /*
 This is the third, update, phase of the garbage collector.  The previous, copy,
 phase will have moved cells in memory.  The update phase goes through all cells
-that could contain an address of a cell that has been moved and looks for a
-tomb-stone that contains its new location. 
+that could contain an address of a cell that has been moved and replaces it with
+the new location.  If the cell was in a space that was slid the new location is
+computed from the summary table and the bitmap.  Otherwise, if the cell was
+copied, there is a tomb-stone that contains its new location.
 */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -53,6 +55,26 @@ tomb-stone that contains its new location.
 #include "memmgr.h"
 #include "gctaskfarm.h"
 #include "diagnostics.h"
+#include "heapsizing.h"
+
+// Local spaces are split into chunks of about this many words so that a
+// large space can be updated by several threads.
+#define UPDATE_CHUNK_WORDS  (256*1024)
+
+// A part of a local space to update.  The chunk starts and ends on object
+// boundaries.  If "contiguous" is true the objects have been slid or copied
+// and follow one another with no gaps.  Otherwise the bitmap shows which
+// words are in objects.
+class UpdateChunk
+{
+public:
+    UpdateChunk(LocalMemSpace *sp, PolyWord *s, PolyWord *e, bool c):
+        space(sp), start(s), end(e), contiguous(c), updated(0) {}
+    LocalMemSpace   *space;
+    PolyWord        *start, *end;
+    bool            contiguous;
+    POLYUNSIGNED    updated;    // Words in objects updated.  Added to the space at the end.
+};
 
 class MTGCProcessUpdate: public ScanAddress
 {
@@ -61,13 +83,40 @@ public:
     virtual void ScanRuntimeAddress(PolyObject **pt, RtsStrength weak);
     virtual PolyObject *ScanObjectAddress(PolyObject *base);
 
-    void UpdateObjectsInArea(LocalMemSpace *area);
+    void UpdateObjectsInChunk(UpdateChunk *chunk);
 
 private:
-    static void UpdateAddress(PolyObject *&obj)
+    void UpdateObject(PolyObject *obj, POLYUNSIGNED L);
+
+    // Return the new address of an object in a local space or of code that has
+    // been moved out of a code space being evacuated.
+    // It's important not to look at the old location of an object in a space that
+    // has been slid because it may now contain part of a different object.
+    static PolyObject *NewAddress(PolyObject *obj)
     {
+        MemSpace *s = gMem.SpaceForAddress((PolyWord*)obj - 1);
+        if (s == 0)
+            return obj;
+        if (s->spaceType == ST_CODE)
+        {
+            if (((CodeSpace*)s)->evacuating)
+            {
+                while (obj->ContainsForwardingPtr())
+                    obj = obj->GetForwardingPtr();
+            }
+            return obj;
+        }
+        if (s->spaceType != ST_LOCAL)
+            return obj;
+        LocalMemSpace *space = (LocalMemSpace*)s;
+        if (space->slideSummary != 0)
+        {
+            ASSERT(space->bitmap.TestBit(space->wordNo((PolyWord*)obj - 1)));
+            return space->SlidAddress(obj);
+        }
         while (obj->ContainsForwardingPtr())
             obj = obj->GetForwardingPtr();
+        return obj;
     }
 };
 
@@ -77,26 +126,15 @@ private:
 /*********************************************************************/
 PolyObject *MTGCProcessUpdate::ScanObjectAddress(PolyObject *obj)
 {
-    PolyWord val = obj;
-
-    LocalMemSpace *space = gMem.LocalSpaceForAddress(val.AsStackAddr()-1);
-    if (space != 0)
-    {
-        UpdateAddress(obj);
-        ASSERT(obj->ContainsNormalLengthWord());
-    }
-    return obj;
+    PolyObject *newAddr = NewAddress(obj);
+    ASSERT(newAddr == obj || newAddr->ContainsNormalLengthWord());
+    return newAddr;
 }
 
 void MTGCProcessUpdate::ScanRuntimeAddress(PolyObject **pt, RtsStrength/* weak*/)
 /* weak is not used, but needed so type of the function is correct */
 {
-    PolyObject *obj = *pt;
-    if (obj->ContainsForwardingPtr())
-    {
-        UpdateAddress(obj);
-        *pt = obj;
-    }
+    *pt = NewAddress(*pt);
 }  
 
 // Update the addresses in a group of words.
@@ -104,33 +142,59 @@ POLYUNSIGNED MTGCProcessUpdate::ScanAddressAt(PolyWord *pt)
 {
     PolyWord val = *pt;
 
-    if (val.IsTagged())
+    if (val.IsTagged() || val == PolyWord::FromUnsigned(0))
         return 0;
 
-    // It looked like it would be possible to simplify this code and
-    // just call ContainsForwardingPtr on any address.
-    // Profiling shows that it's quite important to avoid calling
-    // ContainsForwardingPtr unnecessarily. I guess the reason is that
-    // it actually accesses the memory referenced by the address and it
-    // is unlikely to be in the cache.
+    *pt = NewAddress(val.AsObjPtr());
+    return 0;
+}
 
-    PolyObject *obj = val.AsObjPtr();
-    if (obj->ContainsForwardingPtr())
+// Update the addresses in an object that has not been moved or is at its new location.
+void MTGCProcessUpdate::UpdateObject(PolyObject *obj, POLYUNSIGNED L)
+{
+    if (OBJ_IS_WORD_OBJECT(L))
     {
-        UpdateAddress(obj);
-        *pt = obj;
+        POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+        PolyWord *pt = (PolyWord*)obj;
+        while (length--)
+        {
+            PolyWord val = *pt;
+            if (! val.IsTagged() && val != PolyWord::FromUnsigned(0))
+                *pt = NewAddress(val.AsObjPtr());
+            pt++;
+        }
     }
-    return 0;
+    else ScanAddressesInObject(obj, L);
+
+    CheckObject(obj); // Can check it after it's been updated
 }
 
-// Updates the addresses for objects in the area with the "allocated" bit set.
-// It processes the area between area->pointer and the bit corresponding to area->highest.
-// area->highest corresponds to gen_top i.e. we don't process older generations.
-void MTGCProcessUpdate::UpdateObjectsInArea(LocalMemSpace *area)
+// Updates the addresses for objects in a chunk.  If the chunk is not contiguous
+// it contains the objects that have not been moved, with the "allocated" bit set,
+// and the tombstones of any objects that have been copied out.
+void MTGCProcessUpdate::UpdateObjectsInChunk(UpdateChunk *chunk)
 {
-    PolyWord *pt      = area->upperAllocPtr;
+    LocalMemSpace *area = chunk->space;
+    PolyWord *pt = chunk->start;
+
+    if (chunk->contiguous)
+    {
+        while (pt < chunk->end)
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            POLYUNSIGNED L = obj->LengthWord();
+            ASSERT(OBJ_IS_LENGTH(L));
+            POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+            chunk->updated += length+1;
+            UpdateObject(obj, L);
+            pt += length+1;
+        }
+        ASSERT(pt == chunk->end);
+        return;
+    }
+
     POLYUNSIGNED   bitno   = area->wordNo(pt);
-    POLYUNSIGNED   highest = area->wordNo(area->top);
+    POLYUNSIGNED   highest = area->wordNo(chunk->end);
 
     for (;;)
     {
@@ -150,8 +214,8 @@ void MTGCProcessUpdate::UpdateObjectsInArea(LocalMemSpace *area)
         }
         
         if (bitno == highest) {
-            // Have reached the top of the area
-            ASSERT(pt == area->top);
+            // Have reached the end of the chunk
+            ASSERT(pt == chunk->end);
             break;
         }
         
@@ -165,70 +229,105 @@ void MTGCProcessUpdate::UpdateObjectsInArea(LocalMemSpace *area)
         {
             // Skip over moved objects.  We have to find the new location to find
             // its length.
-            UpdateAddress(obj);            
-            POLYUNSIGNED length = obj->Length();
+            POLYUNSIGNED length = NewAddress(obj)->Length();
             pt    += length;
             bitno += length;
         }
         else // Contains real object
         {
-            
-            if (OBJ_IS_WORD_OBJECT(L))
-            {
-                POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
-                
-                area->updated += length+1;
-                
-                while (length--)
-                {
-                    PolyWord val = *pt;
-
-                    if (! val.IsTagged() && val != PolyWord::FromUnsigned(0))
-                    {
-                        PolyObject *obj = val.AsObjPtr();
-                    
-                        if (obj->ContainsForwardingPtr())
-                        {
-                            UpdateAddress(obj);
-                            *pt = obj;
-                        }
-                    }
-                    
-                    pt++;
-                    bitno++;
-                }
-            }
-            
-            else /* !OBJ_IS_WORD_OBJECT(L) */
-            {
-                POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
-                area->updated += length+1;
-                ScanAddressesInObject(obj, L);
-                pt    += length;
-                bitno += length;
-            } /* !OBJ_IS_WORD_OBJECT(L) */
-
-            CheckObject(obj); // Can check it after it's been updated
-        }  /* !OBJ_IS_POINTER(L) */
+            POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+            chunk->updated += length+1;
+            UpdateObject(obj, L);
+            pt    += length;
+            bitno += length;
+        }
     } /* for loop */
 }
 
-// Task to update addresses in a local area.
-static void updateLocalArea(GCTaskId*, void *arg1, void *arg2)
+// Time each thread has spent running update tasks, indexed by WorkerNumber.
+// Each entry is only updated by its own thread.
+static std::vector<float> workerBusyTime;
+
+static void AddBusyTime(const TIMEDATA &startTime)
+{
+    workerBusyTime[gpTaskFarm->WorkerNumber()] += HeapSizeParameters::GCPhaseTime(startTime);
+}
+
+// Task to update addresses in a chunk of a local area.
+static void updateLocalChunk(GCTaskId*, void *arg1, void *arg2)
 {
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     MTGCProcessUpdate *processUpdate = (MTGCProcessUpdate *)arg1;
-    LocalMemSpace *space = (LocalMemSpace *)arg2;
+    UpdateChunk *chunk = (UpdateChunk *)arg2;
+    processUpdate->UpdateObjectsInChunk(chunk);
     if (debugOptions & DEBUG_GC_ENHANCED)
-        Log("GC: Update local area %p\n", space);
-    // Process the current generation for mutable or immutable areas.
-    processUpdate->UpdateObjectsInArea(space);
-    if (debugOptions & DEBUG_GC_ENHANCED)
-        Log("GC: Completed local update for %p. %lu words updated\n", space, space->updated);
+        Log("GC: Completed local update for %p from %p to %p. %lu words updated\n",
+            chunk->space, chunk->start, chunk->end, chunk->updated);
+    AddBusyTime(startTime);
+}
+
+// Find the start of an object at or after bitno that follows a gap.  Within a
+// run of set bits we can't tell where one object ends and the next starts.
+static POLYUNSIGNED NextObjectAfterGap(LocalMemSpace *space, POLYUNSIGNED bitno, POLYUNSIGNED limit)
+{
+    return space->bitmap.FindNextSet(space->bitmap.FindNextClear(bitno, limit), limit);
+}
+
+// Split a local space into chunks.
+static void AddChunks(std::vector<UpdateChunk> &chunks, LocalMemSpace *space)
+{
+    POLYUNSIGNED highest = space->spaceSize();
+
+    if (space->slideSummary != 0)
+    {
+        // The objects copied into the space are below the slid data.  They
+        // are usually a small part of the space so they form a single chunk.
+        POLYUNSIGNED firstBlockEnd = highest < SLIDE_BLOCK_WORDS ? highest : SLIDE_BLOCK_WORDS;
+        PolyWord *chunkStart =
+            space->top - space->slideSummary[0] - space->bitmap.CountSetBits(0, firstBlockEnd);
+        if (space->upperAllocPtr < chunkStart)
+            chunks.push_back(UpdateChunk(space, space->upperAllocPtr, chunkStart, true));
+        // Split the slid data.  The summary gives the new address of the data
+        // above each block and the bitmap gives the objects that start after a gap.
+        POLYUNSIGNED blocks = (highest + SLIDE_BLOCK_WORDS - 1) >> SLIDE_BLOCK_SHIFT;
+        for (POLYUNSIGNED b = 0; b < blocks; b++)
+        {
+            if ((space->top - space->slideSummary[b]) - chunkStart < UPDATE_CHUNK_WORDS)
+                continue;
+            POLYUNSIGNED split = NextObjectAfterGap(space, (b+1) << SLIDE_BLOCK_SHIFT, highest);
+            if (split >= highest)
+                break;
+            PolyWord *newSplit = (PolyWord*)space->SlidAddress((PolyObject*)(space->wordAddr(split)+1)) - 1;
+            chunks.push_back(UpdateChunk(space, chunkStart, newSplit, true));
+            chunkStart = newSplit;
+            b = split >> SLIDE_BLOCK_SHIFT;
+        }
+        chunks.push_back(UpdateChunk(space, chunkStart, space->top, true));
+        return;
+    }
+
+    // Objects copied into the space are between upperAllocPtr and fullGCLowerLimit.
+    if (space->upperAllocPtr < space->fullGCLowerLimit)
+        chunks.push_back(UpdateChunk(space, space->upperAllocPtr, space->fullGCLowerLimit, true));
+    // Above that the objects are shown in the bitmap.
+    POLYUNSIGNED chunkStart = space->wordNo(space->fullGCLowerLimit);
+    if (chunkStart == highest)
+        return;
+    while (highest - chunkStart > UPDATE_CHUNK_WORDS)
+    {
+        POLYUNSIGNED split = NextObjectAfterGap(space, chunkStart + UPDATE_CHUNK_WORDS, highest);
+        if (split >= highest)
+            break;
+        chunks.push_back(UpdateChunk(space, space->wordAddr(chunkStart), space->wordAddr(split), false));
+        chunkStart = split;
+    }
+    chunks.push_back(UpdateChunk(space, space->wordAddr(chunkStart), space->top, false));
 }
 
 // Task to update addresses in a non-local area.
 static void updateNonLocalMutableArea(GCTaskId*, void *arg1, void *arg2)
 {
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     MTGCProcessUpdate *processUpdate = (MTGCProcessUpdate *)arg1;
     MemSpace *space = (MemSpace *)arg2;
     if (debugOptions & DEBUG_GC_ENHANCED)
@@ -236,13 +335,16 @@ static void updateNonLocalMutableArea(GCTaskId*, void *arg1, void *arg2)
     processUpdate->ScanAddressesInRegion(space->bottom, space->top);
     if (debugOptions & DEBUG_GC_ENHANCED)
         Log("GC: Completed non-local mutable update for %p\n", space);
+    AddBusyTime(startTime);
 }
 
 // Task to update addresses maintained by the RTS itself.
 static void updateGCProcAddresses(GCTaskId*, void *arg1, void *)
 {
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
     MTGCProcessUpdate *processUpdate = (MTGCProcessUpdate *)arg1;
     GCModules(processUpdate);
+    AddBusyTime(startTime);
 }
 
 void GCUpdatePhase()
@@ -257,13 +359,16 @@ void GCUpdatePhase()
     // We can do the updates in parallel since they don't interfere at all.
     MTGCProcessUpdate processUpdate;
 
-    // Process local areas.
+    workerBusyTime.assign(gpTaskFarm->ThreadCount()+1, 0.0);
+
+    // Process local areas.  Large spaces are split so that the work can
+    // be shared between the threads.  As well as updating the addresses
+    // this zeros the unused words.
+    std::vector<UpdateChunk> chunks;
     for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
-    {
-        LocalMemSpace *space = *i;
-        // As well as updating the addresses this also clears the bitmaps.
-        gpTaskFarm->AddWorkOrRunNow(&updateLocalArea, &processUpdate, space);
-    }
+        AddChunks(chunks, *i);
+    for (std::vector<UpdateChunk>::iterator i = chunks.begin(); i < chunks.end(); i++)
+        gpTaskFarm->AddWorkOrRunNow(&updateLocalChunk, &processUpdate, &*i);
     // Scan the permanent mutable areas and the code areas.
     for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
     {
@@ -283,4 +388,33 @@ void GCUpdatePhase()
     gpTaskFarm->AddWorkOrRunNow(&updateGCProcAddresses, &processUpdate, 0);
     // Wait for these to complete before proceeding.
     gpTaskFarm->WaitForCompletion();
+
+    for (std::vector<UpdateChunk>::iterator i = chunks.begin(); i < chunks.end(); i++)
+        i->space->updated += i->updated;
+
+    // Report the time each thread was busy so that any imbalance is visible.
+    // The thread running the GC only runs tasks if there are no workers
+    // or the queue is full so it is left out of the range.
+    if (debugOptions & DEBUG_GC)
+    {
+        unsigned workers = gpTaskFarm->ThreadCount() == 0 ? 1 : gpTaskFarm->ThreadCount();
+        float minBusy = workerBusyTime[0], maxBusy = workerBusyTime[0];
+        for (unsigned w = 0; w < workerBusyTime.size(); w++)
+        {
+            if (w < workers && workerBusyTime[w] < minBusy) minBusy = workerBusyTime[w];
+            if (w < workers && workerBusyTime[w] > maxBusy) maxBusy = workerBusyTime[w];
+            if (debugOptions & DEBUG_GC_ENHANCED)
+                Log("GC: Update: %s %u busy for %1.3fs\n",
+                    w == gpTaskFarm->ThreadCount() ? "GC thread" : "Worker", w, workerBusyTime[w]);
+        }
+        Log("GC: Update: %lu chunks, busy time per thread %1.3fs to %1.3fs\n",
+            (unsigned long)chunks.size(), minBusy, maxBusy);
+    }
+
+    // The summary tables are no longer needed.
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        delete[] (*i)->slideSummary;
+        (*i)->slideSummary = 0;
+    }
 }
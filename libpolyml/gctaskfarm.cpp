@@ -45,20 +45,149 @@
 #define ASSERT(x)
 #endif
 
+#include <new>
+
 #include "gctaskfarm.h"
 #include "diagnostics.h"
 #include "timing.h"
+#include "osmem.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+#   include <intrin.h>
+#   pragma intrinsic(_InterlockedCompareExchange)
+#   if (SIZEOF_VOIDP == 8)
+#       define InterlockedCompareExchange64 _InterlockedCompareExchange64
+#   else
+#       define InterlockedCompareExchange   _InterlockedCompareExchange
+#   endif
+#endif
 
 static GCTaskId gTask;
 
 GCTaskId *globalTask = &gTask;
 
+#if (! defined(_MSC_VER) && ! defined(__GNUC__))
+// Fallback if we have no atomic operations.
+static PLock atomicLock("GC task farm atomic");
+#endif
+
+// Compare and swap.  This is a full memory barrier.
+static inline bool CompareAndSwap(volatile POLYUNSIGNED *p, POLYUNSIGNED oldVal, POLYUNSIGNED newVal)
+{
+#if defined(_MSC_VER)
+# if (SIZEOF_VOIDP == 8)
+    return (POLYUNSIGNED)InterlockedCompareExchange64((volatile LONGLONG*)p, newVal, oldVal) == oldVal;
+# else
+    return (POLYUNSIGNED)InterlockedCompareExchange((volatile LONG*)p, newVal, oldVal) == oldVal;
+# endif
+#elif defined(__GNUC__)
+    return __sync_bool_compare_and_swap(p, oldVal, newVal);
+#else
+    PLocker lock(&atomicLock);
+    if (*p != oldVal) return false;
+    *p = newVal;
+    return true;
+#endif
+}
+
+// Add a value and return the new value.
+static inline POLYUNSIGNED AtomicAdd(volatile POLYUNSIGNED *p, POLYUNSIGNED n)
+{
+    while (true)
+    {
+        POLYUNSIGNED old = *p;
+        if (CompareAndSwap(p, old, old+n))
+            return old+n;
+    }
+}
+
+static inline void FullFence(void)
+{
+#if defined(_MSC_VER)
+    MemoryBarrier();
+#elif defined(__GNUC__)
+    __sync_synchronize();
+#else
+    PLocker lock(&atomicLock);
+#endif
+}
+
+GCTaskDeque::~GCTaskDeque()
+{
+    free(entries);
+}
+
+bool GCTaskDeque::Initialise(unsigned size)
+{
+    POLYUNSIGNED s = 1;
+    while (s < size) s <<= 1;
+    entries = (queue_entry*)calloc(s, sizeof(queue_entry));
+    if (entries == 0) return false;
+    mask = s - 1;
+    top = bottom = 0;
+    return true;
+}
+
+bool GCTaskDeque::Push(gctask task, void *arg1, void *arg2)
+{
+    POLYUNSIGNED b = bottom, t = top;
+    if ((POLYSIGNED)(b - t) > (POLYSIGNED)mask) return false; // Full
+    queue_entry *e = &entries[b & mask];
+    e->task = task;
+    e->arg1 = arg1;
+    e->arg2 = arg2;
+    // The entry must be visible before the new bottom.
+    FullFence();
+    bottom = b + 1;
+    return true;
+}
+
+bool GCTaskDeque::Pop(queue_entry *entry)
+{
+    POLYUNSIGNED b = bottom - 1;
+    bottom = b;
+    // Setting bottom must be visible before we read top.
+    FullFence();
+    POLYUNSIGNED t = top;
+    if ((POLYSIGNED)(b - t) < 0)
+    {
+        // Empty.
+        bottom = b + 1;
+        return false;
+    }
+    *entry = entries[b & mask];
+    if (b != t)
+        return true; // There are other entries so no thief can take this one.
+    // This is the last entry.  We have to race any thieves for it.
+    bool result = CompareAndSwap(&top, t, t+1);
+    bottom = b + 1;
+    return result;
+}
+
+bool GCTaskDeque::Steal(queue_entry *entry)
+{
+    POLYUNSIGNED t = top;
+    FullFence();
+    POLYUNSIGNED b = bottom;
+    if ((POLYSIGNED)(b - t) <= 0)
+        return false; // Empty
+    // The owner cannot overwrite this entry until top has moved past it so if the
+    // compare-and-swap succeeds we have read a valid entry.
+    queue_entry e = entries[t & mask];
+    if (! CompareAndSwap(&top, t, t+1))
+        return false; // Another thread took it.
+    *entry = e;
+    return true;
+}
+
 GCTaskFarm::GCTaskFarm(): workLock("GC task farm work")
 {
-    queueSize = queueIn = queuedItems = 0;
-    workQueue = 0;
+    deques = 0;
+    nDeques = 0;
+    outstandingTasks = sleepingThreads = nextWorker = 0;
     terminate = false;
-    threadCount = activeThreadCount = 0;
+    threadCount = 0;
+    numaNodes = 1;
 #if (defined(HAVE_PTHREAD_H) || defined(HAVE_WINDOWS_H))
     threadHandles = 0;
 #endif
@@ -67,29 +196,35 @@ GCTaskFarm::GCTaskFarm(): workLock("GC task farm work")
 GCTaskFarm::~GCTaskFarm()
 {
     Terminate();
-    free(workQueue);
+    delete[] deques;
 #if (defined(HAVE_PTHREAD_H) || defined(HAVE_WINDOWS_H))
     free(threadHandles);
 #endif
 }
 
 
-bool GCTaskFarm::Initialise(unsigned thrdCount, unsigned qSize)
+bool GCTaskFarm::Initialise(unsigned thrdCount, unsigned qSize, unsigned nodes)
 {
     terminate = false;
+    numaNodes = nodes;
     if (!waitForWork.Init(0, thrdCount)) return false;
-    workQueue = (queue_entry*)calloc(qSize, sizeof(queue_entry));
-    if (workQueue == 0) return false;
+    // One deque for each worker and one for the thread running the GC.
+    deques = new(std::nothrow) GCTaskDeque[thrdCount+1];
+    if (deques == 0) return false;
+    nDeques = thrdCount+1;
+    for (unsigned d = 0; d < nDeques; d++)
+    {
+        if (! deques[d].Initialise(qSize)) return false;
+    }
 #if ((!defined(_WIN32) || defined(__CYGWIN__)) && defined(HAVE_PTHREAD_H))
-    queueSize = qSize;
+    if (pthread_key_create(&dequeKey, NULL) != 0) return false;
     threadHandles = (pthread_t*)calloc(thrdCount, sizeof(pthread_t));
     if (threadHandles == 0) return false;
 #elif defined(HAVE_WINDOWS_H)
-    queueSize = qSize;
+    dequeKey = TlsAlloc();
+    if (dequeKey == TLS_OUT_OF_INDEXES) return false;
     threadHandles = (HANDLE*)calloc(thrdCount, sizeof(HANDLE));
     if (threadHandles == 0) return false;
-#else
-    queueSize = 0;
 #endif
     // Create the worker threads.
     for (unsigned i = 0; i < thrdCount; i++) {
@@ -116,6 +251,7 @@ bool GCTaskFarm::Initialise(unsigned thrdCount, unsigned qSize)
 void GCTaskFarm::Terminate()
 {
     terminate = true;
+    FullFence();
     // Increment the semaphore by the number of threads to release them all.
     for (unsigned i = 0; i < threadCount; i++) waitForWork.Signal();
     // Wait for the threads to terminate.
@@ -128,22 +264,57 @@ void GCTaskFarm::Terminate()
 #endif
 }
 
+// Return the index of the deque for the current thread.  Workers have their
+// own deques.  Any other thread must be the one running the GC and uses the last.
+unsigned GCTaskFarm::CurrentDeque()
+{
+#if ((!defined(_WIN32) || defined(__CYGWIN__)) && defined(HAVE_PTHREAD_H))
+    void *value = pthread_getspecific(dequeKey);
+#elif defined(HAVE_WINDOWS_H)
+    void *value = TlsGetValue(dequeKey);
+#else
+    void *value = 0;
+#endif
+    if (value == 0)
+        return nDeques-1;
+    return (unsigned)((uintptr_t)value - 1);
+}
+
+// Try to decrement the count of sleeping threads.  If this succeeds the caller
+// is responsible for waking a thread or, if it is a thread that was about to
+// block, for not blocking.
+bool GCTaskFarm::ClaimSleeper()
+{
+    while (true)
+    {
+        POLYUNSIGNED s = sleepingThreads;
+        if (s == 0)
+            return false;
+        if (CompareAndSwap(&sleepingThreads, s, s-1))
+            return true;
+    }
+}
+
 // Add work to the queue.  Returns true if it succeeds.
 bool GCTaskFarm::AddWork(gctask work, void *arg1, void *arg2)
 {
-    bool wantSignal = false;
+    if (threadCount == 0)
+        return false;
+    // Count the task before it is visible so that the count cannot reach zero
+    // while it is running.  If the push fails the count cannot reach zero here
+    // either because the caller is either the GC thread, which is not waiting, or
+    // a task that is still outstanding.
+    (void)AtomicAdd(&outstandingTasks, 1);
+    if (! deques[CurrentDeque()].Push(work, arg1, arg2))
     {
-        PLocker l(&workLock);
-        if (queuedItems == queueSize) return false; // Queue is full
-        workQueue[queueIn].task = work;
-        workQueue[queueIn].arg1 = arg1;
-        workQueue[queueIn].arg2 = arg2;
-        queueIn++;
-        if (queueIn == queueSize) queueIn = 0;
-        queuedItems++;
-        wantSignal = queuedItems <= threadCount;
+        (void)AtomicAdd(&outstandingTasks, (POLYUNSIGNED)-1);
+        return false; // Queue is full
     }
-    if (wantSignal) waitForWork.Signal();
+    // Wake a sleeping worker.  The fence ensures that either a worker about
+    // to sleep sees the new entry or we see that it is sleeping.
+    FullFence();
+    if (sleepingThreads != 0 && ClaimSleeper())
+        waitForWork.Signal();
     return true;
 }
 
@@ -154,81 +325,107 @@ void GCTaskFarm::AddWorkOrRunNow(gctask work, void *arg1, void *arg2)
         (*work)(globalTask, arg1, arg2);
 }
 
+// Try to steal a task from another deque.  Start with the next deque
+// to spread the load.
+bool GCTaskFarm::StealWork(unsigned myDeque, queue_entry *entry)
+{
+    for (unsigned i = 1; i < nDeques; i++)
+    {
+        unsigned victim = myDeque + i;
+        if (victim >= nDeques) victim -= nDeques;
+        if (deques[victim].Steal(entry))
+            return true;
+    }
+    return false;
+}
+
+bool GCTaskFarm::HaveWork()
+{
+    for (unsigned i = 0; i < nDeques; i++)
+    {
+        if (! deques[i].IsEmpty())
+            return true;
+    }
+    return false;
+}
+
+// Called when a task has finished.  If this was the last outstanding task
+// signal the GC thread.
+void GCTaskFarm::TaskCompleted()
+{
+    if (AtomicAdd(&outstandingTasks, (POLYUNSIGNED)-1) == 0)
+    {
+        // In our Windows partial implementation of condition vars we assume
+        // that signalling is done with the lock held.
+        PLocker l(&workLock);
+        waitForCompletion.Signal();
+    }
+}
+
 void GCTaskFarm::ThreadFunction()
 {
     GCTaskId myTaskId;
+    unsigned myDeque = (unsigned)(AtomicAdd(&nextWorker, 1) - 1);
+#if ((!defined(_WIN32) || defined(__CYGWIN__)) && defined(HAVE_PTHREAD_H))
+    pthread_setspecific(dequeKey, (void*)((uintptr_t)myDeque+1));
+#elif defined(HAVE_WINDOWS_H)
+    TlsSetValue(dequeKey, (void*)((uintptr_t)myDeque+1));
+#endif
+    // Keep the worker on one node so that the spaces it takes in the GC are local.
+    if (numaNodes > 1 && ! osMemoryManager->RunOnNumaNode(myDeque % numaNodes) && (debugOptions & DEBUG_GCTASKS))
+        Log("GCTask: Thread %p unable to run on NUMA node %u\n", &myTaskId, myDeque % numaNodes);
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
     DWORD startActive = GetTickCount();
 #else
     struct timeval startTime;
     gettimeofday(&startTime, NULL);
 #endif
-    workLock.Lock();
-    activeThreadCount++;
     while (! terminate) {
-        // Invariant: We have the lock and the activeThreadCount includes this thread.
-        // Find some work.
-
-        if (queuedItems > 0) { // There is work
-            unsigned outPos;
-            if (queuedItems > queueIn)
-                outPos = queueIn+queueSize-queuedItems;
-            else outPos = queueIn-queuedItems;
-            gctask work = workQueue[outPos].task;
-            void *arg1 = workQueue[outPos].arg1;
-            void *arg2 = workQueue[outPos].arg2;
-            workQueue[outPos].task = 0;
-            queuedItems--;
-            ASSERT(work != 0);
-            workLock.Unlock();
-            (*work)(&myTaskId, arg1, arg2);
-            workLock.Lock();
+        // Find some work.  Take it from our own deque first and otherwise
+        // try to steal it from another thread.
+        queue_entry entry;
+        if (deques[myDeque].Pop(&entry) || StealWork(myDeque, &entry))
+        {
+            ASSERT(entry.task != 0);
+            (*entry.task)(&myTaskId, entry.arg1, entry.arg2);
+            TaskCompleted();
+            continue;
         }
-        else {
-            activeThreadCount--; // We're no longer active
-            // If there is no work and we're the last active thread signal the
-            // main thread that the queue is empty
-            bool wantSignal = activeThreadCount == 0;
-            if (wantSignal)
-                waitForCompletion.Signal();
-            // Now release the lock.  In our Windows partial implementation of
-            // condition vars we assume that signalling is done with the lock
-            // still held.
-            workLock.Unlock();
-
-            if (debugOptions & DEBUG_GCTASKS)
-            {
+
+        // There's no work.  Record that we're about to sleep and then check again.
+        // Either we will see any work added after this or the thread adding it
+        // will see that we are sleeping and wake us.
+        (void)AtomicAdd(&sleepingThreads, 1);
+        if ((terminate || HaveWork()) && ClaimSleeper())
+            continue;
+
+        if (debugOptions & DEBUG_GCTASKS)
+        {
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
-                Log("GCTask: Thread %p blocking after %u milliseconds\n", &myTaskId,
-                     GetTickCount() - startActive);
+            Log("GCTask: Thread %p blocking after %u milliseconds\n", &myTaskId,
+                 GetTickCount() - startActive);
 #else
-                struct timeval endTime;
-                gettimeofday(&endTime, NULL);
-                subTimevals(&endTime, &startTime);
-                Log("GCTask: Thread %p blocking after %0.4f seconds\n", &myTaskId,
-                    (float)endTime.tv_sec + (float)endTime.tv_usec / 1.0E6);
+            struct timeval endTime;
+            gettimeofday(&endTime, NULL);
+            subTimevals(&endTime, &startTime);
+            Log("GCTask: Thread %p blocking after %0.4f seconds\n", &myTaskId,
+                (float)endTime.tv_sec + (float)endTime.tv_usec / 1.0E6);
 #endif
-            }
-
-            if (terminate) return;
-            // Block until there's work.
-            waitForWork.Wait();
-            // We've been woken up
-            if (debugOptions & DEBUG_GCTASKS)
-            {
+        }
+
+        // Block until there's work.
+        waitForWork.Wait();
+        // We've been woken up
+        if (debugOptions & DEBUG_GCTASKS)
+        {
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
-                startActive = GetTickCount();
+            startActive = GetTickCount();
 #else
-                gettimeofday(&startTime, NULL);
+            gettimeofday(&startTime, NULL);
 #endif
-                Log("GCTask: Thread %p resuming\n", &myTaskId);
-            }
-            workLock.Lock();
-            activeThreadCount++;
+            Log("GCTask: Thread %p resuming\n", &myTaskId);
         }
     }
-    activeThreadCount--;
-    workLock.Unlock();
 }
 
 #if ((!defined(_WIN32) || defined(__CYGWIN__)) && defined(HAVE_PTHREAD_H))
@@ -247,7 +444,9 @@ DWORD WINAPI GCTaskFarm::WorkerThreadFunction(void *parameter)
 }
 #endif
 
-// Wait until the queue is empty.
+// Wait until all the tasks have finished.  The count of outstanding tasks
+// includes tasks that are running so this also waits for any work that
+// they create.
 void GCTaskFarm::WaitForCompletion(void)
 {
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
@@ -260,9 +459,11 @@ void GCTaskFarm::WaitForCompletion(void)
         gettimeofday(&startWait, NULL);
 #endif
     workLock.Lock();
-    while (activeThreadCount > 0 || queuedItems > 0)
+    while (outstandingTasks != 0)
         waitForCompletion.Wait(&workLock);
     workLock.Unlock();
+    // Make sure we see the results of the tasks.
+    FullFence();
 
     if (debugOptions & DEBUG_GCTASKS)
     {
@@ -23,6 +23,7 @@
 #define GCTASKFARM_H_INCLUDED
 
 #include "locking.h"
+#include "globals.h" // For POLYUNSIGNED
 
 // An empty class just used as an ID.
 class GCTaskId {
@@ -42,47 +43,89 @@ typedef struct {
     void    *arg2;
 } queue_entry;
 
+// Work-stealing deque (Chase and Lev).  Each worker thread has its own
+// deque and there is an extra one for the thread running the GC.  Only the
+// owner pushes or pops at the bottom so that needs no lock.  Other threads
+// steal from the top using a compare-and-swap on the top index.  The deque
+// has a fixed size; if it is full the caller runs the task itself.
+class GCTaskDeque {
+public:
+    GCTaskDeque(): entries(0), mask(0), top(0), bottom(0) {}
+    ~GCTaskDeque();
+
+    bool Initialise(unsigned size);
+
+    bool Push(gctask task, void *arg1, void *arg2); // Owner only.  Returns false if full.
+    bool Pop(queue_entry *entry); // Owner only.
+    bool Steal(queue_entry *entry); // Any thread.  May fail if another thread is also taking.
+    bool IsEmpty(void) const { return (POLYSIGNED)(bottom - top) <= 0; }
+
+private:
+    queue_entry *entries;
+    POLYUNSIGNED mask; // Size of the array - 1.  The size is a power of two.
+    volatile POLYUNSIGNED top, bottom;
+    // Pad the structure so that deques belonging to different threads
+    // are not in the same cache line.
+    char padding[64];
+};
+
 class GCTaskFarm {
 public:
     GCTaskFarm();
     ~GCTaskFarm();
 
-    bool Initialise(unsigned threadCount, unsigned queueSize);
+    // If numaNodes is more than one each worker is restricted to the processors on
+    // one of the nodes, spreading the workers evenly across the nodes.
+    bool Initialise(unsigned threadCount, unsigned queueSize, unsigned numaNodes = 1);
 
     bool AddWork(gctask task, void *arg1, void *arg2);
     void AddWorkOrRunNow(gctask task, void *arg1, void *arg2);
+    // Wait until all the tasks, including any they have created, have finished.
     void WaitForCompletion(void);
     void Terminate(void);
-    // See if the queue is draining.  Used as a hint as to whether
+    // See if there are idle workers.  Used as a hint as to whether
     // it's worth sparking off some new work.
-    bool Draining(void) const { return queuedItems == 0; }
+    bool Draining(void) const { return sleepingThreads != 0; }
 
     unsigned ThreadCount(void) const { return threadCount; }
+    // The number of the thread running the current task.  The workers are numbered
+    // from zero to ThreadCount()-1 and the thread running the GC is ThreadCount().
+    unsigned WorkerNumber(void) { return nDeques == 0 ? threadCount : CurrentDeque(); }
 
 private:
-    // The semaphore is zero if there is no work or some value up to
-    // the number of threads if there is work.
+    // The semaphore is signalled once for each sleeping thread that is
+    // woken to process new work.
     PSemaphore waitForWork;
-    // The lock protects the queue and the item count.
+    // The lock is only used with the condition variable.
     PLock workLock;
-    // The condition variable is signalled when the queue is empty.
+    // The condition variable is signalled when the last outstanding task finishes.
     // This can only be waited for by a single thread because it's not a proper
     // implementation of a condition variable in Windows.
     PCondVar waitForCompletion;
-    unsigned queueSize, queueIn, queuedItems;
-    queue_entry *workQueue; // Array of unit->unit functions.
-    bool terminate; // Set to true to kill all workers.
+    GCTaskDeque *deques; // One for each worker plus one for the GC thread.
+    unsigned nDeques;
+    volatile POLYUNSIGNED outstandingTasks; // Tasks that have been added but not finished.
+    volatile POLYUNSIGNED sleepingThreads; // Workers that are, or are about to be, blocked.
+    volatile POLYUNSIGNED nextWorker; // Used to allocate deques to workers.
+    volatile bool terminate; // Set to true to kill all workers.
     unsigned threadCount; // Count of workers.
-    unsigned activeThreadCount; // Count of workers doing work.
+    unsigned numaNodes; // Number of NUMA nodes to place workers on.
 
     void ThreadFunction(void);
+    unsigned CurrentDeque(void);
+    bool StealWork(unsigned myDeque, queue_entry *entry);
+    bool HaveWork(void);
+    bool ClaimSleeper(void);
+    void TaskCompleted(void);
 
 #if ((!defined(_WIN32) || defined(__CYGWIN__)) && defined(HAVE_PTHREAD_H))
     static void *WorkerThreadFunction(void *parameter);
     pthread_t *threadHandles;
+    pthread_key_t dequeKey;
 #elif defined(HAVE_WINDOWS_H)
     static DWORD WINAPI WorkerThreadFunction(void *parameter);
     HANDLE *threadHandles;
+    DWORD dequeKey;
 #endif
 };
 
@@ -107,10 +107,20 @@ HeapSizeParameters::HeapSizeParameters()
     minHeapSize = 0;
     maxHeapSize = 0; // Unlimited
     lastFreeSpace = 0;
+    targetPause = targetInterval = 0.0;
+    pauseAllocSize = 0;
+    lastMajorPause = 0.0;
+    liveAfterLastMajor = 0;
     pagingLimitSize = 0;
     highWaterMark = 0;
     sharingWordsRecovered = 0;
     cumulativeSharingSaving = 0;
+    for (unsigned i = 0; i <= GC_SHARE_HASH; i++)
+    {
+        sharingMethodPasses[i] = 0;
+        sharingMethodWords[i] = 0;
+        sharingMethodTime[i] = 0.0;
+    }
     // Initial values until we've actually done a sharing pass.
     sharingRecoveryRate = 0.5; // The structure sharing recovers half the heap.
     sharingCostFactor = 2; // It doubles the cost
@@ -205,10 +215,19 @@ void HeapSizeParameters::SetReservation(POLYUNSIGNED rsize)
     gMem.SetReservation(K_to_words(rsize));
 }
 
+void HeapSizeParameters::SetPauseTarget(unsigned pause, unsigned interval)
+{
+    targetPause = (double)pause / 1000.0;
+    targetInterval = (double)interval / 1000.0;
+    if (pause != 0 && (debugOptions & DEBUG_HEAPSIZE))
+        Log("Heap: Target pause %0.3fs minimum interval %0.3fs\n", targetPause, targetInterval);
+}
+
 // Called in the minor GC if a GC thread needs to grow the heap.
 // Returns zero if the heap cannot be grown. "space" is the space required for the
 // object (and length field) in case this is larger than the default size.
-LocalMemSpace *HeapSizeParameters::AddSpaceInMinorGC(POLYUNSIGNED space, bool isMutable)
+// "node" is the NUMA node of the thread that wants the space.
+LocalMemSpace *HeapSizeParameters::AddSpaceInMinorGC(POLYUNSIGNED space, bool isMutable, unsigned node)
 {
     // See how much space is allocated to the major heap.
     POLYUNSIGNED spaceAllocated = gMem.CurrentHeapSize() - gMem.CurrentAllocSpace();
@@ -223,7 +242,7 @@ LocalMemSpace *HeapSizeParameters::AddSpaceInMinorGC(POLYUNSIGNED space, bool is
     // than the allowed heap size.
     if (spaceAllocated + spaceSize + gMem.DefaultSpaceSize() <= gMem.SpaceForHeap())
     {
-        LocalMemSpace *sp = gMem.NewLocalSpace(spaceSize, isMutable); // Return the space or zero if it failed
+        LocalMemSpace *sp = gMem.NewLocalSpace(spaceSize, isMutable, node); // Return the space or zero if it failed
         // If this is the first time the allocation failed report it.
         if (sp == 0 && (debugOptions & DEBUG_HEAPSIZE) && lastAllocationSucceeded)
         {
@@ -427,16 +446,30 @@ void HeapSizeParameters::AdjustSizeAfterMajorGC(POLYUNSIGNED wordsRequired)
     // the available memory and causes paging.  We need to raise the limit carefully.
     // Also, if we use the whole of the heap we may not then be able to allocate
     // new areas in the major heap without going over the limit.  Restrict it to
-    // half of the available heap.
+    // half of the available heap.  Large objects and spaces added during the GC
+    // may have taken the heap above the size at the start.
+    if (highWaterMark < gMem.CurrentHeapSize()) highWaterMark = gMem.CurrentHeapSize();
     POLYUNSIGNED nextLimit = highWaterMark + highWaterMark / 32;
     if (nextLimit > newHeapSize) nextLimit = newHeapSize;
     // gMem.CurrentHeapSize() is the live space size.
     if (gMem.CurrentHeapSize() > nextLimit)
         gMem.SetSpaceBeforeMinorGC(0); // Run out of space
-    else gMem.SetSpaceBeforeMinorGC((nextLimit-gMem.CurrentHeapSize())/2);
+    else
+    {
+        POLYUNSIGNED minorSize = (nextLimit-gMem.CurrentHeapSize())/2;
+        // If we have a pause target keep to the size chosen from the minor GC pauses.
+        if (pauseAllocSize != 0 && pauseAllocSize < minorSize)
+            minorSize = pauseAllocSize;
+        gMem.SetSpaceBeforeMinorGC(minorSize);
+    }
 
     lastFreeSpace = newHeapSize - currentSpaceUsed;
     predictedRatio = cost;
+
+    // The time for this GC is in the minor GC timings.
+    lastMajorPause = minorGCReal.toSeconds();
+    liveAfterLastMajor = currentSpaceUsed;
+    globalStats.setTime(PST_GC_LAST_MAJOR_PAUSE, minorGCReal);
 }
 
 // Called after a minor GC.  Currently does nothing.
@@ -492,6 +525,12 @@ bool HeapSizeParameters::AdjustSizeAfterMinorGC(POLYUNSIGNED spaceAfterGC, POLYU
     // rather than run out of space.
     if (allocationFailedBeforeLastMajorGC)
         allowedAlloc = allowedAlloc / 2;
+    // With a pause target the size may be smaller than the heap allows.
+    POLYUNSIGNED heapAlloc = allowedAlloc;
+    globalStats.setTime(PST_GC_LAST_MINOR_PAUSE, minorGCReal);
+    globalStats.addPause(PSH_GC_MINOR, minorGCReal);
+    if (targetPause != 0.0)
+        allowedAlloc = pauseTargetAllocation(heapAlloc);
     if (gMem.CurrentAllocSpace() - allocatedInAlloc != allowedAlloc)
     {
         if (debugOptions & DEBUG_HEAPSIZE)
@@ -503,7 +542,7 @@ bool HeapSizeParameters::AdjustSizeAfterMinorGC(POLYUNSIGNED spaceAfterGC, POLYU
             Log("\n");
         }
         gMem.SetSpaceBeforeMinorGC(allowedAlloc);
-        if (allowedAlloc < gMem.DefaultSpaceSize() * 2 || minorGCPageFaults > 100)
+        if (heapAlloc < gMem.DefaultSpaceSize() * 2 || minorGCPageFaults > 100)
             return false; // Trigger full GC immediately.
      }
 
@@ -511,9 +550,73 @@ bool HeapSizeParameters::AdjustSizeAfterMinorGC(POLYUNSIGNED spaceAfterGC, POLYU
     // the target ratio over several GCs (this smooths out small variations).
     if ((minorGCsSinceMajor > 4 && g > predictedRatio*0.8) || majorGCPageFaults > 100)
         fullGCNextTime = true;
+
+    // With a pause target start a major GC early if the data in the major heap has
+    // grown so much since the last one that the pause would exceed the target.  The
+    // pause is assumed to be proportional to the data.  This can only help if the
+    // last major GC was within the target and there is some prospect of recovering
+    // space, otherwise we would repeatedly collect the same live data.
+    if (targetPause != 0.0 && ! fullGCNextTime && lastMajorPause != 0.0 &&
+            lastMajorPause < targetPause && liveAfterLastMajor != 0)
+    {
+        POLYUNSIGNED majorData = 0;
+        for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        {
+            if (! (*i)->allocationSpace)
+                majorData += (*i)->allocatedSpace();
+        }
+        double predictedPause = lastMajorPause * (double)majorData / (double)liveAfterLastMajor;
+        if (predictedPause > targetPause && majorData > liveAfterLastMajor + liveAfterLastMajor / 4)
+        {
+            if (debugOptions & DEBUG_HEAPSIZE)
+                Log("Heap: Predicted major GC pause %0.3fs exceeds the target: major GC next time\n", predictedPause);
+            fullGCNextTime = true;
+            globalStats.incCount(PSC_GC_PAUSE_MAJOR);
+        }
+    }
     return true;
 }
 
+// Choose the size of the allocation area to meet the pause target.  The time for a
+// minor GC depends on the data that survives rather than the size of the area but a
+// larger area generally means more survivors.  Shrink the area if the last pause was
+// over the target.  Grow it if the pause was well inside the target and either the
+// interval between minor GCs was shorter than requested or no interval was given.
+// The change is limited to a factor of two each time to damp out the variation
+// between GCs.
+POLYUNSIGNED HeapSizeParameters::pauseTargetAllocation(POLYUNSIGNED limit)
+{
+    double pause = minorGCReal.toSeconds(), interval = minorNonGCReal.toSeconds();
+    POLYUNSIGNED currentSize = pauseAllocSize != 0 ? pauseAllocSize : gMem.SpaceBeforeMinorGC();
+    double scale = 1.0;
+    if (pause > targetPause)
+        scale = targetPause / pause;
+    else if (pause < targetPause * 0.75 && (targetInterval == 0.0 || interval < targetInterval))
+    {
+        // Aim for a pause of three-quarters of the target.
+        scale = pause == 0.0 ? 2.0 : targetPause * 0.75 / pause;
+        if (targetInterval != 0.0 && interval != 0.0 && targetInterval / interval < scale)
+            scale = targetInterval / interval;
+    }
+    if (scale < 0.5) scale = 0.5;
+    else if (scale > 2.0) scale = 2.0;
+
+    POLYUNSIGNED newSize = (POLYUNSIGNED)((double)currentSize * scale);
+    if (newSize > limit) newSize = limit;
+    if (newSize < gMem.DefaultSpaceSize()) newSize = gMem.DefaultSpaceSize();
+    if (debugOptions & DEBUG_HEAPSIZE)
+    {
+        Log("Heap: Minor GC pause %0.4fs interval %0.4fs: allocation area ", pause, interval);
+        LogSize(currentSize);
+        Log(" to ");
+        LogSize(newSize);
+        Log("\n");
+    }
+    pauseAllocSize = newSize;
+    globalStats.setSize(PSS_PAUSE_ALLOCATION, newSize*sizeof(PolyWord));
+    return newSize < limit ? newSize : limit;
+}
+
 // Estimate the GC cost for a given heap size.  The result is the ratio of
 // GC time to application time.
 // This is really guesswork.
@@ -648,6 +751,52 @@ static bool GetLastStats(TIMEDATA &userTime, TIMEDATA &systemTime, TIMEDATA &rea
     return true;
 }
 
+static void GetRealTime(TIMEDATA &realTime)
+{
+#if (defined(_WIN32) && ! defined(__CYGWIN__))
+    FILETIME rt;
+    GetSystemTimeAsFileTime(&rt);
+    realTime = rt;
+#else
+    struct timeval tv;
+    if (gettimeofday(&tv, NULL) == 0)
+        realTime = tv;
+#endif
+}
+
+TIMEDATA HeapSizeParameters::StartGCPhase()
+{
+    TIMEDATA startTime;
+    GetRealTime(startTime);
+    return startTime;
+}
+
+void HeapSizeParameters::EndGCPhase(int statistic, const TIMEDATA &startTime, int pause)
+{
+    TIMEDATA endTime;
+    GetRealTime(endTime);
+    endTime.sub(startTime);
+    globalStats.incTime(statistic, endTime);
+    if (pause != -1)
+        globalStats.addPause(pause, endTime);
+}
+
+void HeapSizeParameters::EndGCPause(int pause, const TIMEDATA &startTime)
+{
+    TIMEDATA endTime;
+    GetRealTime(endTime);
+    endTime.sub(startTime);
+    globalStats.addPause(pause, endTime);
+}
+
+float HeapSizeParameters::GCPhaseTime(const TIMEDATA &startTime)
+{
+    TIMEDATA now;
+    GetRealTime(now);
+    now.sub(startTime);
+    return now.toSeconds();
+}
+
 void HeapSizeParameters::RecordAtStartOfMajorGC()
 {
     heapSizeAtStart = gMem.CurrentHeapSize();
@@ -761,9 +910,16 @@ void HeapSizeParameters::RecordGCTime(gcTime isEnd, const char *stage)
 // Record the recovery rate and cost after running the GC sharing pass.
 // TODO: We should probably average these because if we've run a full
 // sharing pass and then a full GC after the recovery rate will be zero.
-void HeapSizeParameters::RecordSharingData(POLYUNSIGNED recovery)
+void HeapSizeParameters::RecordSharingData(unsigned method, POLYUNSIGNED recovery, float seconds)
 {
     sharingWordsRecovered = recovery;
+    sharingMethodPasses[method]++;
+    sharingMethodWords[method] += recovery;
+    sharingMethodTime[method] += seconds;
+    if (debugOptions & DEBUG_HEAPSIZE)
+        Log("Heap: Sharing by %s recovered %" POLYUFMT " words in %1.3fs.  Total for %u passes by %s: %" POLYUFMT " words in %1.3fs\n",
+            method == GC_SHARE_HASH ? "hashing" : "sorting", recovery, seconds, sharingMethodPasses[method],
+            method == GC_SHARE_HASH ? "hashing" : "sorting", sharingMethodWords[method], sharingMethodTime[method]);
     TIMEDATA userTime, systemTime, realTime;
     long pageCount;
     if (! GetLastStats(userTime, systemTime, realTime, pageCount))
@@ -23,6 +23,7 @@
 #define HEAPSIZING_H_INCLUDED 1
 
 #include "timing.h"
+#include "gc.h" // For GC_SHARE_HASH
 
 class LocalMemSpace;
 
@@ -38,9 +39,14 @@ public:
 
     void SetReservation(POLYUNSIGNED rsize);
 
+    // Set the maximum pause and the minimum interval between minor GCs in
+    // milliseconds.  If the pause is non-zero the heap is sized from the
+    // measured pause times rather than the GC time ratio.
+    void SetPauseTarget(unsigned pause, unsigned interval);
+
     // Called in the minor GC if a GC thread needs to grow the heap.
     // Returns zero if the heap cannot be grown.
-    LocalMemSpace *AddSpaceInMinorGC(POLYUNSIGNED space, bool isMutable);
+    LocalMemSpace *AddSpaceInMinorGC(POLYUNSIGNED space, bool isMutable, unsigned node = 0);
 
     // Called in the major GC before the copy phase if the heap is more than
     // 90% full.  This should improve the efficiency of copying.
@@ -52,6 +58,8 @@ public:
 
     // Returns true if we should run a major GC at this point
     bool RunMajorGCImmediately();
+    // Returns true if the next GC will be a major GC.
+    bool MajorGCPending() const { return fullGCNextTime; }
 
     /* Called by the garbage collector at the beginning and
        end of garbage collection. */
@@ -64,7 +72,18 @@ public:
     // These are called by the GC to record information about its progress.
     void RecordAtStartOfMajorGC();
     void RecordGCTime(gcTime isEnd, const char *stage = "");
-    void RecordSharingData(POLYUNSIGNED recovery);
+    // Record the result of a sharing pass.  method is GC_SHARE_SORT or GC_SHARE_HASH
+    // and seconds is the real time taken to find and merge the equal objects.
+    void RecordSharingData(unsigned method, POLYUNSIGNED recovery, float seconds);
+
+    // Record the real time taken by a phase of the GC in the statistics.
+    // If pause is not -1 the time is also added to that pause histogram.
+    // These may be called from any GC thread.
+    static TIMEDATA StartGCPhase(void);
+    static void EndGCPhase(int statistic, const TIMEDATA &startTime, int pause = -1);
+    static void EndGCPause(int pause, const TIMEDATA &startTime);
+    // Real time in seconds since the start of a phase.
+    static float GCPhaseTime(const TIMEDATA &startTime);
     
     void resetMinorTimingData(void);
     void resetMajorTimingData(void);
@@ -79,6 +98,9 @@ private:
 
     bool getCostAndSize(POLYUNSIGNED &heapSize, double &cost, bool withSharing);
 
+    // Choose the size of the allocation area from the last minor GC pause.
+    POLYUNSIGNED pauseTargetAllocation(POLYUNSIGNED limit);
+
     // Set if we should do a full GC next time instead of a minor GC.
     bool fullGCNextTime;
 
@@ -92,12 +114,24 @@ private:
     POLYUNSIGNED sharingWordsRecovered;
     // The saving we would have made by enabling sharing in the past
     double cumulativeSharingSaving;
+    // Totals for each sharing method, indexed by GC_SHARE_SORT or GC_SHARE_HASH.
+    unsigned sharingMethodPasses[GC_SHARE_HASH+1];
+    POLYUNSIGNED sharingMethodWords[GC_SHARE_HASH+1];
+    double sharingMethodTime[GC_SHARE_HASH+1];
 
     // Maximum and minimum heap size as given by the user.
     POLYUNSIGNED minHeapSize, maxHeapSize;
 
     // Target GC cost requested by the user.
     double userGCRatio;
+    // Target pause and minor GC interval in seconds.  Zero if they have not been set.
+    double targetPause, targetInterval;
+    // Allocation area size chosen by the pause controller.
+    POLYUNSIGNED pauseAllocSize;
+    // The real time taken by the last major GC and the data in the heap after it.
+    double lastMajorPause;
+    POLYUNSIGNED liveAfterLastMajor;
+
     // Actual ratio for the last major GC
     double lastMajorGCRatio;
     // Predicted ratio for the next GC
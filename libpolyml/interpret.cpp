@@ -116,7 +116,7 @@ union realdb { double dble; POLYUNSIGNED puns[DOUBLESIZE]; };
 
 class IntTaskData: public TaskData {
 public:
-    IntTaskData(): interrupt_requested(false), overflowPacket(0), dividePacket(0) {}
+    IntTaskData(): interrupt_requested(false), overflowPacket(0), dividePacket(0) { taskPc = 0; }
 
     virtual void GarbageCollect(ScanAddress *process);
     void ScanStackAddress(ScanAddress *process, PolyWord &val, StackSpace *stack);
@@ -167,7 +167,7 @@ public:
         // N.B. This may return zero if the heap is exhausted and it has set this
         // up for an exception.  Generally it allocates by decrementing allocPointer
         // but if the required memory is large it may allocate in a separate area.
-        PolyWord *space = processes->FindAllocationSpace(this, words, true);
+        PolyWord *space = processes->FindAllocationSpace(this, words, false);
         LoadInterpreterState(pc, sp);
         if (space == 0) return 0;
         return (PolyObject *)(space+1);
@@ -228,6 +228,16 @@ static PLock mutexLock;
 // Special value for return address.
 #define SPECIAL_PC_END_THREAD           TAGGED(1)
 
+// Store a word into an object.  The object may be an existing mutable
+// so this must go through the write barrier.
+static inline void StoreWord(PolyObject *p, POLYUNSIGNED i, PolyWord v)
+{
+    if (concurrentMarking)
+        ConcurrentMarkRecord(p->Get(i));
+    p->Set(i, v);
+    gMem.RecordMutableStore(p->Offset(i), v);
+}
+
 class Interpreter : public MachineDependent {
 public:
     Interpreter() {}
@@ -235,6 +245,8 @@ public:
     // Create a task data object.
     virtual TaskData *CreateTaskData(void) { return new IntTaskData(); }
     virtual Architectures MachineArchitecture(void) { return MA_Interpreted; }
+    // All stores into mutable objects are made through StoreWord.
+    virtual bool HasWriteBarrier(void) { return true; }
 };
 
 void IntTaskData::InitStackFrame(TaskData *parentTask, Handle proc, Handle arg)
@@ -676,7 +688,7 @@ int IntTaskData::SwitchToPoly()
         case INSTR_move_to_vec_w:
             {
                 PolyWord u = *sp++;
-                (*sp).AsObjPtr()->Set(arg1, u);
+                StoreWord((*sp).AsObjPtr(), arg1, u);
                 pc += 2;
                 break;
             }
@@ -753,7 +765,7 @@ int IntTaskData::SwitchToPoly()
             *sp = (*sp).AsObjPtr()->Get(*pc); pc += 1; break;
 
         case INSTR_move_to_vec_b:
-            { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(*pc, u); pc += 1; break; }
+            { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), *pc, u); pc += 1; break; }
 
         case INSTR_set_stack_val_b:
             { PolyWord u = *sp++; sp[*pc-1] = u; pc += 1; break; }
@@ -803,14 +815,14 @@ int IntTaskData::SwitchToPoly()
         case INSTR_const_4: *(--sp) = TAGGED(4); break;
         case INSTR_const_10: *(--sp) = TAGGED(10); break;
 
-        case INSTR_move_to_vec_0:  { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(0, u); break; }
-        case INSTR_move_to_vec_1: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(1, u); break; }
-        case INSTR_move_to_vec_2: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(2, u); break; }
-        case INSTR_move_to_vec_3: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(3, u); break; }
-        case INSTR_move_to_vec_4: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(4, u); break; }
-        case INSTR_move_to_vec_5: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(5, u); break; }
-        case INSTR_move_to_vec_6: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(6, u); break; }
-        case INSTR_move_to_vec_7: { PolyWord u = *sp++; (*sp).AsObjPtr()->Set(7, u); break; }
+        case INSTR_move_to_vec_0:  { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 0, u); break; }
+        case INSTR_move_to_vec_1: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 1, u); break; }
+        case INSTR_move_to_vec_2: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 2, u); break; }
+        case INSTR_move_to_vec_3: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 3, u); break; }
+        case INSTR_move_to_vec_4: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 4, u); break; }
+        case INSTR_move_to_vec_5: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 5, u); break; }
+        case INSTR_move_to_vec_6: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 6, u); break; }
+        case INSTR_move_to_vec_7: { PolyWord u = *sp++; StoreWord((*sp).AsObjPtr(), 7, u); break; }
 
         case INSTR_reset_r_1: { PolyWord u = *sp; sp += 1; *sp = u; break; }
         case INSTR_reset_r_2: { PolyWord u = *sp; sp += 2; *sp = u; break; }
@@ -1258,7 +1270,10 @@ int IntTaskData::SwitchToPoly()
             Handle reset = this->saveVec.mark();
             Handle pushedArg1 = this->saveVec.push(*sp++);
             Handle pushedArg2 = this->saveVec.push(*sp);
+            // The multiplication may allocate memory and so GC.
+            SaveInterpreterState(pc, sp);
             Handle result = mult_longc(this, pushedArg2, pushedArg1);
+            LoadInterpreterState(pc, sp);
             PolyWord res = result->Word();
             this->saveVec.reset(reset);
             if (! res.IsTagged()) 
@@ -1795,7 +1810,7 @@ int IntTaskData::SwitchToPoly()
             POLYUNSIGNED offset = UNTAGGED(*sp++);
             POLYUNSIGNED index = UNTAGGED(*sp++);
             PolyObject *p = (PolyObject*)((*sp).AsCodePtr() + offset);
-            p->Set(index, toStore);
+            StoreWord(p, index, toStore);
             *sp = Zero;
             break;
         }
@@ -1908,7 +1923,7 @@ int IntTaskData::SwitchToPoly()
             POLYUNSIGNED srcOffset = UNTAGGED_UNSIGNED(*sp++);
             POLYUNSIGNED srcIndex = UNTAGGED_UNSIGNED(*sp++);
             PolyObject *src = (PolyObject*)((*sp).AsCodePtr() + srcOffset);
-            for (POLYUNSIGNED u = 0; u < length; u++) dest->Set(destIndex+u, src->Get(srcIndex+u));
+            for (POLYUNSIGNED u = 0; u < length; u++) StoreWord(dest, destIndex+u, src->Get(srcIndex+u));
             *sp = Zero;
             break;
         }
@@ -1962,6 +1977,14 @@ void IntTaskData::GarbageCollect(ScanAddress *process)
     overflowPacket = process->ScanObjectAddress(overflowPacket);
     dividePacket = process->ScanObjectAddress(dividePacket);
 
+    // The program counter is saved while the thread is in the RTS.  The code
+    // it points into must be retained and must not be moved.
+    if (taskPc != 0)
+    {
+        PolyWord pc = PolyWord::FromCodePtr(taskPc);
+        ScanStackAddress(process, pc, stack);
+    }
+
     if (stack != 0)
     {
         StackSpace *stackSpace = stack;
@@ -1979,10 +2002,20 @@ void IntTaskData::GarbageCollect(ScanAddress *process)
 // Process a value within the stack.
 void IntTaskData::ScanStackAddress(ScanAddress *process, PolyWord &val, StackSpace *stack)
 {
-    if (! val.IsDataPtr()) return;
-
-    MemSpace *space = gMem.LocalSpaceForAddress(val.AsStackAddr()-1);
-    if (space != 0)
+    // Return addresses and handler addresses are byte addresses within the code
+    // and may look like tagged values.  Check for the code area first.
+    // The -1 here is because we may have a zero-sized cell in the last
+    // word of a space.
+    MemSpace *space = gMem.SpaceForAddress(val.AsCodePtr()-1);
+    if (space == 0) return;
+    if (space->spaceType == ST_CODE)
+    {
+        PolyObject *obj = gMem.FindCodeObject(val.AsCodePtr());
+        // If it is actually an integer it might be outside a valid code object.
+        if (obj != 0)
+            process->ScanCodeAddressAt(obj, &val);
+    }
+    else if (space->spaceType == ST_LOCAL && val.IsDataPtr())
         val = process->ScanObjectAddress(val.AsObjPtr());
 }
 
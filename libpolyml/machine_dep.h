@@ -53,6 +53,10 @@ public:
         { ScanConstantsWithinCode(addr, addr, addr->Length(), process); } // Common case
 
     virtual void FlushInstructionCache(void *p, POLYUNSIGNED bytes) {}
+    // True if every store into a mutable object calls the write barrier.
+    // The minor GC can then use the card tables.  Only the interpreter does
+    // this.  The native x86 code does not mark cards.
+    virtual bool HasWriteBarrier(void) { return false; }
     virtual Architectures MachineArchitecture(void) = 0; 
 };
 
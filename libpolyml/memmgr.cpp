@@ -32,7 +32,16 @@
 #define ASSERT(x)
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #include <new>
+#include <algorithm>
 
 #include "globals.h"
 #include "memmgr.h"
@@ -43,6 +52,8 @@
 #include "diagnostics.h"
 #include "statistics.h"
 #include "processes.h"
+#include "machine_dep.h"
+#include "gc.h"
 
 // heap resizing policy option requested on command line
 unsigned heapsizingOption = 0;
@@ -60,7 +71,12 @@ MemSpace::MemSpace(): SpaceTree(true)
 MemSpace::~MemSpace()
 {
     if (isOwnSpace && bottom != 0)
-        osMemoryManager->Free(bottom, (char*)top - (char*)bottom);
+    {
+        if (gMem.InHeapRange(bottom))
+            gMem.FreeInHeapRange(bottom, (char*)top - (char*)bottom);
+        else
+            osMemoryManager->Free(bottom, (char*)top - (char*)bottom);
+    }
 }
 
 MarkableSpace::MarkableSpace(): spaceLock("Local space")
@@ -71,21 +87,35 @@ LocalMemSpace::LocalMemSpace()
 {
     spaceType = ST_LOCAL;
     upperAllocPtr = lowerAllocPtr = 0;
-    for (unsigned i = 0; i < NSTARTS; i++)
-        start[i] = 0;
-    start_index = 0;
+    slideSummary = 0;
     i_marked = m_marked = updated = 0;
+    weakObjectsOverflowed = false;
     allocationSpace = false;
+    largeObjectSpace = false;
+    survivorSpace = survivorEvacuate = false;
+    survivorAge = 0;
+    partialGCCards = false;
+    numaNode = 0;
+    hugePages = HUGE_PAGES_NONE;
+    recentlyUsed = 0;
 }
 
-bool LocalMemSpace::InitSpace(POLYUNSIGNED size, bool mut)
+bool LocalMemSpace::InitSpace(POLYUNSIGNED size, bool mut, bool useHugePages)
 {
     isMutable = mut;
 
-    // Allocate the heap itself.
+    // Allocate the heap itself.  With huge pages this is rounded up to a whole
+    // number of huge pages.  In heap range mode it is taken from the range if
+    // there is room and rounded up to a whole number of granules.
     size_t iSpace = size*sizeof(PolyWord);
-    bottom  =
-        (PolyWord*)osMemoryManager->Allocate(iSpace, PERMISSION_READ|PERMISSION_WRITE);
+    bottom = gMem.AllocateInHeapRange(iSpace, hugePages);
+    if (bottom == 0)
+    {
+        if (useHugePages)
+            bottom = (PolyWord*)osMemoryManager->AllocateHuge(iSpace, PERMISSION_READ|PERMISSION_WRITE, hugePages);
+        else
+            bottom = (PolyWord*)osMemoryManager->Allocate(iSpace, PERMISSION_READ|PERMISSION_WRITE);
+    }
 
     if (bottom == 0)
         return false;
@@ -104,20 +134,61 @@ bool LocalMemSpace::InitSpace(POLYUNSIGNED size, bool mut)
     allocationSpace = false;
 
     // Bitmap for the space.
-    return bitmap.Create(size);
+    if (! bitmap.Create(size, useHugePages))
+        return false;
+    if (! CreateCardTable())
+        return false;
+    // The space is empty so the card table is trivially up to date.
+    cards.valid = true;
+    return true;
+}
+
+// Create the card table if this is a mutable space.  The card table is
+// only useful if every store into a mutable object goes through the
+// write barrier.  That is currently true of the interpreter but the native
+// code generator does not mark cards so we continue to scan the whole of
+// the mutable areas in the minor GC.
+bool LocalMemSpace::CreateCardTable()
+{
+    if (! isMutable || ! machineDependent->HasWriteBarrier())
+        return true;
+    return cards.Create(bottom, top);
+}
+
+// Called after a GC when the layout of the space may have changed.
+// The mutable data now contains no references to the allocation area
+// so all the cards can be cleared.
+void LocalMemSpace::ResetCards()
+{
+    if (! cards.Created())
+        return;
+    cards.ClearAllDirty();
+    cards.SetObjects(bottom, lowerAllocPtr);
+    cards.SetObjects(upperAllocPtr, top);
+    cards.valid = true;
 }
 
-MemMgr::MemMgr(): allocLock("Memmgr alloc"), codeBitmapLock("Code bitmap")
+MemMgr::MemMgr(): allocLock("Memmgr alloc"), codeBitmapLock("Code bitmap"), heapRangeLock("Heap range")
 {
     nextIndex = 0;
     reservedSpace = 0;
     nextAllocator = 0;
+    numaNodes = 1;
+    hugePages = false;
     defaultSpaceSize = 0;
     spaceBeforeMinorGC = 0;
     spaceForHeap = 0;
     currentAllocSpace = currentHeapSize = 0;
+    currentLargeObjectSpace = largeObjectsSinceGC = 0;
     defaultSpaceSize = 1024 * 1024 / sizeof(PolyWord); // 1Mbyte segments.
     spaceTree = new SpaceTreeTree;
+    heapRangeBase = heapRangeSize = 0;
+    heapRangeShift = 0;
+    heapRangeHuge = false;
+    heapRangeTable = 0;
+    heapRangeTableSize = 0;
+    codeSpaceIndex = 0;
+    permanentCodeIndex = 0;
 }
 
 MemMgr::~MemMgr()
@@ -133,13 +204,33 @@ MemMgr::~MemMgr()
         delete(*i);
     for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i < cSpaces.end(); i++)
         delete(*i);
+    delete(codeSpaceIndex);
+    delete(permanentCodeIndex);
+    for (std::vector<CodeIndexTable*>::iterator i = retiredCodeIndexes.begin(); i < retiredCodeIndexes.end(); i++)
+        delete(*i);
+    // The local spaces in the heap range have been returned to it.
+    if (heapRangeSize != 0)
+    {
+        osMemoryManager->Free((void*)heapRangeBase, heapRangeSize);
+        osMemoryManager->Free(heapRangeTable, heapRangeTableSize);
+    }
 }
 
 // Create and initialise a new local space and add it to the table.
-LocalMemSpace* MemMgr::NewLocalSpace(POLYUNSIGNED size, bool mut)
+static const char *HugePagesName(unsigned hugePages)
+{
+    switch (hugePages)
+    {
+    case HUGE_PAGES_TRANSPARENT: return "transparent huge";
+    case HUGE_PAGES_EXPLICIT: return "explicit huge";
+    default: return "ordinary";
+    }
+}
+
+LocalMemSpace* MemMgr::NewLocalSpace(POLYUNSIGNED size, bool mut, unsigned node, bool largeObject)
 {
     try {
-        LocalMemSpace *space = new LocalMemSpace;
+        LocalMemSpace *space = largeObject ? new LargeObjectSpace : new LocalMemSpace;
         // Before trying to allocate the heap temporarily allocate the
         // reserved space.  This ensures that this much space will always
         // be available for C stacks and the C++ heap.
@@ -157,13 +248,25 @@ LocalMemSpace* MemMgr::NewLocalSpace(POLYUNSIGNED size, bool mut)
             }
         }
 
-        bool success = space->InitSpace(size, mut) && AddLocalSpace(space);
+        bool success = space->InitSpace(size, mut, hugePages) && AddLocalSpace(space);
         if (reservation != 0) osMemoryManager->Free(reservation, rSpace);
         if (success)
         {
+            // The pages have not yet been touched so binding the space now means
+            // they will be allocated on the node when they are first used.
+            if (numaNodes > 1)
+            {
+                space->numaNode = node;
+                if (! osMemoryManager->BindToNumaNode(space->bottom, (char*)space->top - (char*)space->bottom, node)
+                        && (debugOptions & DEBUG_MEMMGR))
+                    Log("MMGR: Unable to bind space %p to NUMA node %u\n", space, node);
+            }
             if (debugOptions & DEBUG_MEMMGR)
-                Log("MMGR: New local %smutable space %p, size=%luk words, bottom=%p, top=%p\n", mut ? "": "im",
-                    space, space->spaceSize()/1024, space->bottom, space->top);
+                Log("MMGR: New local %s space %p, size=%luk words, bottom=%p, top=%p, node=%u\n",
+                    space->spaceTypeString(), space, space->spaceSize()/1024, space->bottom, space->top, space->numaNode);
+            if (hugePages && (debugOptions & DEBUG_HEAPSIZE))
+                Log("Heap: Space %p (%luk words) using %s pages, bitmap using %s pages\n", space,
+                    space->spaceSize()/1024, HugePagesName(space->hugePages), HugePagesName(space->bitmap.HugePages()));
             currentHeapSize += space->spaceSize();
             globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
             return space;
@@ -183,9 +286,9 @@ LocalMemSpace* MemMgr::NewLocalSpace(POLYUNSIGNED size, bool mut)
 }
 
 // Create a local space for initial allocation.
-LocalMemSpace *MemMgr::CreateAllocationSpace(POLYUNSIGNED size)
+LocalMemSpace *MemMgr::CreateAllocationSpace(POLYUNSIGNED size, unsigned node)
 {
-    LocalMemSpace *result = NewLocalSpace(size, true);
+    LocalMemSpace *result = NewLocalSpace(size, true, node);
     if (result) 
     {
         result->allocationSpace = true;
@@ -286,6 +389,11 @@ void MemMgr::DeleteLocalSpace(std::vector<LocalMemSpace*>::iterator &iter)
     currentHeapSize -= sp->spaceSize();
     globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
     if (sp->allocationSpace) currentAllocSpace -= sp->spaceSize();
+    if (sp->largeObjectSpace)
+    {
+        currentLargeObjectSpace -= sp->spaceSize();
+        globalStats.setSize(PSS_LARGE_OBJECTS, currentLargeObjectSpace * sizeof(PolyWord));
+    }
     RemoveTree(sp);
     delete(sp);
     iter = lSpaces.erase(iter);
@@ -304,6 +412,56 @@ void MemMgr::RemoveEmptyLocals()
     }
 }
 
+// Don't bother releasing less than this.
+#define DECOMMIT_MINIMUM    (256*1024)
+
+// Called at the start of a major GC.  Minor GCs allocate upwards from the bottom of
+// the free space so lowerAllocPtr shows how much of it has been used since the last
+// major GC.  Pages that were used this time are likely to be needed again so they
+// are kept.  The amount kept decays over "decay" major GCs so that the space used
+// by a spike is eventually released.
+void MemMgr::RecordRecentlyUsed(unsigned decay)
+{
+    for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
+    {
+        LocalMemSpace *space = *i;
+        POLYUNSIGNED used = space->lowerAllocPtr - space->bottom;
+        space->recentlyUsed -= space->recentlyUsed / decay;
+        if (used > space->recentlyUsed)
+            space->recentlyUsed = used;
+    }
+}
+
+// Called at the end of a major GC to release the free pages that have not been
+// used recently.  Allocation spaces are excluded because the mutator will start
+// to fill them immediately.  Reserved huge pages can only be released in whole
+// huge pages and there's little benefit since they remain reserved.
+size_t MemMgr::DecommitFreeSpace()
+{
+    size_t released = 0;
+    for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
+    {
+        LocalMemSpace *space = *i;
+        if (space->allocationSpace || space->hugePages == HUGE_PAGES_EXPLICIT)
+            continue;
+        PolyWord *start = space->bottom + space->recentlyUsed;
+        if (start < space->lowerAllocPtr)
+            start = space->lowerAllocPtr;
+        if (start >= space->upperAllocPtr)
+            continue;
+        size_t bytes = (char*)space->upperAllocPtr - (char*)start;
+        if (bytes >= DECOMMIT_MINIMUM)
+        {
+            size_t freed = osMemoryManager->Decommit(start, bytes);
+            if (freed != 0 && (debugOptions & DEBUG_MEMMGR))
+                Log("MMGR: Released %zu bytes of free space in %s space %p\n",
+                    freed, space->spaceTypeString(), space);
+            released += freed;
+        }
+    }
+    return released;
+}
+
 // Create and initialise a new export space and add it to the table.
 PermanentMemSpace* MemMgr::NewExportSpace(POLYUNSIGNED size, bool mut, bool noOv, bool code)
 {
@@ -421,6 +579,8 @@ bool MemMgr::PromoteExportSpaces(unsigned hierarchy)
                         }
                         if (obj->IsCodeObject())
                             space->headerMap.SetBit(ptr-space->bottom);
+                        else if (obj->IsByteObject())
+                            space->AddFreeCell(ptr);
                         ptr += obj->Length() + 1;
                     }
                 }
@@ -435,7 +595,9 @@ bool MemMgr::PromoteExportSpaces(unsigned hierarchy)
                     space->isMutable = pSpace->isMutable;
                     space->isOwnSpace = true;
                     space->isCode = false;
-                    if (! space->bitmap.Create(space->top-space->bottom) || ! AddLocalSpace(space))
+                    // The card table will be set up by the next GC.
+                    if (! space->bitmap.Create(space->top-space->bottom, hugePages) || ! space->CreateCardTable() ||
+                            ! AddLocalSpace(space))
                     {
                         if (debugOptions & DEBUG_MEMMGR)
                             Log("MMGR: Unable to convert saved state space %p into local space\n", pSpace);
@@ -468,6 +630,14 @@ bool MemMgr::PromoteExportSpaces(unsigned hierarchy)
     }
     eSpaces.clear();
 
+    // Spaces may have been converted into code spaces or removed.
+    if (permanentCodeIndex != 0)
+    {
+        RetireCodeIndex(permanentCodeIndex);
+        permanentCodeIndex = 0;
+    }
+    RebuildCodeIndex();
+
     return true;
 }
 
@@ -510,40 +680,124 @@ void MemMgr::FillUnusedSpace(PolyWord *base, POLYUNSIGNED words)
     }
 }
 
-// Allocate an area of the heap of at least minWords and at most maxWords.
-// This is used both when allocating single objects (when minWords and maxWords
-// are the same) and when allocating heap segments.  If there is insufficient
-// space to satisfy the minimum it will return 0.
-PolyWord *MemMgr::AllocHeapSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation)
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+#   include <intrin.h>
+#endif
+
+#if (! defined(_MSC_VER) && ! defined(__GNUC__))
+// Fallback if we have no atomic operations.
+static PLock allocPtrLock("Alloc pointer");
+#endif
+
+// Update the allocation pointer of an allocation space.  ML threads allocate
+// in the same space without holding allocLock so this must be atomic.
+static inline bool CompareAndSwapAllocPtr(PolyWord **p, PolyWord *oldVal, PolyWord *newVal)
 {
-    PLocker locker(&allocLock);
-    // We try to distribute the allocations between the memory spaces
-    // so that at the next GC we don't have all the most recent cells in
-    // one space.  The most recent cells will be more likely to survive a
-    // GC so distibuting them improves the load balance for a multi-thread GC.
-    nextAllocator++;
-    if (nextAllocator > gMem.lSpaces.size()) nextAllocator = 0;
+#if defined(_MSC_VER)
+    return InterlockedCompareExchangePointer((PVOID volatile*)p, newVal, oldVal) == oldVal;
+#elif defined(__GNUC__)
+    return __sync_bool_compare_and_swap(p, oldVal, newVal);
+#else
+    PLocker lock(&allocPtrLock);
+    if (*p != oldVal) return false;
+    *p = newVal;
+    return true;
+#endif
+}
+
+// Allocate between minWords and maxWords in an allocation space.  Returns zero
+// if there is not enough space.
+PolyWord *MemMgr::AllocInSpace(LocalMemSpace *space, POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation)
+{
+    while (true)
+    {
+        PolyWord *result = space->lowerAllocPtr;
+        POLYUNSIGNED available = space->upperAllocPtr - result;
+        if (available == 0 || available < minWords)
+            return 0;
+        POLYUNSIGNED allocated = available < maxWords ? available : maxWords;
+        if (! doAllocation || CompareAndSwapAllocPtr(&space->lowerAllocPtr, result, result+allocated))
+        {
+            maxWords = allocated;
+            return result;
+        }
+        // Another thread allocated in the space.  Try again.
+    }
+}
+
+// The node of the processor the current thread is running on.
+unsigned MemMgr::CurrentNumaNode() const
+{
+    if (numaNodes <= 1)
+        return 0;
+    unsigned node = osMemoryManager->CurrentNumaNode();
+    return node < numaNodes ? node : 0;
+}
 
+// Allocate a segment for a thread.  Usually this comes from the same space as the
+// previous segment.  The thread clears "preferred" at each GC.  Spaces are only
+// deleted during a GC or if they are empty so it remains valid until then.
+// In NUMA mode the preferred space is only used if it is on the node the thread
+// is currently running on.
+PolyWord *MemMgr::AllocHeapSegment(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, LocalMemSpace *&preferred)
+{
+    if (preferred != 0 && (numaNodes <= 1 || preferred->numaNode == CurrentNumaNode()))
+    {
+        PolyWord *result = AllocInSpace(preferred, minWords, maxWords, true);
+        if (result != 0)
+            return result;
+    }
+    return AllocHeapSpace(minWords, maxWords, true, &preferred);
+}
+
+// Look for an existing allocation space with enough room.  Unless anyNode is
+// true only spaces on the given node are considered.  Must be called with allocLock held.
+PolyWord *MemMgr::AllocInExistingSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation,
+                                       LocalMemSpace **allocSpace, bool anyNode, unsigned node)
+{
     unsigned j = nextAllocator;
     for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
     {
         if (j >= gMem.lSpaces.size()) j = 0;
         LocalMemSpace *space = gMem.lSpaces[j++];
-        if (space->allocationSpace)
+        if (space->allocationSpace && (anyNode || space->numaNode == node))
         {
-            POLYUNSIGNED available = space->freeSpace();
-            if (available > 0 && available >= minWords)
+            PolyWord *result = AllocInSpace(space, minWords, maxWords, doAllocation);
+            if (result != 0)
             {
-                // Reduce the maximum value if we had less than that.
-                if (available < maxWords)
-                    maxWords = available;
-                PolyWord *result = space->lowerAllocPtr; // Return the address.
-                if (doAllocation)
-                    space->lowerAllocPtr += maxWords; // Allocate it.
+                if (allocSpace != 0)
+                    *allocSpace = space;
                 return result;
             }
         }
     }
+    return 0;
+}
+
+// Allocate an area of the heap of at least minWords and at most maxWords.
+// This is used both when allocating single objects (when minWords and maxWords
+// are the same) and when allocating heap segments.  If there is insufficient
+// space to satisfy the minimum it will return 0.  If allocSpace is not zero
+// it is set to the space that was used.
+PolyWord *MemMgr::AllocHeapSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation,
+                                 LocalMemSpace **allocSpace)
+{
+    PLocker locker(&allocLock);
+    // We try to distribute the allocations between the memory spaces
+    // so that at the next GC we don't have all the most recent cells in
+    // one space.  The most recent cells will be more likely to survive a
+    // GC so distibuting them improves the load balance for a multi-thread GC.
+    nextAllocator++;
+    if (nextAllocator > gMem.lSpaces.size()) nextAllocator = 0;
+
+    // In NUMA mode we first look for a space on this node.  If there isn't one
+    // we would rather create a new one than use a space on a different node.
+    const bool numaMode = numaNodes > 1;
+    const unsigned node = CurrentNumaNode();
+    PolyWord *result = AllocInExistingSpace(minWords, maxWords, doAllocation, allocSpace, ! numaMode, node);
+    if (result != 0)
+        return result;
+
     // There isn't space in the existing areas - can we create a new area?
     // The reason we don't have enough space could simply be that we want to
     // allocate an object larger than the default space size.  Try deleting
@@ -559,21 +813,59 @@ PolyWord *MemMgr::AllocHeapSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords,
         // we have a new GC very shortly.
         POLYUNSIGNED spaceSize = defaultSpaceSize;
         if (minWords > spaceSize) spaceSize = minWords; // If we really want a large space.
-        LocalMemSpace *space = CreateAllocationSpace(spaceSize);
-        if (space == 0) return 0; // Can't allocate it
-        // Allocate our space in this new area.
-        POLYUNSIGNED available = space->freeSpace();
-        ASSERT(available >= minWords);
-        if (available < maxWords)
-            maxWords = available;
-        PolyWord *result = space->lowerAllocPtr; // Return the address.
-        if (doAllocation)
-            space->lowerAllocPtr += maxWords; // Allocate it.
-        return result;
+        LocalMemSpace *space = CreateAllocationSpace(spaceSize, node);
+        if (space != 0)
+        {
+            // Allocate our space in this new area.
+            ASSERT(space->freeSpace() >= minWords);
+            result = AllocInSpace(space, minWords, maxWords, doAllocation);
+            if (result != 0 && allocSpace != 0)
+                *allocSpace = space;
+            return result;
+        }
+        else if (! numaMode)
+            return 0; // Can't allocate it
     }
+    // Use a space on another node rather than running a GC.
+    if (numaMode)
+        return AllocInExistingSpace(minWords, maxWords, doAllocation, allocSpace, true, node);
     return 0; // There isn't space even for the minimum.
 }
 
+// Allocate a large object in a space of its own.  Large objects count against
+// the allocation area in the same way as allocations in the allocation spaces so
+// that a minor GC is triggered when it is exhausted.  The first large object after
+// a GC is always allowed so that we can allocate objects larger than the area.
+PolyWord *MemMgr::AllocLargeObject(POLYUNSIGNED words)
+{
+    PLocker locker(&allocLock);
+    if (largeObjectsSinceGC != 0 && currentAllocSpace + largeObjectsSinceGC >= spaceBeforeMinorGC)
+        return 0;
+
+    LocalMemSpace *space = NewLocalSpace(words, true, CurrentNumaNode(), true);
+    if (space == 0)
+        return 0;
+    // The object goes at the top.  Any space below it left over by rounding
+    // the size is never used.
+    space->upperAllocPtr = space->top - words;
+    // The new object may contain references to the allocation spaces so the
+    // whole space must be scanned by the next minor GC.
+    space->cards.valid = false;
+    largeObjectsSinceGC += words;
+    if (concurrentMarking)
+        ConcurrentMarkAllocated((PolyObject*)(space->upperAllocPtr+1));
+    currentLargeObjectSpace += space->spaceSize();
+    globalStats.setSize(PSS_LARGE_OBJECTS, currentLargeObjectSpace * sizeof(PolyWord));
+    return space->upperAllocPtr;
+}
+
+// Threads take blocks of CODE_CACHE_SIZE words for code objects of less than
+// CODE_CACHE_MAX_OBJECT words.  New code spaces are at least CODE_SPACE_MIN_SIZE
+// words so that they can provide several blocks.
+#define CODE_CACHE_SIZE         512
+#define CODE_CACHE_MAX_OBJECT   (CODE_CACHE_SIZE/4)
+#define CODE_SPACE_MIN_SIZE     (16*CODE_CACHE_SIZE)
+
 CodeSpace::CodeSpace(PolyWord *start, POLYUNSIGNED spaceSize)
 {
     isOwnSpace = true;
@@ -583,8 +875,85 @@ CodeSpace::CodeSpace(PolyWord *start, POLYUNSIGNED spaceSize)
     isOwnSpace = true;
     isCode = true;
     spaceType = ST_CODE;
-    largestFree = spaceSize-1;
-    firstFree = start;
+    evacuating = false;
+    ClearFreeLists();
+}
+
+unsigned CodeSpace::FreeListFor(POLYUNSIGNED length)
+{
+    unsigned n = 0;
+    while (length > 1 && n < CODE_FREE_LISTS-1) { length >>= 1; n++; }
+    return n;
+}
+
+void CodeSpace::ClearFreeLists()
+{
+    for (unsigned i = 0; i < CODE_FREE_LISTS; i++)
+        freeLists[i] = 0;
+    freeWords = 0;
+    freeCells = 0;
+}
+
+void CodeSpace::AddFreeCell(PolyWord *pt)
+{
+    PolyObject *obj = (PolyObject*)(pt+1);
+    ASSERT(obj->IsByteObject());
+    POLYUNSIGNED length = obj->Length();
+    // A cell with no data words has nowhere to hold the link.  It is merged
+    // with its neighbours by the next major GC.
+    if (length == 0) return;
+    unsigned n = FreeListFor(length);
+    NextFree(pt) = freeLists[n];
+    freeLists[n] = pt;
+    freeWords += length + 1;
+    freeCells++;
+}
+
+void CodeSpace::AddFreeCells(PolyWord *pt, POLYUNSIGNED words)
+{
+    PolyWord *end = pt + words;
+    while (pt < end)
+    {
+        AddFreeCell(pt);
+        pt += ((PolyObject*)(pt+1))->Length() + 1;
+    }
+}
+
+PolyWord *CodeSpace::TakeFreeCell(POLYUNSIGNED words)
+{
+    // Cells in the first list searched may be too small.  In the following lists,
+    // apart from the last, the first cell is always large enough.
+    for (unsigned n = FreeListFor(words); n < CODE_FREE_LISTS; n++)
+    {
+        for (PolyWord **prev = &freeLists[n]; *prev != 0; prev = &NextFree(*prev))
+        {
+            PolyWord *pt = *prev;
+            POLYUNSIGNED length = ((PolyObject*)(pt+1))->Length();
+            if (length >= words)
+            {
+                *prev = NextFree(pt);
+                freeWords -= length + 1;
+                freeCells--;
+                return pt;
+            }
+        }
+    }
+    return 0;
+}
+
+POLYUNSIGNED CodeSpace::LargestFree() const
+{
+    for (unsigned n = CODE_FREE_LISTS; n > 0; n--)
+    {
+        POLYUNSIGNED largest = 0;
+        for (PolyWord *pt = freeLists[n-1]; pt != 0; pt = NextFree(pt))
+        {
+            POLYUNSIGNED length = ((PolyObject*)(pt+1))->Length();
+            if (length > largest) largest = length;
+        }
+        if (largest != 0) return largest;
+    }
+    return 0;
 }
 
 CodeSpace *MemMgr::NewCodeSpace(POLYUNSIGNED size)
@@ -613,7 +982,11 @@ CodeSpace *MemMgr::NewCodeSpace(POLYUNSIGNED size)
             else if (debugOptions & DEBUG_MEMMGR)
                 Log("MMGR: New code space %p allocated at %p size %lu\n", allocSpace, allocSpace->bottom, allocSpace->spaceSize());
             // Put in a byte cell to mark the area as unallocated.
-            FillUnusedSpace(allocSpace->bottom, allocSpace->spaceSize());
+            if (allocSpace != 0)
+            {
+                FillUnusedSpace(allocSpace->bottom, allocSpace->spaceSize());
+                allocSpace->AddFreeCells(allocSpace->bottom, allocSpace->spaceSize());
+            }
         }
         catch (std::bad_alloc&)
         {
@@ -627,72 +1000,136 @@ CodeSpace *MemMgr::NewCodeSpace(POLYUNSIGNED size)
     return allocSpace;
 }
 
+// Turn the free cell at pt into a code object and copy initCell into it.
+PolyObject *MemMgr::InitCodeObject(CodeSpace *space, PolyWord *pt, PolyObject *initCell)
+{
+    POLYUNSIGNED requiredSize = initCell->Length();
+    PolyObject *obj = (PolyObject*)(pt+1);
+    space->isMutable = true; // Set this - it ensures the area is scanned on GC.
+    // Threads allocating from their own blocks may set bits in the same word.
+    space->headerMap.SetBitAtomic(pt-space->bottom); // Set the "header" bit
+    // Set the length word of the code area and copy the byte cell in.
+    obj->SetLengthWord(requiredSize,  F_CODE_OBJ|F_MUTABLE_BIT);
+    memcpy(obj, initCell, requiredSize * sizeof(PolyWord));
+    if (concurrentMarking)
+        ConcurrentMarkAllocated(obj);
+    return obj;
+}
+
 // Allocate memory for a piece of code.  This needs to be both mutable and executable,
 // at least for native code.  The interpreted version need not (should not?) make the
 // area executable.  It will not be executed until the mutable bit has been cleared.
-// Once code is allocated it is not GCed or moved.
+// Once code is allocated it is only moved if code compaction is enabled.
 // initCell is a byte cell that is copied into the new code area.
-PolyObject*MemMgr::AllocCodeSpace(PolyObject *initCell)
+PolyObject*MemMgr::AllocCodeSpace(TaskData *taskData, PolyObject *initCell)
 {
-    PLocker locker(&codeSpaceLock);
-    // Search the code spaces until we find a free area big enough.
-    size_t i = 0;
     POLYUNSIGNED requiredSize = initCell->Length();
-    while (true)
+    bool useCache = requiredSize < CODE_CACHE_MAX_OBJECT;
+    // Try the thread's own block first.  The rest of the block is always a
+    // valid free cell so no other thread or the GC can see a partial object.
+    if (useCache && taskData->codeCachePtr != 0 &&
+        taskData->codeCachePtr + requiredSize + 1 <= taskData->codeCacheTop)
     {
-        if (i != cSpaces.size())
+        PolyWord *pt = taskData->codeCachePtr;
+        taskData->codeCachePtr = pt + requiredSize + 1;
+        if (taskData->codeCachePtr < taskData->codeCacheTop)
+            FillUnusedSpace(taskData->codeCachePtr, taskData->codeCacheTop - taskData->codeCachePtr);
+        return InitCodeObject(taskData->codeCacheSpace, pt, initCell);
+    }
+
+    PLocker locker(&codeSpaceLock);
+    if (useCache)
+    {
+        // Return the rest of the old block and take a new one if there is a free
+        // cell large enough.  If not allocate this object directly and only create
+        // a new space if it will not fit anywhere.
+        ReleaseCodeCacheLocked(taskData);
+        for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i != cSpaces.end(); i++)
         {
-            CodeSpace *space = cSpaces[i];
-            if (space->largestFree >= requiredSize)
+            CodeSpace *space = *i;
+            PolyWord *pt = space->TakeFreeCell(CODE_CACHE_SIZE);
+            if (pt != 0)
             {
-                POLYUNSIGNED actualLargest = 0;
-                while (space->firstFree < space->top)
+                POLYUNSIGNED length = ((PolyObject*)(pt+1))->Length();
+                if (length > CODE_CACHE_SIZE)
                 {
-                    PolyObject *obj = (PolyObject*)(space->firstFree+1);
-                    // Skip over allocated areas or free areas that are too small.
-                    if (obj->IsCodeObject() || obj->Length() < 8)
-                        space->firstFree += obj->Length()+1;
-                    else break;
+                    // Take only CODE_CACHE_SIZE words and return the rest.
+                    PolyWord *next = pt + CODE_CACHE_SIZE + 1;
+                    FillUnusedSpace(next, length - CODE_CACHE_SIZE);
+                    space->AddFreeCells(next, length - CODE_CACHE_SIZE);
                 }
-                PolyWord *pt = space->firstFree;
-                while (pt < space->top)
-                {
-                    PolyObject *obj = (PolyObject*)(pt+1);
-                    POLYUNSIGNED length = obj->Length();
-                    if (obj->IsByteObject())
-                    {
-                        if (length >= requiredSize)
-                        {
-                            // Free and large enough
-                            PolyWord *next = pt+requiredSize+1;
-                            if (requiredSize < length)
-                                FillUnusedSpace(next, length-requiredSize);
-                            space->isMutable = true; // Set this - it ensures the area is scanned on GC.
-                            space->headerMap.SetBit(pt-space->bottom); // Set the "header" bit
-                            // Set the length word of the code area and copy the byte cell in.
-                            // The code bit must be set before the lock is released to ensure
-                            // another thread doesn't reuse this.
-                            obj->SetLengthWord(requiredSize,  F_CODE_OBJ|F_MUTABLE_BIT);
-                            memcpy(obj, initCell, requiredSize * sizeof(PolyWord));
-                            return obj;
-                        }
-                        else if (length >= actualLargest) actualLargest = length+1;
-                    }
-                    pt += length+1;
-                }
-                // Reached the end without finding what we wanted.  Update the largest size.
-                space->largestFree = actualLargest;
+                taskData->codeCacheSpace = space;
+                taskData->codeCachePtr = pt + requiredSize + 1;
+                taskData->codeCacheTop = pt + CODE_CACHE_SIZE + 1;
+                FillUnusedSpace(taskData->codeCachePtr, taskData->codeCacheTop - taskData->codeCachePtr);
+                return InitCodeObject(space, pt, initCell);
             }
-            i++; // Next area
         }
-        else
+    }
+
+    // Search the code spaces until we find a free area big enough.
+    while (true)
+    {
+        for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i != cSpaces.end(); i++)
         {
-            // Allocate a new area and add it at the end of the table.
-            CodeSpace *allocSpace = NewCodeSpace(requiredSize + 1);
-            if (allocSpace == 0)
-                return 0; // Try a GC.
+            CodeSpace *space = *i;
+            PolyWord *pt = space->TakeFreeCell(requiredSize);
+            if (pt != 0)
+            {
+                POLYUNSIGNED length = ((PolyObject*)(pt+1))->Length();
+                if (requiredSize < length)
+                {
+                    PolyWord *next = pt+requiredSize+1;
+                    FillUnusedSpace(next, length-requiredSize);
+                    space->AddFreeCells(next, length-requiredSize);
+                }
+                // The code bit is set before the lock is released.
+                return InitCodeObject(space, pt, initCell);
+            }
         }
+        // Allocate a new area and add it at the end of the table.  Make it large
+        // enough to provide blocks for the threads.
+        POLYUNSIGNED newSize = requiredSize + 1;
+        if (newSize < CODE_SPACE_MIN_SIZE) newSize = CODE_SPACE_MIN_SIZE;
+        CodeSpace *allocSpace = NewCodeSpace(newSize);
+        if (allocSpace == 0)
+            return 0; // Try a GC.
+        UpdateCodeStatistics();
+    }
+}
+
+void MemMgr::ReleaseCodeCache(TaskData *taskData)
+{
+    if (taskData->codeCachePtr == 0) return;
+    PLocker locker(&codeSpaceLock);
+    ReleaseCodeCacheLocked(taskData);
+}
+
+void MemMgr::ReleaseCodeCacheLocked(TaskData *taskData)
+{
+    if (taskData->codeCachePtr != 0 && taskData->codeCachePtr < taskData->codeCacheTop)
+        taskData->codeCacheSpace->AddFreeCells(taskData->codeCachePtr, taskData->codeCacheTop - taskData->codeCachePtr);
+    taskData->codeCacheSpace = 0;
+    taskData->codeCachePtr = 0;
+    taskData->codeCacheTop = 0;
+}
+
+void MemMgr::UpdateCodeStatistics()
+{
+    POLYUNSIGNED total = 0, free = 0, largest = 0, cells = 0;
+    for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i != cSpaces.end(); i++)
+    {
+        CodeSpace *space = *i;
+        total += space->spaceSize();
+        free += space->freeWords;
+        cells += space->freeCells;
+        POLYUNSIGNED l = space->LargestFree();
+        if (l > largest) largest = l;
     }
+    globalStats.setSize(PSS_CODE_SPACE, total * sizeof(PolyWord));
+    globalStats.setSize(PSS_CODE_FREE, free * sizeof(PolyWord));
+    globalStats.setSize(PSS_CODE_LARGEST_FREE, largest * sizeof(PolyWord));
+    globalStats.setSize(PSC_CODE_FREE_CELLS, cells);
 }
 
 // Remove code areas that are completely empty.  This is probably better than waiting to reuse them.
@@ -715,6 +1152,7 @@ void MemMgr::RemoveEmptyCodeAreas()
         }
         else i++;
     }
+    UpdateCodeStatistics();
 }
 
 // Add a code space to the tables.  Used both for newly compiled code and also demoted saved spaces.
@@ -736,6 +1174,8 @@ bool MemMgr::AddCodeSpace(CodeSpace *space)
 // loop trying to allocate, failing and garbage-collecting again.
 bool MemMgr::CheckForAllocation(POLYUNSIGNED words)
 {
+    if (IsLargeObject(words))
+        return largeObjectsSinceGC == 0 || currentAllocSpace + largeObjectsSinceGC < spaceBeforeMinorGC;
     POLYUNSIGNED allocated = 0;
     return AllocHeapSpace(words, allocated, false) != 0;
 }
@@ -918,13 +1358,123 @@ void MemMgr::AddTree(MemSpace *space, PolyWord *startS, PolyWord *endS)
 {
     // It isn't clear we need to lock here but it's probably sensible.
     PLocker lock(&spaceTreeLock);
-    AddTreeRange(&spaceTree, space, (uintptr_t)startS, (uintptr_t)endS);
+    if (InHeapRange(startS))
+    {
+        // Spaces in the heap range cover whole granules.
+        uintptr_t start = ((uintptr_t)startS - heapRangeBase) >> heapRangeShift;
+        uintptr_t end = ((uintptr_t)endS - heapRangeBase) >> heapRangeShift;
+        ASSERT(end <= (heapRangeSize >> heapRangeShift));
+        for (uintptr_t g = start; g < end; g++)
+        {
+            ASSERT(heapRangeTable[g] == 0);
+            heapRangeTable[g] = space;
+        }
+    }
+    else AddTreeRange(&spaceTree, space, (uintptr_t)startS, (uintptr_t)endS);
 }
 
 void MemMgr::RemoveTree(MemSpace *space, PolyWord *startS, PolyWord *endS)
 {
     PLocker lock(&spaceTreeLock);
-    RemoveTreeRange(&spaceTree, space, (uintptr_t)startS, (uintptr_t)endS);
+    if (InHeapRange(startS))
+    {
+        uintptr_t start = ((uintptr_t)startS - heapRangeBase) >> heapRangeShift;
+        uintptr_t end = ((uintptr_t)endS - heapRangeBase) >> heapRangeShift;
+        for (uintptr_t g = start; g < end; g++)
+        {
+            ASSERT(heapRangeTable[g] == space || heapRangeTable[g] == 0 /* Recovery only */);
+            heapRangeTable[g] = 0;
+        }
+    }
+    else RemoveTreeRange(&spaceTree, space, (uintptr_t)startS, (uintptr_t)endS);
+}
+
+// Reserve the heap range.  This must be called before any local spaces are created.
+bool MemMgr::ReserveHeapRange(uintptr_t bytes)
+{
+    // The granule is the default space size so that ordinary spaces are not rounded
+    // up.  With huge pages it must be at least a huge page so that each space is aligned.
+    size_t granule = defaultSpaceSize*sizeof(PolyWord);
+    if (hugePages && granule < HUGE_PAGE_SIZE)
+        granule = HUGE_PAGE_SIZE;
+    unsigned shift = 0;
+    while (((size_t)1 << shift) < granule) shift++;
+
+    size_t rangeSize = bytes;
+    void *base = osMemoryManager->Reserve(rangeSize, hugePages);
+    if (base == 0)
+    {
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: Unable to reserve a heap range of %luk bytes\n", (unsigned long)(bytes/1024));
+        return false;
+    }
+    size_t granules = rangeSize >> shift;
+    size_t tableSize = granules * sizeof(MemSpace*);
+    MemSpace **table = (MemSpace**)osMemoryManager->Allocate(tableSize, PERMISSION_READ|PERMISSION_WRITE);
+    if (table == 0 || ! heapRangeMap.Create(granules))
+    {
+        if (table != 0) osMemoryManager->Free(table, tableSize);
+        osMemoryManager->Free(base, rangeSize);
+        return false;
+    }
+    heapRangeTable = table;
+    heapRangeTableSize = tableSize;
+    heapRangeShift = shift;
+    heapRangeHuge = hugePages;
+    heapRangeBase = (uintptr_t)base;
+    heapRangeSize = granules << shift;
+    if (debugOptions & DEBUG_MEMMGR)
+        Log("MMGR: Heap range %p, size=%luk bytes, %lu granules of %luk bytes\n", base,
+            (unsigned long)(heapRangeSize/1024), (unsigned long)granules, (unsigned long)(granule/1024));
+    return true;
+}
+
+// Find a free run of granules for a local space and commit it.
+PolyWord *MemMgr::AllocateInHeapRange(size_t &bytes, unsigned &hugePageType)
+{
+    if (heapRangeSize == 0)
+        return 0;
+    POLYUNSIGNED granules = (POLYUNSIGNED)((bytes + ((size_t)1 << heapRangeShift) - 1) >> heapRangeShift);
+    POLYUNSIGNED total = (POLYUNSIGNED)(heapRangeSize >> heapRangeShift);
+    PLocker lock(&heapRangeLock);
+    // First fit from the bottom of the range.  Bitmap::FindFree searches down
+    // from the top and can never return bit zero.
+    POLYUNSIGNED g = heapRangeMap.FindNextClear(0, total);
+    while (g < total)
+    {
+        POLYUNSIGNED used = heapRangeMap.FindNextSet(g, total);
+        if (used - g >= granules)
+            break;
+        g = heapRangeMap.FindNextClear(used, total);
+    }
+    if (g == total)
+    {
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: No room in the heap range for %luk bytes\n", (unsigned long)(bytes/1024));
+        return 0;
+    }
+    size_t rangeBytes = (size_t)granules << heapRangeShift;
+    void *result = (void*)(heapRangeBase + ((uintptr_t)g << heapRangeShift));
+    if (! osMemoryManager->Commit(result, rangeBytes, PERMISSION_READ|PERMISSION_WRITE))
+        return 0;
+    heapRangeMap.SetBits(g, granules);
+    bytes = rangeBytes;
+    hugePageType = heapRangeHuge ? HUGE_PAGES_TRANSPARENT : HUGE_PAGES_NONE;
+    return (PolyWord*)result;
+}
+
+void MemMgr::FreeInHeapRange(void *p, size_t bytes)
+{
+    POLYUNSIGNED g = (POLYUNSIGNED)(((uintptr_t)p - heapRangeBase) >> heapRangeShift);
+    POLYUNSIGNED granules = (POLYUNSIGNED)(bytes >> heapRangeShift);
+    PLocker lock(&heapRangeLock);
+    // If the pages can't be released leave the granules allocated since a new
+    // space expects its memory to be zero.
+    if (! osMemoryManager->Uncommit(p, bytes))
+        return;
+    // Bitmap::ClearBits may clear whole words so clear them individually.
+    for (POLYUNSIGNED i = 0; i < granules; i++)
+        heapRangeMap.ClearBit(g+i);
 }
 
 
@@ -1071,7 +1621,16 @@ void MemMgr::ReportHeapSizes(const char *phase)
             }
         }
     }
-    Log("Heap: Code area: total "); LogSize(cTotal); Log(" occupied: "); LogSize(cOccupied); Log("\n");
+    Log("Heap: Code area: total "); LogSize(cTotal); Log(" occupied: "); LogSize(cOccupied);
+    POLYUNSIGNED cFree = 0, cCells = 0, cLargest = 0;
+    for (std::vector<CodeSpace*>::iterator c = cSpaces.begin(); c != cSpaces.end(); c++)
+    {
+        cFree += (*c)->freeWords;
+        cCells += (*c)->freeCells;
+        POLYUNSIGNED l = (*c)->LargestFree();
+        if (l > cLargest) cLargest = l;
+    }
+    Log(" free: "); LogSize(cFree); Log(" in %" POLYUFMT " cells, largest ", cCells); LogSize(cLargest); Log("\n");
     POLYUNSIGNED stackSpace = 0;
     for (std::vector<StackSpace*>::iterator s = sSpaces.begin(); s != sSpaces.end(); s++)
     {
@@ -1082,8 +1641,222 @@ void MemMgr::ReportHeapSizes(const char *phase)
 
 // Profiling - Find a code object or return zero if not found.
 // This can be called on a "user" thread.
+PolyObject *CodeIndexTable::Find(const PolyWord *addr) const
+{
+    // Find the last entry that starts at or before addr.
+    POLYUNSIGNED lo = 0, hi = count;
+    while (lo < hi)
+    {
+        POLYUNSIGNED mid = lo + (hi - lo) / 2;
+        if ((PolyWord*)entries[mid].obj <= addr)
+            lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo != 0 && addr < entries[lo-1].end)
+        return entries[lo-1].obj;
+    unsigned n = recentCount;
+    for (unsigned i = 0; i < n; i++)
+    {
+        if ((PolyWord*)recent[i].obj <= addr && addr < recent[i].end)
+            return recent[i].obj;
+    }
+    return 0;
+}
+
+// Make sure a table or entry is complete before FindCodeObject can see it.
+static inline void CodeIndexFence(void)
+{
+#if defined(_MSC_VER)
+    MemoryBarrier();
+#elif defined(__GNUC__)
+    __sync_synchronize();
+#endif
+}
+
+static int codeIndexCompare(const void *a, const void *b)
+{
+    PolyObject *x = ((const CodeIndexTable::Entry*)a)->obj;
+    PolyObject *y = ((const CodeIndexTable::Entry*)b)->obj;
+    if (x < y) return -1;
+    if (x > y) return 1;
+    return 0;
+}
+
+// Make a table from the entries, which need not be sorted.  Returns zero if
+// there is insufficient memory.
+CodeIndexTable *MemMgr::MakeCodeIndex(std::vector<CodeIndexTable::Entry> &entries)
+{
+    CodeIndexTable *table = new(std::nothrow) CodeIndexTable;
+    if (table == 0) return 0;
+    if (! entries.empty())
+    {
+        table->entries = new(std::nothrow) CodeIndexTable::Entry[entries.size()];
+        if (table->entries == 0)
+        {
+            delete table;
+            return 0;
+        }
+        qsort(&entries[0], entries.size(), sizeof(CodeIndexTable::Entry), codeIndexCompare);
+        memcpy(table->entries, &entries[0], entries.size() * sizeof(CodeIndexTable::Entry));
+        table->count = entries.size();
+    }
+    return table;
+}
+
+static bool codeIndexLess(const CodeIndexTable::Entry &a, const CodeIndexTable::Entry &b)
+{
+    return a.obj < b.obj;
+}
+
+// Make a new table from a table whose array of recent objects is full.  The
+// entries are already sorted so only the recent objects need to be sorted and
+// the two can then be merged.  Returns zero if there is insufficient memory.
+CodeIndexTable *MemMgr::MergeCodeIndex(const CodeIndexTable *table)
+{
+    CodeIndexTable *newTable = new(std::nothrow) CodeIndexTable;
+    if (newTable == 0) return 0;
+    newTable->entries = new(std::nothrow) CodeIndexTable::Entry[table->count + CODE_INDEX_RECENT];
+    if (newTable->entries == 0)
+    {
+        delete newTable;
+        return 0;
+    }
+    CodeIndexTable::Entry recent[CODE_INDEX_RECENT];
+    memcpy(recent, table->recent, sizeof(recent));
+    qsort(recent, CODE_INDEX_RECENT, sizeof(CodeIndexTable::Entry), codeIndexCompare);
+    std::merge(table->entries, table->entries + table->count, recent, recent + CODE_INDEX_RECENT,
+        newTable->entries, codeIndexLess);
+    newTable->count = table->count + CODE_INDEX_RECENT;
+    return newTable;
+}
+
+// A search may still be using a table that has been replaced so it is not
+// deleted until the next rebuild, which happens with the ML threads stopped.
+void MemMgr::RetireCodeIndex(CodeIndexTable *table)
+{
+    if (table == 0) return;
+    try {
+        retiredCodeIndexes.push_back(table);
+    }
+    catch (std::bad_alloc&) {} // Leave it allocated.
+}
+
+// Add the immutable code objects from a space to the entries.
+static void AddCodeEntries(std::vector<CodeIndexTable::Entry> &entries, PolyWord *bottom, PolyWord *top)
+{
+    for (PolyWord *pt = bottom; pt < top; )
+    {
+        PolyObject *obj = (PolyObject*)(pt+1);
+        if (obj->ContainsForwardingPtr())
+        {
+            // This can happen while a state is being saved.  Leave it to the bitmap.
+            pt += obj->FollowForwardingChain()->Length() + 1;
+            continue;
+        }
+        POLYUNSIGNED L = obj->LengthWord();
+        POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+        if (OBJ_IS_CODE_OBJECT(L) && ! OBJ_IS_MUTABLE_OBJECT(L))
+        {
+            CodeIndexTable::Entry e = { obj, pt + 1 + length };
+            entries.push_back(e);
+        }
+        pt += length + 1;
+    }
+}
+
+void MemMgr::RebuildCodeIndex()
+{
+    for (std::vector<CodeIndexTable*>::iterator i = retiredCodeIndexes.begin(); i < retiredCodeIndexes.end(); i++)
+        delete(*i);
+    retiredCodeIndexes.clear();
+
+    CodeIndexTable *table = 0;
+    try {
+        std::vector<CodeIndexTable::Entry> entries;
+        for (std::vector<CodeSpace *>::iterator i = cSpaces.begin(); i < cSpaces.end(); i++)
+            AddCodeEntries(entries, (*i)->bottom, (*i)->top);
+        table = MakeCodeIndex(entries);
+    }
+    catch (std::bad_alloc&) {}
+    // If there was no memory FindCodeObject uses the bitmaps.
+    CodeIndexFence();
+    RetireCodeIndex(codeSpaceIndex);
+    codeSpaceIndex = table;
+    if (debugOptions & DEBUG_MEMMGR)
+        Log("MMGR: Code index rebuilt with %" POLYUFMT " objects\n", table == 0 ? 0 : table->count);
+}
+
+void MemMgr::BuildPermanentCodeIndex()
+{
+    if (permanentCodeIndex != 0) return;
+    CodeIndexTable *table = 0;
+    try {
+        std::vector<CodeIndexTable::Entry> entries;
+        for (std::vector<PermanentMemSpace*>::iterator i = pSpaces.begin(); i < pSpaces.end(); i++)
+        {
+            PermanentMemSpace *space = *i;
+            if (space->isCode)
+                AddCodeEntries(entries, space->bottom, space->top);
+        }
+        table = MakeCodeIndex(entries);
+    }
+    catch (std::bad_alloc&) {}
+    CodeIndexFence();
+    permanentCodeIndex = table;
+}
+
+// Called when code is made immutable.  Objects are added to the current table
+// until it is full and then a new table is made.  Code that is not in the index
+// is still found using the bitmaps.
+void MemMgr::AddCodeToIndex(PolyObject *obj)
+{
+    codeSpaceLock.Lock();
+    CodeIndexTable *table = codeSpaceIndex;
+    while (table == 0 || table->recentCount == CODE_INDEX_RECENT)
+    {
+        // Make the new table without the lock so that code can still be allocated.
+        // A full table is not changed and a replaced one is only deleted by a GC,
+        // which cannot happen during this call.
+        codeSpaceLock.Unlock();
+        CodeIndexTable *newTable = table == 0 ? new(std::nothrow) CodeIndexTable : MergeCodeIndex(table);
+        codeSpaceLock.Lock();
+        if (newTable == 0)
+        {
+            codeSpaceLock.Unlock();
+            return;
+        }
+        if (codeSpaceIndex == table)
+        {
+            CodeIndexFence();
+            codeSpaceIndex = newTable;
+            RetireCodeIndex(table);
+        }
+        else delete newTable; // Another thread has replaced it.
+        table = codeSpaceIndex;
+    }
+    CodeIndexTable::Entry *e = &table->recent[table->recentCount];
+    e->obj = obj;
+    e->end = (PolyWord*)obj + obj->Length();
+    CodeIndexFence();
+    table->recentCount++;
+    codeSpaceLock.Unlock();
+}
+
 PolyObject *MemMgr::FindCodeObject(const byte *addr)
 {
+    // Search the indexes first.  They contain all the immutable code apart from
+    // permanent spaces loaded while profiling and objects added when there
+    // was no memory for a new table.
+    {
+        const PolyWord *wordAddr = (const PolyWord*)((uintptr_t)addr & ~(uintptr_t)(sizeof(POLYUNSIGNED)-1));
+        CodeIndexTable *table = codeSpaceIndex;
+        PolyObject *obj = table == 0 ? 0 : table->Find(wordAddr);
+        if (obj != 0) return obj;
+        table = permanentCodeIndex;
+        obj = table == 0 ? 0 : table->Find(wordAddr);
+        if (obj != 0) return obj;
+    }
+
     MemSpace *space = SpaceForAddress(addr);
     if (space == 0) return 0;
     Bitmap *profMap = 0;
@@ -1152,11 +1925,13 @@ PolyObject *MemMgr::FindCodeObject(const byte *addr)
     return 0;
 }
 
-// Remove profiling bitmaps from permanent areas to free up memory.
+// Remove profiling bitmaps and the index from permanent areas to free up memory.
 void MemMgr::RemoveProfilingBitmaps()
 {
     for (std::vector<PermanentMemSpace*>::iterator i = pSpaces.begin(); i < pSpaces.end(); i++)
         (*i)->profileCode.Destroy();
+    RetireCodeIndex(permanentCodeIndex);
+    permanentCodeIndex = 0;
 }
 
 MemMgr gMem; // The one and only memory manager object
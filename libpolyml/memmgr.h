@@ -111,11 +111,15 @@ public:
 
     Bitmap      shareBitmap; // Used in sharedata
     Bitmap      profileCode; // Used when profiling
+    CardTable   cards;       // Dirty cards if this is mutable.  Created by the first minor GC.
 
     friend class MemMgr;
 };
 
-#define NSTARTS 10
+// The major GC slides the objects in a space in blocks of this many words.
+// For each block it records the number of live words above the block.
+#define SLIDE_BLOCK_SHIFT   8
+#define SLIDE_BLOCK_WORDS   ((POLYUNSIGNED)1 << SLIDE_BLOCK_SHIFT)
 
 // Markable spaces are used as the base class for local heap
 // spaces and code spaces.
@@ -136,7 +140,7 @@ class LocalMemSpace: public MarkableSpace
 protected:
     LocalMemSpace();
     virtual ~LocalMemSpace() {}
-    bool InitSpace(POLYUNSIGNED size, bool mut);
+    bool InitSpace(POLYUNSIGNED size, bool mut, bool useHugePages);
 
 public:
     // Allocation.  The minor GC allocates at the bottom of the areas while the
@@ -156,11 +160,41 @@ public:
 
     Bitmap       bitmap;          /* bitmap with one bit for each word in the GC area. */
     bool         allocationSpace; // True if this is (mutable) space for initial allocation
-    POLYUNSIGNED start[NSTARTS];  /* starting points for bit searches.                 */
-    unsigned     start_index;     /* last index used to index start array              */
+    bool         largeObjectSpace;// True if this is a LargeObjectSpace.
+    // Survivor spaces hold objects that have survived fewer minor GCs than the
+    // tenuring threshold.  Every object in the space has survived survivorAge
+    // minor GCs.  survivorEvacuate is set during a minor GC if the objects are
+    // being copied out.  An empty survivor space can be reused for any age.
+    bool         survivorSpace;
+    bool         survivorEvacuate;
+    unsigned     survivorAge;
+    // Summary table if the copy phase has slid the live objects in this space up to
+    // the top.  Entry n is the number of live words above block n.  Together with the
+    // bitmap, which still describes the old layout, this gives the new address of
+    // any object in the space.  It is only non-zero between the copy and update phases.
+    POLYUNSIGNED *slideSummary;
     POLYUNSIGNED i_marked;        /* count of immutable words marked.                  */
     POLYUNSIGNED m_marked;        /* count of mutable words marked.                    */
     POLYUNSIGNED updated;         /* count of words updated.                           */
+    // The weak objects marked in this space.  Set when the major GC builds
+    // the bitmap and used to check the weak references.  If there was not
+    // enough memory for the list the whole space is checked instead.
+    std::vector<PolyObject*> weakObjects;
+    bool weakObjectsOverflowed;
+
+    // Card table.  This is only created for mutable spaces and only if the
+    // mutator has a write barrier.
+    CardTable    cards;
+    bool         partialGCCards;  // True if the minor GC is scanning only the dirty cards.
+    unsigned     numaNode;        // The NUMA node the space was allocated on.
+    unsigned     hugePages;       // HUGE_PAGES_NONE etc for the space itself.
+    // Words at the bottom of the free space that minor GCs have used recently.
+    // Free pages above this are returned to the OS after a major GC.
+    POLYUNSIGNED recentlyUsed;
+
+    bool CreateCardTable();
+    // Clear the dirty cards and rebuild the object table for the whole space.
+    void ResetCards();
     
     POLYUNSIGNED allocatedSpace(void)const // Words allocated
         { return (top-upperAllocPtr) + (lowerAllocPtr-bottom); }
@@ -168,12 +202,41 @@ public:
         { return upperAllocPtr-lowerAllocPtr; }
 
     virtual const char *spaceTypeString()
-        { return allocationSpace ? "allocation" : MemSpace::spaceTypeString(); }
+        { return allocationSpace ? "allocation" : survivorSpace ? "survivor" : MemSpace::spaceTypeString(); }
 
     // Used when converting to and from bit positions in the bitmap
     POLYUNSIGNED wordNo(PolyWord *pt) { return pt - bottom; }
     PolyWord *wordAddr(POLYUNSIGNED bitno) { return bottom + bitno; }
 
+    // The new address of an object in a space that has been slid.  The
+    // object must have been marked.
+    PolyObject *SlidAddress(PolyObject *obj)
+    {
+        POLYUNSIGNED bitno = wordNo((PolyWord*)obj - 1);
+        POLYUNSIGNED block = bitno >> SLIDE_BLOCK_SHIFT;
+        POLYUNSIGNED blockEnd = (block + 1) << SLIDE_BLOCK_SHIFT;
+        if (blockEnd > spaceSize()) blockEnd = spaceSize();
+        POLYUNSIGNED above = slideSummary[block] + bitmap.CountSetBits(bitno, blockEnd - bitno);
+        return (PolyObject*)(top - above + 1);
+    }
+
+    friend class MemMgr;
+};
+
+// Large object spaces each hold a single object that was too large to allocate
+// in an allocation space.  The object is placed at the top of the space and is
+// never moved.  The minor GC treats it as old data and the major GC marks it and
+// deletes the space if it is unreachable.  The space is mutable so that the
+// minor GC scans the object for references into the allocation spaces.
+class LargeObjectSpace: public LocalMemSpace
+{
+protected:
+    LargeObjectSpace() { largeObjectSpace = true; }
+    virtual ~LargeObjectSpace() {}
+
+public:
+    virtual const char *spaceTypeString() { return "large object"; }
+
     friend class MemMgr;
 };
 
@@ -188,15 +251,68 @@ public:
     StackObject *stack()const { return (StackObject *)bottom; }
 };
 
+// The number of free lists in a code space.  List n holds free cells with a length
+// of at least 2^n and less than 2^(n+1) words.  The last list holds everything larger.
+#define CODE_FREE_LISTS     20
+
 // Code Space.  These contain local code created by the compiler.
+// Free cells are byte objects.  Those with a length of at least one word are
+// kept on size-class free lists, linked through their first word.  The lists are
+// protected by codeSpaceLock and are rebuilt by the major GC.
 class CodeSpace: public MarkableSpace
 {
     public:
         CodeSpace(PolyWord *start, POLYUNSIGNED spaceSize);
 
     Bitmap  headerMap; // Map to find the headers during GC or profiling.
-    POLYUNSIGNED largestFree; // The largest free space in the area
-    PolyWord *firstFree; // The start of the first free space in the area.
+    POLYUNSIGNED freeWords; // Words in the cells on the free lists, including the length words.
+    POLYUNSIGNED freeCells; // Number of cells on the free lists.
+    bool evacuating; // Set during a major GC if the code is being moved out of the space.
+
+    // Empty the free lists.
+    void ClearFreeLists();
+    // Add the free cell whose length word is at pt to the lists.
+    void AddFreeCell(PolyWord *pt);
+    // Add the cells made by FillUnusedSpace(pt, words) to the lists.
+    void AddFreeCells(PolyWord *pt, POLYUNSIGNED words);
+    // Remove and return a free cell with a length of at least "words".  Returns
+    // zero if there is none.
+    PolyWord *TakeFreeCell(POLYUNSIGNED words);
+    // The length of the largest free cell.
+    POLYUNSIGNED LargestFree() const;
+
+private:
+    static unsigned FreeListFor(POLYUNSIGNED length);
+    static PolyWord *&NextFree(PolyWord *pt) { return *(PolyWord**)(pt+1); }
+    PolyWord *freeLists[CODE_FREE_LISTS];
+};
+
+// The number of code objects that can be added to a code index table after it
+// has been built.
+#define CODE_INDEX_RECENT   256
+
+// A table of code objects sorted by address.  A table is never changed once it
+// has been published so that FindCodeObject can search it without a lock, including
+// from the profiling signal handler.  When the code changes a new table is built
+// and the old one is kept until the next major GC.
+class CodeIndexTable
+{
+public:
+    CodeIndexTable(): count(0), entries(0), recentCount(0) {}
+    ~CodeIndexTable() { delete[] entries; }
+
+    // The words of an object from obj up to but not including end.
+    typedef struct { PolyObject *obj; PolyWord *end; } Entry;
+
+    // Return the object containing the word at addr or zero if none.
+    PolyObject *Find(const PolyWord *addr) const;
+
+    POLYUNSIGNED count;
+    Entry *entries;
+    // Objects added after the table was built.  These are searched linearly.  When
+    // the array is full the entries are merged into a new table.
+    Entry recent[CODE_INDEX_RECENT];
+    volatile unsigned recentCount;
 };
 
 class MemMgr
@@ -206,9 +322,10 @@ public:
     ~MemMgr();
 
     // Create a local space for initial allocation.
-    LocalMemSpace *CreateAllocationSpace(POLYUNSIGNED size);
-    // Create and initialise a new local space and add it to the table.
-    LocalMemSpace *NewLocalSpace(POLYUNSIGNED size, bool mut);
+    LocalMemSpace *CreateAllocationSpace(POLYUNSIGNED size, unsigned node = 0);
+    // Create and initialise a new local space and add it to the table.  In NUMA
+    // mode the pages are allocated on the given node.
+    LocalMemSpace *NewLocalSpace(POLYUNSIGNED size, bool mut, unsigned node = 0, bool largeObject = false);
     // Create an entry for a permanent space.
     PermanentMemSpace *NewPermanentSpace(PolyWord *base, POLYUNSIGNED words,
         unsigned flags, unsigned index, unsigned hierarchy = 0);
@@ -221,13 +338,36 @@ public:
     // are the same) and when allocating heap segments.  If there is insufficient
     // space to satisfy the minimum it will return 0.  Updates "maxWords" with
     // the space actually allocated
-    PolyWord *AllocHeapSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation = true);
+    PolyWord *AllocHeapSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation = true,
+                             LocalMemSpace **allocSpace = 0);
     PolyWord *AllocHeapSpace(POLYUNSIGNED words)
         { POLYUNSIGNED allocated = words; return AllocHeapSpace(words, allocated); }
 
+    // Allocate a heap segment for an ML thread.  "preferred" is the space the thread
+    // last allocated in or zero.  If that has room the segment is taken from it
+    // without using allocLock.  Otherwise it uses AllocHeapSpace and updates "preferred".
+    PolyWord *AllocHeapSegment(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, LocalMemSpace *&preferred);
+
+    // Objects larger than the default space size are allocated in a LargeObjectSpace.
+    bool IsLargeObject(POLYUNSIGNED words) const { return words > defaultSpaceSize; }
+    // Allocate a large object in a new space of its own.  Returns zero if
+    // a GC is needed first.
+    PolyWord *AllocLargeObject(POLYUNSIGNED words);
+    // Called at the end of each GC.  Large objects allocated since then count
+    // against the allocation area.
+    void ResetLargeObjectAllocation() { largeObjectsSinceGC = 0; }
+
     CodeSpace *NewCodeSpace(POLYUNSIGNED size);
     // Allocate space for code.  This is initially mutable to allow the code to be built.
-    PolyObject *AllocCodeSpace(PolyObject *initCell);
+    // Small objects are allocated from a block of code space held by the thread so
+    // that codeSpaceLock is only needed when the block is used up.
+    PolyObject *AllocCodeSpace(TaskData *taskData, PolyObject *initCell);
+    // Return the rest of a thread's code block to the free lists.  Called when
+    // the thread's allocation state is reset by the GC and when it exits.
+    void ReleaseCodeCache(TaskData *taskData);
+    // Set the code space statistics.  Must be called with codeSpaceLock held or
+    // the ML threads stopped.
+    void UpdateCodeStatistics();
 
     // Check that a subsequent allocation will succeed.  Called from the GC to ensure
     bool CheckForAllocation(POLYUNSIGNED words);
@@ -266,6 +406,10 @@ public:
     MemSpace *SpaceForAddress(const void *pt) const
     {
         uintptr_t t = (uintptr_t)pt;
+        // Spaces in the heap range are found with a single table lookup.
+        // heapRangeSize is zero if there is no range.
+        if (t - heapRangeBase < heapRangeSize)
+            return heapRangeTable[(t - heapRangeBase) >> heapRangeShift];
         SpaceTree *tr = spaceTree;
 
         // Each level of the tree is either a leaf or a vector of trees.
@@ -291,6 +435,32 @@ public:
         else return 0;
     }
 
+    // Write barrier.  This must be called when a value is stored into an existing
+    // mutable object.  If the object is in a local or permanent space that has a
+    // card table the card containing the word is marked so that the minor GC will
+    // scan it.  Stores into the allocation area need not be recorded because the
+    // allocation area is always scanned.
+    void RecordMutableStore(PolyWord *addr, PolyWord value) const
+    {
+        if (value.IsTagged() || value == PolyWord::FromUnsigned(0))
+            return;
+        MemSpace *space = SpaceForAddress(addr);
+        if (space == 0)
+            return;
+        if (space->spaceType == ST_LOCAL)
+        {
+            LocalMemSpace *lSpace = (LocalMemSpace*)space;
+            if (lSpace->cards.Created() && ! lSpace->allocationSpace)
+                lSpace->cards.SetDirty(addr);
+        }
+        else if (space->spaceType == ST_PERMANENT)
+        {
+            PermanentMemSpace *pSpace = (PermanentMemSpace*)space;
+            if (pSpace->cards.Created())
+                pSpace->cards.SetDirty(addr);
+        }
+    }
+
     void SetReservation(POLYUNSIGNED words) { reservedSpace = words; }
 
     // In several places we assume that segments are filled with valid
@@ -302,6 +472,10 @@ public:
 
     // Remove unused local areas.
     void RemoveEmptyLocals();
+    // Record the space used by minor GCs at the start of a major GC.
+    void RecordRecentlyUsed(unsigned decay);
+    // Return free pages in the local areas to the OS.  Returns the number of bytes released.
+    size_t DecommitFreeSpace();
     // Remove unused code areas.
     void RemoveEmptyCodeAreas();
 
@@ -342,22 +516,65 @@ public:
     POLYUNSIGNED CurrentAllocSpace() { return currentAllocSpace; }
     POLYUNSIGNED AllocatedInAlloc();
     POLYUNSIGNED CurrentHeapSize() { return currentHeapSize; }
+    POLYUNSIGNED CurrentLargeObjectSpace() { return currentLargeObjectSpace; }
 
     POLYUNSIGNED DefaultSpaceSize() const { return defaultSpaceSize; }
 
+    // NUMA mode.  If numaNodes is more than one spaces are allocated on particular
+    // nodes and ML threads allocate in spaces on the node they are running on.
+    void SetNumaNodes(unsigned nodes) { numaNodes = nodes; }
+    unsigned NumaNodes() const { return numaNodes; }
+    unsigned CurrentNumaNode() const;
+
+    // Huge pages mode.  Local spaces and large bitmaps are aligned to huge pages.
+    void SetHugePages(bool h) { hugePages = h; }
+    bool HugePages() const { return hugePages; }
+
+    // Heap range mode.  Local spaces are allocated on granule boundaries within a
+    // single reserved range of address space so that SpaceForAddress can find them
+    // with a table lookup.  Spaces that do not fit in the range and other kinds of
+    // space are found using the tree.  "bytes" is the size of the range.
+    bool ReserveHeapRange(uintptr_t bytes);
+    bool InHeapRange(const void *pt) const { return (uintptr_t)pt - heapRangeBase < heapRangeSize; }
+    // Commit space in the range for a local space.  The size is rounded up to a whole
+    // number of granules.  Returns zero if there is no room.
+    PolyWord *AllocateInHeapRange(size_t &bytes, unsigned &hugePageType);
+    // Return the space to the range.
+    void FreeInHeapRange(void *p, size_t bytes);
+
     void ReportHeapSizes(const char *phase);
 
-    // Profiling - Find a code object or return zero if not found.
+    // Profiling - Find a code object or return zero if not found.  This searches the
+    // code index and only uses the header bitmaps if the address is not in an indexed
+    // object, for example if it is in mutable code.
     PolyObject *FindCodeObject(const byte *addr);
-    // Profiling - Free bitmaps to indicate start of an object.
+    // Profiling - Free bitmaps to indicate start of an object and the permanent code index.
     void RemoveProfilingBitmaps();
 
+    // Code index.  Add a code object once it has been made immutable.
+    void AddCodeToIndex(PolyObject *obj);
+    // Rebuild the index for the code spaces.  Must be called with the ML threads
+    // stopped, after the major GC has removed or moved code and when the spaces change.
+    void RebuildCodeIndex();
+    // Build the index for the permanent code spaces.  Used when profiling starts.
+    void BuildPermanentCodeIndex();
+
 private:
     bool AddLocalSpace(LocalMemSpace *space);
+    PolyWord *AllocInSpace(LocalMemSpace *space, POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation);
+    PolyWord *AllocInExistingSpace(POLYUNSIGNED minWords, POLYUNSIGNED &maxWords, bool doAllocation,
+                                   LocalMemSpace **allocSpace, bool anyNode, unsigned node);
     bool AddCodeSpace(CodeSpace *space);
+    void RetireCodeIndex(CodeIndexTable *table);
+    static CodeIndexTable *MakeCodeIndex(std::vector<CodeIndexTable::Entry> &entries);
+    static CodeIndexTable *MergeCodeIndex(const CodeIndexTable *table);
+    PolyObject *InitCodeObject(CodeSpace *space, PolyWord *pt, PolyObject *initCell);
+    void ReleaseCodeCacheLocked(TaskData *taskData);
 
     POLYUNSIGNED reservedSpace;
     unsigned nextAllocator;
+    unsigned numaNodes;
+    bool hugePages;
     // The default size in words when creating new segments.
     POLYUNSIGNED defaultSpaceSize;
     // The number of words that can be used for initial allocation.
@@ -366,6 +583,8 @@ private:
     POLYUNSIGNED spaceForHeap;
     // The current sizes of the allocation space and the total heap size.
     POLYUNSIGNED currentAllocSpace, currentHeapSize;
+    // The size of the large object spaces and the words allocated in them since the last GC.
+    POLYUNSIGNED currentLargeObjectSpace, largeObjectsSinceGC;
     // LocalSpaceForAddress is a hot-spot so we use a B-tree to convert addresses;
     SpaceTree *spaceTree;
     PLock spaceTreeLock;
@@ -376,6 +595,22 @@ private:
 
     void AddTreeRange(SpaceTree **t, MemSpace *space, uintptr_t startS, uintptr_t endS);
     void RemoveTreeRange(SpaceTree **t, MemSpace *space, uintptr_t startS, uintptr_t endS);
+
+    // The heap range.  heapRangeSize is zero if there is no range.
+    uintptr_t heapRangeBase, heapRangeSize;
+    unsigned heapRangeShift; // Log2 of the granule size.
+    bool heapRangeHuge; // Whether huge pages were requested for the range.
+    MemSpace **heapRangeTable; // The space, if any, for each granule.
+    size_t heapRangeTableSize;
+    Bitmap heapRangeMap; // Granules that have been allocated.
+    PLock heapRangeLock;
+
+    // The code index.  codeSpaceIndex is replaced or added to with codeSpaceLock held
+    // or with the ML threads stopped.  permanentCodeIndex is only built while profiling.
+    CodeIndexTable * volatile codeSpaceIndex;
+    CodeIndexTable * volatile permanentCodeIndex;
+    // Tables that have been replaced.  These are deleted by RebuildCodeIndex.
+    std::vector<CodeIndexTable*> retiredCodeIndexes;
 };
 
 extern MemMgr gMem;
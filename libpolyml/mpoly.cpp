@@ -59,6 +59,7 @@
 #define _tcslen strlen
 #define _tcstol strtol
 #define _tcsncmp strncmp
+#define _tcscmp strcmp
 #define _tcschr strchr
 #endif
 
@@ -104,6 +105,19 @@ enum {
     OPT_GCPERCENT,
     OPT_RESERVE,
     OPT_GCTHREADS,
+    OPT_GCMODE,
+    OPT_GCFRAGMENT,
+    OPT_GCCOMPACTTIME,
+    OPT_GCCODECOMPACT,
+    OPT_GCPREFETCH,
+    OPT_GCSHARE,
+    OPT_GCTENURE,
+    OPT_GCPAUSE,
+    OPT_GCINTERVAL,
+    OPT_GCDECOMMIT,
+    OPT_NUMA,
+    OPT_HUGEPAGES,
+    OPT_HEAPRANGE,
     OPT_DEBUGOPTS,
     OPT_DEBUGFILE,
     OPT_DDESERVICE,
@@ -123,6 +137,19 @@ static struct __argtab {
     { _T("--gcpercent"),    "Target percentage time in GC (1-99)",                  OPT_GCPERCENT },
     { _T("--stackspace"),   "Space to reserve for thread stacks and C++ heap(MB)",  OPT_RESERVE },
     { _T("--gcthreads"),    "Number of threads to use for garbage collection",      OPT_GCTHREADS },
+    { _T("--gcmode"),       "Major GC marking: stop (default) or concurrent",       OPT_GCMODE },
+    { _T("--gcfragment"),   "Fragmentation (%) of a space before it is compacted",  OPT_GCFRAGMENT },
+    { _T("--gccompacttime"),"Maximum time (ms) for compaction in each GC",          OPT_GCCOMPACTTIME },
+    { _T("--gccodecompact"),"Occupancy (%) below which a code space is emptied",    OPT_GCCODECOMPACT },
+    { _T("--gcprefetch"),   "Depth of the GC mark prefetch queue (0 to disable)",   OPT_GCPREFETCH },
+    { _T("--gcshare"),      "GC sharing pass method: auto (default), sort or hash", OPT_GCSHARE },
+    { _T("--gctenure"),     "Minor GCs an object survives before promotion (1-15)", OPT_GCTENURE },
+    { _T("--gcpause"),      "Target maximum pause (ms) for each garbage collection", OPT_GCPAUSE },
+    { _T("--gcinterval"),   "Target minimum interval (ms) between minor GCs",       OPT_GCINTERVAL },
+    { _T("--gcdecommit"),   "Major GCs before unused free heap is returned to the OS", OPT_GCDECOMMIT },
+    { _T("--numa"),         "Place heap spaces and GC threads on NUMA nodes",       OPT_NUMA },
+    { _T("--hugepages"),    "Use huge pages for the heap and the GC bitmaps",       OPT_HUGEPAGES },
+    { _T("--heaprange"),    "Address range (MB) to reserve for the heap spaces",    OPT_HEAPRANGE },
     { _T("--debug"),        "Debug options: checkmem, gc, x",                       OPT_DEBUGOPTS },
     { _T("--logfile"),      "Logging file (default is to log to stdout)",           OPT_DEBUGFILE },
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
@@ -207,9 +234,12 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
 {
     POLYUNSIGNED minsize=0, maxsize=0, initsize=0;
     unsigned gcpercent=0;
+    unsigned gcpause=0, gcinterval=0;
     /* Get arguments. */
     memset(&userOptions, 0, sizeof(userOptions)); /* Reset it */
     userOptions.gcthreads = 0; // Default multi-threaded
+    userOptions.markPrefetch = MARK_PREFETCH_DEFAULT;
+    userOptions.tenureThreshold = TENURE_THRESHOLD_DEFAULT;
 
     if (polyStdout == 0) polyStdout = stdout;
     if (polyStderr == 0) polyStderr = stderr;
@@ -241,7 +271,8 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                 {
                     const TCHAR *p = 0;
                     TCHAR *endp = 0;
-                    if (argTable[j].argKey != OPT_REMOTESTATS)
+                    if (argTable[j].argKey != OPT_REMOTESTATS && argTable[j].argKey != OPT_NUMA &&
+                        argTable[j].argKey != OPT_HUGEPAGES)
                     {
                         if (_tcslen(argv[i]) == argl)
                         { // If it has used all the argument pick the next
@@ -289,6 +320,79 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                         if (*endp != '\0') 
                             Usage("Incomplete %s option\n", argTable[j].argName);
                         break;
+                    case OPT_GCMODE:
+                        if (_tcscmp(p, _T("stop")) == 0)
+                            userOptions.concurrentGC = false;
+                        else if (_tcscmp(p, _T("concurrent")) == 0)
+                            userOptions.concurrentGC = true;
+                        else Usage("Unknown argument to %s\n", argTable[j].argName);
+                        break;
+                    case OPT_GCFRAGMENT:
+                        userOptions.compactThreshold = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        if (userOptions.compactThreshold > 99)
+                            Usage("%s argument must be between 0 and 99\n", argTable[j].argName);
+                        break;
+                    case OPT_GCCOMPACTTIME:
+                        userOptions.compactTime = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_GCCODECOMPACT:
+                        userOptions.codeCompactThreshold = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        if (userOptions.codeCompactThreshold > 99)
+                            Usage("%s argument must be between 0 and 99\n", argTable[j].argName);
+                        break;
+                    case OPT_GCPREFETCH:
+                        userOptions.markPrefetch = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        if (userOptions.markPrefetch > MARK_PREFETCH_MAX)
+                            Usage("%s argument must be between 0 and %u\n", argTable[j].argName, MARK_PREFETCH_MAX);
+                        break;
+                    case OPT_GCSHARE:
+                        if (_tcscmp(p, _T("auto")) == 0)
+                            userOptions.shareMethod = GC_SHARE_AUTO;
+                        else if (_tcscmp(p, _T("sort")) == 0)
+                            userOptions.shareMethod = GC_SHARE_SORT;
+                        else if (_tcscmp(p, _T("hash")) == 0)
+                            userOptions.shareMethod = GC_SHARE_HASH;
+                        else Usage("Unknown argument to %s\n", argTable[j].argName);
+                        break;
+                    case OPT_GCTENURE:
+                        userOptions.tenureThreshold = _tcstol(p, &endp, 10);
+                        if (*endp != '\0')
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        if (userOptions.tenureThreshold < 1 || userOptions.tenureThreshold > TENURE_THRESHOLD_MAX)
+                            Usage("%s argument must be between 1 and %u\n", argTable[j].argName, TENURE_THRESHOLD_MAX);
+                        break;
+                    case OPT_GCPAUSE:
+                        gcpause = _tcstol(p, &endp, 10);
+                        if (*endp != '\0')
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_GCINTERVAL:
+                        gcinterval = _tcstol(p, &endp, 10);
+                        if (*endp != '\0')
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_GCDECOMMIT:
+                        userOptions.decommitDecay = _tcstol(p, &endp, 10);
+                        if (*endp != '\0')
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_NUMA:
+                        userOptions.numa = true;
+                        break;
+                    case OPT_HUGEPAGES:
+                        userOptions.hugePages = true;
+                        break;
+                    case OPT_HEAPRANGE:
+                        userOptions.heapRange = parseSize(p, argTable[j].argName);
+                        break;
                     case OPT_DEBUGOPTS:
                         while (*p != '\0')
                         {
@@ -371,8 +475,16 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
             userOptions.gcthreads = NumberOfProcessors();
     }
 
+    // Concurrent marking needs the write barrier and at least one GC thread
+    // to run the marker.
+    if (userOptions.concurrentGC && ! machineDependent->HasWriteBarrier())
+        Usage("--gcmode concurrent is only supported by the interpreter\n");
+    if (userOptions.concurrentGC && userOptions.gcthreads == 1)
+        Usage("--gcmode concurrent requires --gcthreads to be more than 1\n");
+
     // Set the heap size if it has been provided otherwise use the default.
     gHeapSizeParameters.SetHeapParameters(minsize, maxsize, initsize, gcpercent);
+    gHeapSizeParameters.SetPauseTarget(gcpause, gcinterval);
 
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
     SetupDDEHandler(lpszServiceName); // Windows: Start the DDE handler now we processed any service name.
@@ -37,6 +37,17 @@ extern struct _userOptions {
     TCHAR       **user_arg_strings;
     const TCHAR *programName;
     unsigned    gcthreads;    // Number of threads to use for gc
+    bool        concurrentGC; // Mark in parallel with the ML threads
+    unsigned    compactThreshold; // Minimum percentage of a space that is fragmented before it is compacted
+    unsigned    compactTime;  // Maximum time (ms) to spend compacting in a GC or zero if unlimited
+    unsigned    codeCompactThreshold; // Code spaces less full than this percentage are emptied by a major GC or zero for none
+    unsigned    markPrefetch; // Depth of the prefetch queue in the mark phase or zero to disable it
+    unsigned    shareMethod;  // GC_SHARE_AUTO, GC_SHARE_SORT or GC_SHARE_HASH for the GC sharing pass
+    unsigned    tenureThreshold; // Minor GCs an object survives before it is promoted
+    unsigned    decommitDecay; // Major GCs before unused free heap is released to the OS or zero to keep it
+    bool        numa;         // Allocate spaces and place GC threads on NUMA nodes
+    bool        hugePages;    // Align heap spaces and bitmaps to huge pages and request them
+    POLYUNSIGNED heapRange;   // Size (kbytes) of the range to reserve for the heap or zero for none
 } userOptions;
 
 class PolyWord;
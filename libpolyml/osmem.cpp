@@ -35,6 +35,10 @@
 #include <sys/mman.h>
 #endif
 
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
 
 #include "osmem.h"
 
@@ -121,6 +125,104 @@ bool OSMem::SetPermissions(void *p, size_t space, unsigned permissions)
     return res != -1;
 }
 
+// Release the pages within the range.  MADV_DONTNEED frees the pages immediately
+// so that the resident size goes down.  MADV_FREE would be cheaper if the space is
+// reused soon but the pages stay in the resident size until there is memory pressure.
+size_t OSMem::Decommit(void *p, size_t space)
+{
+#ifdef MADV_DONTNEED
+    uintptr_t pageSize = getpagesize();
+    uintptr_t start = ((uintptr_t)p + pageSize - 1) & ~(pageSize-1);
+    uintptr_t end = ((uintptr_t)p + space) & ~(pageSize-1);
+    if (end <= start || madvise((char*)start, end-start, MADV_DONTNEED) != 0)
+        return 0;
+    return end-start;
+#else
+    return 0;
+#endif
+}
+
+// Map a multiple of HUGE_PAGE_SIZE aligned on a huge page boundary.  We map an
+// extra huge page so that we can align the start and then return the unused
+// parts at either end.
+static void *MapAligned(size_t space, int prot, int flags)
+{
+    size_t extended = space + HUGE_PAGE_SIZE;
+    char *base = (char*)mmap(0, extended, prot, flags, -1, 0);
+    if (base == MAP_FAILED)
+        return 0;
+    char *aligned = base + ((HUGE_PAGE_SIZE - ((uintptr_t)base & (HUGE_PAGE_SIZE-1))) & (HUGE_PAGE_SIZE-1));
+    if (aligned != base)
+        munmap(FIXTYPE base, aligned - base);
+    if (aligned + space != base + extended)
+        munmap(FIXTYPE (aligned + space), base + extended - (aligned + space));
+    return aligned;
+}
+
+// Allocate space aligned on a huge page boundary.  If the administrator has
+// reserved huge pages we use those.  Otherwise we align the space ourselves and
+// advise the kernel to back it with transparent huge pages.
+void *OSMem::AllocateHuge(size_t &space, unsigned permissions, unsigned &hugePages)
+{
+    int prot = ConvertPermissions(permissions);
+    hugePages = HUGE_PAGES_NONE;
+    space = (space + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+#ifdef MAP_HUGETLB
+    int fd = -1;
+    void *result = mmap(0, space, prot, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, fd, 0);
+    if (result != MAP_FAILED)
+    {
+        hugePages = HUGE_PAGES_EXPLICIT;
+        return result;
+    }
+#endif
+    char *aligned = (char*)MapAligned(space, prot, MAP_PRIVATE|MAP_ANON);
+    if (aligned == 0)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, space, MADV_HUGEPAGE) == 0)
+        hugePages = HUGE_PAGES_TRANSPARENT;
+#endif
+    return aligned;
+}
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Reserve the range with no access.  MAP_NORESERVE means the range is not
+// counted against the commit limit until it is used.
+void *OSMem::Reserve(size_t &space, bool hugePages)
+{
+    space = (space + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+    void *result = MapAligned(space, PROT_NONE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE);
+    if (result == 0)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    // The advice applies to the range so it covers every part that is committed later.
+    if (hugePages)
+        (void)madvise(result, space, MADV_HUGEPAGE);
+#endif
+    return result;
+}
+
+// Committing and uncommitting only change the protection so that the range
+// remains a single mapping and keeps any huge page advice.  MADV_DONTNEED
+// discards the pages so they are zero if the range is committed again.
+bool OSMem::Commit(void *p, size_t space, unsigned permissions)
+{
+    return mprotect(FIXTYPE p, space, ConvertPermissions(permissions)) == 0;
+}
+
+bool OSMem::Uncommit(void *p, size_t space)
+{
+#ifdef MADV_DONTNEED
+    if (madvise(FIXTYPE p, space, MADV_DONTNEED) != 0)
+        return false;
+#endif
+    return mprotect(FIXTYPE p, space, PROT_NONE) == 0;
+}
+
 
 #elif defined(_WIN32)
 // Use Windows memory management.
@@ -180,6 +282,47 @@ bool OSMem::SetPermissions(void *p, size_t space, unsigned permissions)
     return VirtualProtect(p, space, ConvertPermissions(permissions), &oldProtect) == TRUE;
 }
 
+// Release the pages within the range.  MEM_RESET tells Windows the contents are
+// no longer needed and unlocking pages that are not locked removes them from the
+// working set.
+size_t OSMem::Decommit(void *p, size_t space)
+{
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    size_t pageSize = sysInfo.dwPageSize;
+    uintptr_t start = ((uintptr_t)p + pageSize - 1) & ~(pageSize-1);
+    uintptr_t end = ((uintptr_t)p + space) & ~(pageSize-1);
+    if (end <= start || VirtualAlloc((void*)start, end-start, MEM_RESET, PAGE_READWRITE) == 0)
+        return 0;
+    (void)VirtualUnlock((void*)start, end-start); // This always "fails".
+    return end-start;
+}
+
+// Large pages in Windows require a special privilege so we don't try to use them.
+void *OSMem::AllocateHuge(size_t &space, unsigned permissions, unsigned &hugePages)
+{
+    hugePages = HUGE_PAGES_NONE;
+    return Allocate(space, permissions);
+}
+
+// Windows aligns reservations on the allocation granularity, 64k, which is enough
+// since the granules are relative to the start of the range.
+void *OSMem::Reserve(size_t &space, bool /*hugePages*/)
+{
+    space = (space + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+    return VirtualAlloc(0, space, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool OSMem::Commit(void *p, size_t space, unsigned permissions)
+{
+    return VirtualAlloc(p, space, MEM_COMMIT, ConvertPermissions(permissions)) != 0;
+}
+
+bool OSMem::Uncommit(void *p, size_t space)
+{
+    return VirtualFree(p, space, MEM_DECOMMIT) == TRUE;
+}
+
 
 #else
 
@@ -210,6 +353,169 @@ bool OSMem::SetPermissions(void *p, size_t space, unsigned permissions)
     return true; // Let's hope this is all right.
 }
 
+// We can't release part of a malloced area.
+size_t OSMem::Decommit(void *p, size_t space)
+{
+    return 0;
+}
+
+void *OSMem::AllocateHuge(size_t &bytes, unsigned permissions, unsigned &hugePages)
+{
+    hugePages = HUGE_PAGES_NONE;
+    return Allocate(bytes, permissions);
+}
+
+// We can't reserve address space without allocating it.
+void *OSMem::Reserve(size_t &bytes, bool hugePages)
+{
+    return 0;
+}
+
+bool OSMem::Commit(void *p, size_t space, unsigned permissions)
+{
+    return false;
+}
+
+bool OSMem::Uncommit(void *p, size_t space)
+{
+    return false;
+}
+
+#endif
+
+#if (defined(__linux__) && defined(HAVE_MMAP))
+// Linux.  We use the system calls directly rather than libnuma.  The node
+// and processor numbers are read from /sys.
+#include <sys/syscall.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define MAX_NUMA_NODES  64  // The node mask is a single word.
+#define MAX_NUMA_CPUS   1024
+
+static bool numaInitialised = false;
+static unsigned numaNodes = 1;
+static unsigned char cpuNodes[MAX_NUMA_CPUS]; // Node for each processor
+
+// Read a list of the form "0-3,8-11" and call the function for each value.
+static void ReadNumberList(const char *fileName, void (*f)(unsigned n, unsigned arg), unsigned arg)
+{
+    FILE *list = fopen(fileName, "r");
+    if (list == NULL)
+        return;
+    unsigned low, high;
+    while (fscanf(list, "%u", &low) == 1)
+    {
+        high = low;
+        int ch = fgetc(list);
+        if (ch == '-')
+        {
+            if (fscanf(list, "%u", &high) != 1)
+                break;
+            ch = fgetc(list);
+        }
+        for (unsigned n = low; n <= high; n++)
+            f(n, arg);
+        if (ch != ',')
+            break;
+    }
+    fclose(list);
+}
+
+static void SetNodeCount(unsigned node, unsigned)
+{
+    if (node < MAX_NUMA_NODES && node >= numaNodes)
+        numaNodes = node+1;
+}
+
+static void SetCpuNode(unsigned cpu, unsigned node)
+{
+    if (cpu < MAX_NUMA_CPUS)
+        cpuNodes[cpu] = (unsigned char)node;
+}
+
+static void InitNuma(void)
+{
+    if (numaInitialised)
+        return;
+    ReadNumberList("/sys/devices/system/node/online", SetNodeCount, 0);
+    for (unsigned node = 0; node < numaNodes; node++)
+    {
+        char fileName[60];
+        sprintf(fileName, "/sys/devices/system/node/node%u/cpulist", node);
+        ReadNumberList(fileName, SetCpuNode, node);
+    }
+    numaInitialised = true;
+}
+
+unsigned OSMem::NumaNodeCount(void)
+{
+    InitNuma();
+    return numaNodes;
+}
+
+unsigned OSMem::CurrentNumaNode(void)
+{
+    InitNuma();
+    if (numaNodes == 1)
+        return 0;
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= MAX_NUMA_CPUS)
+        return 0;
+    return cpuNodes[cpu];
+}
+
+bool OSMem::BindToNumaNode(void *p, size_t space, unsigned node)
+{
+#ifdef SYS_mbind
+    // MPOL_PREFERRED rather than MPOL_BIND so that we fall back to another node
+    // if this one is full.
+    const int mpolPreferred = 1;
+    unsigned long nodeMask = 1UL << node;
+    if (node >= MAX_NUMA_NODES)
+        return false;
+    return syscall(SYS_mbind, p, space, mpolPreferred, &nodeMask, sizeof(nodeMask)*8+1, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+bool OSMem::RunOnNumaNode(unsigned node)
+{
+    InitNuma();
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned cpu = 0; cpu < MAX_NUMA_CPUS; cpu++)
+    {
+        if (cpuNodes[cpu] == node && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpus);
+    }
+    if (CPU_COUNT(&cpus) == 0)
+        return false;
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+
+// The second field of /proc/self/statm is the number of resident pages.
+size_t OSMem::ResidentSize(void)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    unsigned long size, resident;
+    int n = fscanf(statm, "%lu %lu", &size, &resident);
+    fclose(statm);
+    if (n != 2)
+        return 0;
+    return (size_t)resident * getpagesize();
+}
+
+#else
+unsigned OSMem::NumaNodeCount(void) { return 1; }
+unsigned OSMem::CurrentNumaNode(void) { return 0; }
+bool OSMem::BindToNumaNode(void *, size_t, unsigned) { return true; }
+bool OSMem::RunOnNumaNode(unsigned) { return true; }
+size_t OSMem::ResidentSize(void) { return 0; }
 #endif
 
 // Create the global object for the memory manager.
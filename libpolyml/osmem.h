@@ -41,6 +41,13 @@
 #define PERMISSION_WRITE    2
 #define PERMISSION_EXEC     4
 
+// Huge pages.  The size is the usual one on X86 and ARM.
+#define HUGE_PAGE_SIZE      ((size_t)2*1024*1024)
+// What AllocateHuge was able to get.
+#define HUGE_PAGES_NONE         0   // Ordinary pages
+#define HUGE_PAGES_TRANSPARENT  1   // Aligned and advised to use transparent huge pages
+#define HUGE_PAGES_EXPLICIT     2   // Reserved huge pages (hugetlb)
+
 class OSMem
 {
 public:
@@ -49,6 +56,11 @@ public:
     // Returns NULL if it cannot allocate the space.
     void *Allocate(size_t &bytes, unsigned permissions);
 
+    // Allocate space as Allocate but rounded up to a multiple of HUGE_PAGE_SIZE,
+    // aligned on a huge page boundary and, if possible, backed by huge pages.
+    // hugePages is set to one of the HUGE_PAGES values.
+    void *AllocateHuge(size_t &bytes, unsigned permissions, unsigned &hugePages);
+
     // Release the space previously allocated.  This must free the whole of
     // the segment.  The space must be the size actually allocated.
     bool Free(void *p, size_t space);
@@ -56,6 +68,38 @@ public:
     // Adjust the permissions on a segment.  This must apply to the
     // whole of a segment.
     bool SetPermissions(void *p, size_t space, unsigned permissions);
+
+    // Return the physical memory for the whole pages within a range of a segment
+    // to the OS.  The range remains part of the segment but its contents are
+    // undefined.  Returns the number of bytes released.
+    size_t Decommit(void *p, size_t space);
+
+    // Reserve a range of address space without any memory behind it.  The size is
+    // rounded up to a multiple of HUGE_PAGE_SIZE.  If hugePages is true the OS is asked
+    // to use huge pages for the parts that are committed.  Returns NULL if the space
+    // cannot be reserved or reservation is not supported.  The range is released with Free.
+    void *Reserve(size_t &bytes, bool hugePages);
+
+    // Make a page-aligned part of a reserved range available with the given permissions.
+    // The contents are zero.
+    bool Commit(void *p, size_t space, unsigned permissions);
+
+    // Return a committed part of a reserved range to the OS, leaving it reserved.
+    bool Uncommit(void *p, size_t space);
+
+    // Return the resident set size of the process in bytes or zero if it is not known.
+    size_t ResidentSize(void);
+
+    // NUMA support.  These return a single node if the system does not
+    // support NUMA or it is not available.
+    // Return the number of nodes.
+    unsigned NumaNodeCount(void);
+    // Return the node of the processor the calling thread is running on.
+    unsigned CurrentNumaNode(void);
+    // Ask for the pages of a segment to be allocated on the given node.
+    bool BindToNumaNode(void *p, size_t space, unsigned node);
+    // Restrict the calling thread to the processors on a node.
+    bool RunOnNumaNode(unsigned node);
 };
 
 
@@ -210,6 +210,7 @@ Handle poly_dispatch_c(TaskData *taskData, Handle args, Handle code)
             POLYUNSIGNED segLength = codeObj->Length();
             codeObj->SetLengthWord(segLength, F_CODE_OBJ);
             machineDependent->FlushInstructionCache(codeObj, segLength * sizeof(PolyWord));
+            gMem.AddCodeToIndex(codeObj);
             // In the future it may be necessary to return a different address here.
             // N.B.  The code area should only have execute permission in the native
             // code version, not the interpreted version.
@@ -223,7 +224,7 @@ Handle poly_dispatch_c(TaskData *taskData, Handle args, Handle code)
                 raise_fail(taskData, "Not byte data area");
             while (true)
             {
-                PolyObject *result = gMem.AllocCodeSpace(args->WordP());
+                PolyObject *result = gMem.AllocCodeSpace(taskData, args->WordP());
                 if (result != 0)
                     return taskData->saveVec.push(result);
                 // Could not allocate - must GC.
@@ -308,7 +309,7 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyCopyByteVecToCode(PolyObject * threadId, Pol
         if (!pushedArg->WordP()->IsByteObject())
             raise_fail(taskData, "Not byte data area");
         do {
-            result = gMem.AllocCodeSpace(pushedArg->WordP());
+            result = gMem.AllocCodeSpace(taskData, pushedArg->WordP());
             if (result == 0)
             {
                 // Could not allocate - must GC.
@@ -344,6 +345,8 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyLockMutableCode(PolyObject * threadId, PolyW
         codeObj->SetLengthWord(segLength, F_CODE_OBJ);
         // This is really a legacy of the PPC code-generator.
         machineDependent->FlushInstructionCache(codeObj, segLength * sizeof(PolyWord));
+        // Add it to the index used when profiling and scanning stacks.
+        gMem.AddCodeToIndex(codeObj);
         // In the future it may be necessary to return a different address here.
         // N.B.  The code area should only have execute permission in the native
         // code version, not the interpreted version.
@@ -126,6 +126,7 @@
 #include "exporter.h"
 #include "statistics.h"
 #include "rtsentry.h"
+#include "heapsizing.h"
 
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
 #include "Console.h"
@@ -308,6 +309,8 @@ public:
     // A requesting thread sets this to indicate the request.  This value
     // is only reset once the request has been satisfied.
     MainThreadRequest *threadRequest;
+    // The time when threadRequest was set.  Used to record how long it takes the ML threads to stop.
+    TIMEDATA threadRequestTime;
 
     PCondVar mlThreadWait;  // All the threads block on here until the request has completed.
 
@@ -746,7 +749,10 @@ POLYUNSIGNED PolyThreadMaxStackSize(PolyObject *threadId, PolyWord newSize)
     Handle reset = taskData->saveVec.mark();
 
     try {
+            if (concurrentMarking)
+                ConcurrentMarkRecord(taskData->threadObject->mlStackSize);
             taskData->threadObject->mlStackSize = newSize;
+            gMem.RecordMutableStore(&taskData->threadObject->mlStackSize, newSize);
             if (newSize != TAGGED(0))
             {
                 POLYUNSIGNED current = taskData->currentStackSpace(); // Current size in words
@@ -811,6 +817,7 @@ void TaskData::FillUnusedSpace(void)
 
 
 TaskData::TaskData(): allocPointer(0), allocLimit(0), allocSize(MIN_HEAP_SIZE), allocCount(0),
+        allocWords(0), allocSpace(0), codeCacheSpace(0), codeCachePtr(0), codeCacheTop(0),
         stack(0), threadObject(0), signalStack(0), foreignStack(TAGGED(0)),
         inML(false), requests(kRequestNone), blockMutex(0), inMLHeap(false),
         runningProfileTimer(false)
@@ -828,6 +835,7 @@ TaskData::~TaskData()
 {
     if (signalStack) free(signalStack);
     if (stack) gMem.DeleteStackSpace(stack);
+    gMem.ReleaseCodeCache(this);
 #ifdef HAVE_WINDOWS_H
     if (threadHandle) CloseHandle(threadHandle);
 #endif
@@ -989,6 +997,8 @@ void Processes::MakeRootRequest(TaskData *taskData, MainThreadRequest *request)
     {
         mainThreadPhase = request->mtp;
         ThreadReleaseMLMemoryWithSchedLock(taskData); // Primarily to call FillUnusedSpace
+        if (request->mtp != MTP_GCPHASEMARK)
+            AbandonConcurrentGC();
         request->Perform();
         ThreadUseMLMemoryWithSchedLock(taskData);
         mainThreadPhase = MTP_USER_CODE;
@@ -1007,6 +1017,7 @@ void Processes::MakeRootRequest(TaskData *taskData, MainThreadRequest *request)
         // Now the other requests have been dealt with (and we have schedLock).
         request->completed = false;
         threadRequest = request;
+        threadRequestTime = HeapSizeParameters::StartGCPhase();
         // Wait for it to complete.
         while (! request->completed)
         {
@@ -1021,12 +1032,14 @@ void Processes::MakeRootRequest(TaskData *taskData, MainThreadRequest *request)
 PolyWord *Processes::FindAllocationSpace(TaskData *taskData, POLYUNSIGNED words, bool alwaysInSeg)
 {
     bool triedInterrupt = false;
+    // Very large objects are put in spaces of their own so they are never copied.
+    const bool largeObject = ! alwaysInSeg && gMem.IsLargeObject(words);
 
     while (1)
     {
         // After a GC allocPointer and allocLimit are zero and when allocating the
         // heap segment we request a minimum of zero words.
-        if (taskData->allocPointer != 0 && taskData->allocPointer >= taskData->allocLimit + words)
+        if (! largeObject && taskData->allocPointer != 0 && taskData->allocPointer >= taskData->allocLimit + words)
         {
             // There's space in the current segment,
             taskData->allocPointer -= words;
@@ -1034,11 +1047,17 @@ PolyWord *Processes::FindAllocationSpace(TaskData *taskData, POLYUNSIGNED words,
         }
         else // Insufficient space in this area. 
         {
-            if (words > taskData->allocSize && ! alwaysInSeg)
+            if (largeObject)
+            {
+                PolyWord *foundSpace = gMem.AllocLargeObject(words);
+                if (foundSpace) return foundSpace;
+            }
+            else if (words > taskData->allocSize && ! alwaysInSeg)
             {
                 // If the object we want is larger than the heap segment size
                 // we allocate it separately rather than in the segment.
-                PolyWord *foundSpace = gMem.AllocHeapSpace(words);
+                POLYUNSIGNED spaceSize = words;
+                PolyWord *foundSpace = gMem.AllocHeapSegment(words, spaceSize, taskData->allocSpace);
                 if (foundSpace) return foundSpace;
             }
             else
@@ -1049,12 +1068,15 @@ PolyWord *Processes::FindAllocationSpace(TaskData *taskData, POLYUNSIGNED words,
                 POLYUNSIGNED requestSpace = taskData->allocSize+words;
                 POLYUNSIGNED spaceSize = requestSpace;
                 // Get the space and update spaceSize with the actual size.
-                PolyWord *space = gMem.AllocHeapSpace(words, spaceSize);
+                // This normally comes from the same space as last time without locking.
+                PolyWord *space = gMem.AllocHeapSegment(words, spaceSize, taskData->allocSpace);
                 if (space)
                 {
                     // Double the allocation size for the next time if
-                    // we succeeded in allocating the whole space.
+                    // we succeeded in allocating the whole space.  The size is
+                    // adjusted to what the thread has actually used at the next GC.
                     taskData->allocCount++; 
+                    taskData->allocWords += spaceSize;
                     if (spaceSize == requestSpace) taskData->allocSize = taskData->allocSize*2;
                     taskData->allocLimit = space;
                     taskData->allocPointer = space+spaceSize;
@@ -1515,8 +1537,12 @@ void Processes::BeginRootThread(PolyObject *rootFunction)
 
         if (allStopped && threadRequest != 0)
         {
+            HeapSizeParameters::EndGCPause(PSH_SAFEPOINT, threadRequestTime);
             mainThreadPhase = threadRequest->mtp;
             gMem.ProtectImmutable(false); // GC, sharing and export may all write to the immutable area
+            // Anything other than the GC must not see the marks of a concurrent GC.
+            if (threadRequest->mtp != MTP_GCPHASEMARK)
+                AbandonConcurrentGC();
             threadRequest->Perform();
             gMem.ProtectImmutable(true);
             mainThreadPhase = MTP_USER_CODE;
@@ -2157,21 +2183,26 @@ void TaskData::GarbageCollect(ScanAddress *process)
     }
     if (blockMutex != 0)
         process->ScanRuntimeAddress(&blockMutex, ScanAddress::STRENGTH_STRONG);
-    // The allocation spaces are no longer valid.
-    allocPointer = 0;
-    allocLimit = 0;
-    // Divide the allocation size by four. If we have made a single allocation
-    // since the last GC the size will have been doubled after the allocation.
-    // On average for each thread, apart from the one that ran out of space
-    // and requested the GC, half of the space will be unused so reducing by
-    // four should give a good estimate for next time.
+    // Set the segment size from the amount this thread actually used since
+    // the last GC.  Aim to get about four segments between GCs.  That bounds
+    // the space left unused in the last segment at the GC while a thread that
+    // allocates a lot still only needs a few segments.  The size grows again
+    // by doubling if the thread allocates more than that.
     if (allocCount != 0)
     { // Do this only once for each GC.
+        POLYUNSIGNED used = allocWords - (allocPointer - allocLimit);
         allocCount = 0;
-        allocSize = allocSize/4;
+        allocWords = 0;
+        allocSize = used/4;
         if (allocSize < MIN_HEAP_SIZE)
             allocSize = MIN_HEAP_SIZE;
     }
+    // The allocation spaces are no longer valid.
+    allocPointer = 0;
+    allocLimit = 0;
+    allocSpace = 0;
+    // The code block goes back on the free lists.  A major GC rebuilds the lists.
+    gMem.ReleaseCodeCache(this);
     process->ScanRuntimeWord(&foreignStack);
 }
 
@@ -40,6 +40,8 @@
 class SaveVecEntry;
 typedef SaveVecEntry *Handle;
 class StackSpace;
+class LocalMemSpace;
+class CodeSpace;
 class PolyWord;
 class ScanAddress;
 class MDTaskData;
@@ -148,6 +150,11 @@ public:
     PolyWord    *allocLimit;    // ... lower limit of allocation
     POLYUNSIGNED allocSize;     // The preferred heap segment size
     unsigned    allocCount;     // The number of allocations since the last GC
+    POLYUNSIGNED allocWords;    // Words in the segments allocated since the last GC
+    LocalMemSpace *allocSpace;  // Space the last segment came from.  Reset by the GC.
+    CodeSpace   *codeCacheSpace; // Block of code space used for small code objects...
+    PolyWord    *codeCachePtr;  // ... next free word.  This is the length word of a free cell...
+    PolyWord    *codeCacheTop;  // ... that extends to here.  Returned to the free lists by the GC.
     StackSpace  *stack;
     ThreadObject *threadObject;  // Pointer to the thread object.
     int         lastError;      // Last error from foreign code.
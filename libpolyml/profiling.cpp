@@ -494,6 +494,8 @@ void ProfileRequest::Perform()
       
     case kProfileTime:
         profileMode = kProfileTime;
+        // Index the permanent code so that the signal handler can find it quickly.
+        gMem.BuildPermanentCodeIndex();
         processes->StartProfiling();
         break;
 
@@ -21,6 +21,24 @@
 This is a quick copying garbage collector that moves all the data out of
 the allocation areas and into the mutable and immutable areas.  If either of
 these has filled up it fails and a full garbage collection must be done.
+
+Old mutable objects may refer to objects in the allocation areas and so are
+roots.  When the code calls a write barrier on every store into a mutable
+object the mutable spaces have card tables and only the dirty cards are
+scanned.  At present only the byte code interpreter has a write barrier.
+The native x86 code generator and its assembly code helpers store directly
+without marking cards, so with native code no card tables are created and
+the whole of each old mutable space is scanned as before.
+
+If the tenuring threshold is more than one objects copied out of the
+allocation areas go into survivor spaces rather than the mutable and immutable
+areas.  Each survivor space holds objects of a single age, the number of minor
+GCs they have survived, and the survivor spaces are emptied by the next minor
+GC in the same way as the allocation areas.  Objects are copied into the old
+areas when they reach the threshold or if there is no room for them in a
+survivor space.  Old objects that refer to survivors are remembered and are
+roots for the next minor GC.  A major GC turns the survivor spaces into
+ordinary old spaces.
 */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -56,52 +74,152 @@ these has filled up it fails and a full garbage collection must be done.
 #include "heapsizing.h"
 #include "gctaskfarm.h"
 #include "statistics.h"
+#include "machine_dep.h"
+#include "mpoly.h"
 
 // This protects access to the gMem.lSpace table.
 static PLock localTableLock("Minor GC tables");
 
+// The dirty cards are scanned in chunks of this many cards.
+#define CARD_CHUNK_SIZE     4096
+
 static bool succeeded = true;
 
+// In NUMA mode we count the words copied and how many of these were copied
+// from a space on a different node from the thread doing the copying.
+static POLYUNSIGNED numaWordsCopied, numaRemoteWords;
+// The words copied into survivor spaces, the words promoted into the old
+// spaces and how many of those had not reached the tenuring threshold.
+static POLYUNSIGNED survivorWords, promotedWords, prematureWords;
+static PLock countLock("Minor GC counts");
+
+// Old objects that referred to objects in the survivor spaces at the end of
+// the last minor GC.  They are scanned as roots by the next minor GC.
+static std::vector<PolyObject*> rememberedObjects;
+
+// True if the concurrent markers were running when this minor GC started.  The
+// objects it copies are passed to the markers when they are restarted.
+static bool greyCopies;
+static std::vector<PolyObject*> copiedObjects;
+
+// The age given to objects in the old spaces.
+#define TENURED_AGE     ((unsigned)-1)
+
 class QuickGCScanner: public ScanAddress
 {
 public:
-    QuickGCScanner(bool r): rootScan(r) {}
+    QuickGCScanner(bool r): rootScan(r), numaNode(gMem.CurrentNumaNode()), wordsCopied(0), remoteWords(0),
+        survivorCopied(0), promoted(0), premature(0), oldObjects(true), scanObject(0), lastRemembered(0) {}
     virtual ~QuickGCScanner() {}
 
     // Overrides for ScanAddress class
     virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt);
     virtual PolyObject *ScanObjectAddress(PolyObject *base);
+    virtual void ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthWord);
+    void ScanAddressesInObject(PolyObject *base)
+        { ScanAddressesInObject(base, base->LengthWord()); }
+    // Scan the part of a card that lies within a region of old objects.
+    void ScanCardInRegion(CardTable *cards, POLYUNSIGNED card, PolyWord *regionStart, PolyWord *regionEnd);
+    // Set whether the objects that are going to be scanned are old.
+    void SetOldObjects(bool old) { oldObjects = old; }
+    // Add the counts of copied words and the remembered objects to the totals.
+    void AddCounts(void);
 private:
-    PolyObject *FindNewAddress(PolyObject *obj, POLYUNSIGNED L, LocalMemSpace *srcSpace);
-    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable) = 0;
+    PolyObject *FindNewAddress(PolyObject *obj, POLYUNSIGNED L, LocalMemSpace *srcSpace, unsigned age);
+    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable, unsigned age) = 0;
+    void Remember(PolyObject *obj);
 protected:
     bool objectCopied;
+    unsigned copiedAge; // The age of the space the last object was copied into.
     bool rootScan;
+    unsigned numaNode; // The node this thread is running on.
+    POLYUNSIGNED wordsCopied, remoteWords;
+    POLYUNSIGNED survivorCopied, promoted, premature;
+    // True if the objects being scanned are old.  If they refer to survivors
+    // they must be remembered.
+    bool oldObjects;
+    PolyObject *scanObject; // The object being scanned or zero if these are roots.
+    PolyObject *lastRemembered;
+    std::vector<PolyObject*> remembered;
+    std::vector<PolyObject*> copied;
 };
 
+void QuickGCScanner::AddCounts()
+{
+    PLocker l(&countLock);
+    if (gMem.NumaNodes() > 1)
+    {
+        numaWordsCopied += wordsCopied;
+        numaRemoteWords += remoteWords;
+    }
+    survivorWords += survivorCopied;
+    promotedWords += promoted;
+    prematureWords += premature;
+    try {
+        rememberedObjects.insert(rememberedObjects.end(), remembered.begin(), remembered.end());
+        copiedObjects.insert(copiedObjects.end(), copied.begin(), copied.end());
+    }
+    catch (std::bad_alloc &) {
+        succeeded = false;
+    }
+    remembered.clear();
+    copied.clear();
+    wordsCopied = remoteWords = 0;
+    survivorCopied = promoted = premature = 0;
+}
+
+// True if this is a survivor space that is being copied into.
+static bool IsSurvivor(LocalMemSpace *space)
+{
+    return space != 0 && space->survivorSpace && ! space->survivorEvacuate;
+}
+
+// Whether a survivor space can be used for new objects of the given age.
+static bool SurvivorSpaceFor(LocalMemSpace *space, POLYUNSIGNED n, bool isMutable, unsigned age)
+{
+    return space->survivorSpace && ! space->survivorEvacuate && space->isMutable == isMutable &&
+        (space->survivorAge == age || space->allocatedSpace() == 0) && space->freeSpace() > n /* At least n+1*/;
+}
+
+static LocalMemSpace *NewSurvivorSpace(POLYUNSIGNED n, bool isMutable, unsigned age, unsigned node)
+{
+    LocalMemSpace *space = gHeapSizeParameters.AddSpaceInMinorGC(n+1, isMutable, node);
+    if (space != 0)
+    {
+        space->survivorSpace = true;
+        space->survivorAge = age;
+    }
+    return space;
+}
+
 class RootScanner: public QuickGCScanner
 {
 public:
-    RootScanner(): QuickGCScanner(true), mutableSpace(0), immutableSpace(0) {}
+    RootScanner(): QuickGCScanner(true), mutableSpace(0), immutableSpace(0),
+        mutableSurvivor(0), immutableSurvivor(0) {}
 private:
-    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable);
+    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable, unsigned age);
     LocalMemSpace *mutableSpace, *immutableSpace;
+    LocalMemSpace *mutableSurvivor, *immutableSurvivor;
 };
 
 class ThreadScanner: public QuickGCScanner
 {
 public:
     ThreadScanner(GCTaskId* id): QuickGCScanner(false), taskID(id), mutableSpace(0), immutableSpace(0),
-        spaceTable(0), nOwnedSpaces(0) {}
+        mutableSurvivor(0), immutableSurvivor(0), spaceTable(0), nOwnedSpaces(0) {}
     virtual ~ThreadScanner() { free(spaceTable); }
 
     void ScanOwnedAreas(void);
+    void ScanDirtyCards(LocalMemSpace *space, PolyWord *chunkStart);
 private:
-    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable);
+    virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable, unsigned age);
+    LocalMemSpace *FindSurvivorSpace(POLYUNSIGNED length, bool isMutable, unsigned age);
     bool TakeOwnership(LocalMemSpace *space);
 
     GCTaskId *taskID;
     LocalMemSpace *mutableSpace, *immutableSpace;
+    LocalMemSpace *mutableSurvivor, *immutableSurvivor;
     LocalMemSpace **spaceTable;
     unsigned nOwnedSpaces;
 };
@@ -178,13 +296,20 @@ static bool atomiclySetForwarding(LocalMemSpace *space, POLYUNSIGNED *pt,
 #endif
 }
 
-PolyObject *QuickGCScanner::FindNewAddress(PolyObject *obj, POLYUNSIGNED L, LocalMemSpace *srcSpace)
+PolyObject *QuickGCScanner::FindNewAddress(PolyObject *obj, POLYUNSIGNED L, LocalMemSpace *srcSpace, unsigned age)
 {
     bool isMutable = OBJ_IS_MUTABLE_OBJECT(L);
     POLYUNSIGNED n = OBJ_OBJECT_LENGTH(L);
-    LocalMemSpace *lSpace = FindSpace(n, isMutable);
+    LocalMemSpace *lSpace = FindSpace(n, isMutable, age);
+    if (lSpace == 0 && age != TENURED_AGE)
+    {
+        // If there's no room in a survivor space promote it.
+        age = TENURED_AGE;
+        lSpace = FindSpace(n, isMutable, age);
+    }
     if (lSpace == 0)
         return 0; // Unable to move it.
+    copiedAge = age;
     PolyObject *newObject = (PolyObject*)(lSpace->lowerAllocPtr+1);
 
     // It's possible that another thread may have actually copied the 
@@ -226,13 +351,44 @@ PolyObject *QuickGCScanner::FindNewAddress(PolyObject *obj, POLYUNSIGNED L, Loca
     lSpace->lowerAllocPtr += n+1;
     CopyObjectToNewAddress(obj, newObject, L);
     objectCopied = true;
+    if (greyCopies)
+    {
+        try {
+            copied.push_back(newObject);
+        }
+        catch (std::bad_alloc &) {
+            succeeded = false;
+        }
+    }
+    wordsCopied += n+1;
+    if (srcSpace->numaNode != numaNode)
+        remoteWords += n+1;
     return newObject;
 }
 
 // When scanning the roots we want to distribute the data among the immutable and mutable areas
 // so that the work is distributed for the scanning threads.
-LocalMemSpace *RootScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
+LocalMemSpace *RootScanner::FindSpace(POLYUNSIGNED n, bool isMutable, unsigned age)
 {
+    if (age != TENURED_AGE)
+    {
+        LocalMemSpace *&survivor = isMutable ? mutableSurvivor : immutableSurvivor;
+        if (survivor != 0 && survivor->survivorAge == age && survivor->freeSpace() > n)
+            return survivor;
+        for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        {
+            if (SurvivorSpaceFor(*i, n, isMutable, age))
+            {
+                survivor = *i;
+                survivor->survivorAge = age;
+                return survivor;
+            }
+        }
+        LocalMemSpace *sp = NewSurvivorSpace(n, isMutable, age, numaNode);
+        if (sp != 0) survivor = sp;
+        return sp;
+    }
+
     LocalMemSpace *lSpace = isMutable ? mutableSpace : immutableSpace;
 
     if (lSpace != 0)
@@ -246,7 +402,7 @@ LocalMemSpace *RootScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
     for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *sp = *i;
-        if (sp->isMutable == isMutable && !sp->allocationSpace &&
+        if (sp->isMutable == isMutable && !sp->allocationSpace && !sp->largeObjectSpace && !sp->survivorSpace &&
                 (lSpace == 0 || sp->freeSpace() > lSpace->freeSpace()))
             lSpace = sp;
     }
@@ -257,12 +413,15 @@ LocalMemSpace *RootScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
         return lSpace;
     }
 
-    return gHeapSizeParameters.AddSpaceInMinorGC(n+1, isMutable);
+    return gHeapSizeParameters.AddSpaceInMinorGC(n+1, isMutable, numaNode);
 }
 
 // When scanning within a thread we don't want to be searching the space table.
-LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
+LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable, unsigned age)
 {
+    if (age != TENURED_AGE)
+        return FindSurvivorSpace(n, isMutable, age);
+
     LocalMemSpace *lSpace = isMutable ? mutableSpace : immutableSpace;
 
     if (lSpace != 0)
@@ -275,8 +434,8 @@ LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
     for (unsigned i = 0; i < nOwnedSpaces; i++)
     {
         lSpace = spaceTable[i];
-        if (lSpace->isMutable == isMutable &&
-            ! lSpace->allocationSpace && lSpace->freeSpace() > n /* At least n+1*/)
+        if (lSpace->isMutable == isMutable && ! lSpace->allocationSpace &&
+            ! lSpace->largeObjectSpace && ! lSpace->survivorSpace && lSpace->freeSpace() > n /* At least n+1*/)
         {
             if (n < 10)
             {
@@ -293,33 +452,83 @@ LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
     // we need a lock here.
     if (taskID != 0)
     {
-        // See if we can take a space that is currently unused.
-        for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        // See if we can take a space that is currently unused.  In NUMA mode we
+        // first look for one on our own node and then on any other node.  Only
+        // if there is none do we create a new space.
+        const bool numaMode = gMem.NumaNodes() > 1;
+        for (unsigned pass = numaMode ? 0 : 1; pass < 2; pass++)
         {
-            lSpace = *i;
-            if (lSpace->spaceOwner == 0 && lSpace->isMutable == isMutable &&
-                ! lSpace->allocationSpace && lSpace->freeSpace() > n /* At least n+1*/)
+            for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
             {
-                if (debugOptions & DEBUG_GC_ENHANCED)
-                    Log("GC: Quick: Thread %p is taking ownership of space %p\n", taskID, lSpace);
-                if (! TakeOwnership(lSpace))
-                    return 0;
-                return lSpace;
+                lSpace = *i;
+                if (lSpace->spaceOwner == 0 && lSpace->isMutable == isMutable && ! lSpace->allocationSpace &&
+                    ! lSpace->largeObjectSpace && ! lSpace->survivorSpace && lSpace->freeSpace() > n /* At least n+1*/ &&
+                    (pass == 1 || lSpace->numaNode == numaNode))
+                {
+                    if (debugOptions & DEBUG_GC_ENHANCED)
+                        Log("GC: Quick: Thread %p is taking ownership of space %p\n", taskID, lSpace);
+                    if (! TakeOwnership(lSpace))
+                        return 0;
+                    return lSpace;
+                }
             }
         }
     }
 
-    lSpace = gHeapSizeParameters.AddSpaceInMinorGC(n+1, isMutable);
+    lSpace = gHeapSizeParameters.AddSpaceInMinorGC(n+1, isMutable, numaNode);
     if (lSpace != 0 && TakeOwnership(lSpace))
         return lSpace;
     return 0;
 }
 
+// Find a survivor space for an object of the given age.  This is similar to
+// FindSpace but an empty survivor space can be taken for any age.
+LocalMemSpace *ThreadScanner::FindSurvivorSpace(POLYUNSIGNED n, bool isMutable, unsigned age)
+{
+    LocalMemSpace *&survivor = isMutable ? mutableSurvivor : immutableSurvivor;
+    if (survivor != 0 && survivor->survivorAge == age && survivor->freeSpace() > n)
+        return survivor;
+
+    for (unsigned i = 0; i < nOwnedSpaces; i++)
+    {
+        LocalMemSpace *lSpace = spaceTable[i];
+        if (lSpace->survivorAge == age && SurvivorSpaceFor(lSpace, n, isMutable, age))
+        {
+            survivor = lSpace;
+            return lSpace;
+        }
+    }
+
+    PLocker l(&localTableLock);
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        if (lSpace->spaceOwner == 0 && SurvivorSpaceFor(lSpace, n, isMutable, age))
+        {
+            if (! TakeOwnership(lSpace))
+                return 0;
+            lSpace->survivorAge = age;
+            survivor = lSpace;
+            return lSpace;
+        }
+    }
+
+    LocalMemSpace *lSpace = NewSurvivorSpace(n, isMutable, age, numaNode);
+    if (lSpace == 0 || ! TakeOwnership(lSpace))
+        return 0;
+    survivor = lSpace;
+    return lSpace;
+}
+
 // Copy all the objects.
 POLYUNSIGNED QuickGCScanner::ScanAddressAt(PolyWord *pt)
 {
     POLYUNSIGNED n = 1; // Set up the loop to process one word at *pt
     pt++;
+    // The object containing *pt and whether it is old.  These change if we go
+    // on to scan an object we have copied.
+    PolyObject *container = scanObject;
+    bool old = oldObjects;
     
     while (n-- != 0)
     {
@@ -329,8 +538,10 @@ POLYUNSIGNED QuickGCScanner::ScanAddressAt(PolyWord *pt)
             LocalMemSpace *space = gMem.LocalSpaceForAddress(val.AsStackAddr()-1);
 
             // We only copy it if it is in a local allocation space and not in the
-            // "overflow" area of data that could not copied by the last full GC.
-            if (space != 0 && space->allocationSpace && val.AsAddress() <= space->upperAllocPtr)
+            // "overflow" area of data that could not copied by the last full GC
+            // or if it is in a survivor space that is being emptied.
+            if (space != 0 && ((space->allocationSpace && val.AsAddress() <= space->upperAllocPtr) ||
+                    space->survivorEvacuate))
             {
                 // We shouldn't get code addresses since we handle code
                 // segments separately so if this isn't an integer it must be an object address.
@@ -344,11 +555,19 @@ POLYUNSIGNED QuickGCScanner::ScanAddressAt(PolyWord *pt)
                 // Has it been moved already? N.B.  Another thread may be in the process of
                 // moving it so the new object may not be fully copied.
                 if (OBJ_IS_POINTER(L))
+                {
                     *pt = OBJ_GET_POINTER(L);
+                    if (old && userOptions.tenureThreshold > 1 &&
+                            IsSurvivor(gMem.LocalSpaceForAddress(pt->AsStackAddr()-1)))
+                        Remember(container);
+                }
                 else
                 {
-                    // We need to copy this object.
-                    PolyObject *newObject = FindNewAddress(obj, L, space); // New address of object.
+                    // We need to copy this object.  It goes into the survivor space for
+                    // the next age unless it has reached the threshold.
+                    unsigned nextAge = space->survivorEvacuate ? space->survivorAge+1 : 1;
+                    unsigned newAge = nextAge >= userOptions.tenureThreshold ? TENURED_AGE : nextAge;
+                    PolyObject *newObject = FindNewAddress(obj, L, space, newAge); // New address of object.
 
                     if (newObject == 0) { // Couldn't copy it - not enough space.
                         succeeded = false;
@@ -368,6 +587,25 @@ POLYUNSIGNED QuickGCScanner::ScanAddressAt(PolyWord *pt)
                     if (debugOptions & DEBUG_GC_DETAIL)
                         Log("GC: Quick: %p %lu %u moved to %p\n", obj, OBJ_OBJECT_LENGTH(L), GetTypeBits(L), newObject);
 
+                    if (objectCopied)
+                    {
+                        POLYUNSIGNED words = OBJ_OBJECT_LENGTH(L) + 1;
+                        if (copiedAge != TENURED_AGE)
+                            survivorCopied += words;
+                        else
+                        {
+                            promoted += words;
+                            if (nextAge < userOptions.tenureThreshold)
+                                premature += words;
+                        }
+                    }
+
+                    // If an old object now refers to a survivor it must be scanned by the
+                    // next minor GC.  Check this before we follow the new object.
+                    if (old && userOptions.tenureThreshold > 1 &&
+                            IsSurvivor(gMem.LocalSpaceForAddress((PolyWord*)newObject-1)))
+                        Remember(container);
+
                     // Stop now unless this is a simple word object we have been able to move.
                     // Also stop if we're just scanning the roots.
                     if (! rootScan && newObject != obj && ! OBJ_IS_MUTABLE_OBJECT(L) && 
@@ -380,15 +618,44 @@ POLYUNSIGNED QuickGCScanner::ScanAddressAt(PolyWord *pt)
                         // for lists.
                         n = OBJ_OBJECT_LENGTH(L); // Object length
                         pt = (PolyWord*)newObject + n;
+                        container = newObject;
+                        old = copiedAge == TENURED_AGE;
+                        continue;
                     }
                 }
             }
+            // An old object may refer to a survivor that is not being moved.
+            else if (old && userOptions.tenureThreshold > 1 && IsSurvivor(space))
+                Remember(container);
         }
     }
     // We've reached the end without finding a pointer to follow
     return 0;
 }
 
+// Record the object being scanned.  This is used if we need to remember it.
+void QuickGCScanner::ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthWord)
+{
+    scanObject = base;
+    ScanAddress::ScanAddressesInObject(base, lengthWord);
+    scanObject = 0;
+}
+
+// Add an old object to the objects to be scanned by the next minor GC.  Roots
+// are always scanned so they don't need to be remembered.
+void QuickGCScanner::Remember(PolyObject *obj)
+{
+    if (obj == 0 || obj == lastRemembered)
+        return;
+    lastRemembered = obj;
+    try {
+        remembered.push_back(obj);
+    }
+    catch (std::bad_alloc &) {
+        succeeded = false;
+    }
+}
+
 // The initial entry to process the roots.  Also used when processing the addresses
 // in objects that can't be handled by ScanAddressAt.
 PolyObject *QuickGCScanner::ScanObjectAddress(PolyObject *base)
@@ -422,8 +689,87 @@ bool ThreadScanner::TakeOwnership(LocalMemSpace *space)
 static void scanArea(GCTaskId *id, void *arg1, void *arg2)
 {
     ThreadScanner marker(id);
+    marker.SetOldObjects(! IsSurvivor(gMem.LocalSpaceForAddress(arg1)));
     marker.ScanAddressesInRegion((PolyWord*)arg1, (PolyWord*)arg2);
     marker.ScanOwnedAreas();
+    marker.AddCounts();
+}
+
+// Thread function to scan the dirty cards within a chunk of a mutable space.
+static void scanCards(GCTaskId *id, void *arg1, void *arg2)
+{
+    ThreadScanner marker(id);
+    marker.ScanDirtyCards((LocalMemSpace*)arg1, (PolyWord*)arg2);
+    marker.ScanOwnedAreas();
+    marker.AddCounts();
+}
+
+// Scan the dirty cards in a chunk.  Only the old data, between the bottom of the
+// space and the value of lowerAllocPtr at the start of the GC and between
+// upperAllocPtr and the top, is scanned.  Any objects added by this GC are
+// scanned when the space is processed.
+void ThreadScanner::ScanDirtyCards(LocalMemSpace *space, PolyWord *chunkStart)
+{
+    CardTable *cards = &space->cards;
+    POLYUNSIGNED endCard = cards->CardNo(chunkStart) + CARD_CHUNK_SIZE;
+    if (endCard > cards->CardCount()) endCard = cards->CardCount();
+    for (POLYUNSIGNED card = cards->FindDirty(cards->CardNo(chunkStart), endCard);
+         card < endCard; card = cards->FindDirty(card+1, endCard))
+    {
+        cards->ClearDirty(card);
+        ScanCardInRegion(cards, card, space->bottom, space->partialGCRootBase);
+        ScanCardInRegion(cards, card, space->upperAllocPtr, space->top);
+        if (! succeeded)
+            return;
+    }
+}
+
+void QuickGCScanner::ScanCardInRegion(CardTable *cards, POLYUNSIGNED card, PolyWord *regionStart, PolyWord *regionEnd)
+{
+    PolyWord *cardStart = cards->CardAddr(card);
+    PolyWord *cardEnd = cardStart + CARD_WORDS;
+    PolyWord *start = cardStart < regionStart ? regionStart : cardStart;
+    PolyWord *end = cardEnd > regionEnd ? regionEnd : cardEnd;
+    if (start >= end)
+        return;
+    // Find the first object.  If the card begins before the region the
+    // first object is at the start of the region.
+    PolyWord *pt = cardStart <= regionStart ? regionStart : cards->CardObject(card);
+    while (pt < end)
+    {
+        PolyObject *obj = (PolyObject*)(pt+1);
+        if (obj->ContainsForwardingPtr())
+        {
+            // Skip over moved objects as ScanAddressesInRegion does.
+            pt += obj->FollowForwardingChain()->Length() + 1;
+            continue;
+        }
+        POLYUNSIGNED L = obj->LengthWord();
+        POLYUNSIGNED length = OBJ_OBJECT_LENGTH(L);
+        if (OBJ_IS_CODE_OBJECT(L))
+        {
+            // Code objects are not normally in mutable spaces.  Scan the
+            // whole object once when we reach the card containing the length word.
+            if (pt >= start)
+                ScanAddressesInObject(obj, L);
+        }
+        else if (! OBJ_IS_BYTE_OBJECT(L))
+        {
+            // Only scan the words of the object that are within the card.
+            PolyWord *first = (PolyWord*)obj < start ? start : (PolyWord*)obj;
+            PolyWord *last = (PolyWord*)obj + length > end ? end : (PolyWord*)obj + length;
+            scanObject = obj;
+            for (PolyWord *w = first; w < last; w++)
+            {
+                if (! w->IsTagged() && *w != PolyWord::FromUnsigned(0))
+                    ScanAddressAt(w);
+                if (! succeeded)
+                    return;
+            }
+            scanObject = 0;
+        }
+        pt += length + 1;
+    }
 }
 
 void ThreadScanner::ScanOwnedAreas()
@@ -444,6 +790,7 @@ void ThreadScanner::ScanOwnedAreas()
         for (unsigned l = 0; l < nOwnedSpaces; l++)
         {
             LocalMemSpace *space = spaceTable[l];
+            SetOldObjects(! IsSurvivor(space));
             // Scan the area.  This may well result in more data being added
             while (space->partialGCScan < space->lowerAllocPtr)
             {
@@ -496,14 +843,26 @@ void ThreadScanner::ScanOwnedAreas()
 
 bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
 {
+    // Minor GCs continue while the concurrent markers are running.  Once they
+    // have finished the marking is completed with a full GC.
+    if (concurrentMarking && ConcurrentMarkFinished())
+    {
+        (void)gHeapSizeParameters.RunMajorGCImmediately();
+        return false;
+    }
     // If the last minor GC took too long force a full GC.
-    if (gHeapSizeParameters.RunMajorGCImmediately())
+    if (! concurrentMarking && gHeapSizeParameters.RunMajorGCImmediately())
         return false;
+    // The markers are stopped while we copy objects.
+    greyCopies = concurrentMarking;
+    GCConcurrentMarkStop();
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeStart);
     globalStats.incCount(PSC_GC_PARTIALGC);
     mainThreadPhase = MTP_GCQUICK;
     succeeded = true;
+    numaWordsCopied = numaRemoteWords = 0;
+    survivorWords = promotedWords = prematureWords = 0;
 
     if (debugOptions & DEBUG_GC)
         Log("GC: Beginning quick GC\n");
@@ -519,35 +878,74 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
         ASSERT (lSpace->top >= lSpace->upperAllocPtr);
         ASSERT (lSpace->upperAllocPtr >= lSpace->lowerAllocPtr);
         ASSERT (lSpace->lowerAllocPtr >= lSpace->bottom);
+        // Survivor spaces containing objects are emptied like the allocation
+        // areas.  Their objects are not roots.
+        lSpace->survivorEvacuate = lSpace->survivorSpace && lSpace->allocatedSpace() != 0;
+        // If the space has an up-to-date card table we only need to scan
+        // the dirty cards in the old data.
+        lSpace->partialGCCards =
+            lSpace->cards.valid && lSpace->isMutable && ! lSpace->allocationSpace && ! lSpace->survivorSpace;
         // Remember the top before we started this GC.  It's
         // only relevant for mutable areas.  It avoids us rescanning
         // objects that may have been added to the space as a result of
         // scanning another space.
-        if (lSpace->isMutable)
+        if (lSpace->isMutable && ! lSpace->partialGCCards && ! lSpace->survivorSpace)
             lSpace->partialGCTop = lSpace->upperAllocPtr;
         else lSpace->partialGCTop = lSpace->top;
         // If we're scanning a space this is where we start.
         // For immutable areas this only includes newly added
         // data but for mutable areas we have to scan data added
-        // by previous partial GCs.
-        if (lSpace->isMutable && ! lSpace->allocationSpace)
+        // by previous partial GCs unless we are using the cards.
+        if (lSpace->isMutable && ! lSpace->allocationSpace && ! lSpace->partialGCCards && ! lSpace->survivorSpace)
             lSpace->partialGCRootBase = lSpace->bottom;
         else lSpace->partialGCRootBase = lSpace->lowerAllocPtr;
         lSpace->spaceOwner = 0; // Not currently owned
         // Add up the space in the mutable and immutable areas
-        if (! lSpace->allocationSpace)
+        if (! lSpace->allocationSpace && ! lSpace->survivorEvacuate)
             spaceBeforeGC += lSpace->allocatedSpace();
     }
 
     // First scan the roots, copying the data into the mutable and immutable areas.
     RootScanner rootScan;
+    // Old objects that referred to survivors at the end of the last minor GC.
+    {
+        std::vector<PolyObject*> lastRemembered;
+        lastRemembered.swap(rememberedObjects);
+        for (std::vector<PolyObject*>::iterator i = lastRemembered.begin(); i < lastRemembered.end(); i++)
+            rootScan.ScanAddressesInObject(*i);
+    }
+    // Objects that the concurrent markers have still to process.
+    if (greyCopies)
+        GCConcurrentMarkScanRoots(&rootScan);
     // Scan the permanent mutable areas.  This could be parallelised but it doesn't
-    // appear to be worthwhile at the moment.
+    // appear to be worthwhile at the moment.  The layout of a permanent space never
+    // changes so once we have built the card table we only need to scan the dirty cards.
     for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
     {
         PermanentMemSpace *space = *i;
         if (space->isMutable && ! space->byteOnly)
-            rootScan.ScanAddressesInRegion(space->bottom, space->top);
+        {
+            CardTable *cards = &space->cards;
+            if (cards->valid)
+            {
+                const POLYUNSIGNED nCards = cards->CardCount();
+                for (POLYUNSIGNED card = cards->FindDirty(0, nCards); card < nCards;
+                     card = cards->FindDirty(card+1, nCards))
+                {
+                    cards->ClearDirty(card);
+                    rootScan.ScanCardInRegion(cards, card, space->bottom, space->top);
+                }
+            }
+            else
+            {
+                rootScan.ScanAddressesInRegion(space->bottom, space->top);
+                if (machineDependent->HasWriteBarrier() && cards->Create(space->bottom, space->top))
+                {
+                    cards->SetObjects(space->bottom, space->top);
+                    cards->valid = true;
+                }
+            }
+        }
     }
     // Scan code spaces.  
     for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
@@ -566,8 +964,11 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
         }
     }
 
-    // Scan RTS addresses.  This will include the thread stacks.
+    // Scan RTS addresses.  This will include the thread stacks.  These are
+    // scanned on every GC so they never need to be remembered.
+    rootScan.SetOldObjects(false);
     GCModules(&rootScan);
+    rootScan.AddCounts();
 
     // At this point the immutable and mutable areas will have some root objects
     // in the space between partialGCRootBase (the old value of lowerAllocPtr) and
@@ -613,6 +1014,18 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
                 gpTaskFarm->AddWorkOrRunNow(scanArea, space->partialGCRootBase, space->partialGCRootTop);
             if (space->partialGCTop != space->top)
                 gpTaskFarm->AddWorkOrRunNow(scanArea, space->partialGCTop, space->top);
+            if (space->partialGCCards)
+            {
+                // Create a task for each chunk that contains a dirty card.
+                CardTable *cards = &space->cards;
+                const POLYUNSIGNED nCards = cards->CardCount();
+                for (POLYUNSIGNED c = 0; c < nCards; c += CARD_CHUNK_SIZE)
+                {
+                    POLYUNSIGNED n = nCards - c < CARD_CHUNK_SIZE ? nCards - c : CARD_CHUNK_SIZE;
+                    if (cards->FindDirty(c, c+n) != c+n)
+                        gpTaskFarm->AddWorkOrRunNow(scanCards, space, cards->CardAddr(c));
+                }
+            }
         }
     }
 
@@ -641,8 +1054,31 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
                 globalStats.incSize(PSS_ALLOCATION, free*sizeof(PolyWord));
                 globalStats.incSize(PSS_ALLOCATION_FREE, free*sizeof(PolyWord));
             }
+            else if (lSpace->survivorEvacuate)
+            {
+                // The survivors have all been copied out.  The space can be reused.
+                lSpace->lowerAllocPtr = lSpace->bottom;
+                lSpace->survivorEvacuate = false;
+                // Remove any marks made by the concurrent markers.
+                if (greyCopies)
+                    lSpace->bitmap.ClearBits(0, lSpace->spaceSize());
+                free = lSpace->freeSpace();
+#ifdef FILL_UNUSED_MEMORY
+                memset(lSpace->bottom, 0xaa, (char*)lSpace->upperAllocPtr - (char*)lSpace->bottom);
+#endif
+            }
             else free = lSpace->freeSpace();
 
+            // Record the objects added to the space by this GC in the card table.
+            // If the table was not up to date we have scanned the whole space
+            // so we can rebuild it now.
+            if (lSpace->cards.Created() && ! lSpace->allocationSpace)
+            {
+                if (lSpace->partialGCCards)
+                    lSpace->cards.SetObjects(lSpace->partialGCRootBase, lSpace->lowerAllocPtr);
+                else lSpace->ResetCards();
+            }
+
             if (debugOptions & DEBUG_GC_ENHANCED)
                 Log("GC: %s space %p %zu free in %zu words %2.1f%% full\n", lSpace->spaceTypeString(),
                     lSpace, lSpace->freeSpace(), lSpace->spaceSize(),
@@ -651,6 +1087,7 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
             spaceAfterGC += lSpace->allocatedSpace();
         }
 
+        gMem.ResetLargeObjectAllocation();
         if (! gMem.CheckForAllocation(wordsRequiredToAllocate))
             succeeded = false;
     }
@@ -659,6 +1096,27 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
     {
         gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeEnd);
 
+        // Restart the concurrent markers.  This must be done before we could
+        // trigger a full GC so that the copied objects are included.
+        if (greyCopies)
+            GCConcurrentMarkResume(copiedObjects);
+        std::vector<PolyObject*>().swap(copiedObjects);
+
+        if (gMem.NumaNodes() > 1 && numaWordsCopied != 0)
+        {
+            POLYUNSIGNED remotePercent = (POLYUNSIGNED)((double)numaRemoteWords * 100.0 / (double)numaWordsCopied);
+            globalStats.setSize(PSC_GC_NUMA_REMOTE, remotePercent);
+            if (debugOptions & DEBUG_GC_ENHANCED)
+                Log("GC: Quick: %lu words copied, %lu%% from another NUMA node\n", numaWordsCopied, remotePercent);
+        }
+
+        globalStats.setSize(PSS_SURVIVOR, survivorWords*sizeof(PolyWord));
+        globalStats.setSize(PSS_PROMOTED, promotedWords*sizeof(PolyWord));
+        globalStats.setSize(PSS_PREMATURE_TENURED, prematureWords*sizeof(PolyWord));
+        if (userOptions.tenureThreshold > 1 && (debugOptions & DEBUG_GC_ENHANCED))
+            Log("GC: Quick: %lu words promoted, %lu before the tenuring threshold, %lu words in survivor spaces, %zu objects remembered\n",
+                promotedWords, prematureWords, survivorWords, rememberedObjects.size());
+
         if (! gHeapSizeParameters.AdjustSizeAfterMinorGC(spaceAfterGC, spaceBeforeGC)) // Adjust the allocation size.
             return false; // If necessary trigger a full GC immediately
         gHeapSizeParameters.resetMinorTimingData();
@@ -673,9 +1131,16 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
             Log("GC: Completed successfully\n");
 
         CheckMemory();
+
+        // If the next GC will be a major GC it may be possible to start it now.
+        StartConcurrentGC();
     }
     else
     {
+        // The marks may refer to objects that have been partly copied.
+        std::vector<PolyObject*>().swap(copiedObjects);
+        if (greyCopies)
+            AbandonConcurrentGC();
         // There was insufficient room to copy everything.  We will need to
         // run a full GC.
         gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeEnd);
@@ -685,3 +1150,18 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
 
     return succeeded;
 }
+
+// Called at the start of a major GC.  The major GC may move objects between
+// spaces so the survivor spaces become ordinary old spaces.  Anything left in
+// the allocation area after the major GC will be copied into new survivor spaces.
+void TenureSurvivorSpaces()
+{
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        lSpace->survivorSpace = lSpace->survivorEvacuate = false;
+        lSpace->survivorAge = 0;
+    }
+    rememberedObjects.clear();
+    globalStats.setSize(PSS_SURVIVOR, 0);
+}
@@ -1711,6 +1711,9 @@ void ModuleLoader::Perform()
             MemSpace *space;
             if (descr->segmentFlags & SSF_CODE)
             {
+                // Hold the lock until the free lists cover only the area after
+                // the segment so that no other thread allocates code in the segment.
+                PLocker locker(&gMem.codeSpaceLock);
                 CodeSpace *cSpace = gMem.NewCodeSpace(actualSize);
                 if (cSpace == 0)
                 {
@@ -1718,9 +1721,14 @@ void ModuleLoader::Perform()
                     return;
                 }
                 space = cSpace;
-                cSpace->firstFree = (PolyWord*)((byte*)space->bottom + descr->segmentSize);
-                if (cSpace->firstFree != cSpace->top)
-                    gMem.FillUnusedSpace(cSpace->firstFree, cSpace->top - cSpace->firstFree);
+                // Only the space after the segment is free.
+                cSpace->ClearFreeLists();
+                PolyWord *firstFree = (PolyWord*)((byte*)space->bottom + descr->segmentSize);
+                if (firstFree != cSpace->top)
+                {
+                    gMem.FillUnusedSpace(firstFree, cSpace->top - firstFree);
+                    cSpace->AddFreeCells(firstFree, cSpace->top - firstFree);
+                }
             }
             else
             {
@@ -1732,6 +1740,8 @@ void ModuleLoader::Perform()
                 }
                 space = lSpace;
                 lSpace->lowerAllocPtr = (PolyWord*)((byte*)lSpace->bottom + descr->segmentSize);
+                // The card table will be rebuilt by the next GC.
+                lSpace->cards.valid = false;
             }
             if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
                 fread(space->bottom, descr->segmentSize, 1, loadFile) != 1)
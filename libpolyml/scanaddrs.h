@@ -61,6 +61,13 @@ public:
     // references and deals with the general case of a word.
     void ScanRuntimeWord(PolyWord *w);
 
+    // Process a return address or other address within the code object "base"
+    // held in a thread's stack or registers.  These are found by scanning the
+    // stack conservatively so the address is never changed.  The default
+    // processes the object.  Code compaction overrides this to find the code
+    // that must not be moved.
+    virtual void ScanCodeAddressAt(PolyObject *base, PolyWord *pt) { (void)ScanObjectAddress(base); }
+
     // Process a constant within the code.
     // The default action is to call the DEFAULT ScanAddressAt NOT the virtual which means that it calls
     // ScanObjectAddress for the base address of the object referred to.
@@ -56,6 +56,19 @@
 #include "gctaskfarm.h"
 #include "diagnostics.h"
 #include "sharedata.h"
+#include "locking.h"
+#include "statistics.h"
+#include "heapsizing.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+#   include <intrin.h>
+#   pragma intrinsic(_InterlockedCompareExchange)
+#   if (SIZEOF_VOIDP == 8)
+#       define InterlockedCompareExchange64 _InterlockedCompareExchange64
+#   else
+#       define InterlockedCompareExchange   _InterlockedCompareExchange
+#   endif
+#endif
 
 /*
 This code was largely written by Simon Finn as a database improver for the
@@ -115,6 +128,18 @@ A further problem is that the vectors can get very large and this
 can cause problems if there is insufficient contiguous space.
 The code has been modified to reduce the size of the vectors
 at the cost of increasing the total memory requirement.
+
+The depth computation in step 1 is also done in parallel.  Each GC thread
+has its own explicit stack and, in the same way as the mark phase, a thread
+that finds an object to scan while another thread is idle hands it over as
+a new task.  Only the addresses in objects of depth zero are handed over
+since the depth of those objects doesn't depend on them.  An object is
+claimed by setting _OBJ_GC_MARK, or the depth of a byte object, with a
+compare-and-swap on the length word so only one thread adds it to the depth
+vectors.  A thread that needs the depth of an object that another thread is
+still processing waits until it has been labelled.  Only if every running
+thread is waiting do the objects form a cycle and then one wait is broken
+and treated in the same way as a cycle in the single-threaded case.
 */
 
 extern "C" {
@@ -196,6 +221,8 @@ protected:
 // Zero-sized and large objects go in depthVectorArray[0].
 #define FIXEDLENGTHSIZE     10
 
+class ProcessAddToVector;
+
 class ShareDataClass {
 public:
     ShareDataClass();
@@ -204,18 +231,50 @@ public:
     bool RunShareData(PolyObject *root);
     void AddToVector(POLYUNSIGNED depth, POLYUNSIGNED length, PolyObject *pt);
 
+    // Hand an object to an idle labelling thread.
+    bool ForkNew(PolyObject *obj);
+    bool LabellerAvailable(void) const { return nInUse < nLabellers; }
+
+    // Wait for another thread to label an object.  WaitForLabeller returns
+    // false if every running thread is waiting, i.e. there is a cycle.
+    void StartWaiting(void);
+    bool WaitForLabeller(void);
+    void StopWaiting(void);
+
+    // Taken while adding objects to the depth vectors.
+    PLock vectorLock;
+    POLYUNSIGNED totalLabelled;
+    bool labellingFailed;
+
 private:
+    static void LabelTask(GCTaskId*, void *arg1, void *arg2);
+    void LabellerFinished(ProcessAddToVector *labeller);
+
     struct _depthVector {
         DepthVector **vector;
         POLYUNSIGNED vectorSize;
     } depthVectorArray[FIXEDLENGTHSIZE];
 
     POLYUNSIGNED maxVectorSize;
+
+    // The labelling threads.  nInUse, nRunning and nWaiting are protected by labelLock.
+    // nInUse includes tasks that have been queued but haven't yet started.
+    ProcessAddToVector *labellers;
+    unsigned nLabellers;
+    unsigned nInUse;
+    unsigned nRunning;
+    unsigned nWaiting;
+    PLock labelLock;
+    PCondVar labelWait;
 };
 
-ShareDataClass::ShareDataClass()
+ShareDataClass::ShareDataClass(): vectorLock("Share data vectors"), labelLock("Share data labellers")
 {
     maxVectorSize = 0;
+    totalLabelled = 0;
+    labellingFailed = false;
+    labellers = 0;
+    nLabellers = nInUse = nRunning = nWaiting = 0;
     for (unsigned i = 0; i < FIXEDLENGTHSIZE; i++)
     {
         depthVectorArray[i].vector = 0;
@@ -640,13 +699,56 @@ PolyWord ProcessFixupAddress::GetNewAddress(PolyWord old)
     return old;
 }
 
+#if (! defined(_MSC_VER) && ! defined(__GNUC__))
+// Fallback if we have no atomic operations.
+static PLock lengthWordLock("Share data length word");
+#endif
+
+// Replace the length word of an object if it has not changed.  This is used to
+// claim an object so that only one labelling thread adds it to the depth vectors.
+static inline bool CompareAndSwapLengthWord(PolyObject *obj, POLYUNSIGNED oldVal, POLYUNSIGNED newVal)
+{
+    volatile POLYUNSIGNED *p = ((POLYUNSIGNED*)obj) - 1;
+#if defined(_MSC_VER)
+# if (SIZEOF_VOIDP == 8)
+    return (POLYUNSIGNED)InterlockedCompareExchange64((volatile LONGLONG*)p, newVal, oldVal) == oldVal;
+# else
+    return (POLYUNSIGNED)InterlockedCompareExchange((volatile LONG*)p, newVal, oldVal) == oldVal;
+# endif
+#elif defined(__GNUC__)
+    return __sync_bool_compare_and_swap(p, oldVal, newVal);
+#else
+    PLocker lock(&lengthWordLock);
+    if (*p != oldVal) return false;
+    *p = newVal;
+    return true;
+#endif
+}
+
+// Test whether an address is a word object in the local heap that no labelling
+// thread has reached yet.  These are worth handing to another thread.
+static inline bool IsUnlabelledWordObject(PolyWord p)
+{
+    MemSpace *space = gMem.SpaceForAddress(p.AsStackAddr()-1);
+    if (space == 0 || space->spaceType != ST_LOCAL)
+        return false;
+    POLYUNSIGNED L = p.AsObjPtr()->LengthWord();
+    return OBJ_IS_LENGTH(L) && ! (L & _OBJ_GC_MARK) && OBJ_IS_WORD_OBJECT(L);
+}
+
+// Objects are added to the depth vectors in batches so that a labelling
+// thread only takes the lock once for each batch.
+#define SHARE_BATCH_SIZE    256
+
 // This class is used to set up the depth vectors for sorting.  It subclasses ScanAddress
 // in order to be able to use that for code objects since they are complicated but it
 // handles most object types itself.  It scans them depth-first using an explicit stack.
+// There is one of these for each thread that can be labelling.
 class ProcessAddToVector: public ScanAddress
 {
 public:
-    ProcessAddToVector(ShareDataClass *p): m_parent(p), addStack(0), stackSize(0), asp(0) {}
+    ProcessAddToVector(): m_parent(0), addStack(0), stackSize(0), asp(0), nBatch(0),
+        active(false), labelled(0), forked(0) {}
 
     ~ProcessAddToVector();
 
@@ -655,17 +757,43 @@ public:
     virtual PolyObject *ScanObjectAddress(PolyObject *base)
         { (void)AddObjectsToDepthVectors(base); return base; }
 
+    // Process the root, or an object handed on by another thread, and
+    // anything reachable from it.
     void ProcessRoot(PolyObject *root);
 
+    ShareDataClass *m_parent;
+
 protected:
-    POLYUNSIGNED AddObjectsToDepthVectors(PolyWord old);
+    POLYUNSIGNED AddObjectsToDepthVectors(PolyWord old, bool needDepth = false);
+    POLYUNSIGNED WaitForDepth(PolyObject *obj);
 
     void PushToStack(PolyObject *obj);
-
-    ShareDataClass *m_parent;
-    PolyObject **addStack;
+    void ProcessStack(void);
+
+    void AddToBatch(POLYUNSIGNED depth, POLYUNSIGNED length, PolyObject *obj);
+    void FlushBatch(void);
+
+    // Each entry records how far we have got through the object and, for an
+    // immutable, the maximum depth so far.  A wide object is then only scanned
+    // once rather than from the start each time it returns to the top.
+    struct StackEntry {
+        PolyObject *obj;
+        POLYUNSIGNED next;
+        POLYUNSIGNED depth;
+    } *addStack;
     unsigned stackSize;
     unsigned asp;
+
+    struct {
+        POLYUNSIGNED depth, length;
+        PolyObject *obj;
+    } batch[SHARE_BATCH_SIZE];
+    unsigned nBatch;
+
+public:
+    bool active; // Protected by the parent's labelLock
+    POLYUNSIGNED labelled; // Number of objects added to the depth vectors
+    unsigned forked; // Number of objects handed to other threads
 };
 
 ProcessAddToVector::~ProcessAddToVector()
@@ -676,7 +804,7 @@ ProcessAddToVector::~ProcessAddToVector()
     // subsequent GC.
     for (unsigned i = 0; i < asp; i++)
     {
-        PolyObject *obj = addStack[i];
+        PolyObject *obj = addStack[i].obj;
         if (obj->LengthWord() & _OBJ_GC_MARK)
             obj->SetLengthWord(obj->LengthWord() & (~_OBJ_GC_MARK));
     }
@@ -684,14 +812,50 @@ ProcessAddToVector::~ProcessAddToVector()
     free(addStack); // Now free the stack
 }
 
+// Record an object to be added to the depth vectors.  Its length word has already
+// been replaced and the original is saved here.
+void ProcessAddToVector::AddToBatch(POLYUNSIGNED depth, POLYUNSIGNED length, PolyObject *obj)
+{
+    batch[nBatch].depth = depth;
+    batch[nBatch].length = length;
+    batch[nBatch].obj = obj;
+    nBatch++;
+    labelled++;
+    if (nBatch == SHARE_BATCH_SIZE)
+        FlushBatch();
+}
+
+void ProcessAddToVector::FlushBatch()
+{
+    unsigned i = 0;
+    try {
+        PLocker lock(&m_parent->vectorLock);
+        for (; i < nBatch; i++)
+            m_parent->AddToVector(batch[i].depth, batch[i].length, batch[i].obj);
+        m_parent->totalLabelled += nBatch;
+        globalStats.setSize(PSC_SHARE_LABELLED, m_parent->totalLabelled);
+    }
+    catch (MemoryException &)
+    {
+        // Anything we haven't been able to add must have its length word
+        // restored.  It won't be shared.
+        for (; i < nBatch; i++)
+            batch[i].obj->SetLengthWord(batch[i].length);
+        nBatch = 0;
+        throw;
+    }
+    nBatch = 0;
+}
+
 // Either adds an object to the stack or, if its depth is known, adds it
 // to the depth vector and returns the depth.
 // We use _OBJ_GC_MARK to detect when we have visited a cell but not yet
 // computed the depth.  We have to be careful that this bit is removed
 // before we finish in the case that we run out of memory and throw an
 // exception.  PushToStack may throw the exception if the stack needs to
-// grow.
-POLYUNSIGNED ProcessAddToVector::AddObjectsToDepthVectors(PolyWord old)
+// grow.  needDepth is set when the caller is an immutable object whose
+// own depth depends on the result.
+POLYUNSIGNED ProcessAddToVector::AddObjectsToDepthVectors(PolyWord old, bool needDepth)
 {
     // If this is a tagged integer or an IO pointer that's simply a constant.
     if (old.IsTagged() || old == PolyWord::FromUnsigned(0))
@@ -702,126 +866,190 @@ POLYUNSIGNED ProcessAddToVector::AddObjectsToDepthVectors(PolyWord old)
         return 0;
 
     PolyObject *obj = old.AsObjPtr();
-    POLYUNSIGNED L = obj->LengthWord();
 
-    if (OBJ_IS_DEPTH(L)) // tombstone contains genuine depth or 0.
-        return OBJ_GET_DEPTH(L);
+    // Another thread may change the length word at any time so we work from a
+    // copy and repeat if the compare-and-swap fails.
+    while (true)
+    {
+        POLYUNSIGNED L = obj->LengthWord();
+
+        if (OBJ_IS_DEPTH(L)) // tombstone contains genuine depth or 0.
+            return OBJ_GET_DEPTH(L);
 
-    if (obj->LengthWord() & _OBJ_GC_MARK)
-        return 0; // Marked but not yet scanned. Circular structure.
+        if (L & _OBJ_GC_MARK)
+        {
+            // Marked but not yet scanned.  Circular structure or another thread.
+            // Mutable and code objects always have depth zero.
+            if (needDepth && ! OBJ_IS_MUTABLE_OBJECT(L) && ! OBJ_IS_CODE_OBJECT(L))
+                return WaitForDepth(obj);
+            return 0;
+        }
 
-    ASSERT (OBJ_IS_LENGTH(L));
+        ASSERT (OBJ_IS_LENGTH(L));
 
-    if (obj->IsMutable())
-    {
-        // Mutable data in the local or permanent areas.  Ignore byte objects or
-        // word objects containing only ints.
-        if (obj->IsWordObject())
+        if (OBJ_IS_MUTABLE_OBJECT(L))
         {
-            bool containsAddress = false;
-            for (POLYUNSIGNED j = 0; j < OBJ_OBJECT_LENGTH(L) && !containsAddress; j++)
-                containsAddress = ! obj->Get(j).IsTagged();
+            // Mutable data in the local or permanent areas.  Ignore byte objects or
+            // word objects containing only ints.
+            if (OBJ_IS_WORD_OBJECT(L))
+            {
+                bool containsAddress = false;
+                for (POLYUNSIGNED j = 0; j < OBJ_OBJECT_LENGTH(L) && !containsAddress; j++)
+                    containsAddress = ! obj->Get(j).IsTagged();
+
+                if (containsAddress)
+                {
+                    if (! CompareAndSwapLengthWord(obj, L, L | _OBJ_GC_MARK)) // To prevent rescan
+                        continue;
+                    // Add it to the vector so we will update any addresses it contains.
+                    AddToBatch(0, L, obj);
+                    // and follow any addresses to try to merge those.
+                    PushToStack(obj);
+                }
+                // If we don't add it to the vector we mustn't set _OBJ_GC_MARK.
+            }
+            return 0; // Level is zero
+        }
 
-            if (containsAddress)
+        if (space->spaceType == ST_PERMANENT &&
+                 ((PermanentMemSpace*)space)->hierarchy == 0)
+        {
+            // Immutable data in the permanent area can't be merged
+            // because it's read only.  We need to follow the addresses
+            // because they may point to mutable areas containing data
+            // that can be.  A typical case is the root function pointing
+            // at the global name table containing new declarations.
+            // N.B. Two threads could both set a bit in the same word and one
+            // lose the other's bit.  That only means the object may be scanned again.
+            Bitmap *bm = &((PermanentMemSpace*)space)->shareBitmap;
+            if (! bm->TestBit((PolyWord*)obj - space->bottom))
             {
-                // Add it to the vector so we will update any addresses it contains.
-                m_parent->AddToVector(0, L, old.AsObjPtr());
-                // and follow any addresses to try to merge those.
-                PushToStack(obj);
-                obj->SetLengthWord(L | _OBJ_GC_MARK); // To prevent rescan
+                bm->SetBit((PolyWord*)obj - space->bottom);
+                if (! OBJ_IS_BYTE_OBJECT(L))
+                    PushToStack(obj);
             }
-            // If we don't add it to the vector we mustn't set _OBJ_GC_MARK.
+            return 0;
         }
-        return 0; // Level is zero
-    }
 
-    if (space->spaceType == ST_PERMANENT &&
-             ((PermanentMemSpace*)space)->hierarchy == 0)
-    {
-        // Immutable data in the permanent area can't be merged
-        // because it's read only.  We need to follow the addresses
-        // because they may point to mutable areas containing data
-        // that can be.  A typical case is the root function pointing
-        // at the global name table containing new declarations.
-        Bitmap *bm = &((PermanentMemSpace*)space)->shareBitmap;
-        if (! bm->TestBit((PolyWord*)obj - space->bottom))
+        /* There's a problem sharing code objects if they have relative calls/jumps
+           in them to other code.  The code of two functions may be identical (e.g.
+           they both call functions 100 bytes ahead) and so they will appear the
+           same but if the functions they jump to are different they are actually
+           different.  For that reason we don't share code segments.  DCJM 4/1/01 */
+        if (OBJ_IS_CODE_OBJECT(L))
         {
-            bm->SetBit((PolyWord*)obj - space->bottom);
-            if (! obj->IsByteObject())
-                PushToStack(obj);
+            if (! CompareAndSwapLengthWord(obj, L, L | _OBJ_GC_MARK)) // To prevent rescan
+                continue;
+            // We want to update addresses in the code segment.
+            AddToBatch(0, L, obj);
+            PushToStack(obj);
+            return 0;
         }
-        return 0;
-    }
 
-    /* There's a problem sharing code objects if they have relative calls/jumps
-       in them to other code.  The code of two functions may be identical (e.g.
-       they both call functions 100 bytes ahead) and so they will appear the
-       same but if the functions they jump to are different they are actually
-       different.  For that reason we don't share code segments.  DCJM 4/1/01 */
-    if (obj->IsCodeObject())
-    {
-        // We want to update addresses in the code segment.
-        m_parent->AddToVector(0, L, old.AsObjPtr());
-        PushToStack(obj);
-        obj->SetLengthWord(L | _OBJ_GC_MARK); // To prevent rescan
+        // Byte objects always have depth 1 and can't contain addresses.
+        if (OBJ_IS_BYTE_OBJECT(L))
+        {
+            if (! CompareAndSwapLengthWord(obj, L, OBJ_SET_DEPTH(1)))
+                continue;
+            AddToBatch(1, L, obj);// add to vector at correct depth
+            return 1;
+        }
 
+        ASSERT(OBJ_IS_WORD_OBJECT(L)); // That leaves immutable data objects.
+        if (! CompareAndSwapLengthWord(obj, L, L | _OBJ_GC_MARK)) // To prevent rescan
+            continue;
+        PushToStack(obj);
         return 0;
     }
+}
 
-    // Byte objects always have depth 1 and can't contain addresses.
-    if (obj->IsByteObject())
+// Wait until another thread has labelled an object that we need the depth of.
+// If the object is on our own stack or every running thread is waiting this
+// is a cycle and, as in the single-threaded case, the depth is taken as zero.
+POLYUNSIGNED ProcessAddToVector::WaitForDepth(PolyObject *obj)
+{
+    for (unsigned i = asp; i > 0; i--)
     {
-        m_parent->AddToVector (1, L, old.AsObjPtr());// add to vector at correct depth
-        obj->SetLengthWord(OBJ_SET_DEPTH(1));
-        return 1;
+        if (addStack[i-1].obj == obj)
+            return 0;
     }
 
-    ASSERT(OBJ_IS_WORD_OBJECT(L)); // That leaves immutable data objects.
-    PushToStack(obj);
-    obj->SetLengthWord(L | _OBJ_GC_MARK); // To prevent rescan
-
-    return 0;
+    m_parent->StartWaiting();
+    while (true)
+    {
+        POLYUNSIGNED L = obj->LengthWord();
+        if (OBJ_IS_DEPTH(L))
+        {
+            m_parent->StopWaiting();
+            return OBJ_GET_DEPTH(L);
+        }
+        // If the other thread ran out of memory it will have removed the mark.
+        if (! (L & _OBJ_GC_MARK))
+        {
+            m_parent->StopWaiting();
+            return 0;
+        }
+        if (! m_parent->WaitForLabeller())
+            return 0; // Cycle.  WaitForLabeller has removed us from the waiting count.
+    }
 }
 
-// Adds an object to the stack.
+// Adds an object to the stack.  If the stack can't be grown the mark bit is
+// removed before the exception is raised.
 void ProcessAddToVector::PushToStack(PolyObject *obj)
 {
     if (asp == stackSize)
     {
-        if (addStack == 0)
+        unsigned newSize = stackSize + stackSize/2 + 100;
+        StackEntry *newStack = (StackEntry*)realloc(addStack, sizeof(StackEntry) * newSize);
+        if (newStack == 0)
         {
-            addStack = (PolyObject**)malloc(sizeof(PolyObject*) * 100);
-            if (addStack == 0) throw MemoryException();
-            stackSize = 100;
-        }
-        else
-        {
-            unsigned newSize = stackSize+100;
-            PolyObject** newStack = (PolyObject**)realloc(addStack, sizeof(PolyObject*) * newSize);
-            if (newStack == 0) throw MemoryException();
-            stackSize = newSize;
-            addStack = newStack;
+            if (obj->LengthWord() & _OBJ_GC_MARK)
+                obj->SetLengthWord(obj->LengthWord() & (~_OBJ_GC_MARK));
+            throw MemoryException();
         }
+        stackSize = newSize;
+        addStack = newStack;
     }
 
     ASSERT(asp < stackSize);
 
-    addStack[asp++] = obj;
+    addStack[asp].obj = obj;
+    addStack[asp].next = 0;
+    addStack[asp].depth = 0;
+    asp++;
 }
 
-// Processes the root and anything reachable from it.  Addresses are added to the
-// explicit stack if an object has not yet been processed.  Most of this function
-// is about processing the stack.
 void ProcessAddToVector::ProcessRoot(PolyObject *root)
 {
-    // Mark the initial object
-    AddObjectsToDepthVectors(root);
+    try {
+        // Another thread may have reached it first.  The depth isn't needed.
+        AddObjectsToDepthVectors(root); // Mark the initial object
+        ProcessStack();
+        FlushBatch();
+    }
+    catch (MemoryException &)
+    {
+        // If we ran out of memory we may still be able to process what we have.
+        // Everything in the batch must either be added to the vectors or have
+        // its length word restored.
+        m_parent->labellingFailed = true;
+        try {
+            FlushBatch();
+        }
+        catch (MemoryException &) { }
+    }
+}
 
+// Processes the objects reachable from the stack.  Addresses are added to the
+// explicit stack if an object has not yet been processed.
+void ProcessAddToVector::ProcessStack()
+{
     // Process the stack until it's empty.
     while (asp != 0)
     {
         // Pop it from the stack.
-        PolyObject *obj = addStack[asp-1];
+        PolyObject *obj = addStack[asp-1].obj;
 
         if (obj->IsCodeObject())
         {
@@ -842,27 +1070,33 @@ void ProcessAddToVector::ProcessRoot(PolyObject *root)
         // depth by computing the maximum of the depth of all the addresses in it.
         else if ((obj->LengthWord() & _OBJ_GC_MARK) && ! obj->IsMutable())
         {
-            POLYUNSIGNED depth = 0;
+            POLYUNSIGNED depth = addStack[asp-1].depth;
             POLYUNSIGNED length = obj->Length();
-            PolyWord *pt = (PolyWord*)obj;
+            POLYUNSIGNED i = addStack[asp-1].next;
             unsigned osp = asp;
 
-            while (length != 0 && osp == asp)
+            while (i < length)
             {
-                POLYUNSIGNED d = AddObjectsToDepthVectors(*pt);
+                POLYUNSIGNED d = AddObjectsToDepthVectors(obj->Get(i), true);
+                // If we've pushed it look at it again once it has been processed.
+                if (osp != asp) break;
                 if (d > depth) depth = d;
-                pt++;
-                length--;
+                i++;
             }
 
-            if (osp == asp)
+            if (osp != asp)
+            {
+                addStack[osp-1].next = i;
+                addStack[osp-1].depth = depth;
+            }
+            else
             {
                 // We've finished it
                 asp--; // Pop this item.
                 depth++; // One more for this object
-                obj->SetLengthWord(obj->LengthWord() & (~_OBJ_GC_MARK));
-                m_parent->AddToVector(depth, obj->LengthWord() & (~_OBJ_GC_MARK), obj);
+                POLYUNSIGNED L = obj->LengthWord() & (~_OBJ_GC_MARK);
                 obj->SetLengthWord(OBJ_SET_DEPTH(depth));
+                AddToBatch(depth, L, obj);
             }
         }
 
@@ -874,23 +1108,27 @@ void ProcessAddToVector::ProcessRoot(PolyObject *root)
         else
         {
             POLYUNSIGNED length = obj->Length();
-            PolyWord *pt = (PolyWord*)obj;
+            POLYUNSIGNED i = addStack[asp-1].next;
             unsigned osp = asp;
 
-            while (length != 0)
+            // Process the addresses until we push one.  We don't need its depth so
+            // we continue after it when we return to this object.  For the same
+            // reason, if there is an idle thread, we can hand the address to it.
+            while (i < length && osp == asp)
             {
-                if (! (*pt).IsTagged())
+                PolyWord p = obj->Get(i);
+                if (! p.IsTagged())
                 {
-                    // If we've already pushed an address break now
-                    if (osp != asp) break;
-                    // Process the address and possibly push it
-                    AddObjectsToDepthVectors(*pt);
+                    if (m_parent->LabellerAvailable() && IsUnlabelledWordObject(p) && m_parent->ForkNew(p.AsObjPtr()))
+                        forked++;
+                    else AddObjectsToDepthVectors(p);
                 }
-                pt++;
-                length--;
+                i++;
             }
 
-            if (length == 0)
+            if (i < length)
+                addStack[osp-1].next = i;
+            else
             {
                 // We've finished it
                 if (osp != asp)
@@ -906,6 +1144,86 @@ void ProcessAddToVector::ProcessRoot(PolyObject *root)
     }
 }
 
+// Fork a new task.  Because we've checked nInUse without taking the lock
+// we may find that we can no longer create a new task.
+bool ShareDataClass::ForkNew(PolyObject *obj)
+{
+    ProcessAddToVector *labeller = 0;
+    {
+        PLocker lock(&labelLock);
+        if (nInUse == nLabellers)
+            return false;
+        for (unsigned i = 0; i < nLabellers; i++)
+        {
+            if (! labellers[i].active)
+            {
+                labeller = &labellers[i];
+                break;
+            }
+        }
+        ASSERT(labeller != 0);
+        labeller->active = true;
+        nInUse++;
+    }
+    if (gpTaskFarm->AddWork(&ShareDataClass::LabelTask, labeller, obj))
+        return true;
+    LabellerFinished(labeller);
+    return false;
+}
+
+void ShareDataClass::LabelTask(GCTaskId *, void *arg1, void *arg2)
+{
+    ProcessAddToVector *labeller = (ProcessAddToVector*)arg1;
+    ShareDataClass *parent = labeller->m_parent;
+    {
+        PLocker lock(&parent->labelLock);
+        parent->nRunning++;
+    }
+    labeller->ProcessRoot((PolyObject*)arg2);
+    {
+        PLocker lock(&parent->labelLock);
+        parent->nRunning--;
+    }
+    parent->LabellerFinished(labeller);
+}
+
+void ShareDataClass::LabellerFinished(ProcessAddToVector *labeller)
+{
+    PLocker lock(&labelLock);
+    labeller->active = false;
+    nInUse--;
+    labelWait.Signal(); // A waiting thread may now be the only one running.
+}
+
+void ShareDataClass::StartWaiting()
+{
+    PLocker lock(&labelLock);
+    nWaiting++;
+}
+
+void ShareDataClass::StopWaiting()
+{
+    PLocker lock(&labelLock);
+    nWaiting--;
+}
+
+// Wait for a short time for another thread to make progress.  If every running
+// thread is waiting they must be waiting for each other.  In that case this
+// thread stops waiting and returns false.  Only one thread breaks the cycle at
+// a time since it is removed from the count while the lock is held.
+bool ShareDataClass::WaitForLabeller()
+{
+    PLocker lock(&labelLock);
+    if (nWaiting == nRunning)
+    {
+        nWaiting--;
+        labelWait.Signal();
+        return false;
+    }
+    (void)labelWait.WaitFor(&labelLock, 1);
+    return true;
+}
+
 // This is called by the root thread to do the work.
 bool ShareDataClass::RunShareData(PolyObject *root)
 {
@@ -923,21 +1241,49 @@ bool ShareDataClass::RunShareData(PolyObject *root)
 
     POLYUNSIGNED totalObjects = 0;
     POLYUNSIGNED totalShared  = 0;
+    globalStats.setSize(PSC_SHARE_LABELLED, 0);
+    globalStats.setSize(PSC_SHARE_SORTED, 0);
+    globalStats.setSize(PSC_SHARE_MERGED, 0);
 
-    // Build the vectors from the immutable objects.
-    bool success = true;
-
+    // Build the vectors from the immutable objects.  The GC thread starts from
+    // the root and the work is spread to the GC workers when they are idle.
+    nLabellers = gpTaskFarm->ThreadCount() + 1;
     try {
-        ProcessAddToVector addToVector(this);
-        addToVector.ProcessRoot(root);
+        labellers = new ProcessAddToVector[nLabellers];
     }
-    catch (MemoryException &)
+    catch (std::bad_alloc &) {
+        return false;
+    }
+    for (unsigned l = 0; l < nLabellers; l++)
+        labellers[l].m_parent = this;
+
+    TIMEDATA startTime = HeapSizeParameters::StartGCPhase();
+    labellers[0].active = true;
+    nInUse = nRunning = 1;
+    labellers[0].ProcessRoot(root);
     {
-        // If we ran out of memory we may still be able to process what we have.
-        // That will also do any clean-up.
-        success = false;
+        PLocker lock(&labelLock);
+        nRunning--;
+    }
+    LabellerFinished(&labellers[0]);
+    gpTaskFarm->WaitForCompletion();
+
+    if (debugOptions & DEBUG_SHARING)
+    {
+        Log("Sharing: Labelled %" POLYUFMT " objects in %1.3fs\n", totalLabelled, HeapSizeParameters::GCPhaseTime(startTime));
+        if (nLabellers > 1)
+        {
+            for (unsigned l = 0; l < nLabellers; l++)
+                Log("Sharing: Thread %u labelled %" POLYUFMT " objects and handed on %u\n",
+                    l, labellers[l].labelled, labellers[l].forked);
+        }
     }
 
+    // This removes any mark bits left if we ran out of memory.
+    delete[] labellers;
+    labellers = 0;
+    bool success = ! labellingFailed;
+
     ProcessFixupAddress fixup;
 
     for (POLYUNSIGNED depth = 1; depth < maxVectorSize; depth++)
@@ -962,6 +1308,8 @@ bool ShareDataClass::RunShareData(PolyObject *root)
                 totalShared += n;
             }
         }
+        globalStats.setSize(PSC_SHARE_SORTED, totalObjects);
+        globalStats.setSize(PSC_SHARE_MERGED, totalShared);
     }
     
     if (debugOptions & DEBUG_SHARING)
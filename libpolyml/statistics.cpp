@@ -121,6 +121,7 @@
 #include "save_vec.h"
 #include "rts_module.h"
 #include "timing.h"
+#include "osmem.h"
 #include "polystring.h"
 #include "processes.h"
 #include "statistics.h"
@@ -150,6 +151,8 @@ Statistics::Statistics(): accessLock("Statistics")
 
     memset(&gcUserTime, 0, sizeof(gcUserTime));
     memset(&gcSystemTime, 0, sizeof(gcSystemTime));
+    memset(timeTotals, 0, sizeof(timeTotals));
+    memset(pauseHistograms, 0, sizeof(pauseHistograms));
 
 #ifdef HAVE_WINDOWS_H
     // File mapping handle
@@ -246,17 +249,58 @@ void Statistics::Init()
     addCounter(PSC_THREADS_WAIT_SIGNAL, POLY_STATS_ID_THREADS_WAIT_SIGNAL, "ThreadsInSignalWait");
     addCounter(PSC_GC_FULLGC, POLY_STATS_ID_GC_FULLGC, "FullGCCount");
     addCounter(PSC_GC_PARTIALGC, POLY_STATS_ID_GC_PARTIALGC, "PartialGCCount");
+    addCounter(PSC_GC_NUMA_REMOTE, POLY_STATS_ID_GC_NUMA_REMOTE, "GCNUMARemotePercent");
+    addCounter(PSC_GC_MARK_RESCAN, POLY_STATS_ID_GC_MARK_RESCAN, "GCMarkRescanWords");
+    addCounter(PSC_SHARE_LABELLED, POLY_STATS_ID_SHARE_LABELLED, "ShareObjectsLabelled");
+    addCounter(PSC_SHARE_SORTED, POLY_STATS_ID_SHARE_SORTED, "ShareObjectsSorted");
+    addCounter(PSC_SHARE_MERGED, POLY_STATS_ID_SHARE_MERGED, "ShareObjectsMerged");
+    addCounter(PSC_GC_PAUSE_MAJOR, POLY_STATS_ID_GC_PAUSE_MAJOR, "GCPauseTargetMajorGCs");
+    addCounter(PSC_CODE_FREE_CELLS, POLY_STATS_ID_CODE_FREE_CELLS, "CodeSpaceFreeCells");
 
     addSize(PSS_TOTAL_HEAP, POLY_STATS_ID_TOTAL_HEAP, "TotalHeap");
     addSize(PSS_AFTER_LAST_GC, POLY_STATS_ID_AFTER_LAST_GC, "HeapAfterLastGC");
     addSize(PSS_AFTER_LAST_FULLGC, POLY_STATS_ID_AFTER_LAST_FULLGC, "HeapAfterLastFullGC");
     addSize(PSS_ALLOCATION, POLY_STATS_ID_ALLOCATION, "AllocationSpace");
     addSize(PSS_ALLOCATION_FREE, POLY_STATS_ID_ALLOCATION_FREE, "AllocationSpaceFree");
+    addSize(PSS_LARGE_OBJECTS, POLY_STATS_ID_LARGE_OBJECTS, "LargeObjectSpace");
+    addSize(PSS_SURVIVOR, POLY_STATS_ID_SURVIVOR, "SurvivorSpace");
+    addSize(PSS_PROMOTED, POLY_STATS_ID_PROMOTED, "PromotedLastGC");
+    addSize(PSS_PREMATURE_TENURED, POLY_STATS_ID_PREMATURE_TENURED, "PrematureTenuredLastGC");
+    addSize(PSS_PAUSE_ALLOCATION, POLY_STATS_ID_PAUSE_ALLOCATION, "GCPauseTargetAllocation");
+    addSize(PSS_RESIDENT, POLY_STATS_ID_RESIDENT, "ResidentSetSize");
+    addSize(PSS_DECOMMITTED, POLY_STATS_ID_DECOMMITTED, "HeapDecommittedLastGC");
+    addSize(PSS_CODE_SPACE, POLY_STATS_ID_CODE_SPACE, "CodeSpace");
+    addSize(PSS_CODE_FREE, POLY_STATS_ID_CODE_FREE, "CodeSpaceFree");
+    addSize(PSS_CODE_LARGEST_FREE, POLY_STATS_ID_CODE_LARGEST_FREE, "CodeSpaceLargestFree");
 
     addTime(PST_NONGC_UTIME, POLY_STATS_ID_NONGC_UTIME, "NonGCUserTime");
     addTime(PST_NONGC_STIME, POLY_STATS_ID_NONGC_STIME, "NonGCSystemTime");
     addTime(PST_GC_UTIME, POLY_STATS_ID_GC_UTIME, "GCUserTime");
     addTime(PST_GC_STIME, POLY_STATS_ID_GC_STIME, "GCSystemTime");
+    addTime(PST_GC_MARK_PAUSE, POLY_STATS_ID_GC_MARK_PAUSE, "GCMarkPauseTime");
+    addTime(PST_GC_COPY_PAUSE, POLY_STATS_ID_GC_COPY_PAUSE, "GCCopyPauseTime");
+    addTime(PST_GC_UPDATE_PAUSE, POLY_STATS_ID_GC_UPDATE_PAUSE, "GCUpdatePauseTime");
+    addTime(PST_GC_CONCURRENT_MARK, POLY_STATS_ID_GC_CONCURRENT_MARK, "GCConcurrentMarkTime");
+    addTime(PST_GC_LAST_MINOR_PAUSE, POLY_STATS_ID_GC_LAST_MINOR_PAUSE, "GCLastMinorPause");
+    addTime(PST_GC_LAST_MAJOR_PAUSE, POLY_STATS_ID_GC_LAST_MAJOR_PAUSE, "GCLastMajorPause");
+    addTime(PST_GC_MINOR_P50, POLY_STATS_ID_GC_MINOR_P50, "GCMinorPauseP50");
+    addTime(PST_GC_MINOR_P99, POLY_STATS_ID_GC_MINOR_P99, "GCMinorPauseP99");
+    addTime(PST_GC_MINOR_MAX, POLY_STATS_ID_GC_MINOR_MAX, "GCMinorPauseMax");
+    addTime(PST_GC_MARK_P50, POLY_STATS_ID_GC_MARK_P50, "GCMarkPauseP50");
+    addTime(PST_GC_MARK_P99, POLY_STATS_ID_GC_MARK_P99, "GCMarkPauseP99");
+    addTime(PST_GC_MARK_MAX, POLY_STATS_ID_GC_MARK_MAX, "GCMarkPauseMax");
+    addTime(PST_GC_COPY_P50, POLY_STATS_ID_GC_COPY_P50, "GCCopyPauseP50");
+    addTime(PST_GC_COPY_P99, POLY_STATS_ID_GC_COPY_P99, "GCCopyPauseP99");
+    addTime(PST_GC_COPY_MAX, POLY_STATS_ID_GC_COPY_MAX, "GCCopyPauseMax");
+    addTime(PST_GC_UPDATE_P50, POLY_STATS_ID_GC_UPDATE_P50, "GCUpdatePauseP50");
+    addTime(PST_GC_UPDATE_P99, POLY_STATS_ID_GC_UPDATE_P99, "GCUpdatePauseP99");
+    addTime(PST_GC_UPDATE_MAX, POLY_STATS_ID_GC_UPDATE_MAX, "GCUpdatePauseMax");
+    addTime(PST_GC_SHARING_P50, POLY_STATS_ID_GC_SHARING_P50, "GCSharingPauseP50");
+    addTime(PST_GC_SHARING_P99, POLY_STATS_ID_GC_SHARING_P99, "GCSharingPauseP99");
+    addTime(PST_GC_SHARING_MAX, POLY_STATS_ID_GC_SHARING_MAX, "GCSharingPauseMax");
+    addTime(PST_SAFEPOINT_P50, POLY_STATS_ID_SAFEPOINT_P50, "SafepointWaitP50");
+    addTime(PST_SAFEPOINT_P99, POLY_STATS_ID_SAFEPOINT_P99, "SafepointWaitP99");
+    addTime(PST_SAFEPOINT_MAX, POLY_STATS_ID_SAFEPOINT_MAX, "SafepointWaitMax");
 
     addUser(0, POLY_STATS_ID_USER0, "UserCounter0");
     addUser(1, POLY_STATS_ID_USER1, "UserCounter1");
@@ -535,6 +579,64 @@ void Statistics::setTimeValue(int which, unsigned long secs, unsigned long usecs
     }
 }
 
+// Pause histograms.  Bucket n covers a quarter of a power of two
+// microseconds so the buckets are fine for short pauses and coarse for long ones.
+static unsigned pauseBucket(uint64_t usecs)
+{
+    if (usecs < 4) return (unsigned)usecs;
+    unsigned log2 = 2;
+    while (log2 < 63 && (usecs >> (log2+1)) != 0) log2++;
+    unsigned bucket = 4 * (log2 - 1) + (unsigned)((usecs >> (log2 - 2)) & 3);
+    return bucket < N_PS_PAUSE_BUCKETS ? bucket : N_PS_PAUSE_BUCKETS - 1;
+}
+
+// The largest value that falls into a bucket.
+static uint64_t pauseBucketLimit(unsigned bucket)
+{
+    if (bucket < 4) return bucket;
+    unsigned log2 = bucket / 4 + 1;
+    return ((uint64_t)(5 + bucket % 4) << (log2 - 2)) - 1;
+}
+
+// Return an upper bound for a percentile of a histogram.  Called with accessLock held.
+uint64_t Statistics::pausePercentile(int which, unsigned percent)
+{
+    POLYUNSIGNED rank = (pauseHistograms[which].count * percent + 99) / 100;
+    POLYUNSIGNED seen = 0;
+    for (unsigned b = 0; b < N_PS_PAUSE_BUCKETS; b++)
+    {
+        seen += pauseHistograms[which].buckets[b];
+        if (seen >= rank)
+        {
+            uint64_t limit = pauseBucketLimit(b);
+            return limit < pauseHistograms[which].maxUsecs ? limit : pauseHistograms[which].maxUsecs;
+        }
+    }
+    return pauseHistograms[which].maxUsecs;
+}
+
+// Add a pause to a histogram and update its percentiles in the statistics.
+// This may be called from a GC thread.
+void Statistics::addPauseValue(int which, uint64_t usecs)
+{
+    if (statMemory == 0) return;
+    uint64_t values[3];
+    {
+        PLocker lock(&accessLock);
+        pauseHistograms[which].buckets[pauseBucket(usecs)]++;
+        pauseHistograms[which].count++;
+        if (usecs > pauseHistograms[which].maxUsecs)
+            pauseHistograms[which].maxUsecs = usecs;
+        values[0] = pausePercentile(which, 50);
+        values[1] = pausePercentile(which, 99);
+        values[2] = pauseHistograms[which].maxUsecs;
+    }
+    // The time statistics for each histogram are p50, p99 and the maximum.
+    for (unsigned i = 0; i < 3; i++)
+        setTimeValue(PST_GC_MINOR_P50 + which * 3 + i,
+            (unsigned long)(values[i] / 1000000), (unsigned long)(values[i] % 1000000));
+}
+
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
 // Native Windows
 void Statistics::copyGCTimes(const FILETIME &gcUtime, const FILETIME &gcStime)
@@ -549,6 +651,37 @@ void Statistics::copyGCTimes(const FILETIME &gcUtime, const FILETIME &gcStime)
     li.HighPart = gcStime.dwHighDateTime;
     setTimeValue(PST_GC_STIME, (unsigned long)(li.QuadPart / 10000000), (unsigned long)((li.QuadPart / 10) % 1000000));
 }
+
+// Add to the total for a time statistic.  This may be called from a GC thread.
+void Statistics::incTime(int which, const FILETIME &t)
+{
+    ULARGE_INTEGER li;
+    {
+        PLocker lock(&accessLock);
+        addFiletimes(&timeTotals[which], &t);
+        li.LowPart = timeTotals[which].dwLowDateTime;
+        li.HighPart = timeTotals[which].dwHighDateTime;
+    }
+    setTimeValue(which, (unsigned long)(li.QuadPart / 10000000), (unsigned long)((li.QuadPart / 10) % 1000000));
+}
+
+// Set a time statistic that records a single value rather than a total.
+void Statistics::setTime(int which, const FILETIME &t)
+{
+    ULARGE_INTEGER li;
+    li.LowPart = t.dwLowDateTime;
+    li.HighPart = t.dwHighDateTime;
+    setTimeValue(which, (unsigned long)(li.QuadPart / 10000000), (unsigned long)((li.QuadPart / 10) % 1000000));
+}
+
+// Record the length of a pause.
+void Statistics::addPause(int which, const FILETIME &t)
+{
+    ULARGE_INTEGER li;
+    li.LowPart = t.dwLowDateTime;
+    li.HighPart = t.dwHighDateTime;
+    addPauseValue(which, li.QuadPart / 10);
+}
 #else
 // Unix
 void Statistics::copyGCTimes(const struct timeval &gcUtime, const struct timeval &gcStime)
@@ -558,6 +691,31 @@ void Statistics::copyGCTimes(const struct timeval &gcUtime, const struct timeval
     setTimeValue(PST_GC_UTIME, gcUtime.tv_sec, gcUtime.tv_usec);
     setTimeValue(PST_GC_STIME, gcStime.tv_sec, gcStime.tv_usec);
 }
+
+// Add to the total for a time statistic.  This may be called from a GC thread.
+void Statistics::incTime(int which, const struct timeval &t)
+{
+    struct timeval total;
+    {
+        PLocker lock(&accessLock);
+        addTimevals(&timeTotals[which], &t);
+        total = timeTotals[which];
+    }
+    setTimeValue(which, total.tv_sec, total.tv_usec);
+}
+
+// Set a time statistic that records a single value rather than a total.
+void Statistics::setTime(int which, const struct timeval &t)
+{
+    setTimeValue(which, t.tv_sec, t.tv_usec);
+}
+
+// Record the length of a pause.
+void Statistics::addPause(int which, const struct timeval &t)
+{
+    if (t.tv_sec < 0) addPauseValue(which, 0); // The clock may have been reset.
+    else addPauseValue(which, (uint64_t)t.tv_sec * 1000000 + t.tv_usec);
+}
 #endif
 
 // Update the statistics that are not otherwise copied.  Called from the
@@ -565,6 +723,7 @@ void Statistics::copyGCTimes(const struct timeval &gcUtime, const struct timeval
 void Statistics::updatePeriodicStats(POLYUNSIGNED freeWords, unsigned threadsInML)
 {
     setSize(PSS_ALLOCATION_FREE, freeWords*sizeof(PolyWord));
+    setSize(PSS_RESIDENT, osMemoryManager->ResidentSize());
 
 #if (defined(HAVE_WINDOWS_H) && ! defined(__CYGWIN__))
     FILETIME ct, et, st, ut;
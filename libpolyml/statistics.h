@@ -39,12 +39,29 @@ enum {
     PSC_THREADS_WAIT_SIGNAL,        // Special case - signal handling thread
     PSC_GC_FULLGC,                  // Number of full garbage collections
     PSC_GC_PARTIALGC,               // Number of partial GCs
+    PSC_GC_NUMA_REMOTE,             // Percentage of words copied from another node in the last partial GC
+    PSC_GC_MARK_RESCAN,             // Total words rescanned after mark stack overflows
+    PSC_SHARE_LABELLED,             // Objects given a depth by the current or last shareCommonData
+    PSC_SHARE_SORTED,               // Objects in the levels sorted so far by shareCommonData
+    PSC_SHARE_MERGED,               // Objects merged so far by shareCommonData
+    PSC_GC_PAUSE_MAJOR,             // Major GCs started early to keep within the pause target
+    PSC_CODE_FREE_CELLS,            // Number of cells on the code space free lists
 
     PSS_TOTAL_HEAP,                 // Total size of the local heap
     PSS_AFTER_LAST_GC,              // Space free after last GC
     PSS_AFTER_LAST_FULLGC,          // Space free after the last full GC
     PSS_ALLOCATION,                 // Size of allocation space
     PSS_ALLOCATION_FREE,            // Space available in allocation area
+    PSS_LARGE_OBJECTS,              // Size of the large object spaces
+    PSS_SURVIVOR,                   // Data in the survivor spaces after the last partial GC
+    PSS_PROMOTED,                   // Data promoted to the old spaces by the last partial GC
+    PSS_PREMATURE_TENURED,          // Promoted data that had not reached the tenuring threshold
+    PSS_PAUSE_ALLOCATION,           // Allocation area size chosen to meet the pause target
+    PSS_RESIDENT,                   // Resident set size of the process
+    PSS_DECOMMITTED,                // Free heap returned to the OS by the last major GC
+    PSS_CODE_SPACE,                 // Total size of the code spaces
+    PSS_CODE_FREE,                  // Free space in the code spaces
+    PSS_CODE_LARGEST_FREE,          // Largest free cell in the code spaces
     N_PS_INTS
 };
 
@@ -53,9 +70,48 @@ enum {
     PST_NONGC_STIME,
     PST_GC_UTIME,
     PST_GC_STIME,
+    PST_GC_MARK_PAUSE,              // Real time in each phase of the major GC
+    PST_GC_COPY_PAUSE,
+    PST_GC_UPDATE_PAUSE,
+    PST_GC_CONCURRENT_MARK,
+    PST_GC_LAST_MINOR_PAUSE,        // Real time of the last minor GC
+    PST_GC_LAST_MAJOR_PAUSE,        // Real time of the last major GC
+    PST_GC_MINOR_P50,               // Percentiles and maximum of each pause histogram.
+    PST_GC_MINOR_P99,               // These must be in the same order as the histograms
+    PST_GC_MINOR_MAX,               // and each group in the order p50, p99, max.
+    PST_GC_MARK_P50,
+    PST_GC_MARK_P99,
+    PST_GC_MARK_MAX,
+    PST_GC_COPY_P50,
+    PST_GC_COPY_P99,
+    PST_GC_COPY_MAX,
+    PST_GC_UPDATE_P50,
+    PST_GC_UPDATE_P99,
+    PST_GC_UPDATE_MAX,
+    PST_GC_SHARING_P50,
+    PST_GC_SHARING_P99,
+    PST_GC_SHARING_MAX,
+    PST_SAFEPOINT_P50,
+    PST_SAFEPOINT_P99,
+    PST_SAFEPOINT_MAX,
     N_PS_TIMES
 };
 
+// Histograms of the real time of each pause.
+enum {
+    PSH_GC_MINOR,                   // Minor GCs
+    PSH_GC_MARK,                    // Mark phase of a major GC
+    PSH_GC_COPY,                    // Copy phase of a major GC
+    PSH_GC_UPDATE,                  // Update phase of a major GC
+    PSH_GC_SHARING,                 // Sharing pass of a major GC
+    PSH_SAFEPOINT,                  // Time for the ML threads to stop for a root request
+    N_PS_HISTOGRAMS
+};
+
+// Buckets in a pause histogram.  Times are in microseconds with four buckets
+// for each power of two so a percentile is within 25% of the true value.
+#define N_PS_PAUSE_BUCKETS  128
+
 // A few counters that can be used by the application
 #define N_PS_USER   8
 
@@ -87,10 +143,16 @@ public:
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
     // Native Windows
     void copyGCTimes(const FILETIME &gcUtime, const FILETIME &gcStime);
+    void incTime(int which, const FILETIME &t);
+    void setTime(int which, const FILETIME &t);
+    void addPause(int which, const FILETIME &t);
     FILETIME gcUserTime, gcSystemTime;
 #else
     // Unix and Cygwin
     void copyGCTimes(const struct timeval &gcUtime, const struct timeval &gcStime);
+    void incTime(int which, const struct timeval &t);
+    void setTime(int which, const struct timeval &t);
+    void addPause(int which, const struct timeval &t);
     struct timeval gcUserTime, gcSystemTime;
 #endif
     
@@ -114,6 +176,16 @@ private:
     unsigned char *counterAddrs[N_PS_INTS];
     struct { unsigned char *secAddr; unsigned char *usecAddr; } timeAddrs[N_PS_TIMES];
     unsigned char *userAddrs[N_PS_USER];
+#if (defined(_WIN32) && ! defined(__CYGWIN__))
+    FILETIME timeTotals[N_PS_TIMES];
+#else
+    struct timeval timeTotals[N_PS_TIMES];
+#endif
+    struct {
+        POLYUNSIGNED buckets[N_PS_PAUSE_BUCKETS];
+        POLYUNSIGNED count;
+        uint64_t maxUsecs;
+    } pauseHistograms[N_PS_HISTOGRAMS];
 
     Handle returnStatistics(TaskData *taskData, unsigned char *stats);
     void addCounter(int cEnum, unsigned statId, const char *name);
@@ -124,6 +196,8 @@ private:
     size_t getSizeWithLock(int which);
     void setSizeWithLock(int which, size_t s);
     void setTimeValue(int which, unsigned long secs, unsigned long usecs);
+    void addPauseValue(int which, uint64_t usecs);
+    uint64_t pausePercentile(int which, unsigned percent);
 };
 
 extern Statistics globalStats;
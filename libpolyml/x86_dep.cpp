@@ -347,7 +347,7 @@ void X86TaskData::ScanStackAddress(ScanAddress *process, PolyWord *pt, StackSpac
             ASSERT(pt->IsTagged()); // It must be an integer
         }
         else // Process the address of the start.  Don't update anything.
-            process->ScanObjectAddress(obj);
+            process->ScanCodeAddressAt(obj, pt);
     }
     else if (space->spaceType == ST_LOCAL && pt->IsDataPtr())
         // Local values must be word addresses.
@@ -73,6 +73,48 @@
 #define POLY_STATS_ID_USER6                  24
 #define POLY_STATS_ID_USER7                  25
 
+#define POLY_STATS_ID_GC_MARK_PAUSE          26    // Time with ML stopped for marking
+#define POLY_STATS_ID_GC_COPY_PAUSE          27    // Time with ML stopped for compaction
+#define POLY_STATS_ID_GC_UPDATE_PAUSE        28    // Time with ML stopped for updating
+#define POLY_STATS_ID_GC_CONCURRENT_MARK     29    // Time marking while ML was running
+#define POLY_STATS_ID_GC_NUMA_REMOTE         30    // Percentage of minor GC copying from another NUMA node
+#define POLY_STATS_ID_LARGE_OBJECTS          31    // Size of the large object spaces
+#define POLY_STATS_ID_GC_MARK_RESCAN         32    // Words rescanned after mark stack overflows
+#define POLY_STATS_ID_SHARE_LABELLED         33    // Objects given a depth by shareCommonData
+#define POLY_STATS_ID_SHARE_SORTED           34    // Objects in the levels sorted by shareCommonData
+#define POLY_STATS_ID_SHARE_MERGED           35    // Objects merged by shareCommonData
+#define POLY_STATS_ID_SURVIVOR               36    // Data in the survivor spaces after a partial GC
+#define POLY_STATS_ID_PROMOTED               37    // Data promoted by the last partial GC
+#define POLY_STATS_ID_PREMATURE_TENURED      38    // Data promoted before the tenuring threshold
+#define POLY_STATS_ID_GC_PAUSE_MAJOR         39    // Major GCs started early to meet the pause target
+#define POLY_STATS_ID_PAUSE_ALLOCATION       40    // Allocation area size chosen for the pause target
+#define POLY_STATS_ID_GC_LAST_MINOR_PAUSE    41    // Real time of the last minor GC
+#define POLY_STATS_ID_GC_LAST_MAJOR_PAUSE    42    // Real time of the last major GC
+#define POLY_STATS_ID_RESIDENT               43    // Resident set size of the process
+#define POLY_STATS_ID_DECOMMITTED            44    // Free heap returned to the OS by the last major GC
+#define POLY_STATS_ID_CODE_SPACE             45    // Total size of the code spaces
+#define POLY_STATS_ID_CODE_FREE              46    // Free space in the code spaces
+#define POLY_STATS_ID_CODE_LARGEST_FREE      47    // Largest free cell in the code spaces
+#define POLY_STATS_ID_CODE_FREE_CELLS        48    // Number of free cells in the code spaces
+#define POLY_STATS_ID_GC_MINOR_P50           49    // Median minor GC pause
+#define POLY_STATS_ID_GC_MINOR_P99           50    // 99th percentile minor GC pause
+#define POLY_STATS_ID_GC_MINOR_MAX           51    // Longest minor GC pause
+#define POLY_STATS_ID_GC_MARK_P50            52    // Median major GC mark pause
+#define POLY_STATS_ID_GC_MARK_P99            53    // 99th percentile major GC mark pause
+#define POLY_STATS_ID_GC_MARK_MAX            54    // Longest major GC mark pause
+#define POLY_STATS_ID_GC_COPY_P50            55    // Median major GC copy pause
+#define POLY_STATS_ID_GC_COPY_P99            56    // 99th percentile major GC copy pause
+#define POLY_STATS_ID_GC_COPY_MAX            57    // Longest major GC copy pause
+#define POLY_STATS_ID_GC_UPDATE_P50          58    // Median major GC update pause
+#define POLY_STATS_ID_GC_UPDATE_P99          59    // 99th percentile major GC update pause
+#define POLY_STATS_ID_GC_UPDATE_MAX          60    // Longest major GC update pause
+#define POLY_STATS_ID_GC_SHARING_P50         61    // Median GC sharing pass
+#define POLY_STATS_ID_GC_SHARING_P99         62    // 99th percentile GC sharing pass
+#define POLY_STATS_ID_GC_SHARING_MAX         63    // Longest GC sharing pass
+#define POLY_STATS_ID_SAFEPOINT_P50          64    // Median time for ML threads to stop
+#define POLY_STATS_ID_SAFEPOINT_P99          65    // 99th percentile time for ML threads to stop
+#define POLY_STATS_ID_SAFEPOINT_MAX          66    // Longest time for ML threads to stop
+
 #endif // POLY_STATISTICS_INCLUDED
 
 